@@ -3,6 +3,7 @@ LOCAL_CFLAGS += \
 	-DMAJOR_IN_SYSMACROS=1 \
 	-DHAVE_ALLOCA_H=0 \
 	-DHAVE_SYS_SELECT_H=0 \
+	-DHAVE_SYS_EPOLL_H=1 \
 	-DHAVE_SYS_SYSCTL_H=0 \
 	-DHAVE_VISIBILITY=1 \
 	-fvisibility=hidden \
@@ -180,6 +180,10 @@ void drm_intel_bufmgr_gem_enable_reuse(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_gem_enable_fenced_relocs(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_gem_set_vma_cache_size(drm_intel_bufmgr *bufmgr,
 					     int limit);
+void drm_intel_bufmgr_gem_get_vma_cache_stats(drm_intel_bufmgr *bufmgr,
+					      uint64_t *hits,
+					      uint64_t *misses,
+					      uint64_t *evictions);
 int drm_intel_gem_bo_map_unsynchronized(drm_intel_bo *bo);
 int drm_intel_gem_bo_map_gtt(drm_intel_bo *bo);
 int drm_intel_gem_bo_unmap_gtt(drm_intel_bo *bo);
@@ -189,6 +193,10 @@ int drm_intel_bufmgr_gem_can_disable_implicit_sync(drm_intel_bufmgr *bufmgr);
 void drm_intel_gem_bo_disable_implicit_sync(drm_intel_bo *bo);
 void drm_intel_gem_bo_enable_implicit_sync(drm_intel_bo *bo);
 
+void drm_intel_bufmgr_gem_get_reloc_stats(drm_intel_bufmgr *bufmgr,
+					  uint64_t *relocs,
+					  uint64_t *skipped);
+
 void *drm_intel_gem_bo_map__cpu(drm_intel_bo *bo);
 void *drm_intel_gem_bo_map__gtt(drm_intel_bo *bo);
 void *drm_intel_gem_bo_map__wc(drm_intel_bo *bo);
@@ -278,6 +286,38 @@ void drm_intel_decode_set_head_tail(struct drm_intel_decode *ctx,
 void drm_intel_decode_set_output_file(struct drm_intel_decode *ctx, FILE *out);
 void drm_intel_decode(struct drm_intel_decode *ctx);
 
+/** How often drm_intel_decode() came across a command. */
+struct drm_intel_decode_command_stats {
+	/** Header of the command with its length and flags cleared */
+	uint32_t opcode;
+	/** Name of the command, or NULL if the decoder has none for it */
+	const char *name;
+	uint64_t count;
+	uint64_t dwords;
+};
+
+void drm_intel_decode_set_quiet(struct drm_intel_decode *ctx, int quiet);
+int drm_intel_decode_get_stats(struct drm_intel_decode *ctx,
+			       struct drm_intel_decode_command_stats *stats,
+			       int max_stats,
+			       uint64_t *total_commands,
+			       uint64_t *total_dwords);
+void drm_intel_decode_reset_stats(struct drm_intel_decode *ctx);
+
+enum drm_intel_decode_format {
+	/** Lines of offset, dword and description, for reading */
+	DRM_INTEL_DECODE_FORMAT_TEXT,
+	/**
+	 * One JSON object per command and line, for tools:
+	 * {"offset", "opcode", "name", "length",
+	 *  "fields": [{"dword", "value", "text"}...], "warnings": [...]}
+	 */
+	DRM_INTEL_DECODE_FORMAT_JSON,
+};
+
+void drm_intel_decode_set_output_format(struct drm_intel_decode *ctx,
+					enum drm_intel_decode_format format);
+
 int drm_intel_reg_read(drm_intel_bufmgr *bufmgr,
 		       uint32_t offset,
 		       uint64_t *result);
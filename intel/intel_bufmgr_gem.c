@@ -37,6 +37,7 @@
 #include <xf86drm.h>
 #include <xf86atomic.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -57,6 +58,7 @@
 #include "intel_bufmgr.h"
 #include "intel_bufmgr_priv.h"
 #include "intel_chipset.h"
+#include "intel_capture.h"
 #include "string.h"
 
 #include "i915_drm.h"
@@ -79,6 +81,7 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 #define MAX2(A, B) ((A) > (B) ? (A) : (B))
+#define MIN2(A, B) ((A) < (B) ? (A) : (B))
 
 /**
  * upper_32_bits - return bits 32-63 of a number
@@ -103,6 +106,36 @@ struct drm_intel_gem_bo_bucket {
 	unsigned long size;
 };
 
+/** Kinds of mappings kept in the VMA cache, each in its own LRU list. */
+enum drm_intel_gem_vma_type {
+	VMA_CPU,
+	VMA_GTT,
+	VMA_WC,
+	VMA_NUM_TYPES
+};
+
+/* Bounds of the byte budget of the VMA cache, and how often it adapts. */
+#define VMA_BUDGET_MIN (16ull << 20)
+#define VMA_BUDGET_INITIAL (256ull << 20)
+#define VMA_BUDGET_MAX (sizeof(void *) > 4 ? 16ull << 30 : 512ull << 20)
+#define VMA_ADAPT_LOOKUPS 1024
+
+/* Buffers a thread keeps for itself, and the largest size it keeps. */
+#define BO_MAGAZINE_SIZE 16
+#define BO_MAGAZINE_MAX_BO_SIZE (256 * 1024)
+
+/**
+ * Per-thread cache of recently freed buffers, allocated from again without
+ * taking the bufmgr lock. The buffers stay I915_MADV_WILLNEED until the
+ * magazine overflows and the oldest half is handed to the shared buckets.
+ */
+struct drm_intel_gem_bo_magazine {
+	struct _drm_intel_bufmgr_gem *bufmgr_gem;
+	drmMMListHead link;
+	int count;
+	struct _drm_intel_bo_gem *bos[BO_MAGAZINE_SIZE];
+};
+
 typedef struct _drm_intel_bufmgr_gem {
 	drm_intel_bufmgr bufmgr;
 
@@ -125,14 +158,33 @@ typedef struct _drm_intel_bufmgr_gem {
 	int num_buckets;
 	time_t time;
 
+	/** Thread-local drm_intel_gem_bo_magazine, and the list of them all */
+	pthread_key_t magazine_key;
+	drmMMListHead magazines;
+	bool has_magazines;
+
 	drmMMListHead managers;
 
 	drm_intel_bo_gem *name_table;
 	drm_intel_bo_gem *handle_table;
 
-	drmMMListHead vma_cache;
+	drmMMListHead vma_cache[VMA_NUM_TYPES];
 	int vma_count, vma_open, vma_max;
 
+	/**
+	 * Bytes of cached mappings, and how many we keep. The budget grows
+	 * while evicting mappings costs hits, and shrinks while unused.
+	 */
+	uint64_t vma_bytes, vma_budget;
+	/** Most mappings to keep, derived from vm.max_map_count */
+	int vma_map_limit;
+	/** Time of the last unmap, ordering the LRU lists of all types */
+	uint64_t vma_clock;
+	uint64_t vma_hits, vma_misses, vma_evictions;
+	/** Lookups since the budget last adapted, and how they went */
+	unsigned int vma_window_lookups, vma_window_hits;
+	unsigned int vma_window_evictions;
+
 	uint64_t gtt_size;
 	int available_fences;
 	int pci_device;
@@ -146,8 +198,32 @@ typedef struct _drm_intel_bufmgr_gem {
 	unsigned int no_exec : 1;
 	unsigned int has_vebox : 1;
 	unsigned int has_exec_async : 1;
+	unsigned int has_no_reloc : 1;
+	unsigned int has_handle_lut : 1;
+	unsigned int has_batch_first : 1;
 	bool fenced_relocs;
 
+	/**
+	 * Relocations submitted through execbuffer2, and how many of those
+	 * the kernel could skip because no buffer moved.
+	 */
+	uint64_t reloc_total;
+	uint64_t reloc_skipped;
+
+	/**
+	 * Source of the generations stamped on buffers when accounting for
+	 * their aperture space, see drm_intel_bo_gem::aperture_stamp.
+	 */
+	atomic_t aperture_generation;
+
+	/**
+	 * Capture of the execbuffers submitted, when INTEL_CAPTURE names a
+	 * file, and space to read buffer contents into for it.
+	 */
+	struct intel_capture *capture;
+	void *capture_data;
+	uint64_t capture_data_size;
+
 	struct {
 		void *ptr;
 		uint32_t handle;
@@ -223,16 +299,40 @@ struct _drm_intel_bo_gem {
 	 */
 	void *user_virtual;
 	int map_count;
-	drmMMListHead vma_list;
+	drmMMListHead vma_list[VMA_NUM_TYPES];
+	/** vma_clock when the mappings were last unmapped */
+	uint64_t vma_last_used;
 
 	/** BO cache list */
 	drmMMListHead head;
 
 	/**
-	 * Boolean of whether this BO and its children have been included in
-	 * the current drm_intel_bufmgr_check_aperture_space() total.
+	 * Generation of the relocation tree rooted at this BO, whose size is
+	 * kept in reloc_tree_size as relocations are added.
+	 */
+	int working_set_generation;
+
+	/**
+	 * Generation of the last relocation tree whose size includes this BO.
+	 * A relocation to an already stamped buffer adds nothing to the tree.
+	 */
+	int aperture_stamp;
+
+	/**
+	 * Bitmap of the GEM handles of the buffers in the relocation tree
+	 * rooted at this BO, other than itself. Unlike the stamps, which the
+	 * next tree including a buffer overwrites, it is exact unless
+	 * reloc_tree_inexact is set because growing it failed.
 	 */
-	bool included_in_check_aperture;
+	uint32_t *reloc_tree_handles;
+	unsigned int reloc_tree_handles_words;
+	bool reloc_tree_inexact;
+
+	/**
+	 * Generation of the drm_intel_bufmgr_check_aperture_space() walk
+	 * that last counted this BO.
+	 */
+	int check_aperture_stamp;
 
 	/**
 	 * Boolean of whether this buffer has been used as a relocation
@@ -265,8 +365,12 @@ struct _drm_intel_bo_gem {
 	 */
 	bool is_userptr;
 
+	/** Size in bytes this buffer may take up in the aperture. */
+	int aperture_size;
+
 	/**
-	 * Size in bytes of this buffer and its relocation descendents.
+	 * Size in bytes of this buffer and its relocation descendents,
+	 * each of them counted once.
 	 *
 	 * Used to avoid costly tree walking in
 	 * drm_intel_bufmgr_check_aperture in the common case.
@@ -305,11 +409,37 @@ static void drm_intel_gem_bo_unreference(drm_intel_bo *bo);
 
 static void drm_intel_gem_bo_free(drm_intel_bo *bo);
 
+static drm_intel_bo_gem *
+drm_intel_gem_bo_magazine_get(drm_intel_bufmgr_gem *bufmgr_gem,
+			      unsigned long size, bool for_render);
+
 static inline drm_intel_bo_gem *to_bo_gem(drm_intel_bo *bo)
 {
         return (drm_intel_bo_gem *)bo;
 }
 
+static void
+drm_intel_gem_bo_init_vma(drm_intel_bo_gem *bo_gem)
+{
+	int type;
+
+	for (type = 0; type < VMA_NUM_TYPES; type++)
+		DRMINITLISTHEAD(&bo_gem->vma_list[type]);
+}
+
+static void **
+drm_intel_gem_bo_vma(drm_intel_bo_gem *bo_gem, int type)
+{
+	switch (type) {
+	case VMA_CPU:
+		return &bo_gem->mem_virtual;
+	case VMA_GTT:
+		return &bo_gem->gtt_virtual;
+	default:
+		return &bo_gem->wc_virtual;
+	}
+}
+
 static unsigned long
 drm_intel_gem_bo_tile_size(drm_intel_bufmgr_gem *bufmgr_gem, unsigned long size,
 			   uint32_t *tiling_mode)
@@ -392,21 +522,37 @@ drm_intel_gem_bo_tile_pitch(drm_intel_bufmgr_gem *bufmgr_gem,
 	return i;
 }
 
+/**
+ * Returns the smallest bucket holding buffers of at least size bytes.
+ *
+ * The index is computed from the layout set up by init_cache_buckets():
+ * one, two and three pages, then four buckets for each power of two from
+ * four pages on, at 1, 1.25, 1.5 and 1.75 times that power of two.
+ */
 static struct drm_intel_gem_bo_bucket *
 drm_intel_gem_bo_bucket_for_size(drm_intel_bufmgr_gem *bufmgr_gem,
 				 unsigned long size)
 {
-	int i;
+	unsigned long base;
+	int i, order;
 
-	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
-		struct drm_intel_gem_bo_bucket *bucket =
-		    &bufmgr_gem->cache_bucket[i];
-		if (bucket->size >= size) {
-			return bucket;
-		}
+	if (size <= 4 * 4096) {
+		i = size <= 4096 ? 0 : (size - 1) / 4096;
+	} else {
+		/* size is in (base, 2 * base], which ends with 4 buckets
+		 * evenly spaced by a quarter of base.
+		 */
+		order = sizeof(unsigned long) * 8 - 1 -
+			__builtin_clzl(size - 1);
+		base = 1ul << order;
+		i = 3 + 4 * (order - 14) +
+			(size - base + base / 4 - 1) / (base / 4);
 	}
 
-	return NULL;
+	if (i >= bufmgr_gem->num_buckets)
+		return NULL;
+
+	return &bufmgr_gem->cache_bucket[i];
 }
 
 static void
@@ -602,7 +748,101 @@ drm_intel_bo_gem_set_in_aperture_size(drm_intel_bufmgr_gem *bufmgr_gem,
 		alignment = MAX2(alignment, min_size);
 	}
 
-	bo_gem->reloc_tree_size = size + alignment;
+	bo_gem->aperture_size = size + alignment;
+	bo_gem->reloc_tree_size = bo_gem->aperture_size;
+}
+
+/* Largest handle bitmap of a relocation tree, in 32-bit words. */
+#define RELOC_TREE_HANDLES_MAX_WORDS (1 << 16)
+
+static bool
+drm_intel_gem_bo_tree_has_handle(drm_intel_bo_gem *bo_gem, uint32_t handle)
+{
+	return handle / 32 < bo_gem->reloc_tree_handles_words &&
+		bo_gem->reloc_tree_handles[handle / 32] & (1u << (handle % 32));
+}
+
+static void
+drm_intel_gem_bo_tree_add_handle(drm_intel_bo_gem *bo_gem, uint32_t handle)
+{
+	unsigned int words = bo_gem->reloc_tree_handles_words;
+	uint32_t *handles;
+
+	if (handle / 32 >= words) {
+		words = MAX2(2 * words, handle / 32 + 1);
+		if (words > RELOC_TREE_HANDLES_MAX_WORDS) {
+			bo_gem->reloc_tree_inexact = true;
+			return;
+		}
+
+		handles = realloc(bo_gem->reloc_tree_handles,
+				  words * sizeof(*handles));
+		if (!handles) {
+			bo_gem->reloc_tree_inexact = true;
+			return;
+		}
+
+		memset(handles + bo_gem->reloc_tree_handles_words, 0,
+		       (words - bo_gem->reloc_tree_handles_words) *
+		       sizeof(*handles));
+		bo_gem->reloc_tree_handles = handles;
+		bo_gem->reloc_tree_handles_words = words;
+	}
+
+	bo_gem->reloc_tree_handles[handle / 32] |= 1u << (handle % 32);
+}
+
+/**
+ * Adds the tree rooted at target_bo_gem to the one rooted at bo_gem,
+ * leaving out the buffers that are already part of it.
+ *
+ * Buffers used as relocation targets cannot gain relocations of their own,
+ * so each buffer of a tree is only visited once while the tree is built.
+ */
+static void
+drm_intel_gem_bo_add_working_set(drm_intel_bo_gem *bo_gem,
+				 drm_intel_bo_gem *target_bo_gem)
+{
+	int i;
+
+	if (target_bo_gem->aperture_stamp == bo_gem->working_set_generation)
+		return;
+
+	/* Another tree may have stamped a buffer already in this one. */
+	target_bo_gem->aperture_stamp = bo_gem->working_set_generation;
+	if (drm_intel_gem_bo_tree_has_handle(bo_gem,
+					     target_bo_gem->gem_handle))
+		return;
+
+	drm_intel_gem_bo_tree_add_handle(bo_gem, target_bo_gem->gem_handle);
+	bo_gem->reloc_tree_size += target_bo_gem->aperture_size;
+
+	for (i = 0; i < target_bo_gem->reloc_count; i++)
+		drm_intel_gem_bo_add_working_set(bo_gem,
+			(drm_intel_bo_gem *) target_bo_gem->reloc_target_info[i].bo);
+	for (i = 0; i < target_bo_gem->softpin_target_count; i++)
+		drm_intel_gem_bo_add_working_set(bo_gem,
+			(drm_intel_bo_gem *) target_bo_gem->softpin_target[i]);
+}
+
+/**
+ * Starts a new relocation tree rooted at bo_gem, only holding the buffer
+ * itself.
+ */
+static void
+drm_intel_gem_bo_reset_working_set(drm_intel_bufmgr_gem *bufmgr_gem,
+				   drm_intel_bo_gem *bo_gem)
+{
+	bo_gem->working_set_generation =
+		atomic_inc_return(&bufmgr_gem->aperture_generation);
+	bo_gem->aperture_stamp = bo_gem->working_set_generation;
+	bo_gem->reloc_tree_size = bo_gem->aperture_size;
+
+	if (bo_gem->reloc_tree_handles)
+		memset(bo_gem->reloc_tree_handles, 0,
+		       bo_gem->reloc_tree_handles_words *
+		       sizeof(*bo_gem->reloc_tree_handles));
+	bo_gem->reloc_tree_inexact = false;
 }
 
 static int
@@ -733,6 +973,21 @@ drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 			bo_size = page_size;
 	} else {
 		bo_size = bucket->size;
+
+		/* Try the buffers this thread freed last, without locking. */
+		bo_gem = drm_intel_gem_bo_magazine_get(bufmgr_gem, bo_size,
+						       for_render);
+		if (bo_gem) {
+			bo_gem->bo.align = alignment;
+			if (drm_intel_gem_bo_set_tiling_internal(&bo_gem->bo,
+								 tiling_mode,
+								 stride) == 0)
+				goto init;
+
+			pthread_mutex_lock(&bufmgr_gem->lock);
+			drm_intel_gem_bo_free(&bo_gem->bo);
+			pthread_mutex_unlock(&bufmgr_gem->lock);
+		}
 	}
 
 	pthread_mutex_lock(&bufmgr_gem->lock);
@@ -794,7 +1049,7 @@ retry:
 
 		/* drm_intel_gem_bo_free calls DRMLISTDEL() for an uninitialized
 		   list (vma_list), so better set the list head here */
-		DRMINITLISTHEAD(&bo_gem->vma_list);
+		drm_intel_gem_bo_init_vma(bo_gem);
 
 		bo_gem->bo.size = bo_size;
 
@@ -827,7 +1082,9 @@ retry:
 							 stride))
 			goto err_free;
 	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
 
+init:
 	bo_gem->name = name;
 	atomic_set(&bo_gem->refcount, 1);
 	bo_gem->validate_index = -1;
@@ -837,7 +1094,6 @@ retry:
 	bo_gem->reusable = true;
 
 	drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem, alignment);
-	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	DBG("bo_create: buf %d (%s) %ldb\n",
 	    bo_gem->gem_handle, bo_gem->name, size);
@@ -950,7 +1206,7 @@ drm_intel_gem_bo_alloc_userptr(drm_intel_bufmgr *bufmgr,
 		return NULL;
 
 	atomic_set(&bo_gem->refcount, 1);
-	DRMINITLISTHEAD(&bo_gem->vma_list);
+	drm_intel_gem_bo_init_vma(bo_gem);
 
 	bo_gem->bo.size = size;
 
@@ -1148,7 +1404,7 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 		goto out;
 
 	atomic_set(&bo_gem->refcount, 1);
-	DRMINITLISTHEAD(&bo_gem->vma_list);
+	drm_intel_gem_bo_init_vma(bo_gem);
 
 	bo_gem->bo.size = open_arg.size;
 	bo_gem->bo.offset = 0;
@@ -1192,22 +1448,22 @@ drm_intel_gem_bo_free(drm_intel_bo *bo)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_gem_close close;
-	int ret;
+	int i, ret;
 
-	DRMLISTDEL(&bo_gem->vma_list);
-	if (bo_gem->mem_virtual) {
-		VG(VALGRIND_FREELIKE_BLOCK(bo_gem->mem_virtual, 0));
-		drm_munmap(bo_gem->mem_virtual, bo_gem->bo.size);
-		bufmgr_gem->vma_count--;
-	}
-	if (bo_gem->wc_virtual) {
-		VG(VALGRIND_FREELIKE_BLOCK(bo_gem->wc_virtual, 0));
-		drm_munmap(bo_gem->wc_virtual, bo_gem->bo.size);
-		bufmgr_gem->vma_count--;
-	}
-	if (bo_gem->gtt_virtual) {
-		drm_munmap(bo_gem->gtt_virtual, bo_gem->bo.size);
+	for (i = 0; i < VMA_NUM_TYPES; i++) {
+		void *virtual = *drm_intel_gem_bo_vma(bo_gem, i);
+
+		DRMLISTDEL(&bo_gem->vma_list[i]);
+		if (!virtual)
+			continue;
+
+		/* Only the CPU mappings were marked as malloc-like blocks. */
+		if (i != VMA_GTT) {
+			VG(VALGRIND_FREELIKE_BLOCK(virtual, 0));
+		}
+		drm_munmap(virtual, bo_gem->bo.size);
 		bufmgr_gem->vma_count--;
+		bufmgr_gem->vma_bytes -= bo_gem->bo.size;
 	}
 
 	if (bo_gem->global_name)
@@ -1272,82 +1528,351 @@ drm_intel_gem_cleanup_bo_cache(drm_intel_bufmgr_gem *bufmgr_gem, time_t time)
 	bufmgr_gem->time = time;
 }
 
+/** Returns the buffer with the least recently used mapping of a type. */
+static drm_intel_bo_gem *
+drm_intel_gem_vma_cache_first(drm_intel_bufmgr_gem *bufmgr_gem, int type)
+{
+	return (drm_intel_bo_gem *)
+		((char *) bufmgr_gem->vma_cache[type].next -
+		 offsetof(drm_intel_bo_gem, vma_list) -
+		 type * sizeof(drmMMListHead));
+}
+
+/**
+ * Returns the type of the least recently used cached mapping, or -1 if
+ * none is cached. Mappings of the same buffer are all unmapped together,
+ * so the GTT ones go first as they also take up the mappable aperture.
+ */
+static int
+drm_intel_gem_vma_cache_lru(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	static const int order[VMA_NUM_TYPES] = { VMA_GTT, VMA_WC, VMA_CPU };
+	uint64_t oldest = UINT64_MAX;
+	int i, lru = -1;
+
+	for (i = 0; i < VMA_NUM_TYPES; i++) {
+		drm_intel_bo_gem *bo_gem;
+
+		if (DRMLISTEMPTY(&bufmgr_gem->vma_cache[order[i]]))
+			continue;
+
+		bo_gem = drm_intel_gem_vma_cache_first(bufmgr_gem, order[i]);
+		if (bo_gem->vma_last_used < oldest) {
+			oldest = bo_gem->vma_last_used;
+			lru = order[i];
+		}
+	}
+
+	return lru;
+}
+
 static void drm_intel_gem_bo_purge_vma_cache(drm_intel_bufmgr_gem *bufmgr_gem)
 {
-	int limit;
+	int limit, max, type;
 
-	DBG("%s: cached=%d, open=%d, limit=%d\n", __FUNCTION__,
-	    bufmgr_gem->vma_count, bufmgr_gem->vma_open, bufmgr_gem->vma_max);
+	DBG("%s: cached=%d (%lluMiB), open=%d, limit=%d, budget=%lluMiB\n",
+	    __FUNCTION__, bufmgr_gem->vma_count,
+	    (unsigned long long) bufmgr_gem->vma_bytes >> 20,
+	    bufmgr_gem->vma_open, bufmgr_gem->vma_max,
+	    (unsigned long long) bufmgr_gem->vma_budget >> 20);
 
-	if (bufmgr_gem->vma_max < 0)
-		return;
+	max = bufmgr_gem->vma_map_limit;
+	if (bufmgr_gem->vma_max >= 0 && bufmgr_gem->vma_max < max)
+		max = bufmgr_gem->vma_max;
 
 	/* We may need to evict a few entries in order to create new mmaps */
-	limit = bufmgr_gem->vma_max - 2*bufmgr_gem->vma_open;
+	limit = max - 2*bufmgr_gem->vma_open;
 	if (limit < 0)
 		limit = 0;
 
-	while (bufmgr_gem->vma_count > limit) {
+	while (bufmgr_gem->vma_count > limit ||
+	       bufmgr_gem->vma_bytes > bufmgr_gem->vma_budget) {
 		drm_intel_bo_gem *bo_gem;
+		void **virtual;
 
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
-				      bufmgr_gem->vma_cache.next,
-				      vma_list);
+		type = drm_intel_gem_vma_cache_lru(bufmgr_gem);
+		if (type < 0)
+			break;
+
+		bo_gem = drm_intel_gem_vma_cache_first(bufmgr_gem, type);
 		assert(bo_gem->map_count == 0);
-		DRMLISTDELINIT(&bo_gem->vma_list);
+		DRMLISTDELINIT(&bo_gem->vma_list[type]);
 
-		if (bo_gem->mem_virtual) {
-			drm_munmap(bo_gem->mem_virtual, bo_gem->bo.size);
-			bo_gem->mem_virtual = NULL;
-			bufmgr_gem->vma_count--;
-		}
-		if (bo_gem->wc_virtual) {
-			drm_munmap(bo_gem->wc_virtual, bo_gem->bo.size);
-			bo_gem->wc_virtual = NULL;
-			bufmgr_gem->vma_count--;
-		}
-		if (bo_gem->gtt_virtual) {
-			drm_munmap(bo_gem->gtt_virtual, bo_gem->bo.size);
-			bo_gem->gtt_virtual = NULL;
-			bufmgr_gem->vma_count--;
-		}
+		/* Only evictions for the budget tell it is too small. */
+		if (bufmgr_gem->vma_count <= limit)
+			bufmgr_gem->vma_window_evictions++;
+		bufmgr_gem->vma_evictions++;
+
+		virtual = drm_intel_gem_bo_vma(bo_gem, type);
+		drm_munmap(*virtual, bo_gem->bo.size);
+		*virtual = NULL;
+		bufmgr_gem->vma_count--;
+		bufmgr_gem->vma_bytes -= bo_gem->bo.size;
 	}
 }
 
+/**
+ * Records whether a map found the mapping it needed, and adapts the byte
+ * budget of the cache to the hit rate.
+ */
+static void drm_intel_gem_bo_vma_lookup(drm_intel_bufmgr_gem *bufmgr_gem,
+					bool hit)
+{
+	if (hit) {
+		bufmgr_gem->vma_hits++;
+		bufmgr_gem->vma_window_hits++;
+	} else {
+		bufmgr_gem->vma_misses++;
+	}
+
+	if (++bufmgr_gem->vma_window_lookups < VMA_ADAPT_LOOKUPS)
+		return;
+
+	/* Evicted mappings are being mapped again, make room for them.
+	 * Otherwise, release the address space a smaller cache never uses.
+	 */
+	if (bufmgr_gem->vma_window_evictions &&
+	    bufmgr_gem->vma_window_hits < VMA_ADAPT_LOOKUPS * 9 / 10)
+		bufmgr_gem->vma_budget = MIN2(bufmgr_gem->vma_budget * 2,
+					      VMA_BUDGET_MAX);
+	else if (!bufmgr_gem->vma_window_evictions &&
+		 bufmgr_gem->vma_bytes < bufmgr_gem->vma_budget / 4)
+		bufmgr_gem->vma_budget = MAX2(bufmgr_gem->vma_budget / 2,
+					      VMA_BUDGET_MIN);
+
+	bufmgr_gem->vma_window_lookups = 0;
+	bufmgr_gem->vma_window_hits = 0;
+	bufmgr_gem->vma_window_evictions = 0;
+}
+
+/**
+ * Called when creating a mapping failed with err. Running out of mappings
+ * means vm.max_map_count has less headroom than we assumed, so keep half
+ * as many cached mappings from now on.
+ */
+static void drm_intel_gem_bo_vma_failed(drm_intel_bufmgr_gem *bufmgr_gem,
+					int err)
+{
+	if (err != ENOMEM)
+		return;
+
+	bufmgr_gem->vma_map_limit = 2 * bufmgr_gem->vma_open +
+		bufmgr_gem->vma_count / 2;
+	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
+}
+
 static void drm_intel_gem_bo_close_vma(drm_intel_bufmgr_gem *bufmgr_gem,
 				       drm_intel_bo_gem *bo_gem)
 {
+	int type;
+
 	bufmgr_gem->vma_open--;
-	DRMLISTADDTAIL(&bo_gem->vma_list, &bufmgr_gem->vma_cache);
-	if (bo_gem->mem_virtual)
-		bufmgr_gem->vma_count++;
-	if (bo_gem->wc_virtual)
-		bufmgr_gem->vma_count++;
-	if (bo_gem->gtt_virtual)
+	bo_gem->vma_last_used = ++bufmgr_gem->vma_clock;
+	for (type = 0; type < VMA_NUM_TYPES; type++) {
+		if (!*drm_intel_gem_bo_vma(bo_gem, type))
+			continue;
+
+		DRMLISTADDTAIL(&bo_gem->vma_list[type],
+			       &bufmgr_gem->vma_cache[type]);
 		bufmgr_gem->vma_count++;
+		bufmgr_gem->vma_bytes += bo_gem->bo.size;
+	}
 	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
 }
 
 static void drm_intel_gem_bo_open_vma(drm_intel_bufmgr_gem *bufmgr_gem,
 				      drm_intel_bo_gem *bo_gem)
 {
+	int type;
+
 	bufmgr_gem->vma_open++;
-	DRMLISTDEL(&bo_gem->vma_list);
-	if (bo_gem->mem_virtual)
-		bufmgr_gem->vma_count--;
-	if (bo_gem->wc_virtual)
-		bufmgr_gem->vma_count--;
-	if (bo_gem->gtt_virtual)
+	for (type = 0; type < VMA_NUM_TYPES; type++) {
+		if (!*drm_intel_gem_bo_vma(bo_gem, type))
+			continue;
+
+		DRMLISTDELINIT(&bo_gem->vma_list[type]);
 		bufmgr_gem->vma_count--;
+		bufmgr_gem->vma_bytes -= bo_gem->bo.size;
+	}
 	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
 }
 
+/** Puts an unreferenced buffer into our internal cache, or frees it. */
+static void
+drm_intel_gem_bo_cache_put(drm_intel_bufmgr_gem *bufmgr_gem,
+			   drm_intel_bo_gem *bo_gem, time_t time)
+{
+	struct drm_intel_gem_bo_bucket *bucket;
+
+	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo_gem->bo.size);
+	/* Put the buffer into our internal cache for reuse if we can. */
+	if (bufmgr_gem->bo_reuse && bo_gem->reusable && bucket != NULL &&
+	    drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
+					      I915_MADV_DONTNEED)) {
+		bo_gem->free_time = time;
+
+		bo_gem->name = NULL;
+		bo_gem->validate_index = -1;
+
+		DRMLISTADDTAIL(&bo_gem->head, &bucket->head);
+	} else {
+		drm_intel_gem_bo_free(&bo_gem->bo);
+	}
+}
+
+/**
+ * Hands the count oldest buffers of the magazine over to the shared
+ * buckets. Must be called with the bufmgr lock held.
+ */
+static void
+drm_intel_gem_bo_magazine_flush(struct drm_intel_gem_bo_magazine *magazine,
+				int count, time_t time)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		drm_intel_gem_bo_cache_put(magazine->bufmgr_gem,
+					   magazine->bos[i], time);
+
+	magazine->count -= count;
+	memmove(magazine->bos, magazine->bos + count,
+		magazine->count * sizeof(magazine->bos[0]));
+}
+
+static void
+drm_intel_gem_bo_magazine_destroy(void *data)
+{
+	struct drm_intel_gem_bo_magazine *magazine = data;
+	drm_intel_bufmgr_gem *bufmgr_gem = magazine->bufmgr_gem;
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	drm_intel_gem_bo_magazine_flush(magazine, magazine->count, time.tv_sec);
+	DRMLISTDEL(&magazine->link);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	free(magazine);
+}
+
+static struct drm_intel_gem_bo_magazine *
+drm_intel_gem_bo_magazine(drm_intel_bufmgr_gem *bufmgr_gem, bool create)
+{
+	struct drm_intel_gem_bo_magazine *magazine;
+
+	if (!bufmgr_gem->has_magazines)
+		return NULL;
+
+	magazine = pthread_getspecific(bufmgr_gem->magazine_key);
+	if (magazine || !create)
+		return magazine;
+
+	magazine = calloc(1, sizeof(*magazine));
+	if (!magazine)
+		return NULL;
+
+	if (pthread_setspecific(bufmgr_gem->magazine_key, magazine)) {
+		free(magazine);
+		return NULL;
+	}
+
+	magazine->bufmgr_gem = bufmgr_gem;
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	DRMLISTADDTAIL(&magazine->link, &bufmgr_gem->magazines);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	return magazine;
+}
+
+/**
+ * Takes the most recently freed buffer of the given size out of this
+ * thread's magazine. As with the shared buckets, buffers not allocated for
+ * rendering must be idle.
+ */
+static drm_intel_bo_gem *
+drm_intel_gem_bo_magazine_get(drm_intel_bufmgr_gem *bufmgr_gem,
+			      unsigned long size, bool for_render)
+{
+	struct drm_intel_gem_bo_magazine *magazine;
+	drm_intel_bo_gem *bo_gem;
+	int i;
+
+	magazine = drm_intel_gem_bo_magazine(bufmgr_gem, false);
+	if (!magazine)
+		return NULL;
+
+	for (i = magazine->count - 1; i >= 0; i--) {
+		bo_gem = magazine->bos[i];
+		if (bo_gem->bo.size != size)
+			continue;
+
+		if (!for_render && drm_intel_gem_bo_busy(&bo_gem->bo))
+			return NULL;
+
+		magazine->count--;
+		memmove(magazine->bos + i, magazine->bos + i + 1,
+			(magazine->count - i) * sizeof(magazine->bos[0]));
+		return bo_gem;
+	}
+
+	return NULL;
+}
+
+/**
+ * Keeps an unreferenced buffer in this thread's magazine, if it is a small
+ * reusable buffer with nothing else to release. Returns whether it was
+ * kept.
+ *
+ * Reusable buffers are never shared, so they cannot be looked up and
+ * referenced again by another thread while being released.
+ */
+static bool
+drm_intel_gem_bo_magazine_put(drm_intel_bufmgr_gem *bufmgr_gem,
+			      drm_intel_bo_gem *bo_gem)
+{
+	struct drm_intel_gem_bo_magazine *magazine;
+	struct drm_intel_gem_bo_bucket *bucket;
+	struct timespec time;
+
+	if (!bufmgr_gem->bo_reuse || !bo_gem->reusable ||
+	    bo_gem->bo.size > BO_MAGAZINE_MAX_BO_SIZE ||
+	    bo_gem->relocs || bo_gem->softpin_target || bo_gem->map_count)
+		return false;
+
+	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo_gem->bo.size);
+	if (bucket == NULL || bucket->size != bo_gem->bo.size)
+		return false;
+
+	magazine = drm_intel_gem_bo_magazine(bufmgr_gem, true);
+	if (!magazine)
+		return false;
+
+	if (magazine->count == BO_MAGAZINE_SIZE) {
+		clock_gettime(CLOCK_MONOTONIC, &time);
+
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		drm_intel_gem_bo_magazine_flush(magazine, BO_MAGAZINE_SIZE / 2,
+						time.tv_sec);
+		drm_intel_gem_cleanup_bo_cache(bufmgr_gem, time.tv_sec);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	atomic_set(&bo_gem->refcount, 0);
+	bo_gem->kflags = 0;
+	bo_gem->used_as_reloc_target = false;
+	bo_gem->name = NULL;
+	bo_gem->validate_index = -1;
+	magazine->bos[magazine->count++] = bo_gem;
+
+	return true;
+}
+
 static void
 drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
-	struct drm_intel_gem_bo_bucket *bucket;
 	int i;
 
 	/* Unreference all the target buffers */
@@ -1383,6 +1908,11 @@ drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 		bo_gem->softpin_target = NULL;
 		bo_gem->softpin_target_size = 0;
 	}
+	if (bo_gem->reloc_tree_handles) {
+		free(bo_gem->reloc_tree_handles);
+		bo_gem->reloc_tree_handles = NULL;
+		bo_gem->reloc_tree_handles_words = 0;
+	}
 
 	/* Clear any left-over mappings */
 	if (bo_gem->map_count) {
@@ -1392,20 +1922,7 @@ drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 	}
 
-	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo->size);
-	/* Put the buffer into our internal cache for reuse if we can. */
-	if (bufmgr_gem->bo_reuse && bo_gem->reusable && bucket != NULL &&
-	    drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
-					      I915_MADV_DONTNEED)) {
-		bo_gem->free_time = time;
-
-		bo_gem->name = NULL;
-		bo_gem->validate_index = -1;
-
-		DRMLISTADDTAIL(&bo_gem->head, &bucket->head);
-	} else {
-		drm_intel_gem_bo_free(bo);
-	}
+	drm_intel_gem_bo_cache_put(bufmgr_gem, bo_gem, time);
 }
 
 static void drm_intel_gem_bo_unreference_locked_timed(drm_intel_bo *bo,
@@ -1429,6 +1946,9 @@ static void drm_intel_gem_bo_unreference(drm_intel_bo *bo)
 		    (drm_intel_bufmgr_gem *) bo->bufmgr;
 		struct timespec time;
 
+		if (drm_intel_gem_bo_magazine_put(bufmgr_gem, bo_gem))
+			return;
+
 		clock_gettime(CLOCK_MONOTONIC, &time);
 
 		pthread_mutex_lock(&bufmgr_gem->lock);
@@ -1460,6 +1980,7 @@ static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
 	if (bo_gem->map_count++ == 0)
 		drm_intel_gem_bo_open_vma(bufmgr_gem, bo_gem);
 
+	drm_intel_gem_bo_vma_lookup(bufmgr_gem, bo_gem->mem_virtual != NULL);
 	if (!bo_gem->mem_virtual) {
 		struct drm_i915_gem_mmap mmap_arg;
 
@@ -1474,6 +1995,7 @@ static int drm_intel_gem_bo_map(drm_intel_bo *bo, int write_enable)
 			       &mmap_arg);
 		if (ret != 0) {
 			ret = -errno;
+			drm_intel_gem_bo_vma_failed(bufmgr_gem, -ret);
 			DBG("%s:%d: Error mapping buffer %d (%s): %s .\n",
 			    __FILE__, __LINE__, bo_gem->gem_handle,
 			    bo_gem->name, strerror(errno));
@@ -1529,6 +2051,7 @@ map_gtt(drm_intel_bo *bo)
 		drm_intel_gem_bo_open_vma(bufmgr_gem, bo_gem);
 
 	/* Get a mapping of the buffer if we haven't before. */
+	drm_intel_gem_bo_vma_lookup(bufmgr_gem, bo_gem->gtt_virtual != NULL);
 	if (bo_gem->gtt_virtual == NULL) {
 		struct drm_i915_gem_mmap_gtt mmap_arg;
 
@@ -1544,6 +2067,7 @@ map_gtt(drm_intel_bo *bo)
 			       &mmap_arg);
 		if (ret != 0) {
 			ret = -errno;
+			drm_intel_gem_bo_vma_failed(bufmgr_gem, -ret);
 			DBG("%s:%d: Error preparing buffer map %d (%s): %s .\n",
 			    __FILE__, __LINE__,
 			    bo_gem->gem_handle, bo_gem->name,
@@ -1560,6 +2084,7 @@ map_gtt(drm_intel_bo *bo)
 		if (bo_gem->gtt_virtual == MAP_FAILED) {
 			bo_gem->gtt_virtual = NULL;
 			ret = -errno;
+			drm_intel_gem_bo_vma_failed(bufmgr_gem, -ret);
 			DBG("%s:%d: Error mapping buffer %d (%s): %s .\n",
 			    __FILE__, __LINE__,
 			    bo_gem->gem_handle, bo_gem->name,
@@ -1914,6 +2439,7 @@ static void
 drm_intel_bufmgr_gem_destroy(drm_intel_bufmgr *bufmgr)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	struct drm_intel_gem_bo_magazine *magazine, *tmp;
 	struct drm_gem_close close_bo;
 	int i, ret;
 
@@ -1921,6 +2447,22 @@ drm_intel_bufmgr_gem_destroy(drm_intel_bufmgr *bufmgr)
 	free(bufmgr_gem->exec_objects);
 	free(bufmgr_gem->exec_bos);
 
+	if (bufmgr_gem->capture)
+		intel_capture_close(bufmgr_gem->capture);
+	free(bufmgr_gem->capture_data);
+
+	/* Free the buffers kept by every thread */
+	if (bufmgr_gem->has_magazines) {
+		pthread_key_delete(bufmgr_gem->magazine_key);
+
+		DRMLISTFOREACHENTRYSAFE(magazine, tmp, &bufmgr_gem->magazines,
+					link) {
+			for (i = 0; i < magazine->count; i++)
+				drm_intel_gem_bo_free(&magazine->bos[i]->bo);
+			free(magazine);
+		}
+	}
+
 	pthread_mutex_destroy(&bufmgr_gem->lock);
 
 	/* Free any cached buffer objects we were going to reuse */
@@ -2013,8 +2555,12 @@ do_bo_emit_reloc(drm_intel_bo *bo, uint32_t offset,
 	 */
 	assert(!bo_gem->used_as_reloc_target);
 	if (target_bo_gem != bo_gem) {
+		if (bo_gem->reloc_count == 0 &&
+		    bo_gem->softpin_target_count == 0)
+			drm_intel_gem_bo_reset_working_set(bufmgr_gem, bo_gem);
+
 		target_bo_gem->used_as_reloc_target = true;
-		bo_gem->reloc_tree_size += target_bo_gem->reloc_tree_size;
+		drm_intel_gem_bo_add_working_set(bo_gem, target_bo_gem);
 		bo_gem->reloc_tree_fences += target_bo_gem->reloc_tree_fences;
 	}
 
@@ -2081,6 +2627,9 @@ drm_intel_gem_bo_add_softpin_target(drm_intel_bo *bo, drm_intel_bo *target_bo)
 
 		bo_gem->softpin_target_size = new_size;
 	}
+	if (bo_gem->reloc_count == 0 && bo_gem->softpin_target_count == 0)
+		drm_intel_gem_bo_reset_working_set(bufmgr_gem, bo_gem);
+	drm_intel_gem_bo_add_working_set(bo_gem, target_bo_gem);
 	bo_gem->softpin_target[bo_gem->softpin_target_count] = target_bo;
 	drm_intel_gem_bo_reference(target_bo);
 	bo_gem->softpin_target_count++;
@@ -2132,8 +2681,10 @@ drm_intel_gem_bo_get_reloc_count(drm_intel_bo *bo)
  * batchbuffer including drm_intel_gem_get_reloc_count(), emit all the
  * state, and then check if it still fits in the aperture.
  *
- * Any further drm_intel_bufmgr_check_aperture_space() queries
- * involving this buffer in the tree are undefined after this call.
+ * The size of the tree rooted at the BO is recomputed from the remaining
+ * relocations, but any further drm_intel_bufmgr_check_aperture_space()
+ * queries involving this buffer as part of another tree are undefined
+ * after this call.
  *
  * This also removes all softpinned targets being referenced by the BO.
  */
@@ -2168,6 +2719,11 @@ drm_intel_gem_bo_clear_relocs(drm_intel_bo *bo, int start)
 	}
 	bo_gem->softpin_target_count = 0;
 
+	drm_intel_gem_bo_reset_working_set(bufmgr_gem, bo_gem);
+	for (i = 0; i < bo_gem->reloc_count; i++)
+		drm_intel_gem_bo_add_working_set(bo_gem,
+			(drm_intel_bo_gem *) bo_gem->reloc_target_info[i].bo);
+
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 }
@@ -2266,9 +2822,10 @@ drm_intel_update_buffer_offsets(drm_intel_bufmgr_gem *bufmgr_gem)
 	}
 }
 
-static void
+static bool
 drm_intel_update_buffer_offsets2 (drm_intel_bufmgr_gem *bufmgr_gem)
 {
+	bool moved = false;
 	int i;
 
 	for (i = 0; i < bufmgr_gem->exec_count; i++) {
@@ -2289,8 +2846,52 @@ drm_intel_update_buffer_offsets2 (drm_intel_bufmgr_gem *bufmgr_gem)
 			    lower_32_bits(bufmgr_gem->exec2_objects[i].offset));
 			bo->offset64 = bufmgr_gem->exec2_objects[i].offset;
 			bo->offset = bufmgr_gem->exec2_objects[i].offset;
+			moved = true;
+		}
+	}
+
+	return moved;
+}
+
+/**
+ * Points the relocations of the validation list at the index of their
+ * target within it, for I915_EXEC_HANDLE_LUT. The buffers they write are
+ * marked as such, as the kernel only learns that from relocations it
+ * processes.
+ *
+ * Returns whether every relocation presumes the offset its target is
+ * submitted at, which allows I915_EXEC_NO_RELOC.
+ */
+static bool
+drm_intel_gem_prepare_reloc_lut(drm_intel_bufmgr_gem *bufmgr_gem,
+				int *reloc_count)
+{
+	bool presumed_valid = true;
+	int i, j;
+
+	*reloc_count = 0;
+	for (i = 0; i < bufmgr_gem->exec_count; i++) {
+		drm_intel_bo_gem *bo_gem = to_bo_gem(bufmgr_gem->exec_bos[i]);
+
+		for (j = 0; j < bo_gem->reloc_count; j++) {
+			struct drm_i915_gem_relocation_entry *reloc =
+				&bo_gem->relocs[j];
+			drm_intel_bo_gem *target_gem =
+				to_bo_gem(bo_gem->reloc_target_info[j].bo);
+			struct drm_i915_gem_exec_object2 *target =
+				&bufmgr_gem->exec2_objects[target_gem->validate_index];
+
+			reloc->target_handle = target_gem->validate_index;
+			if (reloc->write_domain)
+				target->flags |= EXEC_OBJECT_WRITE;
+			if (reloc->presumed_offset != target->offset)
+				presumed_valid = false;
 		}
+
+		*reloc_count += bo_gem->reloc_count;
 	}
+
+	return presumed_valid;
 }
 
 drm_public void
@@ -2368,6 +2969,87 @@ drm_intel_gem_bo_exec(drm_intel_bo *bo, int used,
 	return ret;
 }
 
+/**
+ * Writes the execbuffer about to be submitted to the capture: the contents
+ * of every buffer on the validation list, as the CPU left them, and the
+ * relocations between them.
+ *
+ * Reading the contents waits for the GPU to be done with each buffer, so
+ * capturing serializes rendering.
+ */
+static void
+drm_intel_gem_capture_exec(drm_intel_bufmgr_gem *bufmgr_gem,
+			   const struct drm_i915_gem_execbuffer2 *execbuf,
+			   drm_intel_bo *batch)
+{
+	struct intel_capture_buffer *buffers;
+	struct intel_capture_reloc *relocs, *reloc;
+	struct intel_capture_exec exec;
+	int i, j;
+
+	memclear(exec);
+	exec.buffer_count = bufmgr_gem->exec_count;
+	exec.batch_index = to_bo_gem(batch)->validate_index;
+	exec.batch_len = execbuf->batch_len;
+	exec.ctx_id = i915_execbuffer2_get_context_id(*execbuf);
+	exec.flags = execbuf->flags;
+	for (i = 0; i < bufmgr_gem->exec_count; i++)
+		exec.reloc_count += to_bo_gem(bufmgr_gem->exec_bos[i])->reloc_count;
+
+	buffers = calloc(exec.buffer_count, sizeof(*buffers));
+	relocs = calloc(exec.reloc_count + 1, sizeof(*relocs));
+	if (buffers == NULL || relocs == NULL)
+		goto out;
+
+	reloc = relocs;
+	for (i = 0; i < bufmgr_gem->exec_count; i++) {
+		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
+		drm_intel_bo_gem *bo_gem = to_bo_gem(bo);
+
+		if (bufmgr_gem->capture_data_size < bo->size) {
+			free(bufmgr_gem->capture_data);
+			bufmgr_gem->capture_data = malloc(bo->size);
+			bufmgr_gem->capture_data_size =
+				bufmgr_gem->capture_data ? bo->size : 0;
+		}
+
+		buffers[i].handle = bo_gem->gem_handle;
+		buffers[i].reloc_count = bo_gem->reloc_count;
+		buffers[i].offset = bufmgr_gem->exec2_objects[i].offset;
+		buffers[i].size = bo->size;
+		buffers[i].flags = bufmgr_gem->exec2_objects[i].flags;
+		if (bufmgr_gem->capture_data &&
+		    drm_intel_gem_bo_get_subdata(bo, 0, bo->size,
+						 bufmgr_gem->capture_data) == 0)
+			buffers[i].hash =
+				intel_capture_add_blob(bufmgr_gem->capture,
+						       bufmgr_gem->capture_data,
+						       bo->size);
+
+		for (j = 0; j < bo_gem->reloc_count; j++, reloc++) {
+			drm_intel_bo_gem *target_gem =
+				to_bo_gem(bo_gem->reloc_target_info[j].bo);
+
+			reloc->buffer = i;
+			reloc->target = target_gem->validate_index;
+			reloc->offset = bo_gem->relocs[j].offset;
+			reloc->delta = bo_gem->relocs[j].delta;
+			reloc->presumed_offset =
+				bo_gem->relocs[j].presumed_offset;
+			reloc->read_domains = bo_gem->relocs[j].read_domains;
+			reloc->write_domain = bo_gem->relocs[j].write_domain;
+		}
+	}
+
+	if (intel_capture_add_exec(bufmgr_gem->capture, &exec,
+				   buffers, relocs) != 0)
+		DBG("Failed to capture execbuffer: %s\n", strerror(errno));
+
+out:
+	free(relocs);
+	free(buffers);
+}
+
 static int
 do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 	 drm_clip_rect_t *cliprects, int num_cliprects, int DR4,
@@ -2376,6 +3058,10 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
 	struct drm_i915_gem_execbuffer2 execbuf;
+	bool use_lut = bufmgr_gem->has_no_reloc && bufmgr_gem->has_handle_lut;
+	bool batch_first = use_lut && bufmgr_gem->has_batch_first;
+	bool no_reloc = false;
+	int reloc_count = 0;
 	int ret = 0;
 	int i;
 
@@ -2403,13 +3089,21 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 	}
 
 	pthread_mutex_lock(&bufmgr_gem->lock);
+	/* Add the batch buffer to the validation list.  There are no relocations
+	 * pointing to it, so it may come first if the kernel allows that.
+	 */
+	if (batch_first)
+		drm_intel_add_validate_buffer2(bo, 0);
+
 	/* Update indices and set up the validate list. */
 	drm_intel_gem_bo_process_reloc2(bo);
 
-	/* Add the batch buffer to the validation list.  There are no relocations
-	 * pointing to it.
-	 */
-	drm_intel_add_validate_buffer2(bo, 0);
+	if (!batch_first)
+		drm_intel_add_validate_buffer2(bo, 0);
+
+	if (use_lut)
+		no_reloc = drm_intel_gem_prepare_reloc_lut(bufmgr_gem,
+							   &reloc_count);
 
 	memclear(execbuf);
 	execbuf.buffers_ptr = (uintptr_t)bufmgr_gem->exec2_objects;
@@ -2434,6 +3128,15 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 		*out_fence = -1;
 		execbuf.flags |= I915_EXEC_FENCE_OUT;
 	}
+	if (use_lut)
+		execbuf.flags |= I915_EXEC_HANDLE_LUT;
+	if (no_reloc)
+		execbuf.flags |= I915_EXEC_NO_RELOC;
+	if (batch_first)
+		execbuf.flags |= I915_EXEC_BATCH_FIRST;
+
+	if (bufmgr_gem->capture)
+		drm_intel_gem_capture_exec(bufmgr_gem, &execbuf, bo);
 
 	if (bufmgr_gem->no_exec)
 		goto skip_execution;
@@ -2453,7 +3156,12 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 			    (unsigned int) bufmgr_gem->gtt_size);
 		}
 	}
-	drm_intel_update_buffer_offsets2(bufmgr_gem);
+
+	/* Nothing moved, so the kernel had no relocation to look at. */
+	if (!drm_intel_update_buffer_offsets2(bufmgr_gem) &&
+	    no_reloc && ret == 0)
+		bufmgr_gem->reloc_skipped += reloc_count;
+	bufmgr_gem->reloc_total += reloc_count;
 
 	if (ret == 0 && out_fence != NULL)
 		*out_fence = execbuf.rsvd2 >> 32;
@@ -2676,7 +3384,7 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 		goto out;
 
 	atomic_set(&bo_gem->refcount, 1);
-	DRMINITLISTHEAD(&bo_gem->vma_list);
+	drm_intel_gem_bo_init_vma(bo_gem);
 
 	/* Determine size of bo.  The fd-to-handle ioctl really should
 	 * return the size, but it doesn't.  If we have kernel 3.12 or
@@ -2834,6 +3542,27 @@ drm_intel_bufmgr_gem_can_disable_implicit_sync(drm_intel_bufmgr *bufmgr)
 	return bufmgr_gem->has_exec_async;
 }
 
+/**
+ * Query how many relocations were submitted through execbuffer2, and how
+ * many of those the kernel was spared from processing.
+ *
+ * Relocations are only skipped with kernels supporting I915_EXEC_NO_RELOC
+ * and I915_EXEC_HANDLE_LUT, when no relocation presumes a stale offset and
+ * the kernel did not have to move any buffer of the batch. Without that
+ * support, only the total is counted.
+ */
+drm_public void
+drm_intel_bufmgr_gem_get_reloc_stats(drm_intel_bufmgr *bufmgr,
+				     uint64_t *relocs, uint64_t *skipped)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	*relocs = bufmgr_gem->reloc_total;
+	*skipped = bufmgr_gem->reloc_skipped;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
 /**
  * Enable use of fenced reloc type.
  *
@@ -2852,25 +3581,31 @@ drm_intel_bufmgr_gem_enable_fenced_relocs(drm_intel_bufmgr *bufmgr)
 
 /**
  * Return the additional aperture space required by the tree of buffer objects
- * rooted at bo.
+ * rooted at bo, leaving out the buffers already counted by this generation.
  */
 static int
-drm_intel_gem_bo_get_aperture_space(drm_intel_bo *bo)
+drm_intel_gem_bo_get_aperture_space(drm_intel_bo *bo, int generation)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	int i;
 	int total = 0;
 
-	if (bo == NULL || bo_gem->included_in_check_aperture)
+	if (bo == NULL || bo_gem->check_aperture_stamp == generation)
 		return 0;
 
 	total += bo->size;
-	bo_gem->included_in_check_aperture = true;
+	bo_gem->check_aperture_stamp = generation;
 
 	for (i = 0; i < bo_gem->reloc_count; i++)
 		total +=
 		    drm_intel_gem_bo_get_aperture_space(bo_gem->
-							reloc_target_info[i].bo);
+							reloc_target_info[i].bo,
+							generation);
+	for (i = 0; i < bo_gem->softpin_target_count; i++)
+		total +=
+		    drm_intel_gem_bo_get_aperture_space(bo_gem->
+							softpin_target[i],
+							generation);
 
 	return total;
 }
@@ -2900,29 +3635,10 @@ drm_intel_gem_total_fences(drm_intel_bo ** bo_array, int count)
 	return total;
 }
 
-/**
- * Clear the flag set by drm_intel_gem_bo_get_aperture_space() so we're ready
- * for the next drm_intel_bufmgr_check_aperture_space() call.
- */
-static void
-drm_intel_gem_bo_clear_aperture_space_flag(drm_intel_bo *bo)
-{
-	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
-	int i;
-
-	if (bo == NULL || !bo_gem->included_in_check_aperture)
-		return;
-
-	bo_gem->included_in_check_aperture = false;
-
-	for (i = 0; i < bo_gem->reloc_count; i++)
-		drm_intel_gem_bo_clear_aperture_space_flag(bo_gem->
-							   reloc_target_info[i].bo);
-}
-
 /**
  * Return a conservative estimate for the amount of aperture required
- * for a collection of buffers. This may double-count some buffers.
+ * for a collection of buffers. This may double-count buffers shared by
+ * several of them, or by trees built concurrently.
  */
 static unsigned int
 drm_intel_gem_estimate_batch_space(drm_intel_bo **bo_array, int count)
@@ -2946,11 +3662,15 @@ drm_intel_gem_estimate_batch_space(drm_intel_bo **bo_array, int count)
 static unsigned int
 drm_intel_gem_compute_batch_space(drm_intel_bo **bo_array, int count)
 {
+	drm_intel_bufmgr_gem *bufmgr_gem =
+	    (drm_intel_bufmgr_gem *) bo_array[0]->bufmgr;
+	int generation = atomic_inc_return(&bufmgr_gem->aperture_generation);
 	int i;
 	unsigned int total = 0;
 
 	for (i = 0; i < count; i++) {
-		total += drm_intel_gem_bo_get_aperture_space(bo_array[i]);
+		total += drm_intel_gem_bo_get_aperture_space(bo_array[i],
+							     generation);
 		/* For the first buffer object in the array, we get an
 		 * accurate count back for its reloc_tree size (since nothing
 		 * had been flagged as being counted yet).  We can save that
@@ -2967,8 +3687,6 @@ drm_intel_gem_compute_batch_space(drm_intel_bo **bo_array, int count)
 		}
 	}
 
-	for (i = 0; i < count; i++)
-		drm_intel_gem_bo_clear_aperture_space_flag(bo_array[i]);
 	return total;
 }
 
@@ -3068,15 +3786,27 @@ _drm_intel_gem_bo_references(drm_intel_bo *bo, drm_intel_bo *target_bo)
 	return 0;
 }
 
-/** Return true if target_bo is referenced by bo's relocation tree. */
+/**
+ * Return true if target_bo is referenced by bo's relocation tree.
+ *
+ * The tree keeps the handles of its buffers as relocations and softpin
+ * targets are added, so this only walks it if recording them failed.
+ */
 static int
 drm_intel_gem_bo_references(drm_intel_bo *bo, drm_intel_bo *target_bo)
 {
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	drm_intel_bo_gem *target_bo_gem = (drm_intel_bo_gem *) target_bo;
 
 	if (bo == NULL || target_bo == NULL)
 		return 0;
-	if (target_bo_gem->used_as_reloc_target)
+	if (bo_gem->reloc_count == 0 && bo_gem->softpin_target_count == 0)
+		return 0;
+	if (!bo_gem->reloc_tree_inexact)
+		return drm_intel_gem_bo_tree_has_handle(bo_gem,
+							target_bo_gem->gem_handle);
+	if (target_bo_gem->used_as_reloc_target ||
+	    target_bo_gem->kflags & EXEC_OBJECT_PINNED)
 		return _drm_intel_gem_bo_references(bo, target_bo);
 	return 0;
 }
@@ -3097,6 +3827,7 @@ static void
 init_cache_buckets(drm_intel_bufmgr_gem *bufmgr_gem)
 {
 	unsigned long size, cache_max_size = 64 * 1024 * 1024;
+	int i;
 
 	/* OK, so power of two buckets was too wasteful of memory.
 	 * Give 3 other sizes between each power of two, to hopefully
@@ -3118,6 +3849,16 @@ init_cache_buckets(drm_intel_bufmgr_gem *bufmgr_gem)
 		add_bucket(bufmgr_gem, size + size * 2 / 4);
 		add_bucket(bufmgr_gem, size + size * 3 / 4);
 	}
+
+	/* drm_intel_gem_bo_bucket_for_size() relies on this layout. */
+	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
+		size = bufmgr_gem->cache_bucket[i].size;
+		assert(drm_intel_gem_bo_bucket_for_size(bufmgr_gem, size) ==
+		       &bufmgr_gem->cache_bucket[i]);
+		assert(drm_intel_gem_bo_bucket_for_size(bufmgr_gem, size + 1) ==
+		       (i + 1 < bufmgr_gem->num_buckets ?
+			&bufmgr_gem->cache_bucket[i + 1] : NULL));
+	}
 }
 
 drm_public void
@@ -3130,6 +3871,49 @@ drm_intel_bufmgr_gem_set_vma_cache_size(drm_intel_bufmgr *bufmgr, int limit)
 	drm_intel_gem_bo_purge_vma_cache(bufmgr_gem);
 }
 
+/**
+ * Query how often mapping a buffer reused a mapping kept from an earlier
+ * map, how often a new one had to be created, and how many kept mappings
+ * were released to stay within the VMA cache limits.
+ *
+ * Maps of buffers already mapped through drm_intel_gem_bo_map__cpu(),
+ * drm_intel_gem_bo_map__gtt() or drm_intel_gem_bo_map__wc() return
+ * without locking and are not counted.
+ */
+drm_public void
+drm_intel_bufmgr_gem_get_vma_cache_stats(drm_intel_bufmgr *bufmgr,
+					 uint64_t *hits, uint64_t *misses,
+					 uint64_t *evictions)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	*hits = bufmgr_gem->vma_hits;
+	*misses = bufmgr_gem->vma_misses;
+	*evictions = bufmgr_gem->vma_evictions;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Returns how many mappings the VMA cache may keep: half of
+ * vm.max_map_count, leaving the rest to the other users of the process.
+ */
+static int
+drm_intel_gem_vma_map_limit(void)
+{
+	int max_map_count = 65530;
+	FILE *file;
+
+	file = fopen("/proc/sys/vm/max_map_count", "r");
+	if (file) {
+		if (fscanf(file, "%d", &max_map_count) != 1)
+			max_map_count = 65530;
+		fclose(file);
+	}
+
+	return max_map_count / 2;
+}
+
 static int
 parse_devid_override(const char *devid_override)
 {
@@ -3483,6 +4267,7 @@ drm_public void *drm_intel_gem_bo_map__gtt(drm_intel_bo *bo)
 		DBG("bo_map_gtt: mmap %d (%s), map_count=%d\n",
 		    bo_gem->gem_handle, bo_gem->name, bo_gem->map_count);
 
+		drm_intel_gem_bo_vma_lookup(bufmgr_gem, false);
 		if (bo_gem->map_count++ == 0)
 			drm_intel_gem_bo_open_vma(bufmgr_gem, bo_gem);
 
@@ -3500,6 +4285,7 @@ drm_public void *drm_intel_gem_bo_map__gtt(drm_intel_bo *bo)
 				       mmap_arg.offset);
 		}
 		if (ptr == MAP_FAILED) {
+			drm_intel_gem_bo_vma_failed(bufmgr_gem, errno);
 			if (--bo_gem->map_count == 0)
 				drm_intel_gem_bo_close_vma(bufmgr_gem, bo_gem);
 			ptr = NULL;
@@ -3529,6 +4315,7 @@ drm_public void *drm_intel_gem_bo_map__cpu(drm_intel_bo *bo)
 	if (!bo_gem->mem_virtual) {
 		struct drm_i915_gem_mmap mmap_arg;
 
+		drm_intel_gem_bo_vma_lookup(bufmgr_gem, false);
 		if (bo_gem->map_count++ == 0)
 			drm_intel_gem_bo_open_vma(bufmgr_gem, bo_gem);
 
@@ -3544,6 +4331,7 @@ drm_public void *drm_intel_gem_bo_map__cpu(drm_intel_bo *bo)
 			DBG("%s:%d: Error mapping buffer %d (%s): %s .\n",
 			    __FILE__, __LINE__, bo_gem->gem_handle,
 			    bo_gem->name, strerror(errno));
+			drm_intel_gem_bo_vma_failed(bufmgr_gem, errno);
 			if (--bo_gem->map_count == 0)
 				drm_intel_gem_bo_close_vma(bufmgr_gem, bo_gem);
 		} else {
@@ -3571,6 +4359,7 @@ drm_public void *drm_intel_gem_bo_map__wc(drm_intel_bo *bo)
 	if (!bo_gem->wc_virtual) {
 		struct drm_i915_gem_mmap mmap_arg;
 
+		drm_intel_gem_bo_vma_lookup(bufmgr_gem, false);
 		if (bo_gem->map_count++ == 0)
 			drm_intel_gem_bo_open_vma(bufmgr_gem, bo_gem);
 
@@ -3587,6 +4376,7 @@ drm_public void *drm_intel_gem_bo_map__wc(drm_intel_bo *bo)
 			DBG("%s:%d: Error mapping buffer %d (%s): %s .\n",
 			    __FILE__, __LINE__, bo_gem->gem_handle,
 			    bo_gem->name, strerror(errno));
+			drm_intel_gem_bo_vma_failed(bufmgr_gem, errno);
 			if (--bo_gem->map_count == 0)
 				drm_intel_gem_bo_close_vma(bufmgr_gem, bo_gem);
 		} else {
@@ -3599,6 +4389,41 @@ drm_public void *drm_intel_gem_bo_map__wc(drm_intel_bo *bo)
 	return bo_gem->wc_virtual;
 }
 
+/**
+ * Starts capturing execbuffers to the file named by the INTEL_CAPTURE
+ * environment variable, for intel_replay to read. Each further bufmgr in
+ * the process captures to that name with a ".N" suffix.
+ */
+static void
+drm_intel_bufmgr_gem_open_capture(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	static int capture_count;
+	const char *filename;
+	char *name = NULL;
+
+	if (geteuid() != getuid())
+		return;
+
+	filename = getenv("INTEL_CAPTURE");
+	if (filename == NULL || filename[0] == '\0')
+		return;
+
+	if (capture_count++ > 0) {
+		if (asprintf(&name, "%s.%d", filename, capture_count - 1) < 0)
+			return;
+		filename = name;
+	}
+
+	bufmgr_gem->capture = intel_capture_open(filename,
+						 bufmgr_gem->pci_device,
+						 bufmgr_gem->gen);
+	if (bufmgr_gem->capture == NULL)
+		fprintf(stderr, "Failed to open capture file %s: %s\n",
+			filename, strerror(errno));
+
+	free(name);
+}
+
 /**
  * Initializes the GEM buffer manager, which uses the kernel to allocate, map,
  * and manage map buffer objections.
@@ -3705,6 +4530,18 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
 	bufmgr_gem->has_exec_async = ret == 0;
 
+	gp.param = I915_PARAM_HAS_EXEC_NO_RELOC;
+	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
+	bufmgr_gem->has_no_reloc = ret == 0 && *gp.value > 0;
+
+	gp.param = I915_PARAM_HAS_EXEC_HANDLE_LUT;
+	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
+	bufmgr_gem->has_handle_lut = ret == 0 && *gp.value > 0;
+
+	gp.param = I915_PARAM_HAS_EXEC_BATCH_FIRST;
+	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
+	bufmgr_gem->has_batch_first = ret == 0 && *gp.value > 0;
+
 	bufmgr_gem->bufmgr.bo_alloc_userptr = check_bo_alloc_userptr;
 
 	gp.param = I915_PARAM_HAS_WAIT_TIMEOUT;
@@ -3810,8 +4647,19 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 
 	init_cache_buckets(bufmgr_gem);
 
-	DRMINITLISTHEAD(&bufmgr_gem->vma_cache);
-	bufmgr_gem->vma_max = -1; /* unlimited by default */
+	DRMINITLISTHEAD(&bufmgr_gem->magazines);
+	bufmgr_gem->has_magazines =
+		pthread_key_create(&bufmgr_gem->magazine_key,
+				   drm_intel_gem_bo_magazine_destroy) == 0;
+
+	for (tmp = 0; tmp < VMA_NUM_TYPES; tmp++)
+		DRMINITLISTHEAD(&bufmgr_gem->vma_cache[tmp]);
+	bufmgr_gem->vma_max = -1; /* only limited by the budget by default */
+	bufmgr_gem->vma_map_limit = drm_intel_gem_vma_map_limit();
+	bufmgr_gem->vma_budget = VMA_BUDGET_INITIAL;
+
+	if (exec2)
+		drm_intel_bufmgr_gem_open_capture(bufmgr_gem);
 
 	DRMLISTADD(&bufmgr_gem->managers, &bufmgr_list);
 
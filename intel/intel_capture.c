@@ -0,0 +1,227 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file intel_capture.c
+ *
+ * Writes captures in the format described in intel_capture.h.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intel_capture.h"
+
+struct intel_capture {
+	FILE *file;
+
+	/** Open-addressed set of the hashes of the blobs written so far */
+	uint64_t *hashes;
+	unsigned int hash_count;
+	unsigned int hash_size;
+};
+
+static const uint64_t padding;
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * Hashes data 8 bytes at a time, mixing each word in with a multiply and a
+ * rotate. Never returns 0, which marks buffers whose contents are missing.
+ */
+drm_private uint64_t
+intel_capture_hash(const void *data, size_t size)
+{
+	const uint64_t prime1 = 0x9e3779b185ebca87ull;
+	const uint64_t prime2 = 0xc2b2ae3d27d4eb4full;
+	const uint8_t *bytes = data;
+	uint64_t hash = size * prime1;
+	uint64_t word;
+	size_t i;
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&word, bytes + i, 8);
+		hash ^= rotl64(word * prime2, 31) * prime1;
+		hash = rotl64(hash, 27) * prime1 + prime2;
+	}
+
+	word = 0;
+	memcpy(&word, bytes + i, size - i);
+	hash ^= rotl64(word * prime2, 31) * prime1;
+
+	hash ^= hash >> 33;
+	hash *= prime2;
+	hash ^= hash >> 29;
+
+	return hash ? hash : 1;
+}
+
+static int
+intel_capture_write(struct intel_capture *capture, uint32_t type,
+		    uint64_t size)
+{
+	struct intel_capture_record record = {
+		.type = type,
+		.size = size,
+	};
+
+	if (fwrite(&record, sizeof(record), 1, capture->file) != 1)
+		return -errno;
+
+	return 0;
+}
+
+static int
+intel_capture_write_data(struct intel_capture *capture, const void *data,
+			 uint64_t size)
+{
+	if (size && fwrite(data, size, 1, capture->file) != 1)
+		return -errno;
+
+	if (size % 8 &&
+	    fwrite(&padding, 8 - size % 8, 1, capture->file) != 1)
+		return -errno;
+
+	return 0;
+}
+
+drm_private struct intel_capture *
+intel_capture_open(const char *filename, uint32_t devid, uint32_t gen)
+{
+	struct intel_capture_header header;
+	struct intel_capture *capture;
+
+	capture = calloc(1, sizeof(*capture));
+	if (!capture)
+		return NULL;
+
+	capture->file = fopen(filename, "wb");
+	if (!capture->file) {
+		free(capture);
+		return NULL;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INTEL_CAPTURE_MAGIC, sizeof(header.magic));
+	header.version = INTEL_CAPTURE_VERSION;
+	header.devid = devid;
+	header.gen = gen;
+
+	if (fwrite(&header, sizeof(header), 1, capture->file) != 1) {
+		intel_capture_close(capture);
+		return NULL;
+	}
+
+	return capture;
+}
+
+drm_private void
+intel_capture_close(struct intel_capture *capture)
+{
+	fclose(capture->file);
+	free(capture->hashes);
+	free(capture);
+}
+
+/** Adds hash to the set, returning false if it was already there. */
+static bool
+intel_capture_insert_hash(struct intel_capture *capture, uint64_t hash)
+{
+	unsigned int i, mask;
+
+	if (2 * (capture->hash_count + 1) > capture->hash_size) {
+		unsigned int size = capture->hash_size ? 2 * capture->hash_size :
+			1024;
+		uint64_t *hashes, *old = capture->hashes;
+		unsigned int old_size = capture->hash_size;
+
+		hashes = calloc(size, sizeof(*hashes));
+		if (!hashes)
+			return true;
+
+		capture->hashes = hashes;
+		capture->hash_size = size;
+		capture->hash_count = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i])
+				intel_capture_insert_hash(capture, old[i]);
+		free(old);
+	}
+
+	mask = capture->hash_size - 1;
+	for (i = hash & mask; capture->hashes[i]; i = (i + 1) & mask)
+		if (capture->hashes[i] == hash)
+			return false;
+
+	capture->hashes[i] = hash;
+	capture->hash_count++;
+	return true;
+}
+
+drm_private uint64_t
+intel_capture_add_blob(struct intel_capture *capture, const void *data,
+		       uint64_t size)
+{
+	struct intel_capture_blob blob;
+
+	blob.hash = intel_capture_hash(data, size);
+	blob.size = size;
+
+	if (!intel_capture_insert_hash(capture, blob.hash))
+		return blob.hash;
+
+	if (intel_capture_write(capture, INTEL_CAPTURE_BLOB,
+				sizeof(blob) + ((size + 7) & ~7ull)) ||
+	    intel_capture_write_data(capture, &blob, sizeof(blob)) ||
+	    intel_capture_write_data(capture, data, size))
+		return 0;
+
+	return blob.hash;
+}
+
+drm_private int
+intel_capture_add_exec(struct intel_capture *capture,
+		       const struct intel_capture_exec *exec,
+		       const struct intel_capture_buffer *buffers,
+		       const struct intel_capture_reloc *relocs)
+{
+	uint64_t buffers_size = exec->buffer_count * sizeof(*buffers);
+	uint64_t relocs_size = exec->reloc_count * sizeof(*relocs);
+	int ret;
+
+	ret = intel_capture_write(capture, INTEL_CAPTURE_EXEC,
+				  sizeof(*exec) + buffers_size + relocs_size);
+	if (ret == 0)
+		ret = intel_capture_write_data(capture, exec, sizeof(*exec));
+	if (ret == 0)
+		ret = intel_capture_write_data(capture, buffers, buffers_size);
+	if (ret == 0)
+		ret = intel_capture_write_data(capture, relocs, relocs_size);
+
+	return ret;
+}
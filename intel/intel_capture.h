@@ -0,0 +1,133 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/**
+ * @file intel_capture.h
+ *
+ * File format for captures of the execbuffer stream of a process, written
+ * by the GEM bufmgr when INTEL_CAPTURE names a file and read back by
+ * intel_replay.
+ *
+ * A capture is an intel_capture_header followed by records, each an
+ * intel_capture_record and its payload, all in native byte order and
+ * 8-byte aligned so the file can be used in place once mapped.
+ *
+ * Buffer contents are stored once per content hash in blob records, which
+ * always come before the first exec record referring to them. An exec
+ * record holds an intel_capture_exec, its buffers, then the relocations of
+ * all its buffers in order.
+ */
+
+#ifndef INTEL_CAPTURE_H
+#define INTEL_CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "libdrm_macros.h"
+
+#define INTEL_CAPTURE_MAGIC "DRMICAP"
+#define INTEL_CAPTURE_VERSION 1
+
+enum intel_capture_record_type {
+	INTEL_CAPTURE_BLOB = 1,
+	INTEL_CAPTURE_EXEC = 2,
+};
+
+struct intel_capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t devid;
+	uint32_t gen;
+	uint32_t pad;
+};
+
+struct intel_capture_record {
+	uint32_t type;
+	uint32_t pad;
+	/** Bytes of payload following, a multiple of 8 */
+	uint64_t size;
+};
+
+/** Blob payload header, followed by the contents padded to 8 bytes */
+struct intel_capture_blob {
+	uint64_t hash;
+	uint64_t size;
+};
+
+struct intel_capture_exec {
+	uint32_t buffer_count;
+	uint32_t reloc_count;
+	/** Index of the batch among the buffers */
+	uint32_t batch_index;
+	uint32_t batch_len;
+	uint32_t ctx_id;
+	uint32_t pad;
+	/** Flags of the execbuffer2 ioctl */
+	uint64_t flags;
+};
+
+struct intel_capture_buffer {
+	uint32_t handle;
+	uint32_t reloc_count;
+	/** Address the buffer was submitted at */
+	uint64_t offset;
+	uint64_t size;
+	/** Hash of the contents, or 0 if they could not be read */
+	uint64_t hash;
+	/** EXEC_OBJECT_* flags */
+	uint64_t flags;
+};
+
+struct intel_capture_reloc {
+	/** Index of the buffer holding the address */
+	uint32_t buffer;
+	/** Index of the buffer the address points into */
+	uint32_t target;
+	uint64_t offset;
+	uint64_t delta;
+	uint64_t presumed_offset;
+	uint32_t read_domains;
+	uint32_t write_domain;
+};
+
+struct intel_capture;
+
+drm_private uint64_t intel_capture_hash(const void *data, size_t size);
+
+drm_private struct intel_capture *intel_capture_open(const char *filename,
+						     uint32_t devid,
+						     uint32_t gen);
+drm_private void intel_capture_close(struct intel_capture *capture);
+
+/**
+ * Stores the contents of a buffer unless the same contents were stored
+ * before, and returns their hash.
+ */
+drm_private uint64_t intel_capture_add_blob(struct intel_capture *capture,
+					    const void *data, uint64_t size);
+
+drm_private int intel_capture_add_exec(struct intel_capture *capture,
+				       const struct intel_capture_exec *exec,
+				       const struct intel_capture_buffer *buffers,
+				       const struct intel_capture_reloc *relocs);
+
+#endif /* INTEL_CAPTURE_H */
@@ -0,0 +1,580 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Replays a capture written by the GEM bufmgr with INTEL_CAPTURE set,
+ * without a GPU. Each execbuffer has its relocations applied the way the
+ * kernel would, to copies of the captured buffers, and then either has its
+ * batch decoded or only counts towards the summary, so that changes to
+ * relocation handling and to the decoder can be tested and timed against
+ * real workloads.
+ *
+ * With -t, the execbuffers are split into runs of consecutive ones, each
+ * replayed by its own thread with its own decode context, and the output
+ * of the runs is written in order once they are all done.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <err.h>
+#include <pthread.h>
+
+#include "libdrm_macros.h"
+#include "intel_bufmgr.h"
+#include "intel_capture.h"
+
+struct blob {
+	const struct intel_capture_blob *header;
+	const void *data;
+};
+
+struct exec {
+	const struct intel_capture_exec *header;
+	const struct intel_capture_buffer *buffers;
+	const struct intel_capture_reloc *relocs;
+};
+
+/** Replays the execbuffers from first to last, less one. */
+struct worker {
+	struct replay *replay;
+	pthread_t thread;
+	uint64_t first, last;
+
+	struct drm_intel_decode *decode;
+	/** Output of the decode, unless it goes straight to stdout */
+	FILE *out;
+	char *output;
+	size_t output_size;
+
+	uint64_t buffers;
+	uint64_t bytes;
+	uint64_t relocs_patched;
+	uint64_t relocs_skipped;
+};
+
+struct replay {
+	uint32_t devid;
+	uint32_t gen;
+	bool decode;
+	bool json;
+	bool stats;
+
+	/** Open-addressed table of the blobs, by hash */
+	struct blob *blobs;
+	unsigned int blob_count;
+	unsigned int blob_size;
+
+	struct exec *execs;
+	uint64_t exec_count;
+	uint64_t exec_size;
+};
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: intel_replay [-d] [-J] [-s] [-t threads] <capture>\n\n");
+	fprintf(stderr, "\t-d\tdecode the batches instead of printing a summary\n");
+	fprintf(stderr, "\t-J\tdecode the batches as a JSON record per command\n");
+	fprintf(stderr, "\t-s\tcount the commands in the batches\n");
+	fprintf(stderr, "\t-t <threads>\treplay with that many threads\n");
+	exit(1);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+read_file(const char *filename, void **ptr, size_t *size)
+{
+	int fd, ret;
+	struct stat st;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		errx(1, "couldn't open `%s'", filename);
+
+	ret = fstat(fd, &st);
+	if (ret)
+		errx(1, "couldn't stat `%s'", filename);
+
+	*size = st.st_size;
+	*ptr = drm_mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (*ptr == MAP_FAILED)
+		errx(1, "couldn't map `%s'", filename);
+
+	close(fd);
+}
+
+static const struct blob *
+find_blob(const struct replay *replay, uint64_t hash)
+{
+	unsigned int i, mask = replay->blob_size - 1;
+
+	if (replay->blob_size == 0)
+		return NULL;
+
+	for (i = hash & mask; replay->blobs[i].header; i = (i + 1) & mask)
+		if (replay->blobs[i].header->hash == hash)
+			return &replay->blobs[i];
+
+	return NULL;
+}
+
+static void
+add_blob(struct replay *replay, const struct intel_capture_blob *header,
+	 const void *data)
+{
+	unsigned int i, mask;
+
+	if (intel_capture_hash(data, header->size) != header->hash)
+		errx(1, "blob %016llx is corrupt",
+		     (unsigned long long) header->hash);
+
+	if (2 * (replay->blob_count + 1) > replay->blob_size) {
+		struct blob *old = replay->blobs;
+		unsigned int old_size = replay->blob_size;
+
+		replay->blob_size = old_size ? 2 * old_size : 1024;
+		replay->blobs = calloc(replay->blob_size, sizeof(*replay->blobs));
+		if (replay->blobs == NULL)
+			errx(1, "out of memory");
+
+		replay->blob_count = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i].header)
+				add_blob(replay, old[i].header, old[i].data);
+		free(old);
+	}
+
+	mask = replay->blob_size - 1;
+	for (i = header->hash & mask; replay->blobs[i].header; i = (i + 1) & mask)
+		if (replay->blobs[i].header->hash == header->hash)
+			return;
+
+	replay->blobs[i].header = header;
+	replay->blobs[i].data = data;
+	replay->blob_count++;
+}
+
+/**
+ * Applies the relocations of one execbuffer and decodes its batch if asked
+ * to. Like the kernel, only relocations whose presumed offset is stale get
+ * written, using 64-bit addresses from gen8 on.
+ */
+static void
+replay_exec(struct worker *worker, uint64_t index)
+{
+	const struct replay *replay = worker->replay;
+	const struct intel_capture_exec *exec = replay->execs[index].header;
+	const struct intel_capture_buffer *buffers =
+		replay->execs[index].buffers;
+	const struct intel_capture_reloc *relocs = replay->execs[index].relocs;
+	unsigned int address_size = replay->gen >= 8 ? 8 : 4;
+	const struct intel_capture_buffer *batch;
+	uint8_t **contents;
+	uint32_t i;
+
+	if (exec->batch_index >= exec->buffer_count)
+		errx(1, "execbuffer %llu has no batch",
+		     (unsigned long long) index);
+
+	/* The bufmgr always starts batches at offset 0, so none is captured. */
+	batch = &buffers[exec->batch_index];
+	if (exec->batch_len > batch->size)
+		errx(1, "batch of execbuffer %llu is longer than its buffer",
+		     (unsigned long long) index);
+
+	contents = calloc(exec->buffer_count, sizeof(*contents));
+	if (contents == NULL)
+		errx(1, "out of memory");
+
+	/* Work on copies of the buffers, as the capture is mapped read-only. */
+	for (i = 0; i < exec->buffer_count; i++) {
+		const struct blob *blob;
+
+		if (buffers[i].hash == 0)
+			continue;
+
+		blob = find_blob(replay, buffers[i].hash);
+		if (blob == NULL || blob->header->size > buffers[i].size)
+			errx(1, "buffer %u of execbuffer %llu has no contents",
+			     i, (unsigned long long) index);
+
+		contents[i] = calloc(1, buffers[i].size);
+		if (contents[i] == NULL)
+			errx(1, "out of memory");
+		memcpy(contents[i], blob->data, blob->header->size);
+
+		worker->bytes += buffers[i].size;
+	}
+
+	for (i = 0; i < exec->reloc_count; i++) {
+		const struct intel_capture_reloc *reloc = &relocs[i];
+		uint64_t address;
+
+		if (reloc->buffer >= exec->buffer_count ||
+		    reloc->target >= exec->buffer_count ||
+		    reloc->offset > buffers[reloc->buffer].size ||
+		    buffers[reloc->buffer].size - reloc->offset < address_size)
+			errx(1, "relocation %u of execbuffer %llu is invalid",
+			     i, (unsigned long long) index);
+
+		address = buffers[reloc->target].offset + reloc->delta;
+		if (reloc->presumed_offset == buffers[reloc->target].offset ||
+		    contents[reloc->buffer] == NULL) {
+			worker->relocs_skipped++;
+			continue;
+		}
+
+		memcpy(contents[reloc->buffer] + reloc->offset, &address,
+		       address_size);
+		worker->relocs_patched++;
+	}
+
+	if (worker->decode && contents[exec->batch_index]) {
+		uint32_t len = exec->batch_len ? exec->batch_len : batch->size;
+
+		drm_intel_decode_set_batch_pointer(worker->decode,
+						   contents[exec->batch_index],
+						   batch->offset, len / 4);
+		drm_intel_decode(worker->decode);
+	}
+
+	for (i = 0; i < exec->buffer_count; i++)
+		free(contents[i]);
+	free(contents);
+
+	worker->buffers += exec->buffer_count;
+}
+
+static void *
+replay_execs(void *arg)
+{
+	struct worker *worker = arg;
+	uint64_t i;
+
+	for (i = worker->first; i < worker->last; i++)
+		replay_exec(worker, i);
+
+	if (worker->out)
+		fclose(worker->out);
+
+	return NULL;
+}
+
+static void
+add_exec(struct replay *replay, const struct intel_capture_exec *header,
+	 const struct intel_capture_buffer *buffers,
+	 const struct intel_capture_reloc *relocs)
+{
+	struct exec *exec;
+
+	if (replay->exec_count == replay->exec_size) {
+		uint64_t size = replay->exec_size ? 2 * replay->exec_size : 256;
+
+		exec = realloc(replay->execs, size * sizeof(*exec));
+		if (exec == NULL)
+			errx(1, "out of memory");
+
+		replay->execs = exec;
+		replay->exec_size = size;
+	}
+
+	exec = &replay->execs[replay->exec_count++];
+	exec->header = header;
+	exec->buffers = buffers;
+	exec->relocs = relocs;
+}
+
+/** Indexes the blobs and execbuffers of a capture. */
+static void
+read_capture(struct replay *replay, const uint8_t *ptr, size_t size)
+{
+	size_t pos = sizeof(struct intel_capture_header);
+
+	while (pos + sizeof(struct intel_capture_record) <= size) {
+		const struct intel_capture_record *record =
+			(const void *) (ptr + pos);
+		const uint8_t *payload = ptr + pos + sizeof(*record);
+
+		pos += sizeof(*record);
+		if (record->size > size - pos)
+			errx(1, "capture is truncated");
+		pos += record->size;
+
+		switch (record->type) {
+		case INTEL_CAPTURE_BLOB: {
+			const struct intel_capture_blob *blob =
+				(const void *) payload;
+
+			if (record->size < sizeof(*blob) ||
+			    blob->size > record->size - sizeof(*blob))
+				errx(1, "blob record is invalid");
+
+			add_blob(replay, blob, blob + 1);
+			break;
+		}
+		case INTEL_CAPTURE_EXEC: {
+			const struct intel_capture_exec *exec =
+				(const void *) payload;
+			const struct intel_capture_buffer *buffers =
+				(const void *) (exec + 1);
+			const struct intel_capture_reloc *relocs =
+				(const void *) (buffers + exec->buffer_count);
+
+			if (record->size < sizeof(*exec) ||
+			    record->size != sizeof(*exec) +
+			    (uint64_t) exec->buffer_count * sizeof(*buffers) +
+			    (uint64_t) exec->reloc_count * sizeof(*relocs))
+				errx(1, "execbuffer record is invalid");
+
+			add_exec(replay, exec, buffers, relocs);
+			break;
+		}
+		default:
+			/* Skip records from newer writers. */
+			break;
+		}
+	}
+}
+
+static int
+compare_command_stats(const void *a, const void *b)
+{
+	const struct drm_intel_decode_command_stats *sa = a, *sb = b;
+
+	if (sa->count != sb->count)
+		return sa->count < sb->count ? 1 : -1;
+
+	return sa->opcode < sb->opcode ? -1 : sa->opcode > sb->opcode;
+}
+
+/** Prints the command counts of all the workers added together. */
+static void
+print_command_stats(const struct worker *workers, unsigned int worker_count)
+{
+	struct drm_intel_decode_command_stats *stats = NULL;
+	uint64_t commands = 0, dwords = 0;
+	int i, j, count = 0;
+	unsigned int w;
+
+	for (w = 0; w < worker_count; w++) {
+		struct drm_intel_decode *decode = workers[w].decode;
+		uint64_t worker_commands, worker_dwords;
+		int n, merged = count;
+
+		n = drm_intel_decode_get_stats(decode, NULL, 0,
+					       &worker_commands,
+					       &worker_dwords);
+		stats = realloc(stats, (count + n + 1) * sizeof(*stats));
+		if (stats == NULL)
+			errx(1, "out of memory");
+		n = drm_intel_decode_get_stats(decode, stats + count, n,
+					       NULL, NULL);
+		commands += worker_commands;
+		dwords += worker_dwords;
+
+		/* Fold the new entries into those of the earlier workers. */
+		for (i = count; i < count + n; i++) {
+			for (j = 0; j < count; j++) {
+				if (stats[j].opcode == stats[i].opcode) {
+					stats[j].count += stats[i].count;
+					stats[j].dwords += stats[i].dwords;
+					break;
+				}
+			}
+			if (j == count)
+				stats[merged++] = stats[i];
+		}
+		count = merged;
+	}
+	qsort(stats, count, sizeof(*stats), compare_command_stats);
+
+	printf("%llu commands, %llu dwords\n", (unsigned long long) commands,
+	       (unsigned long long) dwords);
+	for (i = 0; i < count; i++)
+		printf("%10llu %10llu  0x%08x %s\n",
+		       (unsigned long long) stats[i].count,
+		       (unsigned long long) stats[i].dwords, stats[i].opcode,
+		       stats[i].name ? stats[i].name : "");
+
+	free(stats);
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct intel_capture_header *header;
+	struct replay replay;
+	struct worker *workers;
+	unsigned int i, worker_count = 1;
+	uint64_t buffers = 0, bytes = 0, patched = 0, skipped = 0;
+	double start, elapsed;
+	size_t size;
+	void *ptr;
+	int c;
+
+	memset(&replay, 0, sizeof(replay));
+	while ((c = getopt(argc, argv, "dJst:h")) != -1) {
+		switch (c) {
+		case 'd':
+			replay.decode = true;
+			break;
+		case 'J':
+			replay.decode = true;
+			replay.json = true;
+			break;
+		case 's':
+			replay.stats = true;
+			break;
+		case 't':
+			worker_count = strtoul(optarg, NULL, 0);
+			if (worker_count == 0)
+				usage();
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (optind != argc - 1)
+		usage();
+
+#if !HAVE_OPEN_MEMSTREAM
+	/* The decode of each run is buffered in memory to keep it in order. */
+	if (replay.decode)
+		worker_count = 1;
+#endif
+
+	read_file(argv[optind], &ptr, &size);
+
+	header = ptr;
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, INTEL_CAPTURE_MAGIC, sizeof(header->magic)))
+		errx(1, "`%s' is not a capture", argv[optind]);
+	if (header->version != INTEL_CAPTURE_VERSION)
+		errx(1, "unsupported capture version %u", header->version);
+
+	replay.devid = header->devid;
+	replay.gen = header->gen;
+
+	start = now();
+	read_capture(&replay, ptr, size);
+
+	workers = calloc(worker_count, sizeof(*workers));
+	if (workers == NULL)
+		errx(1, "out of memory");
+
+	for (i = 0; i < worker_count; i++) {
+		struct worker *worker = &workers[i];
+
+		worker->replay = &replay;
+		worker->first = replay.exec_count * i / worker_count;
+		worker->last = replay.exec_count * (i + 1) / worker_count;
+
+		if (!replay.decode && !replay.stats)
+			continue;
+
+		worker->decode = drm_intel_decode_context_alloc(header->devid);
+		if (worker->decode == NULL)
+			errx(1, "can't decode for device 0x%04x", header->devid);
+#if HAVE_OPEN_MEMSTREAM
+		if (replay.decode && worker_count > 1) {
+			worker->out = open_memstream(&worker->output,
+						     &worker->output_size);
+			if (worker->out == NULL)
+				errx(1, "out of memory");
+		}
+#endif
+		drm_intel_decode_set_output_file(worker->decode,
+						 worker->out ? worker->out :
+						 stdout);
+		drm_intel_decode_set_output_format(worker->decode,
+						   replay.json ?
+						   DRM_INTEL_DECODE_FORMAT_JSON :
+						   DRM_INTEL_DECODE_FORMAT_TEXT);
+		drm_intel_decode_set_quiet(worker->decode, !replay.decode);
+	}
+
+	if (worker_count == 1) {
+		replay_execs(&workers[0]);
+	} else {
+		for (i = 0; i < worker_count; i++)
+			if (pthread_create(&workers[i].thread, NULL,
+					   replay_execs, &workers[i]))
+				errx(1, "failed to create thread %u", i);
+		for (i = 0; i < worker_count; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+	elapsed = now() - start;
+
+	for (i = 0; i < worker_count; i++) {
+		if (workers[i].output)
+			fwrite(workers[i].output, 1, workers[i].output_size,
+			       stdout);
+		buffers += workers[i].buffers;
+		bytes += workers[i].bytes;
+		patched += workers[i].relocs_patched;
+		skipped += workers[i].relocs_skipped;
+	}
+
+	if (!replay.decode) {
+		printf("device 0x%04x, gen%u\n", replay.devid, replay.gen);
+		printf("%llu execbuffers, %llu buffers, %u unique contents\n",
+		       (unsigned long long) replay.exec_count,
+		       (unsigned long long) buffers, replay.blob_count);
+		printf("%llu relocations written, %llu skipped\n",
+		       (unsigned long long) patched,
+		       (unsigned long long) skipped);
+		printf("%.1f MB replayed in %.3f ms, %.1f us per execbuffer\n",
+		       bytes / 1e6, elapsed * 1e3,
+		       replay.exec_count ?
+		       elapsed * 1e6 / replay.exec_count : 0.0);
+	}
+
+	if (replay.stats)
+		print_command_stats(workers, worker_count);
+
+	for (i = 0; i < worker_count; i++) {
+		if (workers[i].decode)
+			drm_intel_decode_context_free(workers[i].decode);
+		free(workers[i].output);
+	}
+	free(workers);
+	free(replay.execs);
+	free(replay.blobs);
+
+	return 0;
+}
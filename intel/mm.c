@@ -29,6 +29,139 @@
 #include "libdrm_macros.h"
 #include "mm.h"
 
+/*
+ * Free blocks are kept in segregated lists as in TLSF ("two-level
+ * segregated fit"): the first level splits sizes by power of two and the
+ * second splits each power of two into SL_COUNT ranges, with a bitmap of
+ * the non-empty lists at each level. That finds a free block big enough
+ * for a request, splits it and merges freed blocks with their neighbours
+ * in constant time, however fragmented the heap gets.
+ */
+#define SL_LOG2		4
+#define SL_COUNT	(1 << SL_LOG2)
+/* Sizes below SL_COUNT all go in the first list of the first level. */
+#define FL_COUNT	(31 - SL_LOG2 + 1)
+
+struct mem_heap {
+	/* Sentinel of the list of blocks in address order, never free. */
+	struct mem_block head;
+
+	unsigned int fl_bitmap;
+	unsigned int sl_bitmap[FL_COUNT];
+	struct mem_block *free[FL_COUNT][SL_COUNT];
+};
+
+static struct mem_heap *GetHeap(const struct mem_block *heap)
+{
+	return (struct mem_heap *)heap;
+}
+
+static int FloorLog2(unsigned int x)
+{
+	return 31 - __builtin_clz(x);
+}
+
+/* Finds the list of blocks of the given size. */
+static void MappingInsert(unsigned int size, int *fl, int *sl)
+{
+	if (size < SL_COUNT) {
+		*fl = 0;
+		*sl = size;
+	} else {
+		int log2 = FloorLog2(size);
+
+		*fl = log2 - SL_LOG2 + 1;
+		*sl = (size >> (log2 - SL_LOG2)) - SL_COUNT;
+	}
+}
+
+/*
+ * Finds the first list of blocks that are all at least size bytes,
+ * returning 0 if there can't be one.
+ */
+static int MappingSearch(unsigned int size, int *fl, int *sl)
+{
+	if (size >= SL_COUNT)
+		size += (1u << (FloorLog2(size) - SL_LOG2)) - 1;
+
+	MappingInsert(size, fl, sl);
+	return *fl < FL_COUNT;
+}
+
+static void InsertFree(struct mem_heap *heap, struct mem_block *p)
+{
+	int fl, sl;
+
+	MappingInsert(p->size, &fl, &sl);
+
+	p->prev_free = NULL;
+	p->next_free = heap->free[fl][sl];
+	if (p->next_free)
+		p->next_free->prev_free = p;
+	heap->free[fl][sl] = p;
+
+	heap->fl_bitmap |= 1u << fl;
+	heap->sl_bitmap[fl] |= 1u << sl;
+}
+
+static void RemoveFree(struct mem_heap *heap, struct mem_block *p)
+{
+	int fl, sl;
+
+	MappingInsert(p->size, &fl, &sl);
+
+	if (p->next_free)
+		p->next_free->prev_free = p->prev_free;
+	if (p->prev_free)
+		p->prev_free->next_free = p->next_free;
+	else
+		heap->free[fl][sl] = p->next_free;
+
+	if (!heap->free[fl][sl]) {
+		heap->sl_bitmap[fl] &= ~(1u << sl);
+		if (!heap->sl_bitmap[fl])
+			heap->fl_bitmap &= ~(1u << fl);
+	}
+
+	p->next_free = NULL;
+	p->prev_free = NULL;
+}
+
+/* Returns the first block of the first non-empty list from (fl, sl) on. */
+static struct mem_block *FindFree(struct mem_heap *heap, int fl, int sl)
+{
+	unsigned int sl_map = heap->sl_bitmap[fl] & (~0u << sl);
+
+	if (!sl_map) {
+		unsigned int fl_map;
+
+		if (fl + 1 >= FL_COUNT)
+			return NULL;
+		fl_map = heap->fl_bitmap & (~0u << (fl + 1));
+		if (!fl_map)
+			return NULL;
+
+		fl = __builtin_ctz(fl_map);
+		sl_map = heap->sl_bitmap[fl];
+	}
+
+	return heap->free[fl][__builtin_ctz(sl_map)];
+}
+
+/* Where an allocation would start in p, or -1 if it doesn't fit. */
+static int FitBlock(const struct mem_block *p, int size, int mask,
+		    int startSearch)
+{
+	int startofs = (p->ofs + mask) & ~mask;
+
+	if (startofs < startSearch)
+		startofs = startSearch;
+	if (startofs + size > p->ofs + p->size)
+		return -1;
+
+	return startofs;
+}
+
 drm_private void mmDumpMemInfo(const struct mem_block *heap)
 {
 	drmMsg("Memory heap %p:\n", (void *)heap);
@@ -36,6 +169,7 @@ drm_private void mmDumpMemInfo(const struct mem_block *heap)
 		drmMsg("  heap == 0\n");
 	} else {
 		const struct mem_block *p;
+		int fl, sl;
 
 		for (p = heap->next; p != heap; p = p->next) {
 			drmMsg("  Offset:%08x, Size:%08x, %c%c\n", p->ofs,
@@ -45,10 +179,16 @@ drm_private void mmDumpMemInfo(const struct mem_block *heap)
 
 		drmMsg("\nFree list:\n");
 
-		for (p = heap->next_free; p != heap; p = p->next_free) {
-			drmMsg(" FREE Offset:%08x, Size:%08x, %c%c\n", p->ofs,
-			       p->size, p->free ? 'F' : '.',
-			       p->reserved ? 'R' : '.');
+		for (fl = 0; fl < FL_COUNT; fl++) {
+			for (sl = 0; sl < SL_COUNT; sl++) {
+				for (p = GetHeap(heap)->free[fl][sl]; p;
+				     p = p->next_free) {
+					drmMsg(" FREE Offset:%08x, Size:%08x, %c%c\n",
+					       p->ofs, p->size,
+					       p->free ? 'F' : '.',
+					       p->reserved ? 'R' : '.');
+				}
+			}
 		}
 
 	}
@@ -57,12 +197,13 @@ drm_private void mmDumpMemInfo(const struct mem_block *heap)
 
 drm_private struct mem_block *mmInit(int ofs, int size)
 {
-	struct mem_block *heap, *block;
+	struct mem_heap *heap;
+	struct mem_block *block;
 
 	if (size <= 0)
 		return NULL;
 
-	heap = (struct mem_block *)calloc(1, sizeof(struct mem_block));
+	heap = (struct mem_heap *)calloc(1, sizeof(struct mem_heap));
 	if (!heap)
 		return NULL;
 
@@ -72,90 +213,81 @@ drm_private struct mem_block *mmInit(int ofs, int size)
 		return NULL;
 	}
 
-	heap->next = block;
-	heap->prev = block;
-	heap->next_free = block;
-	heap->prev_free = block;
+	heap->head.next = block;
+	heap->head.prev = block;
 
-	block->heap = heap;
-	block->next = heap;
-	block->prev = heap;
-	block->next_free = heap;
-	block->prev_free = heap;
+	block->heap = &heap->head;
+	block->next = &heap->head;
+	block->prev = &heap->head;
 
 	block->ofs = ofs;
 	block->size = size;
 	block->free = 1;
+	InsertFree(heap, block);
 
-	return heap;
+	return &heap->head;
 }
 
+/*
+ * Allocates [startofs, startofs + size) out of the free block p, returning
+ * what is left on either side to the free lists.
+ */
 static struct mem_block *SliceBlock(struct mem_block *p,
 				    int startofs, int size,
 				    int reserved, int alignment)
 {
-	struct mem_block *newblock;
+	struct mem_heap *heap = GetHeap(p->heap);
+	struct mem_block *left = NULL, *right = NULL;
 
-	/* break left  [p, newblock, p->next], then p = newblock */
 	if (startofs > p->ofs) {
-		newblock =
-		    (struct mem_block *)calloc(1, sizeof(struct mem_block));
-		if (!newblock)
+		left = (struct mem_block *)calloc(1, sizeof(struct mem_block));
+		if (!left)
 			return NULL;
-		newblock->ofs = startofs;
-		newblock->size = p->size - (startofs - p->ofs);
-		newblock->free = 1;
-		newblock->heap = p->heap;
-
-		newblock->next = p->next;
-		newblock->prev = p;
-		p->next->prev = newblock;
-		p->next = newblock;
-
-		newblock->next_free = p->next_free;
-		newblock->prev_free = p;
-		p->next_free->prev_free = newblock;
-		p->next_free = newblock;
-
-		p->size -= newblock->size;
-		p = newblock;
 	}
-
-	/* break right, also [p, newblock, p->next] */
-	if (size < p->size) {
-		newblock =
-		    (struct mem_block *)calloc(1, sizeof(struct mem_block));
-		if (!newblock)
+	if (startofs + size < p->ofs + p->size) {
+		right = (struct mem_block *)calloc(1, sizeof(struct mem_block));
+		if (!right) {
+			free(left);
 			return NULL;
-		newblock->ofs = startofs + size;
-		newblock->size = p->size - size;
-		newblock->free = 1;
-		newblock->heap = p->heap;
+		}
+	}
 
-		newblock->next = p->next;
-		newblock->prev = p;
-		p->next->prev = newblock;
-		p->next = newblock;
+	RemoveFree(heap, p);
 
-		newblock->next_free = p->next_free;
-		newblock->prev_free = p;
-		p->next_free->prev_free = newblock;
-		p->next_free = newblock;
+	/* break left  [left, p, p->next] */
+	if (left) {
+		left->ofs = p->ofs;
+		left->size = startofs - p->ofs;
+		left->free = 1;
+		left->heap = p->heap;
 
-		p->size = size;
+		left->next = p;
+		left->prev = p->prev;
+		p->prev->next = left;
+		p->prev = left;
+
+		p->ofs = startofs;
+		p->size -= left->size;
+		InsertFree(heap, left);
 	}
 
-	/* p = middle block */
-	p->free = 0;
+	/* break right [p, right, p->next] */
+	if (right) {
+		right->ofs = startofs + size;
+		right->size = p->size - size;
+		right->free = 1;
+		right->heap = p->heap;
 
-	/* Remove p from the free list: 
-	 */
-	p->next_free->prev_free = p->prev_free;
-	p->prev_free->next_free = p->next_free;
+		right->next = p->next;
+		right->prev = p;
+		p->next->prev = right;
+		p->next = right;
 
-	p->next_free = 0;
-	p->prev_free = 0;
+		p->size = size;
+		InsertFree(heap, right);
+	}
 
+	p->free = 0;
 	p->reserved = reserved;
 	return p;
 }
@@ -163,39 +295,58 @@ static struct mem_block *SliceBlock(struct mem_block *p,
 drm_private struct mem_block *mmAllocMem(struct mem_block *heap, int size,
 					 int align2, int startSearch)
 {
+	struct mem_heap *mm = GetHeap(heap);
 	struct mem_block *p;
-	const int mask = (1 << align2) - 1;
-	int startofs = 0;
-	int endofs;
+	int mask, startofs = -1;
+	int fl, sl;
 
-	if (!heap || align2 < 0 || size <= 0)
+	if (!heap || align2 < 0 || align2 > 30 || size <= 0)
 		return NULL;
-
-	for (p = heap->next_free; p != heap; p = p->next_free) {
-		assert(p->free);
-
-		startofs = (p->ofs + mask) & ~mask;
-		if (startofs < startSearch) {
-			startofs = startSearch;
+	mask = (1 << align2) - 1;
+
+	if (startSearch <= heap->next->ofs) {
+		/* Any block in the first list big enough for size will do
+		 * unless it's misaligned, and any in the first list big
+		 * enough for size plus the alignment slack will do.
+		 */
+		if (MappingSearch(size, &fl, &sl)) {
+			p = FindFree(mm, fl, sl);
+			if (p)
+				startofs = FitBlock(p, size, mask, startSearch);
+		}
+		if (startofs < 0 && mask &&
+		    (unsigned int)size + mask <= 0x7fffffff &&
+		    MappingSearch(size + mask, &fl, &sl)) {
+			p = FindFree(mm, fl, sl);
+			if (p)
+				startofs = FitBlock(p, size, mask, startSearch);
 		}
-		endofs = startofs + size;
-		if (endofs <= (p->ofs + p->size))
-			break;
 	}
 
-	if (p == heap)
-		return NULL;
+	/* Fall back to the lowest free block that fits, which also covers
+	 * requests restricted to past startSearch and blocks that would
+	 * only fit once aligned.
+	 */
+	if (startofs < 0) {
+		for (p = heap->next; p != heap; p = p->next) {
+			if (p->free) {
+				startofs = FitBlock(p, size, mask,
+						    startSearch);
+				if (startofs >= 0)
+					break;
+			}
+		}
+		if (p == heap)
+			return NULL;
+	}
 
 	assert(p->free);
-	p = SliceBlock(p, startofs, size, 0, mask + 1);
-
-	return p;
+	return SliceBlock(p, startofs, size, 0, mask + 1);
 }
 
+/* Merges p->next into p, if both are free and off the free lists. */
 static int Join2Blocks(struct mem_block *p)
 {
-	/* XXX there should be some assertions here */
-
 	/* NOTE: heap->free == 0 */
 
 	if (p->free && p->next->free) {
@@ -207,9 +358,6 @@ static int Join2Blocks(struct mem_block *p)
 		p->next = q->next;
 		q->next->prev = p;
 
-		q->next_free->prev_free = q->prev_free;
-		q->prev_free->next_free = q->next_free;
-
 		free(q);
 		return 1;
 	}
@@ -218,6 +366,8 @@ static int Join2Blocks(struct mem_block *p)
 
 drm_private int mmFreeMem(struct mem_block *b)
 {
+	struct mem_heap *heap;
+
 	if (!b)
 		return 0;
 
@@ -230,15 +380,19 @@ drm_private int mmFreeMem(struct mem_block *b)
 		return -1;
 	}
 
+	heap = GetHeap(b->heap);
 	b->free = 1;
-	b->next_free = b->heap->next_free;
-	b->prev_free = b->heap;
-	b->next_free->prev_free = b;
-	b->prev_free->next_free = b;
 
-	Join2Blocks(b);
-	if (b->prev != b->heap)
-		Join2Blocks(b->prev);
+	if (b->next->free) {
+		RemoveFree(heap, b->next);
+		Join2Blocks(b);
+	}
+	if (b->prev->free) {
+		b = b->prev;
+		RemoveFree(heap, b);
+		Join2Blocks(b);
+	}
+	InsertFree(heap, b);
 
 	return 0;
 }
@@ -256,5 +410,5 @@ drm_private void mmDestroy(struct mem_block *heap)
 		p = next;
 	}
 
-	free(heap);
+	free(GetHeap(heap));
 }
@@ -82,15 +82,38 @@ dump_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 	drm_intel_decode(ctx);
 }
 
+#if HAVE_OPEN_MEMSTREAM
+/** Returns the number of lines of output that look like JSON records. */
+static uint64_t
+count_json_records(const char *output)
+{
+	const char *end;
+	uint64_t records = 0;
+
+	for (; *output; output = end + 1) {
+		end = strchr(output, '\n');
+		if (end == NULL)
+			return 0;
+		if (strncmp(output, "{\"offset\":", 10) != 0 || end[-1] != '}')
+			return 0;
+		records++;
+	}
+
+	return records;
+}
+#endif
+
 static void
 compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 {
 	FILE *out = NULL;
 	void *ptr, *ref_ptr, *batch_ptr;
 #if HAVE_OPEN_MEMSTREAM
+	char *json;
 	size_t size;
 #endif
 	size_t ref_size, batch_size;
+	uint64_t commands, dwords, quiet_commands, quiet_dwords;
 	const char *ref_suffix = "-ref.txt";
 	char *ref_filename;
 
@@ -126,9 +149,43 @@ compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 		exit(1);
 	}
 
+	/* Decoding quietly must count the same commands and print nothing. */
+	drm_intel_decode_get_stats(ctx, NULL, 0, &commands, &dwords);
+	drm_intel_decode_reset_stats(ctx);
+	drm_intel_decode_set_quiet(ctx, 1);
+	drm_intel_decode(ctx);
+	drm_intel_decode_get_stats(ctx, NULL, 0, &quiet_commands, &quiet_dwords);
+
+	fflush(out);
+	if (strcmp(ref_ptr, ptr) != 0 || quiet_commands != commands ||
+	    quiet_dwords != dwords) {
+		fprintf(stderr, "Quiet decode mismatch with reference `%s'.\n",
+			ref_filename);
+		exit(1);
+	}
+
 	fclose(out);
-	free(ref_filename);
 	free(ptr);
+
+	/* The JSON decode must have a record line for each command. */
+#if HAVE_OPEN_MEMSTREAM
+	out = open_memstream(&json, &size);
+	drm_intel_decode_set_output_file(ctx, out);
+	drm_intel_decode_set_quiet(ctx, 0);
+	drm_intel_decode_set_output_format(ctx, DRM_INTEL_DECODE_FORMAT_JSON);
+	drm_intel_decode(ctx);
+	drm_intel_decode_set_output_format(ctx, DRM_INTEL_DECODE_FORMAT_TEXT);
+	fclose(out);
+
+	if (count_json_records(json) != commands) {
+		fprintf(stderr, "JSON decode mismatch with reference `%s'.\n",
+			ref_filename);
+		exit(1);
+	}
+	free(json);
+#endif
+
+	free(ref_filename);
 }
 
 static uint16_t
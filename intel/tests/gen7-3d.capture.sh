@@ -0,0 +1,18 @@
+#!/bin/sh
+
+# Replays a capture of the gen7-3d batch, whose decode must match the one
+# of the batch on its own.
+TEST_FILENAME=`echo "$0" | sed 's|\.sh$||'`
+REF_FILENAME=`echo "$0" | sed 's|\.capture\.sh$|.batch-ref.txt|'`
+NEW_FILENAME="$TEST_FILENAME-new.txt"
+
+./intel_replay $TEST_FILENAME || exit 1
+./intel_replay -d $TEST_FILENAME > $NEW_FILENAME || exit 1
+
+if ! cmp -s $REF_FILENAME $NEW_FILENAME; then
+    echo "Differences:"
+    diff -u $REF_FILENAME $NEW_FILENAME
+    exit 1
+fi
+
+rm -f $NEW_FILENAME
@@ -76,8 +76,47 @@ struct cs_gem {
     unsigned                    nrelocs;
     uint32_t                    *relocs;
     struct radeon_bo_int        **relocs_bo;
+    /* open addressed table of reloc index + 1 by bo handle, 0 if unused,
+     * twice the size of nrelocs */
+    uint32_t                    *reloc_hash;
 };
 
+static inline unsigned reloc_hash_slot(uint32_t handle, unsigned mask)
+{
+    uint32_t h = handle * 0x9e3779b1u;
+
+    return (h ^ (h >> 16)) & mask;
+}
+
+/**
+ * Returns the reloc index of handle in the cs, or -1 if it has none.
+ */
+static int reloc_hash_find(struct cs_gem *csg, uint32_t handle)
+{
+    unsigned mask = 2 * csg->nrelocs - 1;
+    unsigned i;
+    uint32_t idx;
+
+    for (i = reloc_hash_slot(handle, mask); csg->reloc_hash[i];
+         i = (i + 1) & mask) {
+        idx = csg->reloc_hash[i] - 1;
+        if (csg->relocs[idx * RELOC_SIZE] == handle)
+            return idx;
+    }
+    return -1;
+}
+
+static void reloc_hash_insert(struct cs_gem *csg, uint32_t handle,
+                              uint32_t idx)
+{
+    unsigned mask = 2 * csg->nrelocs - 1;
+    unsigned i;
+
+    for (i = reloc_hash_slot(handle, mask); csg->reloc_hash[i];
+         i = (i + 1) & mask);
+    csg->reloc_hash[i] = idx + 1;
+}
+
 static pthread_mutex_t id_mutex = PTHREAD_MUTEX_INITIALIZER;
 static uint32_t cs_id_source = 0;
 
@@ -160,6 +199,14 @@ static struct radeon_cs_int *cs_gem_create(struct radeon_cs_manager *csm,
         free(csg);
         return NULL;
     }
+    csg->reloc_hash = (uint32_t*)calloc(2 * csg->nrelocs, sizeof(uint32_t));
+    if (csg->reloc_hash == NULL) {
+        free(csg->relocs);
+        free(csg->relocs_bo);
+        free(csg->base.packets);
+        free(csg);
+        return NULL;
+    }
     csg->chunks[0].chunk_id = RADEON_CHUNK_ID_IB;
     csg->chunks[0].length_dw = 0;
     csg->chunks[0].chunk_data = (uint64_t)(uintptr_t)csg->base.packets;
@@ -180,6 +227,7 @@ static int cs_gem_write_reloc(struct radeon_cs_int *cs,
     struct cs_reloc_gem *reloc;
     uint32_t idx;
     unsigned i;
+    int r;
 
     assert(boi->space_accounted);
 
@@ -199,64 +247,71 @@ static int cs_gem_write_reloc(struct radeon_cs_int *cs,
     /* use bit field hash function to determine
        if this bo is for sure not in this cs.*/
     if ((atomic_read((atomic_t *)radeon_gem_get_reloc_in_cs(bo)) & cs->id)) {
-        /* check if bo is already referenced.
-         * Scanning from end to begin reduces cycles with mesa because
-         * it often relocates same shared dma bo again. */
-        for(i = cs->crelocs; i != 0;) {
-            --i;
-            idx = i * RELOC_SIZE;
+        /* check if bo is already referenced */
+        r = reloc_hash_find(csg, bo->handle);
+        if (r >= 0) {
+            idx = r * RELOC_SIZE;
             reloc = (struct cs_reloc_gem*)&csg->relocs[idx];
-            if (reloc->handle == bo->handle) {
-                /* Check domains must be in read or write. As we check already
-                 * checked that in argument one of the read or write domain was
-                 * set we only need to check that if previous reloc as the read
-                 * domain set then the read_domain should also be set for this
-                 * new relocation.
-                 */
-                /* the DDX expects to read and write from same pixmap */
-                if (write_domain && (reloc->read_domain & write_domain)) {
-                    reloc->read_domain = 0;
-                    reloc->write_domain = write_domain;
-                } else if (read_domain & reloc->write_domain) {
-                    reloc->read_domain = 0;
-                } else {
-                    if (write_domain != reloc->write_domain)
-                        return -EINVAL;
-                    if (read_domain != reloc->read_domain)
-                        return -EINVAL;
-                }
-
-                reloc->read_domain |= read_domain;
-                reloc->write_domain |= write_domain;
-                /* update flags */
-                reloc->flags |= (flags & reloc->flags);
-                /* write relocation packet */
-                radeon_cs_write_dword((struct radeon_cs *)cs, 0xc0001000);
-                radeon_cs_write_dword((struct radeon_cs *)cs, idx);
-                return 0;
+            /* Check domains must be in read or write. As we check already
+             * checked that in argument one of the read or write domain was
+             * set we only need to check that if previous reloc as the read
+             * domain set then the read_domain should also be set for this
+             * new relocation.
+             */
+            /* the DDX expects to read and write from same pixmap */
+            if (write_domain && (reloc->read_domain & write_domain)) {
+                reloc->read_domain = 0;
+                reloc->write_domain = write_domain;
+            } else if (read_domain & reloc->write_domain) {
+                reloc->read_domain = 0;
+            } else {
+                if (write_domain != reloc->write_domain)
+                    return -EINVAL;
+                if (read_domain != reloc->read_domain)
+                    return -EINVAL;
             }
+
+            reloc->read_domain |= read_domain;
+            reloc->write_domain |= write_domain;
+            /* update flags */
+            reloc->flags |= (flags & reloc->flags);
+            /* write relocation packet */
+            radeon_cs_write_dword((struct radeon_cs *)cs, 0xc0001000);
+            radeon_cs_write_dword((struct radeon_cs *)cs, idx);
+            return 0;
         }
     }
     /* new relocation */
     if (csg->base.crelocs >= csg->nrelocs) {
-        /* allocate more memory (TODO: should use a slab allocator maybe) */
-        uint32_t *tmp, size;
-        size = ((csg->nrelocs + 1) * sizeof(struct radeon_bo*));
+        /* allocate more memory, doubling it so that growing to n relocs
+         * only copies them a few times over */
+        uint32_t *tmp, *hash, size;
+        size = (2 * csg->nrelocs * sizeof(struct radeon_bo*));
         tmp = (uint32_t*)realloc(csg->relocs_bo, size);
         if (tmp == NULL) {
             return -ENOMEM;
         }
         csg->relocs_bo = (struct radeon_bo_int **)tmp;
-        size = ((csg->nrelocs + 1) * RELOC_SIZE * 4);
+        size = (2 * csg->nrelocs * RELOC_SIZE * 4);
         tmp = (uint32_t*)realloc(csg->relocs, size);
         if (tmp == NULL) {
             return -ENOMEM;
         }
         cs->relocs = csg->relocs = tmp;
-        csg->nrelocs += 1;
         csg->chunks[1].chunk_data = (uint64_t)(uintptr_t)csg->relocs;
+        hash = (uint32_t*)calloc(4 * csg->nrelocs, sizeof(uint32_t));
+        if (hash == NULL) {
+            return -ENOMEM;
+        }
+        free(csg->reloc_hash);
+        csg->reloc_hash = hash;
+        csg->nrelocs *= 2;
+        for (i = 0; i < csg->base.crelocs; i++) {
+            reloc_hash_insert(csg, csg->relocs[i * RELOC_SIZE], i);
+        }
     }
     csg->relocs_bo[csg->base.crelocs] = boi;
+    reloc_hash_insert(csg, bo->handle, csg->base.crelocs);
     idx = (csg->base.crelocs++) * RELOC_SIZE;
     reloc = (struct cs_reloc_gem*)&csg->relocs[idx];
     reloc->handle = bo->handle;
@@ -463,6 +518,7 @@ static int cs_gem_destroy(struct radeon_cs_int *cs)
     struct cs_gem *csg = (struct cs_gem*)cs;
 
     free_id(cs->id);
+    free(csg->reloc_hash);
     free(csg->relocs_bo);
     free(cs->relocs);
     free(cs->packets);
@@ -489,6 +545,7 @@ static int cs_gem_erase(struct radeon_cs_int *cs)
     cs->cdw = 0;
     cs->section_ndw = 0;
     cs->crelocs = 0;
+    memset(csg->reloc_hash, 0, 2 * csg->nrelocs * sizeof(uint32_t));
     csg->chunks[0].length_dw = 0;
     csg->chunks[1].length_dw = 0;
     return 0;
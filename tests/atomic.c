@@ -0,0 +1,629 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Checks and times the userspace side of drmModeAtomicCommit(). The atomic
+ * ioctl is intercepted below, so no DRM device is needed: the intercepted
+ * request is validated (sorted objects, no duplicate properties, last value
+ * wins) and then dropped. The blob and FB ioctls are intercepted as well,
+ * to check the property blob and framebuffer caches.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+#include "drm_fourcc.h"
+
+#define FAKE_FD 0x7fff
+#define PROPS_PER_OBJ 10
+
+static unsigned int committed_props;
+static unsigned int atomic_ioctls;
+static unsigned int live_blobs, next_blob_id = 1;
+static unsigned int live_fbs, next_fb_id = 1;
+static bool check_values = true;
+static bool fail_next;
+
+/* What a real commit left in the kernel, for the first 10 x 10 IDs. */
+static uint64_t kernel_values[11][11];
+
+static uint64_t expected_value(uint32_t obj, uint32_t prop)
+{
+	return ((uint64_t)obj << 32) | prop;
+}
+
+static void check_atomic(const struct drm_mode_atomic *atomic)
+{
+	const uint32_t *objs = (const uint32_t *)(uintptr_t)atomic->objs_ptr;
+	const uint32_t *count_props =
+		(const uint32_t *)(uintptr_t)atomic->count_props_ptr;
+	const uint32_t *props = (const uint32_t *)(uintptr_t)atomic->props_ptr;
+	const uint64_t *values =
+		(const uint64_t *)(uintptr_t)atomic->prop_values_ptr;
+	uint32_t i, j, k;
+
+	for (i = 0, k = 0; i < atomic->count_objs; i++) {
+		if (i && objs[i] <= objs[i - 1]) {
+			fprintf(stderr, "objects not sorted: %u after %u\n",
+				objs[i], objs[i - 1]);
+			exit(1);
+		}
+
+		for (j = 0; j < count_props[i]; j++, k++) {
+			if (j && props[k] <= props[k - 1]) {
+				fprintf(stderr, "object %u: property %u after %u\n",
+					objs[i], props[k], props[k - 1]);
+				exit(1);
+			}
+			if (check_values &&
+			    values[k] != expected_value(objs[i], props[k])) {
+				fprintf(stderr, "object %u: property %u has stale value\n",
+					objs[i], props[k]);
+				exit(1);
+			}
+		}
+	}
+
+	committed_props = k;
+}
+
+static void commit_values(const struct drm_mode_atomic *atomic)
+{
+	const uint32_t *objs = (const uint32_t *)(uintptr_t)atomic->objs_ptr;
+	const uint32_t *count_props =
+		(const uint32_t *)(uintptr_t)atomic->count_props_ptr;
+	const uint32_t *props = (const uint32_t *)(uintptr_t)atomic->props_ptr;
+	const uint64_t *values =
+		(const uint64_t *)(uintptr_t)atomic->prop_values_ptr;
+	uint32_t i, j, k;
+
+	for (i = 0, k = 0; i < atomic->count_objs; i++) {
+		for (j = 0; j < count_props[i]; j++, k++) {
+			if (objs[i] <= 10 && props[k] <= 10)
+				kernel_values[objs[i]][props[k]] = values[k];
+		}
+	}
+}
+
+/* Interposes the libc ioctl() used by drmIoctl(). */
+__attribute__((visibility("default")))
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	if (fd != FAKE_FD)
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	if (request == DRM_IOCTL_MODE_CREATEPROPBLOB) {
+		((struct drm_mode_create_blob *)arg)->blob_id = next_blob_id++;
+		live_blobs++;
+		return 0;
+	}
+	if (request == DRM_IOCTL_MODE_DESTROYPROPBLOB) {
+		live_blobs--;
+		return 0;
+	}
+	if (request == DRM_IOCTL_MODE_ADDFB2) {
+		((struct drm_mode_fb_cmd2 *)arg)->fb_id = next_fb_id++;
+		live_fbs++;
+		return 0;
+	}
+	if (request == DRM_IOCTL_MODE_RMFB) {
+		live_fbs--;
+		return 0;
+	}
+
+	if (request != DRM_IOCTL_MODE_ATOMIC) {
+		errno = ENOTTY;
+		return -1;
+	}
+
+	atomic_ioctls++;
+	check_atomic(arg);
+
+	if (fail_next) {
+		fail_next = false;
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!(((struct drm_mode_atomic *)arg)->flags & DRM_MODE_ATOMIC_TEST_ONLY))
+		commit_values(arg);
+	return 0;
+}
+
+static double now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+enum order {
+	ORDER_SORTED,
+	ORDER_SHUFFLED,
+	ORDER_DUPLICATES,
+};
+
+static const char *order_names[] = {
+	[ORDER_SORTED] = "sorted",
+	[ORDER_SHUFFLED] = "shuffled",
+	[ORDER_DUPLICATES] = "duplicates",
+};
+
+static void fill(drmModeAtomicReqPtr req, const uint32_t *perm,
+		 unsigned int count, enum order order)
+{
+	unsigned int i;
+	uint32_t obj, prop;
+
+	drmModeAtomicReset(req);
+
+	for (i = 0; i < count; i++) {
+		obj = 1 + perm[i] / PROPS_PER_OBJ;
+		prop = 1 + perm[i] % PROPS_PER_OBJ;
+
+		/* Every fourth property is set twice, the first value is stale. */
+		if (order == ORDER_DUPLICATES && (i & 3) == 0)
+			drmModeAtomicAddProperty(req, obj, prop, 0);
+
+		drmModeAtomicAddProperty(req, obj, prop,
+					 expected_value(obj, prop));
+	}
+}
+
+static void bench(unsigned int count, enum order order)
+{
+	const unsigned int iterations = 200000 / count;
+	drmModeAtomicReqPtr req;
+	uint32_t *perm;
+	unsigned int i, j;
+	double start, usec;
+	uint32_t tmp;
+
+	perm = malloc(count * sizeof(*perm));
+	for (i = 0; i < count; i++)
+		perm[i] = i;
+
+	if (order != ORDER_SORTED) {
+		srand(count);
+		for (i = count - 1; i > 0; i--) {
+			j = rand() % (i + 1);
+			tmp = perm[i];
+			perm[i] = perm[j];
+			perm[j] = tmp;
+		}
+	}
+
+	req = drmModeAtomicAlloc();
+
+	/* Warm up the request's buffers and check the result once. */
+	fill(req, perm, count, order);
+	if (drmModeAtomicCommit(FAKE_FD, req, 0, NULL) ||
+	    committed_props != count) {
+		fprintf(stderr, "%u %s: committed %u properties\n",
+			count, order_names[order], committed_props);
+		exit(1);
+	}
+
+	start = now_usec();
+	for (i = 0; i < iterations; i++) {
+		fill(req, perm, count, order);
+		drmModeAtomicCommit(FAKE_FD, req, 0, NULL);
+	}
+	usec = (now_usec() - start) / iterations;
+
+	printf("%5u properties, %-10s: %8.2f usec per commit\n",
+	       count, order_names[order], usec);
+
+	drmModeAtomicFree(req);
+	free(perm);
+}
+
+static void expect_commit(drmModeAtomicReqPtr req, uint32_t flags,
+			  int expected_ret, unsigned int expected_props,
+			  const char *what)
+{
+	unsigned int ioctls = atomic_ioctls;
+	int ret;
+
+	committed_props = 0;
+	ret = drmModeAtomicCommit(FAKE_FD, req, flags, NULL);
+
+	/* A skipped commit must not reach the kernel at all. */
+	if ((ret < 0) != (expected_ret < 0) ||
+	    committed_props != expected_props ||
+	    (!expected_props && atomic_ioctls != ioctls)) {
+		fprintf(stderr, "%s: returned %d, committed %u properties\n",
+			what, ret, committed_props);
+		exit(1);
+	}
+}
+
+/* 10 objects with 10 properties each, one of them set to value. */
+static void fill_grid(drmModeAtomicReqPtr req, uint64_t value)
+{
+	uint32_t obj, prop;
+
+	drmModeAtomicReset(req);
+
+	for (obj = 1; obj <= 10; obj++) {
+		for (prop = 1; prop <= 10; prop++)
+			drmModeAtomicAddProperty(req, obj, prop,
+						 obj == 5 && prop == 5 ? value : 0);
+	}
+}
+
+static void check_delta(void)
+{
+	drmModeAtomicReqPtr req;
+
+	check_values = false;
+	req = drmModeAtomicAlloc();
+	drmModeAtomicSetDelta(req, 1);
+
+	fill_grid(req, 0);
+	expect_commit(req, 0, 0, 100, "initial commit");
+	fill_grid(req, 0);
+	expect_commit(req, 0, 0, 0, "unchanged commit");
+
+	fill_grid(req, 1);
+	expect_commit(req, DRM_MODE_ATOMIC_TEST_ONLY, 0, 1, "test commit");
+	expect_commit(req, 0, 0, 1, "commit after test");
+	expect_commit(req, 0, 0, 0, "repeated commit");
+
+	fill_grid(req, 2);
+	fail_next = true;
+	expect_commit(req, 0, -1, 1, "failing commit");
+	expect_commit(req, 0, 0, 1, "commit after failure");
+
+	fill_grid(req, 2);
+	expect_commit(req, DRM_MODE_PAGE_FLIP_EVENT, 0, 100, "event commit");
+
+	drmModeAtomicInvalidateDelta(req);
+	expect_commit(req, 0, 0, 100, "invalidated commit");
+
+	drmModeAtomicSetDelta(req, 0);
+	expect_commit(req, 0, 0, 100, "commit without delta");
+
+	drmModeAtomicFree(req);
+	check_values = true;
+}
+
+static void expect_blobs(drmModeBlobCachePtr cache, uint64_t misses,
+			 uint32_t idle, unsigned int live, const char *what)
+{
+	drmModeBlobCacheStats stats;
+
+	drmModeBlobCacheGetStats(cache, &stats);
+	if (stats.misses != misses || stats.idle != idle || live_blobs != live) {
+		fprintf(stderr, "%s: %llu blobs created, %u idle, %u alive\n",
+			what, (unsigned long long)stats.misses, stats.idle,
+			live_blobs);
+		exit(1);
+	}
+}
+
+static void check_blob_cache(void)
+{
+	static uint16_t lut[4096 * 4];
+	drmModeBlobCachePtr cache;
+	uint32_t id, id2, ids[20];
+	unsigned int i;
+	double start, usec;
+
+	cache = drmModeBlobCacheCreate(FAKE_FD);
+
+	drmModeBlobCacheGet(cache, lut, sizeof(lut), &id);
+	drmModeBlobCacheGet(cache, lut, sizeof(lut), &id2);
+	if (id != id2)
+		exit(1);
+	expect_blobs(cache, 1, 0, 1, "same content");
+
+	lut[100] = 1;
+	drmModeBlobCacheGet(cache, lut, sizeof(lut), &id2);
+	drmModeBlobCacheGet(cache, lut, sizeof(lut) - 2, &ids[0]);
+	if (id == id2 || id2 == ids[0])
+		exit(1);
+	expect_blobs(cache, 3, 0, 3, "different content");
+
+	/* Released blobs stay alive for reuse. */
+	drmModeBlobCachePut(cache, id);
+	drmModeBlobCachePut(cache, id);
+	drmModeBlobCachePut(cache, ids[0]);
+	expect_blobs(cache, 3, 2, 3, "released");
+	if (drmModeBlobCachePut(cache, id) != -EINVAL)
+		exit(1);
+
+	lut[100] = 0;
+	drmModeBlobCacheGet(cache, lut, sizeof(lut), &id2);
+	if (id2 != id)
+		exit(1);
+	expect_blobs(cache, 3, 1, 3, "reused");
+
+	/* Only the most recently released blobs are kept. */
+	for (i = 0; i < 20; i++) {
+		drmModeBlobCacheGet(cache, &i, sizeof(i), &ids[i]);
+		drmModeBlobCachePut(cache, ids[i]);
+	}
+	expect_blobs(cache, 23, 16, 18, "many released");
+
+	drmModeBlobCacheTrim(cache, 0);
+	expect_blobs(cache, 23, 0, 2, "trimmed");
+
+	start = now_usec();
+	for (i = 0; i < 1000; i++) {
+		drmModeBlobCacheGet(cache, lut, sizeof(lut), &id2);
+		drmModeBlobCachePut(cache, id2);
+	}
+	usec = (now_usec() - start) / 1000;
+	printf("%zu byte LUT from the blob cache: %8.2f usec\n",
+	       sizeof(lut), usec);
+
+	drmModeBlobCacheDestroy(cache);
+	if (live_blobs)
+		exit(1);
+}
+
+static uint32_t get_fb(drmModeFBCachePtr cache, uint32_t handle)
+{
+	uint32_t handles[4] = { handle }, pitches[4] = { 7680 };
+	uint32_t offsets[4] = { 0 };
+	uint64_t modifiers[4] = { 0 };
+	uint32_t fb_id;
+
+	if (drmModeFBCacheGet(cache, 1920, 1080, DRM_FORMAT_XRGB8888, handles,
+			      pitches, offsets, modifiers, &fb_id,
+			      DRM_MODE_FB_MODIFIERS))
+		exit(1);
+
+	return fb_id;
+}
+
+static void expect_fbs(drmModeFBCachePtr cache, uint64_t hits,
+		       unsigned int live, const char *what)
+{
+	drmModeFBCacheStats stats;
+
+	drmModeFBCacheGetStats(cache, &stats);
+	if (stats.hits != hits || live_fbs != live) {
+		fprintf(stderr, "%s: %llu hits, %u FBs alive\n", what,
+			(unsigned long long)stats.hits, live_fbs);
+		exit(1);
+	}
+}
+
+static void check_fb_cache(void)
+{
+	drmModeFBCachePtr cache;
+	uint32_t fbs[3], fb_id;
+	unsigned int i, frame;
+
+	cache = drmModeFBCacheCreate(FAKE_FD);
+
+	/* A triple buffered swapchain that loses track of its FBs. */
+	for (frame = 0; frame < 30; frame++) {
+		fb_id = get_fb(cache, 1 + frame % 3);
+		if (frame >= 3 && fb_id != fbs[frame % 3])
+			exit(1);
+		fbs[frame % 3] = fb_id;
+		drmModeFBCachePut(cache, fb_id);
+	}
+	expect_fbs(cache, 27, 3, "swapchain");
+
+	/* Closing a handle drops its idle FB right away... */
+	drmModeFBCacheInvalidateHandle(cache, 1);
+	expect_fbs(cache, 27, 2, "invalidated idle FB");
+
+	/* ...and a referenced one once it is released. */
+	fb_id = get_fb(cache, 2);
+	drmModeFBCacheInvalidateHandle(cache, 2);
+	expect_fbs(cache, 28, 2, "invalidated busy FB");
+	if (get_fb(cache, 2) == fb_id)
+		exit(1);
+	drmModeFBCachePut(cache, fb_id);
+	expect_fbs(cache, 28, 2, "released busy FB");
+
+	for (i = 0; i < 40; i++)
+		drmModeFBCachePut(cache, get_fb(cache, 100 + i));
+	drmModeFBCacheTrim(cache, 0);
+	expect_fbs(cache, 28, 1, "trimmed");
+
+	drmModeFBCacheDestroy(cache);
+	if (live_fbs)
+		exit(1);
+}
+
+static void check_test_cache(void)
+{
+	drmModeAtomicTestCachePtr cache;
+	drmModeAtomicTestCacheStats stats;
+	drmModeAtomicReqPtr req;
+	unsigned int frame, config, ioctls;
+	int ret;
+
+	check_values = false;
+	cache = drmModeAtomicTestCacheCreate(64);
+	req = drmModeAtomicAlloc();
+	drmModeAtomicSetTestCache(req, cache);
+
+	/* Eight candidate configurations tested every frame, 3 is rejected. */
+	ioctls = atomic_ioctls;
+	for (frame = 0; frame < 100; frame++) {
+		for (config = 0; config < 8; config++) {
+			fill_grid(req, config);
+			fail_next = frame == 0 && config == 3;
+			ret = drmModeAtomicCommit(FAKE_FD, req,
+						  DRM_MODE_ATOMIC_TEST_ONLY,
+						  NULL);
+			if (ret != (config == 3 ? -EINVAL : 0)) {
+				fprintf(stderr, "config %u: test returned %d\n",
+					config, ret);
+				exit(1);
+			}
+		}
+	}
+	if (atomic_ioctls - ioctls != 8) {
+		fprintf(stderr, "%u tests reached the kernel\n",
+			atomic_ioctls - ioctls);
+		exit(1);
+	}
+
+	/* A failing real commit makes everything be tested again. */
+	fill_grid(req, 0);
+	fail_next = true;
+	drmModeAtomicCommit(FAKE_FD, req, 0, NULL);
+	ioctls = atomic_ioctls;
+	drmModeAtomicCommit(FAKE_FD, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicCommit(FAKE_FD, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	if (atomic_ioctls - ioctls != 1)
+		exit(1);
+
+	/* So does one that succeeds, as it changes what the tests depend on. */
+	drmModeAtomicCommit(FAKE_FD, req, 0, NULL);
+	ioctls = atomic_ioctls;
+	drmModeAtomicCommit(FAKE_FD, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicCommit(FAKE_FD, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	if (atomic_ioctls - ioctls != 1)
+		exit(1);
+
+	/* So does a hotplug, and the flags are part of the key. */
+	drmModeAtomicTestCacheInvalidate(cache);
+	drmModeAtomicCommit(FAKE_FD, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicCommit(FAKE_FD, req, DRM_MODE_ATOMIC_TEST_ONLY |
+			    DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	if (atomic_ioctls - ioctls != 3)
+		exit(1);
+
+	/*
+	 * These two differ only in bit 63 of two values, which the hash does
+	 * not tell apart, so only comparing the sets keeps them separate.
+	 */
+	drmModeAtomicReset(req);
+	drmModeAtomicAddProperty(req, 10, 1, 0x8000000000000005ull);
+	drmModeAtomicAddProperty(req, 10, 2, 7);
+	drmModeAtomicAddProperty(req, 10, 3, 1);
+	drmModeAtomicAddProperty(req, 10, 4, 1);
+	fail_next = true;
+	ret = drmModeAtomicCommit(FAKE_FD, req, DRM_MODE_ATOMIC_TEST_ONLY, NULL);
+	drmModeAtomicReset(req);
+	drmModeAtomicAddProperty(req, 10, 1, 5);
+	drmModeAtomicAddProperty(req, 10, 2, 0x8000000000000007ull);
+	drmModeAtomicAddProperty(req, 10, 3, 1);
+	drmModeAtomicAddProperty(req, 10, 4, 1);
+	if (ret != -EINVAL ||
+	    drmModeAtomicCommit(FAKE_FD, req, DRM_MODE_ATOMIC_TEST_ONLY,
+				NULL) != 0) {
+		fprintf(stderr, "colliding property sets share a test result\n");
+		exit(1);
+	}
+
+	drmModeAtomicTestCacheGetStats(cache, &stats);
+	printf("TEST_ONLY cache: %llu of %llu tests answered\n",
+	       (unsigned long long)stats.hits,
+	       (unsigned long long)stats.lookups);
+
+	drmModeAtomicFree(req);
+	drmModeAtomicTestCacheFree(cache);
+	check_values = true;
+}
+
+/* Answered tests must not lose the delta to the real commit after them. */
+static void check_delta_test_cache(void)
+{
+	static const uint64_t frames[] = { 1, 2, 1, 2, 2, 1 };
+	drmModeAtomicTestCachePtr cache;
+	drmModeAtomicReqPtr req;
+	unsigned int i, ioctls;
+
+	check_values = false;
+	cache = drmModeAtomicTestCacheCreate(64);
+	req = drmModeAtomicAlloc();
+	drmModeAtomicSetDelta(req, 1);
+	drmModeAtomicSetTestCache(req, cache);
+
+	fill_grid(req, 0);
+	expect_commit(req, 0, 0, 100, "initial commit");
+
+	/* Each frame is tested twice, then committed. The commit forgets the
+	 * first test, but the second one is answered from the cache. */
+	for (i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+		fill_grid(req, frames[i]);
+		if (drmModeAtomicCommit(FAKE_FD, req,
+					DRM_MODE_ATOMIC_TEST_ONLY, NULL))
+			exit(1);
+		ioctls = atomic_ioctls;
+		if (drmModeAtomicCommit(FAKE_FD, req,
+					DRM_MODE_ATOMIC_TEST_ONLY, NULL) ||
+		    atomic_ioctls != ioctls)
+			exit(1);
+		expect_commit(req, 0, 0, i && frames[i] == frames[i - 1] ? 0 : 1,
+			      "commit after test");
+
+		if (kernel_values[5][5] != frames[i]) {
+			fprintf(stderr, "frame %u: kernel has %llu instead of %llu\n",
+				i, (unsigned long long)kernel_values[5][5],
+				(unsigned long long)frames[i]);
+			exit(1);
+		}
+	}
+
+	drmModeAtomicFree(req);
+	drmModeAtomicTestCacheFree(cache);
+	check_values = true;
+}
+
+int main(void)
+{
+	static const unsigned int counts[] = { 10, 100, 1000 };
+	unsigned int i;
+	enum order order;
+
+	check_delta();
+	check_blob_cache();
+	check_fb_cache();
+	check_test_cache();
+	check_delta_test_cache();
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		for (order = ORDER_SORTED; order <= ORDER_DUPLICATES; order++)
+			bench(counts[i], order);
+	}
+
+	return 0;
+}
@@ -40,6 +40,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 
 #include "xf86drm.h"
@@ -133,6 +134,266 @@ static void print_neighbors(void *list, unsigned long key,
     }
 }
 
+/* Reference skip list with the original allocation strategy: one malloc per
+ * entry and a single generator shared by every list.  Only used to compare
+ * against the pooled drmSL implementation. */
+#define REF_MAX_LEVEL 16
+
+typedef struct RefEntry {
+    unsigned long   key;
+    void            *value;
+    struct RefEntry *forward[1]; /* variable sized array */
+} RefEntry;
+
+typedef struct RefList {
+    int      level;
+    RefEntry *head;
+} RefList;
+
+static RefEntry *ref_entry(int level, unsigned long key, void *value)
+{
+    RefEntry *entry = malloc(sizeof(*entry)
+			     + (level + 1) * sizeof(entry->forward[0]));
+
+    entry->key   = key;
+    entry->value = value;
+    return entry;
+}
+
+static RefList *ref_create(void)
+{
+    RefList *list = malloc(sizeof(*list));
+
+    list->level = 0;
+    list->head  = ref_entry(REF_MAX_LEVEL, 0, NULL);
+    memset(list->head->forward, 0,
+	   (REF_MAX_LEVEL + 1) * sizeof(list->head->forward[0]));
+    return list;
+}
+
+static int ref_random_level(void)
+{
+    static void *state = NULL;
+    int         level  = 1;
+
+    if (!state) state = drmRandomCreate(0xc01055a1LU);
+    while ((drmRandom(state) & 0x01) && level < REF_MAX_LEVEL) ++level;
+    return level;
+}
+
+static RefEntry *ref_locate(RefList *list, unsigned long key,
+			    RefEntry **update)
+{
+    RefEntry *entry = list->head;
+    int      i;
+
+    for (i = list->level; i >= 0; i--) {
+	while (entry->forward[i] && entry->forward[i]->key < key)
+	    entry = entry->forward[i];
+	update[i] = entry;
+    }
+    return entry->forward[0];
+}
+
+static void ref_insert(RefList *list, unsigned long key, void *value)
+{
+    RefEntry *update[REF_MAX_LEVEL + 1];
+    RefEntry *entry;
+    int      level, i;
+
+    entry = ref_locate(list, key, update);
+    if (entry && entry->key == key) return;
+
+    level = ref_random_level();
+    if (level > list->level) {
+	level = ++list->level;
+	update[level] = list->head;
+    }
+    entry = ref_entry(level, key, value);
+    for (i = 0; i <= level; i++) {
+	entry->forward[i]     = update[i]->forward[i];
+	update[i]->forward[i] = entry;
+    }
+}
+
+static void ref_destroy(RefList *list)
+{
+    RefEntry *entry, *next;
+
+    for (entry = list->head; entry; entry = next) {
+	next = entry->forward[0];
+	free(entry);
+    }
+    free(list);
+}
+
+static double elapsed_usec(struct timeval *start)
+{
+    struct timeval stop;
+
+    gettimeofday(&stop, NULL);
+    return (double)(stop.tv_sec - start->tv_sec) * 1000000.0
+	+ (stop.tv_usec - start->tv_usec);
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void do_compare(int size)
+{
+    static unsigned long keys[100000];
+    RefEntry       *update[REF_MAX_LEVEL + 1];
+    RefEntry       *entry;
+    RefList        *ref;
+    void           *list;
+    void           *value;
+    void           *ranstate;
+    unsigned long  key;
+    unsigned long  sum;
+    struct timeval start;
+    double         t[2][5];
+    int            i;
+
+    ranstate = drmRandomCreate(54321);
+    for (i = 0; i < size; i++) keys[i] = drmRandom(ranstate);
+    drmRandomDestroy(ranstate);
+
+    gettimeofday(&start, NULL);
+    ref = ref_create();
+    for (i = 0; i < size; i++) ref_insert(ref, keys[i], NULL);
+    t[0][0] = elapsed_usec(&start);
+
+    gettimeofday(&start, NULL);
+    for (i = 0, sum = 0; i < size; i++) {
+	entry = ref_locate(ref, keys[i], update);
+	sum += entry->key;
+    }
+    t[0][1] = elapsed_usec(&start);
+
+    gettimeofday(&start, NULL);
+    for (entry = ref->head->forward[0]; entry; entry = entry->forward[0])
+	sum += entry->key;
+    t[0][2] = elapsed_usec(&start);
+
+    gettimeofday(&start, NULL);
+    ref_destroy(ref);
+    t[0][3] = elapsed_usec(&start);
+
+    gettimeofday(&start, NULL);
+    list = drmSLCreate();
+    for (i = 0; i < size; i++) drmSLInsert(list, keys[i], NULL);
+    t[1][0] = elapsed_usec(&start);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < size; i++) {
+	drmSLLowerBound(list, keys[i], &key, &value);
+	sum += key;
+    }
+    t[1][1] = elapsed_usec(&start);
+
+    gettimeofday(&start, NULL);
+    if (drmSLFirst(list, &key, &value)) {
+	do {
+	    sum += key;
+	} while (drmSLNext(list, &key, &value));
+    }
+    t[1][2] = elapsed_usec(&start);
+
+    gettimeofday(&start, NULL);
+    drmSLDestroy(list);
+    t[1][3] = elapsed_usec(&start);
+
+				/* Bulk load from sorted input */
+    qsort(keys, size, sizeof(keys[0]), compare_keys);
+    gettimeofday(&start, NULL);
+    ref = ref_create();
+    for (i = 0; i < size; i++) ref_insert(ref, keys[i], NULL);
+    t[0][4] = elapsed_usec(&start);
+    ref_destroy(ref);
+
+    gettimeofday(&start, NULL);
+    list = drmSLCreate();
+    drmSLInsertSorted(list, keys, NULL, size);
+    t[1][4] = elapsed_usec(&start);
+    drmSLDestroy(list);
+
+    printf("%6d entries  %10s %10s %10s %10s %10s  (usec, checksum %lu)\n",
+	   size, "insert", "lookup", "iterate", "destroy", "sorted", sum);
+    printf("  reference    %10.0f %10.0f %10.0f %10.0f %10.0f\n",
+	   t[0][0], t[0][1], t[0][2], t[0][3], t[0][4]);
+    printf("  drmSL        %10.0f %10.0f %10.0f %10.0f %10.0f\n",
+	   t[1][0], t[1][1], t[1][2], t[1][3], t[1][4]);
+}
+
+static void expect(void *list, int retval, unsigned long key,
+		   int expected_retval, unsigned long expected_key,
+		   const char *what)
+{
+    if (retval != expected_retval || (retval == 1 && key != expected_key)) {
+	fprintf(stderr, "%s: got %d/%lu, expected %d/%lu\n",
+		what, retval, key, expected_retval, expected_key);
+	drmSLDump(list);
+	exit(1);
+    }
+}
+
+static void check_ranges(void)
+{
+    unsigned long keys[] = { 10, 20, 30, 30, 40, 5, 50 };
+    unsigned long key = 0;
+    unsigned long previous = 0;
+    void          *value;
+    void          *list;
+    int           count = 0;
+    int           ret;
+
+    list = drmSLCreate();
+    ret = drmSLInsertSorted(list, keys, NULL, 7);
+    expect(list, ret, 0, 6, 0, "InsertSorted");
+
+    ret = drmSLLowerBound(list, 0, &key, &value);
+    expect(list, ret, key, 1, 5, "LowerBound(0)");
+    ret = drmSLLowerBound(list, 15, &key, &value);
+    expect(list, ret, key, 1, 20, "LowerBound(15)");
+    ret = drmSLLowerBound(list, 20, &key, &value);
+    expect(list, ret, key, 1, 20, "LowerBound(20)");
+    ret = drmSLNext(list, &key, &value);
+    expect(list, ret, key, 1, 30, "Next after LowerBound(20)");
+    ret = drmSLUpperBound(list, 20, &key, &value);
+    expect(list, ret, key, 1, 30, "UpperBound(20)");
+    ret = drmSLUpperBound(list, 50, &key, &value);
+    expect(list, ret, key, 0, 0, "UpperBound(50)");
+    ret = drmSLLowerBound(list, 51, &key, &value);
+    expect(list, ret, key, 0, 0, "LowerBound(51)");
+
+    drmSLDelete(list, 30);
+    drmSLInsert(list, 35, NULL);
+    ret = drmSLUpperBound(list, 20, &key, &value);
+    expect(list, ret, key, 1, 35, "UpperBound(20) after delete");
+
+    if (drmSLFirst(list, &key, &value)) {
+	do {
+	    if (count && key <= previous) {
+		fprintf(stderr, "%lu !< %lu\n", previous, key);
+		exit(1);
+	    }
+	    previous = key;
+	    ++count;
+	} while (drmSLNext(list, &key, &value));
+    }
+    if (count != 6) {
+	fprintf(stderr, "Expected 6 entries, found %d\n", count);
+	exit(1);
+    }
+
+    drmSLDestroy(list);
+}
+
 int main(void)
 {
     void*    list;
@@ -167,6 +428,8 @@ int main(void)
     drmSLDestroy(list);
     printf("\n==============================\n\n");
 
+    check_ranges();
+
     usec  = do_time(100, 10000);
     usec2 = do_time(1000, 500);
     printf("Table size increased by %0.2f, search time increased by %0.2f\n",
@@ -179,6 +442,11 @@ int main(void)
     usec4 = do_time(100000, 4);
     printf("Table size increased by %0.2f, search time increased by %0.2f\n",
 	   100000.0/100.0, usec4 / usec);
+    printf("\n==============================\n\n");
+
+    do_compare(1000);
+    do_compare(10000);
+    do_compare(100000);
 
     return 0;
 }
@@ -0,0 +1,435 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Feeds DRM events through a pipe into the event dispatch functions. A pipe
+ * hands out whatever was written, so all events written here have the same
+ * size to keep reads from splitting them. A SOCK_SEQPACKET socket returns
+ * one event per read instead. The event loop is also fed an
+ * eventfd, and a pipe standing in for a sync_file since both are readable
+ * once signaled. Finally, a consumer thread takes the events from a
+ * drmEventQueue filled through a deliberately small ring.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "xf86drm.h"
+
+static unsigned int vblanks, flips, sequences;
+static unsigned int next_sequence;
+
+static void vblank_handler(int fd, unsigned int sequence,
+			   unsigned int tv_sec, unsigned int tv_usec,
+			   void *user_data)
+{
+	if (sequence != next_sequence++) {
+		fprintf(stderr, "vblank %u out of order\n", sequence);
+		exit(1);
+	}
+	vblanks++;
+}
+
+static void flip_handler(int fd, unsigned int sequence,
+			 unsigned int tv_sec, unsigned int tv_usec,
+			 unsigned int crtc_id, void *user_data)
+{
+	if (sequence != next_sequence++) {
+		fprintf(stderr, "flip %u out of order\n", sequence);
+		exit(1);
+	}
+	flips++;
+}
+
+static void sequence_handler(int fd, uint64_t sequence, uint64_t ns,
+			     uint64_t user_data)
+{
+	if (sequence != next_sequence++) {
+		fprintf(stderr, "sequence %llu out of order\n",
+			(unsigned long long)sequence);
+		exit(1);
+	}
+	sequences++;
+}
+
+static drmEventContext evctx = {
+	.version = 4,
+	.vblank_handler = vblank_handler,
+	.page_flip_handler2 = flip_handler,
+	.sequence_handler = sequence_handler,
+};
+
+static void write_events(int fd, unsigned int count)
+{
+	static unsigned int sequence;
+	struct drm_event_vblank vblank;
+	struct drm_event_crtc_sequence seq;
+	unsigned int i;
+	ssize_t ret;
+
+	for (i = 0; i < count; i++, sequence++) {
+		if (i % 3 == 2) {
+			memset(&seq, 0, sizeof(seq));
+			seq.base.type = DRM_EVENT_CRTC_SEQUENCE;
+			seq.base.length = sizeof(seq);
+			seq.sequence = sequence;
+			ret = write(fd, &seq, sizeof(seq));
+		} else {
+			memset(&vblank, 0, sizeof(vblank));
+			vblank.base.type = i % 3 ? DRM_EVENT_FLIP_COMPLETE :
+						   DRM_EVENT_VBLANK;
+			vblank.base.length = sizeof(vblank);
+			vblank.sequence = sequence;
+			ret = write(fd, &vblank, sizeof(vblank));
+		}
+
+		if (ret != sizeof(vblank)) {
+			fprintf(stderr, "short write: %zd\n", ret);
+			exit(1);
+		}
+	}
+}
+
+static void check_drain(int fds[2], unsigned int count, void *buffer,
+			size_t size)
+{
+	int ret;
+
+	vblanks = flips = sequences = 0;
+	write_events(fds[1], count);
+
+	ret = drmHandleEventDrain(fds[0], &evctx, NULL, buffer, size);
+	if (ret != (int)count || vblanks + flips + sequences != count) {
+		fprintf(stderr, "drained %d of %u events (%u/%u/%u)\n",
+			ret, count, vblanks, flips, sequences);
+		exit(1);
+	}
+
+	/* Only a non-blocking fd can be asked again without blocking. */
+	if (!(fcntl(fds[0], F_GETFL) & O_NONBLOCK))
+		return;
+
+	ret = drmHandleEventDrain(fds[0], &evctx, NULL, buffer, size);
+	if (ret != 0) {
+		fprintf(stderr, "drained %d events from an empty queue\n", ret);
+		exit(1);
+	}
+}
+
+static unsigned int vendor_events;
+
+static void vendor_handler(int fd, struct drm_event *e, void *ctx)
+{
+	vendor_events++;
+}
+
+/*
+ * A SOCK_SEQPACKET socket returns one event per read, like a DRM fd whose
+ * next event doesn't fit in the rest of the buffer. Draining must go on
+ * until nothing is left, and a failing read must not lose the count.
+ */
+static void check_drain_packets(void)
+{
+	char event[512];
+	struct drm_event e;
+	unsigned int i;
+	int fds[2], ret;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds))
+		exit(1);
+
+	e.type = 0x80000000;
+	e.length = sizeof(event);
+	memset(event, 0, sizeof(event));
+	memcpy(event, &e, sizeof(e));
+
+	for (i = 0; i < 3; i++) {
+		if (write(fds[1], event, sizeof(event)) != sizeof(event))
+			exit(1);
+	}
+
+	/* A truncated event makes the fourth read fail. */
+	if (write(fds[1], event, 4) != 4)
+		exit(1);
+
+	ret = drmHandleEventDrain(fds[0], &evctx, vendor_handler, NULL, 0);
+	if (ret != 3 || vendor_events != 3) {
+		fprintf(stderr, "drained %d of 3 packets\n", ret);
+		exit(1);
+	}
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static unsigned int fences;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void fence_handler(int fd, uint64_t arrival_ns, void *user_data)
+{
+	if (arrival_ns > now_ns()) {
+		fprintf(stderr, "fence %d arrived in the future\n", fd);
+		exit(1);
+	}
+	fences++;
+}
+
+static void expect_dispatch(drmEventLoopPtr loop, int expected,
+			    const char *what)
+{
+	int ret = drmEventLoopDispatch(loop, 0);
+
+	if (ret != expected) {
+		fprintf(stderr, "%s: dispatched %d instead of %d\n",
+			what, ret, expected);
+		exit(1);
+	}
+}
+
+static void check_event_loop(void)
+{
+	const uint64_t one = 1;
+	int devices[2][2], sync_file[2], efd;
+	drmEventLoopPtr loop;
+	unsigned int i;
+
+	loop = drmEventLoopCreate();
+	if (!loop) {
+		fprintf(stderr, "failed to create the event loop\n");
+		exit(1);
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (pipe(devices[i]))
+			exit(1);
+		fcntl(devices[i][0], F_SETFL, O_NONBLOCK);
+		if (drmEventLoopAddDevice(loop, devices[i][0], &evctx, NULL))
+			exit(1);
+	}
+
+	efd = eventfd(0, EFD_NONBLOCK);
+	if (efd < 0 || pipe(sync_file))
+		exit(1);
+	if (drmEventLoopAddEventfd(loop, efd, fence_handler, NULL) ||
+	    drmEventLoopAddSyncFile(loop, sync_file[0], fence_handler, NULL))
+		exit(1);
+
+	expect_dispatch(loop, 0, "idle loop");
+
+	/* Both devices are drained in the same wakeup. */
+	write_events(devices[0][1], 10);
+	write_events(devices[1][1], 10);
+	if (write(efd, &one, sizeof(one)) != sizeof(one) ||
+	    write(sync_file[1], "", 1) != 1)
+		exit(1);
+	expect_dispatch(loop, 22, "busy loop");
+	if (fences != 2)
+		exit(1);
+
+	/* The eventfd fires again, the sync_file does not. */
+	if (write(efd, &one, sizeof(one)) != sizeof(one))
+		exit(1);
+	expect_dispatch(loop, 1, "signaled eventfd");
+	expect_dispatch(loop, 0, "drained loop");
+
+	if (drmEventLoopRemove(loop, devices[1][0]) ||
+	    drmEventLoopRemove(loop, sync_file[0]) != -ENOENT)
+		exit(1);
+	write_events(devices[0][1], 1);
+	write_events(devices[1][1], 1);
+	expect_dispatch(loop, 1, "removed device");
+
+	drmEventLoopDestroy(loop);
+
+	close(efd);
+	close(sync_file[0]);
+	close(sync_file[1]);
+	for (i = 0; i < 2; i++) {
+		close(devices[i][0]);
+		close(devices[i][1]);
+	}
+}
+
+#define QUEUE_EVENTS 100000
+
+static void *queue_consumer(void *arg)
+{
+	drmEventQueuePtr queue = arg;
+	drmEventRecord records[16];
+	uint64_t sequence = 0;
+	int i, ret;
+
+	while (sequence < QUEUE_EVENTS) {
+		ret = drmEventQueueDequeue(queue, records, 16, 1000);
+		if (ret < 0) {
+			fprintf(stderr, "dequeue failed: %d\n", ret);
+			exit(1);
+		}
+
+		for (i = 0; i < ret; i++, sequence++) {
+			if (records[i].sequence != sequence ||
+			    records[i].user_data != sequence) {
+				fprintf(stderr, "record %llu out of order\n",
+					(unsigned long long)sequence);
+				exit(1);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void check_event_queue(void)
+{
+	struct drm_event_vblank events[64];
+	unsigned int i, written = 0, queued = 0;
+	drmEventQueuePtr queue;
+	pthread_t consumer;
+	int fds[2], ret;
+
+	queue = drmEventQueueCreate(50);
+	if (!queue || pipe(fds))
+		exit(1);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	if (pthread_create(&consumer, NULL, queue_consumer, queue))
+		exit(1);
+
+	memset(events, 0, sizeof(events));
+	while (queued < QUEUE_EVENTS) {
+		if (written < QUEUE_EVENTS && written - queued < 1000) {
+			for (i = 0; i < 64; i++, written++) {
+				events[i].base.type = DRM_EVENT_FLIP_COMPLETE;
+				events[i].base.length = sizeof(events[i]);
+				events[i].sequence = written;
+				events[i].user_data = written;
+			}
+			if (write(fds[1], events, sizeof(events)) !=
+			    sizeof(events))
+				exit(1);
+		}
+
+		ret = drmEventQueueRead(fds[0], queue, NULL, NULL);
+		if (ret < 0) {
+			fprintf(stderr, "queueing events failed\n");
+			exit(1);
+		}
+		queued += ret;
+	}
+
+	pthread_join(consumer, NULL);
+	drmEventQueueDestroy(queue);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/* A ring for a single record still takes a large vendor event. */
+static void check_event_queue_vendor(void)
+{
+	drmEventRecord records[4];
+	char event[512];
+	struct drm_event_vblank vblank;
+	drmEventQueuePtr queue;
+	int fds[2];
+
+	queue = drmEventQueueCreate(1);
+	if (!queue || pipe(fds))
+		exit(1);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+	memset(&vblank, 0, sizeof(vblank));
+	vblank.base.type = 0x80000000;
+	vblank.base.length = sizeof(event);
+	memset(event, 0, sizeof(event));
+	memcpy(event, &vblank, sizeof(vblank));
+	if (write(fds[1], event, sizeof(event)) != sizeof(event))
+		exit(1);
+
+	vblank.base.type = DRM_EVENT_VBLANK;
+	vblank.base.length = sizeof(vblank);
+	if (write(fds[1], &vblank, sizeof(vblank)) != sizeof(vblank))
+		exit(1);
+
+	vendor_events = 0;
+	if (drmEventQueueRead(fds[0], queue, vendor_handler, NULL) != 1 ||
+	    vendor_events != 1 ||
+	    drmEventQueueDequeue(queue, records, 4, 0) != 1 ||
+	    records[0].type != DRM_EVENT_VBLANK) {
+		fprintf(stderr, "vendor event not read into the queue\n");
+		exit(1);
+	}
+
+	drmEventQueueDestroy(queue);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int main(void)
+{
+	uint64_t small_buffer[8];
+	int fds[2];
+
+	/* drm_event_crtc_sequence and drm_event_vblank have the same size. */
+	if (sizeof(struct drm_event_crtc_sequence) !=
+	    sizeof(struct drm_event_vblank))
+		return 77;
+
+	if (pipe(fds))
+		return 1;
+
+	/* A blocking fd must not block once the events are drained. */
+	check_drain(fds, 1, NULL, 0);
+	check_drain(fds, 600, NULL, 0);
+	check_drain(fds, 100, small_buffer, sizeof(small_buffer));
+
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+	check_drain(fds, 0, NULL, 0);
+	check_drain(fds, 1000, NULL, 0);
+	check_drain(fds, 100, small_buffer, sizeof(small_buffer));
+
+	close(fds[0]);
+	close(fds[1]);
+
+	check_drain_packets();
+	check_event_loop();
+	check_event_queue();
+	check_event_queue_vendor();
+
+	printf("dispatched %u events\n", next_sequence);
+
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Allocates and frees buffers from several threads sharing one bufmgr, the
+ * way multi-threaded GL contexts do, and reports how many allocations per
+ * second the buffer cache sustains as threads are added.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include <xf86drm.h>
+
+#include "intel_bufmgr.h"
+
+#define WORKING_SET 8
+
+static drm_intel_bufmgr *bufmgr;
+static unsigned int iterations = 100000;
+static unsigned long max_size = 64 * 1024;
+static bool for_render;
+
+struct thread_data {
+	pthread_t thread;
+	unsigned int seed;
+	bool failed;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *threadfunc(void *arg)
+{
+	struct thread_data *data = arg;
+	drm_intel_bo *bos[WORKING_SET] = { NULL };
+	unsigned long size;
+	unsigned int i, j;
+
+	for (i = 0; i < iterations; i++) {
+		j = rand_r(&data->seed) % WORKING_SET;
+		size = 4096 * (1 + rand_r(&data->seed) % (max_size / 4096));
+
+		drm_intel_bo_unreference(bos[j]);
+		if (for_render)
+			bos[j] = drm_intel_bo_alloc_for_render(bufmgr, "perf",
+							       size, 0);
+		else
+			bos[j] = drm_intel_bo_alloc(bufmgr, "perf", size, 0);
+
+		if (!bos[j]) {
+			data->failed = true;
+			break;
+		}
+	}
+
+	for (j = 0; j < WORKING_SET; j++)
+		drm_intel_bo_unreference(bos[j]);
+
+	return NULL;
+}
+
+static int run(unsigned int num_threads)
+{
+	struct thread_data *threads;
+	double start, elapsed;
+	unsigned int i;
+	int ret = 0;
+
+	threads = calloc(num_threads, sizeof(*threads));
+	if (!threads)
+		return -1;
+
+	start = now();
+	for (i = 0; i < num_threads; i++) {
+		threads[i].seed = i + 1;
+		if (pthread_create(&threads[i].thread, NULL, threadfunc,
+				   &threads[i])) {
+			fprintf(stderr, "failed to create thread %u\n", i);
+			num_threads = i;
+			ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].failed)
+			ret = -1;
+	}
+	elapsed = now() - start;
+
+	if (ret == 0)
+		printf("%2u threads: %10.0f allocations/s, %6.1f ns each\n",
+		       num_threads, num_threads * iterations / elapsed,
+		       elapsed * 1e9 / iterations);
+	else
+		fprintf(stderr, "allocation failed with %u threads\n",
+			num_threads);
+
+	free(threads);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-i iterations] [-s max_size] [-t threads] "
+		"[-r]\n\n", name);
+	fprintf(stderr, "\t-i <iterations>\tallocations per thread\n");
+	fprintf(stderr, "\t-s <size>\tlargest buffer size in bytes\n");
+	fprintf(stderr, "\t-t <threads>\tmost threads to run, doubling from 1\n");
+	fprintf(stderr, "\t-r\tallocate buffers for rendering\n");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int threads;
+	int fd, c, ret = 0;
+
+	while ((c = getopt(argc, argv, "i:s:t:rh")) != -1) {
+		switch (c) {
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			max_size = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			for_render = true;
+			break;
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (iterations == 0 || max_size < 4096 || max_threads == 0)
+		usage(argv[0]);
+
+	fd = drmOpenWithType("i915", NULL, DRM_NODE_RENDER);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open an i915 device\n");
+		return 77;
+	}
+
+	bufmgr = drm_intel_bufmgr_gem_init(fd, 4096);
+	if (!bufmgr) {
+		fprintf(stderr, "failed to initialize the bufmgr\n");
+		drmClose(fd);
+		return 1;
+	}
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+
+	printf("%u allocations per thread of up to %lu bytes\n",
+	       iterations, max_size);
+
+	for (threads = 1; threads <= max_threads && ret == 0; threads *= 2)
+		ret = run(threads);
+
+	drm_intel_bufmgr_destroy(bufmgr);
+	drmClose(fd);
+
+	return ret ? 1 : 0;
+}
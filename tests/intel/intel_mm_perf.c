@@ -0,0 +1,177 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Churns the heap allocator of the fake bufmgr the way texture uploads do,
+ * replacing random page-aligned blocks of a working set, and reports how
+ * long an allocation and free take and how fragmented the heap gets as the
+ * working set grows. No device is needed. intel_mm_first_fit_perf is the
+ * same benchmark built against the first-fit allocator mm.c used before.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "mm.h"
+
+#define PAGE_ALIGN2 12
+
+static unsigned int iterations = 200000;
+static int heap_size = 128 << 20;
+static int max_size = 64 << 10;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Page multiples up to max_size, small ones as likely as big ones. */
+static int random_size(unsigned int *seed)
+{
+	double pages = exp(log(max_size >> PAGE_ALIGN2) *
+			   (rand_r(seed) / (double)RAND_MAX));
+
+	return (int)pages << PAGE_ALIGN2;
+}
+
+/*
+ * How much of the free space can't be had in one block, from 0 for a
+ * single free block to nearly 1 for many small ones.
+ */
+static double fragmentation(const struct mem_block *heap,
+			    unsigned int *free_blocks)
+{
+	const struct mem_block *p;
+	long long total = 0;
+	int largest = 0;
+
+	*free_blocks = 0;
+	for (p = heap->next; p != heap; p = p->next) {
+		if (!p->free)
+			continue;
+		total += p->size;
+		if (p->size > largest)
+			largest = p->size;
+		(*free_blocks)++;
+	}
+
+	return total ? 1.0 - (double)largest / total : 0.0;
+}
+
+static int run(unsigned int working_set)
+{
+	struct mem_block *heap, **blocks;
+	unsigned int seed = working_set, failed = 0, free_blocks;
+	unsigned int i, j;
+	double start, elapsed, frag;
+
+	heap = mmInit(0, heap_size);
+	blocks = calloc(working_set, sizeof(*blocks));
+	if (!heap || !blocks) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	for (j = 0; j < working_set; j++)
+		blocks[j] = mmAllocMem(heap, random_size(&seed),
+				       PAGE_ALIGN2, 0);
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		j = rand_r(&seed) % working_set;
+
+		mmFreeMem(blocks[j]);
+		blocks[j] = mmAllocMem(heap, random_size(&seed),
+				       PAGE_ALIGN2, 0);
+		if (!blocks[j])
+			failed++;
+	}
+	elapsed = now() - start;
+	frag = fragmentation(heap, &free_blocks);
+
+	printf("%5u blocks: %8.1f ns per free and allocation, "
+	       "%5.2f%% failed, %5u free blocks, %4.1f%% fragmentation\n",
+	       working_set, elapsed * 1e9 / iterations,
+	       100.0 * failed / iterations, free_blocks, 100.0 * frag);
+
+	free(blocks);
+	mmDestroy(heap);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-i iterations] [-H heap_size] [-s max_size] "
+		"[-n blocks]\n\n", name);
+	fprintf(stderr, "\t-i <iterations>\tblocks replaced per working set\n");
+	fprintf(stderr, "\t-H <size>\theap size in bytes\n");
+	fprintf(stderr, "\t-s <size>\tlargest block size in bytes\n");
+	fprintf(stderr, "\t-n <blocks>\tlargest working set, quadrupling from 16\n");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int max_blocks = 4096;
+	unsigned int working_set;
+	int c, ret = 0;
+
+	while ((c = getopt(argc, argv, "i:H:s:n:h")) != -1) {
+		switch (c) {
+		case 'i':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			heap_size = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			max_size = strtol(optarg, NULL, 0);
+			break;
+		case 'n':
+			max_blocks = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+			break;
+		}
+	}
+
+	if (iterations == 0 || heap_size <= 0 || max_size < 4096 ||
+	    max_blocks == 0)
+		usage(argv[0]);
+
+	printf("%u replacements of blocks up to %d bytes in a %d byte heap\n",
+	       iterations, max_size, heap_size);
+
+	for (working_set = 16; working_set <= max_blocks && ret == 0;
+	     working_set *= 4)
+		ret = run(working_set);
+
+	return ret ? 1 : 0;
+}
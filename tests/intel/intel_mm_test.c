@@ -0,0 +1,174 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks the heap allocator of the fake bufmgr against random sequences of
+ * allocations and frees, with random sizes, alignments and search starts,
+ * in heaps of random offsets and sizes. After every step the blocks must
+ * tile the heap exactly with no two free blocks side by side, and an
+ * allocation may only fail if no free block could hold it. No device is
+ * needed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mm.h"
+
+#define LIVE_BLOCKS 256
+#define STEPS 20000
+#define HEAPS 20
+
+static unsigned int live_count;
+
+static void fail(const struct mem_block *heap, const char *what)
+{
+	fprintf(stderr, "%s\n", what);
+	mmDumpMemInfo(heap);
+	exit(1);
+}
+
+/*
+ * Walks the blocks in address order: they must start at the heap offset,
+ * follow each other without gap or overlap, end at the heap end, never
+ * leave two free blocks next to each other, and include every live block.
+ */
+static void check_heap(const struct mem_block *heap, int ofs, int size)
+{
+	const struct mem_block *p;
+	unsigned int allocated = 0;
+	int pos = ofs, prev_free = 0;
+
+	for (p = heap->next; p != heap; p = p->next) {
+		if (p->ofs != pos || p->size <= 0)
+			fail(heap, "blocks overlap or leave a gap");
+		if (p->next->prev != p)
+			fail(heap, "block list is broken");
+		if (prev_free && p->free)
+			fail(heap, "free neighbours were not merged");
+
+		prev_free = p->free;
+		allocated += !p->free;
+		pos += p->size;
+	}
+
+	if (pos != ofs + size)
+		fail(heap, "blocks don't cover the heap");
+	if (allocated != live_count)
+		fail(heap, "allocated blocks don't match the live ones");
+}
+
+/* Whether any free block could hold the allocation, as mmAllocMem places it. */
+static int fits(const struct mem_block *heap, int size, int align2,
+		int startSearch)
+{
+	const struct mem_block *p;
+	int mask = (1 << align2) - 1;
+
+	for (p = heap->next; p != heap; p = p->next) {
+		int start = (p->ofs + mask) & ~mask;
+
+		if (start < startSearch)
+			start = startSearch;
+		if (p->free && start + size <= p->ofs + p->size)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void run(unsigned int seed)
+{
+	struct mem_block *heap, *live[LIVE_BLOCKS] = { NULL };
+	int ofs, size, max_size;
+	unsigned int i, j;
+
+	ofs = rand_r(&seed) % 100000;
+	size = 1 + rand_r(&seed) % (1 << (10 + rand_r(&seed) % 16));
+	max_size = size / 64 + 1;
+
+	heap = mmInit(ofs, size);
+	if (heap == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	live_count = 0;
+
+	for (i = 0; i < STEPS; i++) {
+		j = rand_r(&seed) % LIVE_BLOCKS;
+
+		if (live[j]) {
+			if (mmFreeMem(live[j]) != 0)
+				fail(heap, "freeing a live block failed");
+			live[j] = NULL;
+			live_count--;
+		} else {
+			int block_size = 1 + rand_r(&seed) % max_size;
+			int align2 = rand_r(&seed) % 13;
+			int startSearch = rand_r(&seed) % 8 ? 0 :
+				ofs + rand_r(&seed) % size;
+			struct mem_block *b;
+
+			b = mmAllocMem(heap, block_size, align2, startSearch);
+			if (b == NULL) {
+				if (fits(heap, block_size, align2, startSearch))
+					fail(heap, "allocation failed though a block fits");
+				continue;
+			}
+
+			if (b->free || b->size != block_size)
+				fail(heap, "allocated block has the wrong size");
+			if (b->ofs < startSearch ||
+			    b->ofs + b->size > ofs + size)
+				fail(heap, "allocated block is out of bounds");
+			if ((b->ofs & ((1 << align2) - 1)) &&
+			    b->ofs != startSearch)
+				fail(heap, "allocated block is misaligned");
+
+			live[j] = b;
+			live_count++;
+		}
+
+		check_heap(heap, ofs, size);
+	}
+
+	for (j = 0; j < LIVE_BLOCKS; j++) {
+		if (live[j]) {
+			mmFreeMem(live[j]);
+			live_count--;
+		}
+	}
+	check_heap(heap, ofs, size);
+	if (heap->next->next != heap)
+		fail(heap, "empty heap is not a single free block");
+
+	mmDestroy(heap);
+}
+
+int main(void)
+{
+	unsigned int seed;
+
+	for (seed = 1; seed <= HEAPS; seed++)
+		run(seed);
+
+	return 0;
+}
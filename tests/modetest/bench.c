@@ -0,0 +1,217 @@
+/*
+ * DRM based mode setting test program
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Statistics for the page flip benchmark: every frame's sample is kept, so
+ * that percentiles are exact and the raw data can be written out as CSV.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+#define HISTOGRAM_BUCKETS	16
+#define HISTOGRAM_WIDTH		50
+
+struct bench {
+	struct bench_sample *samples;
+	unsigned int count;
+	unsigned int size;
+};
+
+static uint64_t timespec_ns(const struct timespec *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_ns(&ts);
+}
+
+uint64_t bench_cpu_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return timespec_ns(&ts);
+}
+
+struct bench *bench_create(unsigned int frames)
+{
+	struct bench *bench;
+
+	bench = calloc(1, sizeof(*bench));
+	if (!bench)
+		return NULL;
+
+	bench->samples = calloc(frames, sizeof(*bench->samples));
+	if (!bench->samples) {
+		free(bench);
+		return NULL;
+	}
+	bench->size = frames;
+
+	return bench;
+}
+
+void bench_destroy(struct bench *bench)
+{
+	free(bench->samples);
+	free(bench);
+}
+
+void bench_add(struct bench *bench, const struct bench_sample *sample)
+{
+	if (bench->count < bench->size)
+		bench->samples[bench->count++] = *sample;
+}
+
+static uint64_t sample_latency(const struct bench_sample *sample)
+{
+	/* The event can carry a vblank timestamp from before the submit. */
+	return sample->flip_ns > sample->submit_ns ?
+	       sample->flip_ns - sample->submit_ns : 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Prints a summary line and a histogram of the values, in units of 'unit'
+ * nanoseconds. The buckets span min to max evenly.
+ */
+static void report_values(FILE *out, const char *name, const char *unit_name,
+			  double unit, uint64_t *values, unsigned int count)
+{
+	unsigned int buckets[HISTOGRAM_BUCKETS] = { 0 };
+	unsigned int i, b, peak = 0, width;
+	uint64_t min, max, sum = 0;
+	double step;
+
+	qsort(values, count, sizeof(*values), compare_u64);
+	min = values[0];
+	max = values[count - 1];
+	for (i = 0; i < count; i++)
+		sum += values[i];
+
+	fprintf(out, "\n%s (%s): min %.3f avg %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+		name, unit_name, min / unit, (double)sum / count / unit,
+		values[count / 2] / unit, values[count * 9 / 10] / unit,
+		values[count * 99 / 100] / unit, max / unit);
+
+	/* Narrow ranges, such as missed vblank counts, get a bucket per value. */
+	step = (double)(max - min + 1) / HISTOGRAM_BUCKETS;
+	if (step < 1)
+		step = 1;
+	for (i = 0; i < count; i++) {
+		b = (values[i] - min) / step;
+		if (b >= HISTOGRAM_BUCKETS)
+			b = HISTOGRAM_BUCKETS - 1;
+		if (++buckets[b] > peak)
+			peak = buckets[b];
+	}
+
+	for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		if (max - min + 1 < HISTOGRAM_BUCKETS && b > max - min)
+			break;
+
+		width = (uint64_t)buckets[b] * HISTOGRAM_WIDTH / peak;
+		fprintf(out, "  %10.3f %8u |%.*s\n", (min + b * step) / unit,
+			buckets[b], width,
+			"##################################################");
+	}
+}
+
+void bench_report(struct bench *bench, const char *mode, FILE *out)
+{
+	uint64_t *values;
+	uint64_t missed = 0;
+	unsigned int i;
+
+	if (!bench->count) {
+		fprintf(out, "no flips completed\n");
+		return;
+	}
+
+	values = malloc(bench->count * sizeof(*values));
+	if (!values)
+		return;
+
+	for (i = 0; i < bench->count; i++)
+		missed += bench->samples[i].missed;
+
+	fprintf(out, "%s page flips: %u frames, %" PRIu64 " missed vblanks\n",
+		mode, bench->count, missed);
+
+	for (i = 0; i < bench->count; i++)
+		values[i] = sample_latency(&bench->samples[i]);
+	report_values(out, "submit to flip latency", "ms", 1e6, values,
+		      bench->count);
+
+	for (i = 0; i < bench->count; i++)
+		values[i] = bench->samples[i].missed;
+	report_values(out, "missed vblanks per frame", "frames", 1, values,
+		      bench->count);
+
+	for (i = 0; i < bench->count; i++)
+		values[i] = bench->samples[i].cpu_ns;
+	report_values(out, "CPU time per frame", "us", 1e3, values,
+		      bench->count);
+
+	free(values);
+}
+
+int bench_write_csv(struct bench *bench, const char *filename)
+{
+	const struct bench_sample *sample;
+	unsigned int i;
+	FILE *out;
+
+	out = fopen(filename, "w");
+	if (!out)
+		return -errno;
+
+	fprintf(out, "frame,submit_ns,flip_ns,latency_ns,sequence,missed,cpu_ns\n");
+	for (i = 0; i < bench->count; i++) {
+		sample = &bench->samples[i];
+		fprintf(out, "%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%u,%u,%" PRIu64 "\n",
+			i, sample->submit_ns, sample->flip_ns,
+			sample_latency(sample), sample->sequence,
+			sample->missed, sample->cpu_ns);
+	}
+
+	return fclose(out) ? -errno : 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * DRM based mode setting test program
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct bench;
+
+struct bench_sample {
+	uint64_t submit_ns;	/* CLOCK_MONOTONIC before the flip was queued */
+	uint64_t flip_ns;	/* vblank timestamp of the completion event */
+	uint32_t sequence;	/* vblank sequence of the completion event */
+	uint32_t missed;	/* vblanks skipped since the previous flip */
+	uint64_t cpu_ns;	/* process CPU time spent on this frame */
+};
+
+uint64_t bench_now(void);
+uint64_t bench_cpu_time(void);
+
+struct bench *bench_create(unsigned int frames);
+void bench_destroy(struct bench *bench);
+void bench_add(struct bench *bench, const struct bench_sample *sample);
+void bench_report(struct bench *bench, const char *mode, FILE *out);
+int bench_write_csv(struct bench *bench, const char *filename);
+
+#endif
@@ -65,6 +65,7 @@
 #include "util/kms.h"
 #include "util/pattern.h"
 
+#include "bench.h"
 #include "buffers.h"
 #include "cursor.h"
 
@@ -1860,6 +1861,149 @@ err_rmfb:
 	bo_destroy(other_bo);
 }
 
+struct bench_flip {
+	bool done;
+	unsigned int sequence;
+	uint64_t time_ns;
+};
+
+static void
+bench_flip_handler(int fd, unsigned int sequence, unsigned int sec,
+		   unsigned int usec, unsigned int crtc_id, void *data)
+{
+	struct bench_flip *flip = data;
+
+	flip->done = true;
+	flip->sequence = sequence;
+	flip->time_ns = sec * 1000000000ull + usec * 1000ull;
+}
+
+static int bench_submit_flip(struct device *dev, uint32_t crtc_id,
+			     struct plane_arg *plane, unsigned int fb_id,
+			     struct bench_flip *flip)
+{
+	flip->done = false;
+
+	if (!dev->use_atomic)
+		return drmModePageFlip(dev->fd, crtc_id, fb_id,
+				       DRM_MODE_PAGE_FLIP_EVENT, flip);
+
+	drmModeAtomicFree(dev->req);
+	dev->req = drmModeAtomicAlloc();
+	add_property(dev, plane->plane_id, "FB_ID", fb_id);
+
+	return drmModeAtomicCommit(dev->fd, dev->req,
+				   DRM_MODE_PAGE_FLIP_EVENT |
+				   DRM_MODE_ATOMIC_NONBLOCK, flip);
+}
+
+static int bench_wait_flip(struct device *dev, drmEventContext *evctx,
+			   struct bench_flip *flip)
+{
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+	int ret;
+
+	while (!flip->done) {
+		ret = poll(&pfd, 1, 1000);
+		if (ret <= 0) {
+			fprintf(stderr, "page flip timed out or error (ret %d)\n",
+				ret);
+			return -1;
+		}
+
+		drmHandleEvent(dev->fd, evctx);
+	}
+
+	return 0;
+}
+
+/*
+ * Flips between two framebuffers for the given number of frames, each flip
+ * queued as soon as the previous one completed. Legacy mode flips the CRTC
+ * of the first pipe, atomic mode updates FB_ID of the first plane.
+ */
+static void bench_page_flip(struct device *dev, struct pipe_arg *pipe,
+			    struct plane_arg *plane, unsigned int frames,
+			    const char *csv)
+{
+	unsigned int fb_id[2], other_fb_id, i;
+	struct bench_sample sample;
+	struct bench_flip flip;
+	drmEventContext evctx;
+	struct bench *bench;
+	struct bo *other_bo;
+	uint32_t crtc_id;
+	uint64_t cpu;
+	int ret;
+
+	if (dev->use_atomic) {
+		crtc_id = plane->crtc_id;
+		fb_id[0] = plane->fb_id;
+		ret = bo_fb_create(dev->fd, plane->fourcc, plane->w, plane->h,
+				   UTIL_PATTERN_PLAIN, &other_bo, &other_fb_id);
+	} else {
+		crtc_id = pipe->crtc_id;
+		fb_id[0] = dev->mode.fb_id;
+		ret = bo_fb_create(dev->fd, pipe->fourcc, dev->mode.width,
+				   dev->mode.height, UTIL_PATTERN_PLAIN,
+				   &other_bo, &other_fb_id);
+	}
+	if (ret)
+		return;
+	fb_id[1] = other_fb_id;
+
+	bench = bench_create(frames);
+	if (!bench) {
+		fprintf(stderr, "memory allocation failed\n");
+		goto err_rmfb;
+	}
+
+	memset(&flip, 0, sizeof flip);
+	memset(&evctx, 0, sizeof evctx);
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.page_flip_handler2 = bench_flip_handler;
+
+	for (i = 0; i < frames; i++) {
+		unsigned int previous = flip.sequence;
+
+		cpu = bench_cpu_time();
+		sample.submit_ns = bench_now();
+		ret = bench_submit_flip(dev, crtc_id, plane, fb_id[(i + 1) % 2],
+					&flip);
+		if (ret) {
+			fprintf(stderr, "failed to page flip: %s\n",
+				strerror(errno));
+			break;
+		}
+		if (bench_wait_flip(dev, &evctx, &flip))
+			break;
+
+		sample.flip_ns = flip.time_ns;
+		sample.sequence = flip.sequence;
+		sample.missed = i ? flip.sequence - previous - 1 : 0;
+		sample.cpu_ns = bench_cpu_time() - cpu;
+		bench_add(bench, &sample);
+	}
+
+	/* Leave the original framebuffer on screen before removing ours. */
+	if (i % 2 && !bench_submit_flip(dev, crtc_id, plane, fb_id[0], &flip))
+		bench_wait_flip(dev, &evctx, &flip);
+
+	bench_report(bench, dev->use_atomic ? "atomic" : "legacy", stdout);
+
+	if (csv) {
+		ret = bench_write_csv(bench, csv);
+		if (ret)
+			fprintf(stderr, "failed to write %s: %s\n", csv,
+				strerror(-ret));
+	}
+
+	bench_destroy(bench);
+err_rmfb:
+	drmModeRmFB(dev->fd, other_fb_id);
+	bo_destroy(other_bo);
+}
+
 #define min(a, b)	((a) < (b) ? (a) : (b))
 
 static int parse_connector(struct pipe_arg *pipe, const char *arg)
@@ -2019,7 +2163,7 @@ static void parse_fill_patterns(char *arg)
 
 static void usage(char *name)
 {
-	fprintf(stderr, "usage: %s [-acDdefMPpsCvrw]\n", name);
+	fprintf(stderr, "usage: %s [-abcDdefMoPpsCvrw]\n", name);
 
 	fprintf(stderr, "\n Query options:\n\n");
 	fprintf(stderr, "\t-c\tlist connectors\n");
@@ -2032,6 +2176,8 @@ static void usage(char *name)
 	fprintf(stderr, "\t-s <connector_id>[,<connector_id>][@<crtc_id>]:[#<mode index>]<mode>[-<vrefresh>][@<format>]\tset a mode\n");
 	fprintf(stderr, "\t-C\ttest hw cursor\n");
 	fprintf(stderr, "\t-v\ttest vsynced page flipping\n");
+	fprintf(stderr, "\t-b <frames>\tbenchmark page flip latency over the given number of frames\n");
+	fprintf(stderr, "\t-o <file>\twrite per-frame benchmark results to a CSV file\n");
 	fprintf(stderr, "\t-r\tset the preferred mode for all connectors\n");
 	fprintf(stderr, "\t-w <obj_id>:<prop_name>:<value>\tset property\n");
 	fprintf(stderr, "\t-a \tuse atomic API\n");
@@ -2046,7 +2192,7 @@ static void usage(char *name)
 	exit(0);
 }
 
-static char optstr[] = "acdD:efF:M:P:ps:Cvrw:";
+static char optstr[] = "ab:cdD:efF:M:o:P:ps:Cvrw:";
 
 int main(int argc, char **argv)
 {
@@ -2056,6 +2202,8 @@ int main(int argc, char **argv)
 	int encoders = 0, connectors = 0, crtcs = 0, planes = 0, framebuffers = 0;
 	int drop_master = 0;
 	int test_vsync = 0;
+	unsigned int bench_frames = 0;
+	char *bench_csv = NULL;
 	int test_cursor = 0;
 	int set_preferred = 0;
 	int use_atomic = 0;
@@ -2082,6 +2230,11 @@ int main(int argc, char **argv)
 			/* Preserve the default behaviour of dumping all information. */
 			args--;
 			break;
+		case 'b':
+			bench_frames = strtoul(optarg, NULL, 0);
+			if (!bench_frames)
+				usage(argv[0]);
+			break;
 		case 'c':
 			connectors = 1;
 			break;
@@ -2107,6 +2260,11 @@ int main(int argc, char **argv)
 			/* Preserve the default behaviour of dumping all information. */
 			args--;
 			break;
+		case 'o':
+			bench_csv = optarg;
+			/* Preserve the default behaviour of dumping all information. */
+			args--;
+			break;
 		case 'P':
 			plane_args = realloc(plane_args,
 					     (plane_count + 1) * sizeof *plane_args);
@@ -2172,10 +2330,18 @@ int main(int argc, char **argv)
 	if (!args)
 		encoders = connectors = crtcs = planes = framebuffers = 1;
 
-	if (test_vsync && !count) {
+	if ((test_vsync || bench_frames) && !count) {
 		fprintf(stderr, "page flipping requires at least one -s option.\n");
 		return -1;
 	}
+	if (bench_frames && use_atomic && !plane_count) {
+		fprintf(stderr, "atomic page flip benchmark requires a -P option.\n");
+		return -1;
+	}
+	if (test_vsync && bench_frames) {
+		fprintf(stderr, "cannot use -v (vsync) when -b (benchmark) is set\n");
+		return -1;
+	}
 	if (set_preferred && count) {
 		fprintf(stderr, "cannot use -r (preferred) when -s (mode) is set\n");
 		return -1;
@@ -2245,10 +2411,16 @@ int main(int argc, char **argv)
 			if (test_vsync)
 				atomic_test_page_flip(&dev, pipe_args, plane_args, plane_count);
 
+			if (bench_frames)
+				bench_page_flip(&dev, pipe_args, plane_args,
+						bench_frames, bench_csv);
+
 			if (drop_master)
 				drmDropMaster(dev.fd);
 
-			getchar();
+			/* Benchmarks run unattended, e.g. on vkms in CI. */
+			if (!bench_frames)
+				getchar();
 
 			drmModeAtomicFree(dev.req);
 			dev.req = drmModeAtomicAlloc();
@@ -2291,10 +2463,15 @@ int main(int argc, char **argv)
 			if (test_vsync)
 				test_page_flip(&dev, pipe_args, count);
 
+			if (bench_frames)
+				bench_page_flip(&dev, pipe_args, plane_args,
+						bench_frames, bench_csv);
+
 			if (drop_master)
 				drmDropMaster(dev.fd);
 
-			getchar();
+			if (!bench_frames)
+				getchar();
 
 			if (test_cursor)
 				clear_cursors(&dev);
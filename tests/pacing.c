@@ -0,0 +1,210 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Runs the frame pacing scheduler against a simulated CRTC. The CRTC
+ * sequence ioctls are intercepted below and answered from a 60 Hz vblank
+ * clock with a little noise on the timestamps; every seventh frame is
+ * submitted too late for its target.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+
+#define FAKE_FD 0x7fff
+#define CRTC_ID 42
+#define PERIOD_NS 16666667ull
+#define FRAMES 1000
+#define FIRST_SEQUENCE 1000
+
+static uint64_t vblank_sequence = FIRST_SEQUENCE;
+static uint64_t vblank_ns;
+static uint64_t queued_sequence;
+static uint64_t queued_user_data;
+static uint64_t flip_sequence;
+
+static uint64_t vblank_time(uint64_t sequence)
+{
+	/* Up to 50 usec of noise, the same for each sequence. */
+	return vblank_ns + (sequence - FIRST_SEQUENCE) * PERIOD_NS +
+	       (sequence * 2654435761u) % 50000;
+}
+
+/* Interposes the libc ioctl() used by drmIoctl(). */
+__attribute__((visibility("default")))
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct drm_crtc_get_sequence *get;
+	struct drm_crtc_queue_sequence *queue;
+	va_list args;
+	void *arg;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	if (fd != FAKE_FD)
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	switch (request) {
+	case DRM_IOCTL_CRTC_GET_SEQUENCE:
+		get = arg;
+		get->sequence = vblank_sequence;
+		get->sequence_ns = vblank_time(vblank_sequence);
+		return 0;
+	case DRM_IOCTL_CRTC_QUEUE_SEQUENCE:
+		queue = arg;
+		if (queue->sequence <= vblank_sequence)
+			queue->sequence = vblank_sequence + 1;
+		queued_sequence = queue->sequence;
+		queued_user_data = queue->user_data;
+		return 0;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+static int submit(int fd, uint32_t crtc_id, uint64_t target, void *user_data)
+{
+	unsigned int *frame = user_data;
+
+	if (fd != FAKE_FD || crtc_id != CRTC_ID) {
+		fprintf(stderr, "submitted to the wrong CRTC\n");
+		exit(1);
+	}
+
+	/* The flip lands on the next vblank, or the one after if we dawdle. */
+	flip_sequence = vblank_sequence + (*frame % 7 == 6 ? 2 : 1);
+
+	return 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void vblank(drmModeFrameSchedulerPtr sched, unsigned int *missed)
+{
+	uint64_t ns;
+
+	vblank_sequence++;
+	ns = vblank_time(vblank_sequence);
+
+	if (flip_sequence == vblank_sequence) {
+		flip_sequence = 0;
+		*missed += drmModeFrameSchedulerHandleFlip(sched,
+							   vblank_sequence,
+							   ns) > 0;
+	}
+
+	if (queued_sequence == vblank_sequence) {
+		queued_sequence = 0;
+		if (queued_user_data != (uintptr_t)sched) {
+			fprintf(stderr, "sequence event for someone else\n");
+			exit(1);
+		}
+		drmModeFrameSchedulerHandleSequence(sched, vblank_sequence, ns);
+	}
+}
+
+int main(void)
+{
+	drmModeFrameSchedulerPtr sched;
+	drmModeFrameStats stats;
+	unsigned int frame, missed = 0;
+	uint64_t target, ns, predicted;
+	int64_t error;
+
+	vblank_ns = now_ns();
+
+	sched = drmModeFrameSchedulerCreate(FAKE_FD, CRTC_ID);
+	if (drmModeFrameSchedulerSample(sched) ||
+	    drmModeFrameSchedulerPredict(sched, vblank_sequence + 1,
+					 &ns) != -EAGAIN) {
+		fprintf(stderr, "predicted from a single sample\n");
+		return 1;
+	}
+
+	for (frame = 0; frame < FRAMES; frame++) {
+		/* Aim two frames ahead, like a compositor would. */
+		if (drmModeFrameSchedulerNextSequence(sched,
+				vblank_time(vblank_sequence) + PERIOD_NS * 3 / 2,
+				&target))
+			target = vblank_sequence + 2;
+
+		if (drmModeFrameSchedulerQueue(sched, target, submit,
+					       &frame) < 0) {
+			fprintf(stderr, "failed to queue frame %u\n", frame);
+			return 1;
+		}
+
+		while (queued_sequence || flip_sequence)
+			vblank(sched, &missed);
+	}
+
+	if (drmModeFrameSchedulerPredict(sched, vblank_sequence + 100,
+					 &predicted))
+		return 1;
+
+	error = predicted - vblank_time(vblank_sequence + 100);
+	drmModeFrameSchedulerGetStats(sched, &stats);
+
+	printf("frames %llu, missed %llu, period %llu ns\n",
+	       (unsigned long long)stats.frames,
+	       (unsigned long long)stats.missed,
+	       (unsigned long long)stats.period_ns);
+	printf("jitter avg %llu ns, max %llu ns; prediction error %lld ns\n",
+	       (unsigned long long)stats.jitter_avg_ns,
+	       (unsigned long long)stats.jitter_max_ns,
+	       (long long)error);
+
+	if (stats.frames != FRAMES || stats.missed != missed ||
+	    missed != FRAMES / 7) {
+		fprintf(stderr, "expected %u missed frames\n", FRAMES / 7);
+		return 1;
+	}
+	if (stats.period_ns < PERIOD_NS - 10000 ||
+	    stats.period_ns > PERIOD_NS + 10000 ||
+	    error < -100000 || error > 100000 ||
+	    stats.jitter_max_ns > 100000) {
+		fprintf(stderr, "vblank prediction is off\n");
+		return 1;
+	}
+
+	drmModeFrameSchedulerFree(sched);
+
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Fills buffers with every test pattern in a selection of formats, once on
+ * a single thread and once on as many as the pattern code likes. The two
+ * must match byte for byte, and the fill rate of the latter is reported.
+ *
+ * usage: patterns [<width> <height> [<threads>]]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <drm_fourcc.h>
+
+#include "util/format.h"
+#include "util/pattern.h"
+
+static const uint32_t formats[] = {
+	DRM_FORMAT_C8,
+	DRM_FORMAT_YUYV,
+	DRM_FORMAT_UYVY,
+	DRM_FORMAT_NV12,
+	DRM_FORMAT_NV16,
+	DRM_FORMAT_YUV420,
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_RGB888,
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XRGB2101010,
+	DRM_FORMAT_ABGR16161616F,
+};
+
+static const char *pattern_names[] = {
+	[UTIL_PATTERN_TILES] = "tiles",
+	[UTIL_PATTERN_PLAIN] = "plain",
+	[UTIL_PATTERN_SMPTE] = "smpte",
+	[UTIL_PATTERN_GRADIENT] = "gradient",
+};
+
+static unsigned int format_cpp(uint32_t format)
+{
+	switch (format) {
+	case DRM_FORMAT_C8:
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV16:
+	case DRM_FORMAT_YUV420:
+		return 1;
+	case DRM_FORMAT_YUYV:
+	case DRM_FORMAT_UYVY:
+	case DRM_FORMAT_RGB565:
+		return 2;
+	case DRM_FORMAT_RGB888:
+		return 3;
+	case DRM_FORMAT_ABGR16161616F:
+		return 8;
+	default:
+		return 4;
+	}
+}
+
+/* Bytes in all planes, relative to the first one. */
+static size_t format_size(uint32_t format, size_t size)
+{
+	switch (format) {
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_YUV420:
+		return size * 3 / 2;
+	case DRM_FORMAT_NV16:
+		return size * 2;
+	default:
+		return size;
+	}
+}
+
+static bool is_filled(const unsigned char *mem, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		if (mem[i])
+			return true;
+
+	return false;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Room for NV16, the planes of the other formats fit in the same layout. */
+static void setup_planes(unsigned char *mem, void *planes[3],
+			 unsigned int stride, unsigned int height)
+{
+	planes[0] = mem;
+	planes[1] = mem + stride * height;
+	planes[2] = mem + stride * height + stride * height / 4;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int width = 1920, height = 1080, threads = 0;
+	unsigned char *reference, *mem;
+	void *ref_planes[3], *planes[3];
+	unsigned int f, pattern, stride, iterations, i;
+	size_t size, bytes;
+	double start, elapsed;
+	int ret = 0;
+
+	if (argc >= 3) {
+		width = strtoul(argv[1], NULL, 0);
+		height = strtoul(argv[2], NULL, 0);
+	}
+	if (argc >= 4)
+		threads = strtoul(argv[3], NULL, 0);
+	if (!width || !height) {
+		fprintf(stderr, "usage: %s [<width> <height> [<threads>]]\n",
+			argv[0]);
+		return 1;
+	}
+
+	size = (size_t)(width * 8 + 63) * height * 2;
+	reference = calloc(1, size);
+	mem = calloc(1, size);
+	if (!reference || !mem)
+		return 1;
+
+	printf("%ux%u\n", width, height);
+
+	for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+		const struct util_format_info *info;
+
+		info = util_format_info_find(formats[f]);
+		stride = (width * format_cpp(formats[f]) + 63) & ~63;
+		bytes = format_size(formats[f], (size_t)stride * height);
+
+		for (pattern = 0; pattern <= UTIL_PATTERN_GRADIENT; pattern++) {
+			memset(reference, 0, size);
+			memset(mem, 0, size);
+			setup_planes(reference, ref_planes, stride, height);
+			setup_planes(mem, planes, stride, height);
+
+			util_pattern_set_threads(1);
+			util_fill_pattern(formats[f], pattern, ref_planes,
+					  width, height, stride);
+
+			/* Not every pattern supports every format. */
+			if (!is_filled(reference, bytes))
+				continue;
+
+			/* Enough iterations for a quarter of a gigabyte. */
+			iterations = (1u << 28) / bytes + 1;
+			if (iterations > 100)
+				iterations = 100;
+
+			util_pattern_set_threads(threads);
+			start = now();
+			for (i = 0; i < iterations; i++)
+				util_fill_pattern(formats[f], pattern, planes,
+						  width, height, stride);
+			elapsed = now() - start;
+
+			if (memcmp(reference, mem, size)) {
+				fprintf(stderr, "%s %s: threaded fill differs\n",
+					info->name, pattern_names[pattern]);
+				ret = 1;
+			}
+
+			printf("%-8s %-8s %8.2f GB/s\n", info->name,
+			       pattern_names[pattern],
+			       bytes * iterations / elapsed / 1e9);
+		}
+	}
+
+	free(reference);
+	free(mem);
+
+	return ret;
+}
@@ -0,0 +1,171 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Builds command streams referencing a growing number of distinct BOs,
+ * each relocated once in order and then again at random the way state
+ * emission revisits them, and reports how long a relocation takes. The
+ * streams are erased rather than submitted.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "xf86drm.h"
+#include "radeon_drm.h"
+#include "radeon_bo.h"
+#include "radeon_bo_gem.h"
+#include "radeon_cs.h"
+#include "radeon_cs_gem.h"
+
+static const unsigned bo_counts[] = { 10, 50, 100, 500, 1000, 5000 };
+static unsigned iterations = 100;
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void space_flush(void *data)
+{
+}
+
+static int write_reloc(struct radeon_cs *cs, struct radeon_bo *bo)
+{
+    int r;
+
+    r = radeon_cs_space_check_with_bo(cs, bo, RADEON_GEM_DOMAIN_GTT, 0);
+    if (r)
+        return r;
+    r = radeon_cs_begin(cs, 2, __FILE__, __func__, __LINE__);
+    if (r)
+        return r;
+    r = radeon_cs_write_reloc(cs, bo, RADEON_GEM_DOMAIN_GTT, 0, 0);
+    if (r)
+        return r;
+    return radeon_cs_end(cs, __FILE__, __func__, __LINE__);
+}
+
+static int run(struct radeon_bo_manager *bom, struct radeon_cs *cs,
+               unsigned nbos)
+{
+    struct radeon_bo **bos;
+    unsigned seed = nbos, i, j;
+    double start, elapsed;
+    int r = 0;
+
+    bos = calloc(nbos, sizeof(*bos));
+    if (bos == NULL)
+        return -1;
+    for (i = 0; i < nbos; i++) {
+        bos[i] = radeon_bo_open(bom, 0, 4096, 0, RADEON_GEM_DOMAIN_GTT, 0);
+        if (bos[i] == NULL) {
+            fprintf(stderr, "failed to allocate bo %u\n", i);
+            r = -1;
+            goto out;
+        }
+    }
+
+    start = now();
+    for (i = 0; i < iterations && r == 0; i++) {
+        for (j = 0; j < nbos && r == 0; j++)
+            r = write_reloc(cs, bos[j]);
+        for (j = 0; j < nbos && r == 0; j++)
+            r = write_reloc(cs, bos[rand_r(&seed) % nbos]);
+        radeon_cs_erase(cs);
+    }
+    elapsed = now() - start;
+
+    if (r == 0)
+        printf("%5u bos: %8.1f ns per relocation\n", nbos,
+               elapsed * 1e9 / (2.0 * nbos * iterations));
+    else
+        fprintf(stderr, "relocation failed with %u bos\n", nbos);
+
+out:
+    for (i = 0; i < nbos; i++) {
+        if (bos[i])
+            radeon_bo_unref(bos[i]);
+    }
+    free(bos);
+    return r;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-i iterations]\n\n", name);
+    fprintf(stderr, "\t-i <iterations>\tcommand streams built per bo count\n");
+    exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    struct radeon_bo_manager *bom;
+    struct radeon_cs_manager *csm;
+    struct radeon_cs *cs;
+    unsigned i;
+    int fd, c, r = 0;
+
+    while ((c = getopt(argc, argv, "i:h")) != -1) {
+        switch (c) {
+        case 'i':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            break;
+        }
+    }
+    if (iterations == 0)
+        usage(argv[0]);
+
+    fd = drmOpen("radeon", NULL);
+    if (fd < 0) {
+        fprintf(stderr, "failed to open radeon fd\n");
+        return 77;
+    }
+
+    bom = radeon_bo_manager_gem_ctor(fd);
+    csm = radeon_cs_manager_gem_ctor(fd);
+    cs = bom && csm ? radeon_cs_create(csm, 1024) : NULL;
+    if (cs == NULL) {
+        fprintf(stderr, "failed to create a command stream\n");
+        close(fd);
+        return 1;
+    }
+    radeon_cs_set_limit(cs, RADEON_GEM_DOMAIN_GTT, 1 << 30);
+    radeon_cs_set_limit(cs, RADEON_GEM_DOMAIN_VRAM, 1 << 30);
+    radeon_cs_space_set_flush(cs, space_flush, NULL);
+
+    for (i = 0; i < sizeof(bo_counts) / sizeof(bo_counts[0]) && r == 0; i++)
+        r = run(bom, cs, bo_counts[i]);
+
+    radeon_cs_destroy(cs);
+    radeon_cs_manager_gem_dtor(csm);
+    radeon_bo_manager_gem_dtor(bom);
+    close(fd);
+
+    return r ? 1 : 0;
+}
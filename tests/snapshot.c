@@ -0,0 +1,618 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Checks drmModeSnapshotCreate() and the lookups into a snapshot. The KMS
+ * query ioctls are intercepted below and answered from a fake device, so no
+ * DRM device is needed. The object IDs of the fake device collide in the
+ * snapshot's hash tables, one plane has more formats than fit in an arena
+ * chunk and one connector more properties than the snapshot guesses. Every
+ * ioctl is also made to fail in turn, to tear down partial snapshots. The
+ * scratch queries the snapshot is built on are checked first, reusing one
+ * scratch for smaller and larger results.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "xf86drm.h"
+#include "xf86drmMode.h"
+
+#define FAKE_FD 0x7fff
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* Object IDs that are multiples of 16 share hash buckets. */
+static const uint32_t crtcs[] = { 16, 32, 48 };
+static const uint32_t connectors[] = { 64, 80, 3, 5 };
+static const uint32_t planes[] = { 96, 112, 128, 7 };
+
+#define UNPLUGGED_CONNECTOR 3
+#define BIG_CONNECTOR 5
+#define BIG_PLANE 7
+#define BIG_PLANE_FORMATS 20000
+
+#define BIG_CONNECTOR_MODES 100
+
+#define EXTRA_PROP 100
+#define EXTRA_PROPS 100
+
+struct fake_prop {
+	uint32_t id;
+	const char *name;
+	uint32_t flags;
+	uint32_t count; /* range values or enum entries */
+};
+
+static const struct fake_prop props[] = {
+	{ 1, "ACTIVE", DRM_MODE_PROP_RANGE, 2 },
+	{ 2, "GAMMA_LUT_SIZE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE, 2 },
+	{ 10, "CRTC_ID", DRM_MODE_PROP_OBJECT, 1 },
+	{ 20, "FB_ID", DRM_MODE_PROP_OBJECT, 1 },
+	{ 21, "CRTC_ID", DRM_MODE_PROP_OBJECT, 1 },
+	{ 22, "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE, 3 },
+	{ 23, "pixel blend mode", DRM_MODE_PROP_ENUM, 40 },
+};
+
+static const uint32_t crtc_props[] = { 1, 2 };
+static const uint32_t connector_props[] = { 10 };
+static const uint32_t plane_props[] = { 20, 21, 22, 23 };
+
+#define COUNT_PROPERTIES (ARRAY_SIZE(props) + EXTRA_PROPS)
+
+static unsigned int ioctls, fail_at;
+
+static uint64_t expected_value(uint32_t obj, uint32_t prop)
+{
+	return obj * 1000 + prop;
+}
+
+static const struct fake_prop *find_prop(uint32_t prop_id,
+					 struct fake_prop *extra)
+{
+	static char name[DRM_PROP_NAME_LEN];
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(props); i++) {
+		if (props[i].id == prop_id)
+			return &props[i];
+	}
+
+	if (prop_id < EXTRA_PROP || prop_id >= EXTRA_PROP + EXTRA_PROPS)
+		return NULL;
+
+	snprintf(name, sizeof(name), "extra %u", prop_id);
+	extra->id = prop_id;
+	extra->name = name;
+	extra->flags = DRM_MODE_PROP_RANGE;
+	extra->count = 2;
+	return extra;
+}
+
+static bool contains(const uint32_t *ids, unsigned int count, uint32_t id)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (ids[i] == id)
+			return true;
+	}
+
+	return false;
+}
+
+/* Fills in the properties of an object, returns the count or -1. */
+static int object_props(uint32_t obj, uint32_t type, uint32_t *ids)
+{
+	unsigned int i;
+
+	if (type == DRM_MODE_OBJECT_CRTC && contains(crtcs, ARRAY_SIZE(crtcs), obj)) {
+		memcpy(ids, crtc_props, sizeof(crtc_props));
+		return ARRAY_SIZE(crtc_props);
+	}
+
+	if (type == DRM_MODE_OBJECT_CONNECTOR &&
+	    contains(connectors, ARRAY_SIZE(connectors), obj) &&
+	    obj != UNPLUGGED_CONNECTOR) {
+		memcpy(ids, connector_props, sizeof(connector_props));
+		if (obj != BIG_CONNECTOR)
+			return ARRAY_SIZE(connector_props);
+
+		for (i = 0; i < EXTRA_PROPS; i++)
+			ids[ARRAY_SIZE(connector_props) + i] = EXTRA_PROP + i;
+		return ARRAY_SIZE(connector_props) + EXTRA_PROPS;
+	}
+
+	if (type == DRM_MODE_OBJECT_PLANE &&
+	    contains(planes, ARRAY_SIZE(planes), obj)) {
+		memcpy(ids, plane_props, sizeof(plane_props));
+		return ARRAY_SIZE(plane_props);
+	}
+
+	return -1;
+}
+
+/* Like the kernel, only copy arrays out if they fit, and report the counts. */
+static void copy_ids(uint64_t ptr, uint32_t *count, const uint32_t *ids,
+		     uint32_t n)
+{
+	if (*count >= n && n)
+		memcpy((void *)(uintptr_t)ptr, ids, n * sizeof(*ids));
+	*count = n;
+}
+
+static int fake_ioctl(unsigned long request, void *arg)
+{
+	if (request == DRM_IOCTL_MODE_GETRESOURCES) {
+		struct drm_mode_card_res *res = arg;
+
+		copy_ids(res->crtc_id_ptr, &res->count_crtcs, crtcs,
+			 ARRAY_SIZE(crtcs));
+		copy_ids(res->connector_id_ptr, &res->count_connectors,
+			 connectors, ARRAY_SIZE(connectors));
+		res->count_fbs = 0;
+		res->count_encoders = 0;
+		res->max_width = 4096;
+		res->max_height = 4096;
+		return 0;
+	}
+
+	if (request == DRM_IOCTL_MODE_GETPLANERESOURCES) {
+		struct drm_mode_get_plane_res *res = arg;
+
+		copy_ids(res->plane_id_ptr, &res->count_planes, planes,
+			 ARRAY_SIZE(planes));
+		return 0;
+	}
+
+	if (request == DRM_IOCTL_MODE_GETPLANE) {
+		struct drm_mode_get_plane *plane = arg;
+		uint32_t *formats = (uint32_t *)(uintptr_t)plane->format_type_ptr;
+		uint32_t i, count;
+
+		if (!contains(planes, ARRAY_SIZE(planes), plane->plane_id))
+			return -ENOENT;
+
+		count = plane->plane_id == BIG_PLANE ? BIG_PLANE_FORMATS : 2;
+		if (plane->count_format_types >= count) {
+			for (i = 0; i < count; i++)
+				formats[i] = plane->plane_id + i;
+		}
+		plane->count_format_types = count;
+		plane->possible_crtcs = 1;
+		return 0;
+	}
+
+	if (request == DRM_IOCTL_MODE_OBJ_GETPROPERTIES) {
+		struct drm_mode_obj_get_properties *properties = arg;
+		uint32_t ids[ARRAY_SIZE(connector_props) + EXTRA_PROPS];
+		uint64_t *values = (uint64_t *)(uintptr_t)properties->prop_values_ptr;
+		int i, count;
+
+		count = object_props(properties->obj_id, properties->obj_type, ids);
+		if (count < 0)
+			return -ENOENT;
+
+		if (properties->count_props >= (uint32_t)count) {
+			for (i = 0; i < count; i++)
+				values[i] = expected_value(properties->obj_id, ids[i]);
+		}
+		copy_ids(properties->props_ptr, &properties->count_props, ids, count);
+		return 0;
+	}
+
+	if (request == DRM_IOCTL_MODE_GETCONNECTOR) {
+		struct drm_mode_get_connector *conn = arg;
+		uint32_t ids[ARRAY_SIZE(connector_props) + EXTRA_PROPS];
+		uint64_t *values = (uint64_t *)(uintptr_t)conn->prop_values_ptr;
+		struct drm_mode_modeinfo *modes =
+			(struct drm_mode_modeinfo *)(uintptr_t)conn->modes_ptr;
+		uint32_t encoder_id = conn->connector_id + 1;
+		int i, count, count_modes;
+
+		count = object_props(conn->connector_id,
+				     DRM_MODE_OBJECT_CONNECTOR, ids);
+		if (count < 0)
+			return -ENOENT;
+
+		count_modes = conn->connector_id == BIG_CONNECTOR ?
+			      BIG_CONNECTOR_MODES : 2;
+		if (conn->count_modes >= (uint32_t)count_modes) {
+			for (i = 0; i < count_modes; i++) {
+				memset(&modes[i], 0, sizeof(modes[i]));
+				modes[i].clock = conn->connector_id * 1000 + i;
+			}
+		}
+		conn->count_modes = count_modes;
+
+		if (conn->count_props >= (uint32_t)count) {
+			for (i = 0; i < count; i++)
+				values[i] = expected_value(conn->connector_id, ids[i]);
+		}
+		copy_ids(conn->props_ptr, &conn->count_props, ids, count);
+		copy_ids(conn->encoders_ptr, &conn->count_encoders, &encoder_id, 1);
+
+		conn->encoder_id = encoder_id;
+		conn->connection = DRM_MODE_CONNECTED;
+		return 0;
+	}
+
+	if (request == DRM_IOCTL_MODE_GETPROPERTY) {
+		struct drm_mode_get_property *out = arg;
+		const struct fake_prop *prop;
+		struct fake_prop extra;
+		uint64_t *values = (uint64_t *)(uintptr_t)out->values_ptr;
+		struct drm_mode_property_enum *enums =
+			(struct drm_mode_property_enum *)(uintptr_t)out->enum_blob_ptr;
+		uint32_t i, count_values, count_enums = 0;
+
+		prop = find_prop(out->prop_id, &extra);
+		if (!prop)
+			return -ENOENT;
+
+		count_values = prop->count;
+		if (prop->flags & DRM_MODE_PROP_ENUM)
+			count_enums = prop->count;
+
+		if (out->count_values >= count_values) {
+			for (i = 0; i < count_values; i++)
+				values[i] = i ? prop->id : 0;
+		}
+		if (out->count_enum_blobs >= count_enums) {
+			for (i = 0; i < count_enums; i++) {
+				enums[i].value = i;
+				snprintf(enums[i].name, sizeof(enums[i].name),
+					 "%u", i);
+			}
+		}
+
+		snprintf(out->name, sizeof(out->name), "%s", prop->name);
+		out->flags = prop->flags;
+		out->count_values = count_values;
+		out->count_enum_blobs = count_enums;
+		return 0;
+	}
+
+	return -ENOTTY;
+}
+
+/* Interposes the libc ioctl() used by drmIoctl(). */
+__attribute__((visibility("default")))
+int ioctl(int fd, unsigned long request, ...)
+{
+	va_list args;
+	void *arg;
+	int ret;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+
+	if (fd != FAKE_FD)
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	if (++ioctls == fail_at) {
+		errno = EIO;
+		return -1;
+	}
+
+	ret = fake_ioctl(request, arg);
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void check_property(drmModeSnapshotPtr snapshot, uint32_t obj,
+			   uint32_t prop_id)
+{
+	const struct fake_prop *expected;
+	struct fake_prop extra;
+	drmModePropertyPtr prop;
+	uint64_t value;
+
+	expected = find_prop(prop_id, &extra);
+	prop = drmModeSnapshotFindProperty(snapshot, obj, expected->name, &value);
+	if (!prop || prop->prop_id != prop_id ||
+	    value != expected_value(obj, prop_id)) {
+		fprintf(stderr, "object %u: property %s not found\n", obj,
+			expected->name);
+		exit(1);
+	}
+
+	if (prop->flags != expected->flags || strcmp(prop->name, expected->name)) {
+		fprintf(stderr, "property %u: wrong definition\n", prop_id);
+		exit(1);
+	}
+
+	if (prop->flags & DRM_MODE_PROP_ENUM) {
+		if ((uint32_t)prop->count_enums != expected->count ||
+		    prop->enums[expected->count - 1].value != expected->count - 1)
+			exit(1);
+	} else if ((uint32_t)prop->count_values != expected->count ||
+		   (prop->count_values > 1 && prop->values[1] != prop_id)) {
+		exit(1);
+	}
+}
+
+static void check_object(drmModeSnapshotPtr snapshot, uint32_t id,
+			 uint32_t type)
+{
+	drmModeSnapshotObjectPtr obj;
+	uint32_t ids[ARRAY_SIZE(connector_props) + EXTRA_PROPS];
+	int i, count;
+
+	count = object_props(id, type, ids);
+	obj = drmModeSnapshotGetObject(snapshot, id);
+
+	if (count < 0) {
+		if (obj) {
+			fprintf(stderr, "object %u: not expected\n", id);
+			exit(1);
+		}
+		return;
+	}
+
+	if (!obj || obj->object_id != id || obj->object_type != type ||
+	    obj->count_props != (uint32_t)count) {
+		fprintf(stderr, "object %u: not found\n", id);
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (obj->props[i] != ids[i] ||
+		    obj->prop_values[i] != expected_value(id, ids[i])) {
+			fprintf(stderr, "object %u: wrong property %u\n", id,
+				ids[i]);
+			exit(1);
+		}
+		check_property(snapshot, id, ids[i]);
+	}
+}
+
+static void check_snapshot(void)
+{
+	drmModeSnapshotPtr snapshot;
+	drmModePlanePtr plane;
+	unsigned int i;
+
+	snapshot = drmModeSnapshotCreate(FAKE_FD);
+	if (!snapshot) {
+		fprintf(stderr, "snapshot failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	if (snapshot->res.count_crtcs != ARRAY_SIZE(crtcs) ||
+	    snapshot->res.count_connectors != ARRAY_SIZE(connectors) ||
+	    snapshot->plane_res.count_planes != ARRAY_SIZE(planes) ||
+	    snapshot->res.max_width != 4096) {
+		fprintf(stderr, "wrong resources\n");
+		exit(1);
+	}
+
+	/* The unplugged connector is left out. */
+	if (snapshot->count_objects != ARRAY_SIZE(crtcs) +
+	    ARRAY_SIZE(connectors) - 1 + ARRAY_SIZE(planes)) {
+		fprintf(stderr, "%u objects\n", snapshot->count_objects);
+		exit(1);
+	}
+
+	/* Each property definition is only kept once. */
+	if (snapshot->count_properties != COUNT_PROPERTIES) {
+		fprintf(stderr, "%u properties\n", snapshot->count_properties);
+		exit(1);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(crtcs); i++)
+		check_object(snapshot, crtcs[i], DRM_MODE_OBJECT_CRTC);
+	for (i = 0; i < ARRAY_SIZE(connectors); i++)
+		check_object(snapshot, connectors[i], DRM_MODE_OBJECT_CONNECTOR);
+	for (i = 0; i < ARRAY_SIZE(planes); i++)
+		check_object(snapshot, planes[i], DRM_MODE_OBJECT_PLANE);
+
+	/* Missing IDs in the collision chains, and unknown names. */
+	if (drmModeSnapshotGetObject(snapshot, 144) ||
+	    drmModeSnapshotGetObject(snapshot, 160) ||
+	    drmModeSnapshotFindProperty(snapshot, 144, "ACTIVE", NULL) ||
+	    drmModeSnapshotFindProperty(snapshot, 16, "FB_ID", NULL) ||
+	    drmModeSnapshotFindProperty(snapshot, 16, "ACTIVE ", NULL) ||
+	    drmModeSnapshotFindProperty(snapshot, 16, NULL, NULL)) {
+		fprintf(stderr, "found missing object or property\n");
+		exit(1);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(planes); i++) {
+		plane = &snapshot->planes[i];
+		if (plane->plane_id != planes[i] ||
+		    plane->count_formats != (planes[i] == BIG_PLANE ?
+					     BIG_PLANE_FORMATS : 2) ||
+		    plane->formats[plane->count_formats - 1] !=
+		    planes[i] + plane->count_formats - 1) {
+			fprintf(stderr, "plane %u: wrong formats\n", planes[i]);
+			exit(1);
+		}
+	}
+
+	drmModeSnapshotFree(snapshot);
+}
+
+static void check_scratch_connector(drmModeScratchPtr scratch, uint32_t id,
+				    int probe)
+{
+	drmModeConnectorPtr conn;
+	uint32_t ids[ARRAY_SIZE(connector_props) + EXTRA_PROPS];
+	int i, count, count_modes;
+
+	if (probe)
+		conn = drmModeGetConnectorScratch(FAKE_FD, id, scratch);
+	else
+		conn = drmModeGetConnectorCurrentScratch(FAKE_FD, id, scratch);
+
+	count = object_props(id, DRM_MODE_OBJECT_CONNECTOR, ids);
+	count_modes = id == BIG_CONNECTOR ? BIG_CONNECTOR_MODES : 2;
+
+	if (!conn || conn->connector_id != id || conn->count_props != count ||
+	    conn->count_modes != count_modes || conn->count_encoders != 1 ||
+	    conn->encoders[0] != id + 1 || conn->encoder_id != id + 1) {
+		fprintf(stderr, "connector %u: wrong scratch result\n", id);
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (conn->props[i] != ids[i] ||
+		    conn->prop_values[i] != expected_value(id, ids[i]))
+			exit(1);
+	}
+
+	for (i = 0; i < count_modes; i++) {
+		if (conn->modes[i].clock != id * 1000 + i)
+			exit(1);
+	}
+}
+
+static void check_scratch_property(drmModeScratchPtr scratch, uint32_t prop_id)
+{
+	const struct fake_prop *expected;
+	struct fake_prop extra;
+	drmModePropertyPtr prop;
+	char name[DRM_PROP_NAME_LEN];
+	uint32_t count_enums;
+
+	expected = find_prop(prop_id, &extra);
+	count_enums = expected->flags & DRM_MODE_PROP_ENUM ? expected->count : 0;
+	prop = drmModeGetPropertyScratch(FAKE_FD, prop_id, scratch);
+
+	if (!prop || prop->prop_id != prop_id ||
+	    strcmp(prop->name, expected->name) ||
+	    (uint32_t)prop->count_values != expected->count ||
+	    (uint32_t)prop->count_enums != count_enums ||
+	    (!count_enums && prop->enums)) {
+		fprintf(stderr, "property %u: wrong scratch result\n", prop_id);
+		exit(1);
+	}
+
+	if (count_enums) {
+		snprintf(name, sizeof(name), "%u", count_enums - 1);
+		if (prop->enums[count_enums - 1].value != count_enums - 1 ||
+		    strcmp(prop->enums[count_enums - 1].name, name))
+			exit(1);
+	}
+}
+
+static void expect_ioctls(unsigned int expected, const char *what)
+{
+	if (ioctls != expected) {
+		fprintf(stderr, "%s: %u ioctls\n", what, ioctls);
+		exit(1);
+	}
+	ioctls = 0;
+}
+
+static void check_scratch(void)
+{
+	drmModeScratchPtr scratch;
+
+	scratch = drmModeScratchAlloc();
+	ioctls = 0;
+
+	/* Small results fit the initial hints. */
+	check_scratch_property(scratch, 22);
+	check_scratch_connector(scratch, 64, 0);
+	expect_ioctls(2, "small queries");
+
+	/* Larger ones grow the scratch and the hints... */
+	check_scratch_property(scratch, 23);
+	check_scratch_connector(scratch, BIG_CONNECTOR, 0);
+	expect_ioctls(4, "large queries");
+
+	/* ...so that they fit right away from then on. */
+	check_scratch_property(scratch, 23);
+	check_scratch_connector(scratch, BIG_CONNECTOR, 0);
+	expect_ioctls(2, "repeated large queries");
+
+	/* Smaller results in a reused scratch don't see the larger ones. */
+	check_scratch_property(scratch, 1);
+	check_scratch_property(scratch, 22);
+	check_scratch_connector(scratch, 64, 0);
+	expect_ioctls(3, "small queries after large ones");
+
+	/* Probing takes a second ioctl when there are modes. */
+	check_scratch_connector(scratch, 80, 1);
+	expect_ioctls(2, "probed connector");
+
+	if (drmModeGetConnectorCurrentScratch(FAKE_FD, UNPLUGGED_CONNECTOR,
+					      scratch) ||
+	    drmModeGetPropertyScratch(FAKE_FD, 1, NULL))
+		exit(1);
+
+	drmModeScratchFree(scratch);
+	drmModeScratchFree(NULL);
+}
+
+static void check_failures(void)
+{
+	drmModeSnapshotPtr snapshot;
+	unsigned int total;
+
+	/* Fail each ioctl of a snapshot in turn, until none is left to fail. */
+	for (fail_at = 1; ; fail_at++) {
+		ioctls = 0;
+		snapshot = drmModeSnapshotCreate(FAKE_FD);
+		total = ioctls;
+
+		/* A failing plane resources query just leaves out the planes. */
+		if (!snapshot && errno != EIO) {
+			fprintf(stderr, "ioctl %u: snapshot failed with %s\n",
+				fail_at, strerror(errno));
+			exit(1);
+		}
+
+		drmModeSnapshotFree(snapshot);
+		if (fail_at > total)
+			break;
+	}
+
+	fail_at = 0;
+	printf("snapshot: %u ioctls\n", total);
+}
+
+int main(void)
+{
+	check_scratch();
+	check_snapshot();
+	check_failures();
+
+	drmModeSnapshotFree(NULL);
+	if (drmModeSnapshotGetObject(NULL, 16) ||
+	    drmModeSnapshotFindProperty(NULL, 16, "ACTIVE", NULL))
+		return 1;
+
+	return 0;
+}
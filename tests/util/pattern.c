@@ -23,10 +23,12 @@
  * IN THE SOFTWARE.
  */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <drm_fourcc.h>
 
@@ -156,6 +158,130 @@ static uint16_t uint16_div_64k_to_half(uint16_t v)
 	 shiftcolor16(&(rgb)->blue, uint16_div_64k_to_half((b) << 6)) | \
 	 shiftcolor16(&(rgb)->alpha, uint16_div_64k_to_half((a) << 6)))
 
+/*
+ * Most patterns repeat the same few rows, or windows into the same line, so
+ * these are rendered once and the buffer is filled with copies of them row
+ * by row. Large buffers are split into stripes of rows filled in parallel.
+ */
+#define FILL_MAX_THREADS	16
+#define FILL_THREAD_BYTES	(1 << 20)
+
+static unsigned int fill_threads;
+
+struct fill_job {
+	void (*row)(const struct fill_job *job, unsigned int y);
+	unsigned int width;
+	unsigned int height;
+	unsigned char *dst;
+	unsigned int pitch;
+
+	/* Rendered rows, the band of a row picks which one is copied. */
+	const unsigned char *src;
+	unsigned int src_pitch;
+	unsigned int src_bytes;
+	unsigned int split[2];
+	unsigned int src_row[3];
+
+	/* Lines of which each row is a window. */
+	const unsigned char *line[2];
+	unsigned int cpp;
+	unsigned char *u_mem;
+	unsigned char *v_mem;
+	unsigned int chroma_pitch;
+	const struct util_yuv_info *yuv;
+
+	int value;
+};
+
+struct fill_stripe {
+	const struct fill_job *job;
+	unsigned int start, end;
+	pthread_t thread;
+};
+
+static void *fill_stripe(void *arg)
+{
+	struct fill_stripe *stripe = arg;
+	unsigned int y;
+
+	for (y = stripe->start; y < stripe->end; ++y)
+		stripe->job->row(stripe->job, y);
+
+	return NULL;
+}
+
+static unsigned int fill_thread_count(const struct fill_job *job)
+{
+	size_t size = (size_t)job->pitch * job->height;
+	unsigned int threads = fill_threads;
+	long cpus;
+
+	if (!threads) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cpus > 0 ? cpus : 1;
+	}
+
+	if (threads > FILL_MAX_THREADS)
+		threads = FILL_MAX_THREADS;
+	if (threads > size / FILL_THREAD_BYTES)
+		threads = size / FILL_THREAD_BYTES;
+	if (threads > job->height)
+		threads = job->height;
+
+	return threads ? threads : 1;
+}
+
+static void fill_rows(const struct fill_job *job)
+{
+	struct fill_stripe stripes[FILL_MAX_THREADS];
+	unsigned int threads = fill_thread_count(job);
+	unsigned int i, started;
+
+	for (i = 0; i < threads; ++i) {
+		stripes[i].job = job;
+		stripes[i].start = job->height * i / threads;
+		stripes[i].end = job->height * (i + 1) / threads;
+	}
+
+	for (started = 1; started < threads; ++started)
+		if (pthread_create(&stripes[started].thread, NULL,
+				   fill_stripe, &stripes[started]))
+			break;
+
+	/* The caller fills the first stripe and those without a thread. */
+	fill_stripe(&stripes[0]);
+	for (i = started; i < threads; ++i)
+		fill_stripe(&stripes[i]);
+
+	for (i = 1; i < started; ++i)
+		pthread_join(stripes[i].thread, NULL);
+}
+
+/* Copies the rendered row of the band the row falls into. */
+static void band_row(const struct fill_job *job, unsigned int y)
+{
+	unsigned int band = y < job->split[0] ? 0 : y < job->split[1] ? 1 : 2;
+
+	memcpy(job->dst + y * job->pitch,
+	       job->src + job->src_row[band] * job->src_pitch, job->src_bytes);
+}
+
+static unsigned int format_planes(const struct util_format_info *info)
+{
+	switch (info->format) {
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_NV21:
+	case DRM_FORMAT_NV16:
+	case DRM_FORMAT_NV61:
+		return 2;
+	case DRM_FORMAT_YUV420:
+	case DRM_FORMAT_YVU420:
+		return 3;
+	default:
+		return 1;
+	}
+}
+
 static void fill_smpte_yuv_planar(const struct util_yuv_info *yuv,
 				  unsigned char *y_mem, unsigned char *u_mem,
 				  unsigned char *v_mem, unsigned int width,
@@ -678,21 +804,27 @@ void util_smpte_c8_gamma(unsigned size, struct drm_color_lut *lut)
 #undef FILL_COLOR
 }
 
-static void fill_smpte(const struct util_format_info *info, void *planes[3],
-		       unsigned int width, unsigned int height,
-		       unsigned int stride)
+/*
+ * Returns the bytes written to each row of the first plane, or 0 for
+ * unsupported formats.
+ */
+static unsigned int fill_smpte_direct(const struct util_format_info *info,
+				      void *planes[3], unsigned int width,
+				      unsigned int height, unsigned int stride)
 {
 	unsigned char *u, *v;
 
 	switch (info->format) {
 	case DRM_FORMAT_C8:
-		return fill_smpte_c8(planes[0], width, height, stride);
+		fill_smpte_c8(planes[0], width, height, stride);
+		return width;
 	case DRM_FORMAT_UYVY:
 	case DRM_FORMAT_VYUY:
 	case DRM_FORMAT_YUYV:
 	case DRM_FORMAT_YVYU:
-		return fill_smpte_yuv_packed(&info->yuv, planes[0], width,
-					     height, stride);
+		fill_smpte_yuv_packed(&info->yuv, planes[0], width,
+				      height, stride);
+		return width * 2;
 
 	case DRM_FORMAT_NV12:
 	case DRM_FORMAT_NV21:
@@ -700,16 +832,19 @@ static void fill_smpte(const struct util_format_info *info, void *planes[3],
 	case DRM_FORMAT_NV61:
 		u = info->yuv.order & YUV_YCbCr ? planes[1] : planes[1] + 1;
 		v = info->yuv.order & YUV_YCrCb ? planes[1] : planes[1] + 1;
-		return fill_smpte_yuv_planar(&info->yuv, planes[0], u, v,
-					     width, height, stride);
+		fill_smpte_yuv_planar(&info->yuv, planes[0], u, v,
+				      width, height, stride);
+		return width;
 
 	case DRM_FORMAT_YUV420:
-		return fill_smpte_yuv_planar(&info->yuv, planes[0], planes[1],
-					     planes[2], width, height, stride);
+		fill_smpte_yuv_planar(&info->yuv, planes[0], planes[1],
+				      planes[2], width, height, stride);
+		return width;
 
 	case DRM_FORMAT_YVU420:
-		return fill_smpte_yuv_planar(&info->yuv, planes[0], planes[2],
-					     planes[1], width, height, stride);
+		fill_smpte_yuv_planar(&info->yuv, planes[0], planes[2],
+				      planes[1], width, height, stride);
+		return width;
 
 	case DRM_FORMAT_ARGB4444:
 	case DRM_FORMAT_XRGB4444:
@@ -729,13 +864,15 @@ static void fill_smpte(const struct util_format_info *info, void *planes[3],
 	case DRM_FORMAT_RGBX5551:
 	case DRM_FORMAT_BGRA5551:
 	case DRM_FORMAT_BGRX5551:
-		return fill_smpte_rgb16(&info->rgb, planes[0],
-					width, height, stride);
+		fill_smpte_rgb16(&info->rgb, planes[0],
+				 width, height, stride);
+		return width * 2;
 
 	case DRM_FORMAT_BGR888:
 	case DRM_FORMAT_RGB888:
-		return fill_smpte_rgb24(&info->rgb, planes[0],
-					width, height, stride);
+		fill_smpte_rgb24(&info->rgb, planes[0],
+				 width, height, stride);
+		return width * 3;
 	case DRM_FORMAT_ARGB8888:
 	case DRM_FORMAT_XRGB8888:
 	case DRM_FORMAT_ABGR8888:
@@ -752,16 +889,92 @@ static void fill_smpte(const struct util_format_info *info, void *planes[3],
 	case DRM_FORMAT_RGBX1010102:
 	case DRM_FORMAT_BGRA1010102:
 	case DRM_FORMAT_BGRX1010102:
-		return fill_smpte_rgb32(&info->rgb, planes[0],
-					width, height, stride);
+		fill_smpte_rgb32(&info->rgb, planes[0],
+				 width, height, stride);
+		return width * 4;
 
 	case DRM_FORMAT_XRGB16161616F:
 	case DRM_FORMAT_XBGR16161616F:
 	case DRM_FORMAT_ARGB16161616F:
 	case DRM_FORMAT_ABGR16161616F:
-		return fill_smpte_rgb16fp(&info->rgb, planes[0],
-					  width, height, stride);
+		fill_smpte_rgb16fp(&info->rgb, planes[0],
+				   width, height, stride);
+		return width * 8;
 	}
+
+	return 0;
+}
+
+/*
+ * The SMPTE pattern has three bands of identical rows. They are rendered
+ * into a buffer just high enough for one row of each, in every plane.
+ */
+static void fill_smpte(const struct util_format_info *info, void *planes[3],
+		       unsigned int width, unsigned int height,
+		       unsigned int stride)
+{
+	unsigned int count = format_planes(info);
+	unsigned int ysub = count > 1 ? info->yuv.ysub : 1;
+	unsigned int rows = 9 * ysub;
+	unsigned int chroma_pitch = 0, chroma_rows = 0;
+	unsigned char *scratch;
+	void *scratch_planes[3];
+	struct fill_job job;
+	unsigned int i, bytes;
+
+	if (count > 1) {
+		chroma_pitch = stride * info->yuv.chroma_stride / info->yuv.xsub;
+		chroma_rows = height / ysub;
+	}
+
+	/* Packed YUV writes a byte past the row of an odd width. */
+	scratch = height > rows ?
+		  calloc(1, rows * stride + 2 * 9 * chroma_pitch + 4) : NULL;
+	if (!scratch) {
+		fill_smpte_direct(info, planes, width, height, stride);
+		return;
+	}
+
+	scratch_planes[0] = scratch;
+	scratch_planes[1] = scratch + rows * stride;
+	scratch_planes[2] = scratch_planes[1] + 9 * chroma_pitch;
+	bytes = fill_smpte_direct(info, scratch_planes, width, rows, stride);
+	if (!bytes) {
+		free(scratch);
+		return;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.row = band_row;
+	job.width = width;
+	job.height = height;
+	job.dst = planes[0];
+	job.pitch = stride;
+	job.src = scratch_planes[0];
+	job.src_pitch = stride;
+	job.src_bytes = bytes;
+	job.split[0] = height * 6 / 9;
+	job.split[1] = height * 7 / 9;
+	job.src_row[1] = 6 * ysub;
+	job.src_row[2] = 7 * ysub;
+	fill_rows(&job);
+
+	for (i = 1; i < count; ++i) {
+		job.height = chroma_rows;
+		job.dst = planes[i];
+		job.pitch = chroma_pitch;
+		job.src = scratch_planes[i];
+		job.src_pitch = chroma_pitch;
+		job.src_bytes = (width + info->yuv.xsub - 1) / info->yuv.xsub *
+				info->yuv.chroma_stride;
+		job.split[0] = chroma_rows * 6 / 9;
+		job.split[1] = chroma_rows * 7 / 9;
+		job.src_row[1] = 6;
+		job.src_row[2] = 7;
+		fill_rows(&job);
+	}
+
+	free(scratch);
 }
 
 /* swap these for big endian.. */
@@ -839,38 +1052,101 @@ static void make_pwetty(void *data, unsigned int width, unsigned int height,
 #endif
 }
 
+/*
+ * The tiles pattern only depends on x + y, so each row is a window into a
+ * line of width + height pixels, converted to the format up front.
+ */
+static uint32_t tiles_color(unsigned int k, unsigned int width)
+{
+	div_t d = div(k, width);
+
+	return 0x00130502 * (d.quot >> 6) + 0x000a1120 * (d.rem >> 6);
+}
+
+static struct color_yuv tiles_color_yuv(unsigned int k, unsigned int width)
+{
+	uint32_t rgb32 = tiles_color(k, width);
+	struct color_yuv color =
+		MAKE_YUV_601((rgb32 >> 16) & 0xff, (rgb32 >> 8) & 0xff,
+			     rgb32 & 0xff);
+
+	return color;
+}
+
+static void tiles_yuv_planar_row(const struct fill_job *job, unsigned int y)
+{
+	const struct color_yuv *colors = (const void *)job->line[1];
+	const struct util_yuv_info *yuv = job->yuv;
+	unsigned int cs = yuv->chroma_stride;
+	unsigned char *u_mem, *v_mem;
+	unsigned int x, k;
+
+	memcpy(job->dst + y * job->pitch, job->line[0] + y, job->width);
+
+	/* The chroma of the last row of each group of ysub rows is kept. */
+	if ((y + 1) % yuv->ysub && y != job->height - 1)
+		return;
+
+	u_mem = job->u_mem + y / yuv->ysub * job->chroma_pitch;
+	v_mem = job->v_mem + y / yuv->ysub * job->chroma_pitch;
+	for (k = 0; k * yuv->xsub < job->width; ++k) {
+		x = k * yuv->xsub + yuv->xsub - 1;
+		if (x >= job->width)
+			x = job->width - 1;
+
+		u_mem[k * cs] = colors[x + y].u;
+		v_mem[k * cs] = colors[x + y].v;
+	}
+}
+
 static void fill_tiles_yuv_planar(const struct util_format_info *info,
 				  unsigned char *y_mem, unsigned char *u_mem,
 				  unsigned char *v_mem, unsigned int width,
 				  unsigned int height, unsigned int stride)
 {
-	const struct util_yuv_info *yuv = &info->yuv;
-	unsigned int cs = yuv->chroma_stride;
-	unsigned int xsub = yuv->xsub;
-	unsigned int ysub = yuv->ysub;
-	unsigned int x;
-	unsigned int y;
-
-	for (y = 0; y < height; ++y) {
-		for (x = 0; x < width; ++x) {
-			div_t d = div(x+y, width);
-			uint32_t rgb32 = 0x00130502 * (d.quot >> 6)
-				       + 0x000a1120 * (d.rem >> 6);
-			struct color_yuv color =
-				MAKE_YUV_601((rgb32 >> 16) & 0xff,
-					     (rgb32 >> 8) & 0xff, rgb32 & 0xff);
-
-			y_mem[x] = color.y;
-			u_mem[x/xsub*cs] = color.u;
-			v_mem[x/xsub*cs] = color.v;
-		}
+	unsigned int length = width + height;
+	struct color_yuv *colors;
+	unsigned char *luma;
+	struct fill_job job;
+	unsigned int k;
+
+	luma = malloc(length * (1 + sizeof(*colors)));
+	if (!luma) {
+		printf("Error: failed to allocate the tiles pattern.\n");
+		return;
+	}
+	colors = (struct color_yuv *)(luma + length);
 
-		y_mem += stride;
-		if ((y + 1) % ysub == 0) {
-			u_mem += stride * cs / xsub;
-			v_mem += stride * cs / xsub;
-		}
+	for (k = 0; k < length; ++k) {
+		colors[k] = tiles_color_yuv(k, width);
+		luma[k] = colors[k].y;
 	}
+
+	memset(&job, 0, sizeof(job));
+	job.row = tiles_yuv_planar_row;
+	job.width = width;
+	job.height = height;
+	job.dst = y_mem;
+	job.pitch = stride;
+	job.line[0] = luma;
+	job.line[1] = (const unsigned char *)colors;
+	job.u_mem = u_mem;
+	job.v_mem = v_mem;
+	job.chroma_pitch = stride * info->yuv.chroma_stride / info->yuv.xsub;
+	job.yuv = &info->yuv;
+	fill_rows(&job);
+
+	free(luma);
+}
+
+/*
+ * Each pair of pixels takes its color from the even one, so rows starting
+ * at an odd y use the odd half of the line.
+ */
+static void tiles_yuv_packed_row(const struct fill_job *job, unsigned int y)
+{
+	memcpy(job->dst + y * job->pitch, job->line[y & 1] + (y >> 1) * 4,
+	       (job->width + 1) / 2 * 4);
 }
 
 static void fill_tiles_yuv_packed(const struct util_format_info *info,
@@ -878,132 +1154,132 @@ static void fill_tiles_yuv_packed(const struct util_format_info *info,
 				  unsigned int height, unsigned int stride)
 {
 	const struct util_yuv_info *yuv = &info->yuv;
-	unsigned char *y_mem = (yuv->order & YUV_YC) ? mem : mem + 1;
-	unsigned char *c_mem = (yuv->order & YUV_CY) ? mem : mem + 1;
+	unsigned int y_offset = (yuv->order & YUV_YC) ? 0 : 1;
+	unsigned int c_offset = (yuv->order & YUV_CY) ? 0 : 1;
 	unsigned int u = (yuv->order & YUV_YCrCb) ? 2 : 0;
 	unsigned int v = (yuv->order & YUV_YCbCr) ? 2 : 0;
-	unsigned int x;
-	unsigned int y;
-
-	for (y = 0; y < height; ++y) {
-		for (x = 0; x < width; x += 2) {
-			div_t d = div(x+y, width);
-			uint32_t rgb32 = 0x00130502 * (d.quot >> 6)
-				       + 0x000a1120 * (d.rem >> 6);
-			struct color_yuv color =
-				MAKE_YUV_601((rgb32 >> 16) & 0xff,
-					     (rgb32 >> 8) & 0xff, rgb32 & 0xff);
-
-			y_mem[2*x] = color.y;
-			c_mem[2*x+u] = color.u;
-			y_mem[2*x+2] = color.y;
-			c_mem[2*x+v] = color.v;
-		}
-
-		y_mem += stride;
-		c_mem += stride;
+	unsigned int half = (width + height) / 2 + 1;
+	unsigned char *line, *pixel;
+	struct color_yuv color;
+	struct fill_job job;
+	unsigned int k;
+
+	line = malloc(2 * half * 4);
+	if (!line) {
+		printf("Error: failed to allocate the tiles pattern.\n");
+		return;
 	}
-}
 
-static void fill_tiles_rgb16(const struct util_format_info *info, void *mem,
-			     unsigned int width, unsigned int height,
-			     unsigned int stride)
-{
-	const struct util_rgb_info *rgb = &info->rgb;
-	void *mem_base = mem;
-	unsigned int x, y;
-
-	for (y = 0; y < height; ++y) {
-		for (x = 0; x < width; ++x) {
-			div_t d = div(x+y, width);
-			uint32_t rgb32 = 0x00130502 * (d.quot >> 6)
-				       + 0x000a1120 * (d.rem >> 6);
-			uint16_t color =
-				MAKE_RGBA(rgb, (rgb32 >> 16) & 0xff,
-					  (rgb32 >> 8) & 0xff, rgb32 & 0xff,
-					  255);
-
-			((uint16_t *)mem)[x] = color;
-		}
-		mem += stride;
+	for (k = 0; k < 2 * half; ++k) {
+		color = tiles_color_yuv(k, width);
+		pixel = line + ((k & 1) * half + (k >> 1)) * 4;
+		pixel[y_offset] = color.y;
+		pixel[c_offset + u] = color.u;
+		pixel[y_offset + 2] = color.y;
+		pixel[c_offset + v] = color.v;
 	}
 
-	make_pwetty(mem_base, width, height, stride, info->format);
+	memset(&job, 0, sizeof(job));
+	job.row = tiles_yuv_packed_row;
+	job.width = width;
+	job.height = height;
+	job.dst = mem;
+	job.pitch = stride;
+	job.line[0] = line;
+	job.line[1] = line + half * 4;
+	fill_rows(&job);
+
+	free(line);
 }
 
-static void fill_tiles_rgb24(const struct util_format_info *info, void *mem,
-			     unsigned int width, unsigned int height,
-			     unsigned int stride)
+/*
+ * The top left quarter of formats with alpha is translucent, those rows
+ * start in the translucent line and continue in the opaque one.
+ */
+static void tiles_rgb_row(const struct fill_job *job, unsigned int y)
 {
-	const struct util_rgb_info *rgb = &info->rgb;
-	unsigned int x, y;
-
-	for (y = 0; y < height; ++y) {
-		for (x = 0; x < width; ++x) {
-			div_t d = div(x+y, width);
-			uint32_t rgb32 = 0x00130502 * (d.quot >> 6)
-				       + 0x000a1120 * (d.rem >> 6);
-			struct color_rgb24 color =
-				MAKE_RGB24(rgb, (rgb32 >> 16) & 0xff,
-					   (rgb32 >> 8) & 0xff, rgb32 & 0xff);
-
-			((struct color_rgb24 *)mem)[x] = color;
-		}
-		mem += stride;
+	unsigned char *dst = job->dst + y * job->pitch;
+	unsigned int cpp = job->cpp;
+	unsigned int half = job->width / 2 * cpp;
+
+	if (job->line[1] && y < job->height / 2) {
+		memcpy(dst, job->line[1] + y * cpp, half);
+		memcpy(dst + half, job->line[0] + y * cpp + half,
+		       job->width * cpp - half);
+	} else {
+		memcpy(dst, job->line[0] + y * cpp, job->width * cpp);
 	}
 }
 
-static void fill_tiles_rgb32(const struct util_format_info *info, void *mem,
-			     unsigned int width, unsigned int height,
-			     unsigned int stride)
+static void tiles_rgb_line(const struct util_rgb_info *rgb, void *line,
+			   unsigned int cpp, unsigned int width,
+			   unsigned int length, uint32_t alpha)
 {
-	const struct util_rgb_info *rgb = &info->rgb;
-	void *mem_base = mem;
-	unsigned int x, y;
-
-	for (y = 0; y < height; ++y) {
-		for (x = 0; x < width; ++x) {
-			div_t d = div(x+y, width);
-			uint32_t rgb32 = 0x00130502 * (d.quot >> 6)
-				       + 0x000a1120 * (d.rem >> 6);
-			uint32_t alpha = ((y < height/2) && (x < width/2)) ? 127 : 255;
-			uint32_t color =
-				MAKE_RGBA(rgb, (rgb32 >> 16) & 0xff,
-					  (rgb32 >> 8) & 0xff, rgb32 & 0xff,
-					  alpha);
-
-			((uint32_t *)mem)[x] = color;
+	unsigned int k;
+
+	for (k = 0; k < length; ++k) {
+		uint32_t rgb32 = tiles_color(k, width);
+		uint32_t r = (rgb32 >> 16) & 0xff;
+		uint32_t g = (rgb32 >> 8) & 0xff;
+		uint32_t b = rgb32 & 0xff;
+
+		switch (cpp) {
+		case 2:
+			((uint16_t *)line)[k] = MAKE_RGBA(rgb, r, g, b, alpha);
+			break;
+		case 3: {
+			struct color_rgb24 color = MAKE_RGB24(rgb, r, g, b);
+
+			((struct color_rgb24 *)line)[k] = color;
+			break;
+		}
+		case 4:
+			((uint32_t *)line)[k] = MAKE_RGBA(rgb, r, g, b, alpha);
+			break;
+		case 8:
+			/* TODO: Give this actual fp16 precision */
+			((uint64_t *)line)[k] =
+				MAKE_RGBA8FP16(rgb, r, g, b, alpha);
+			break;
 		}
-		mem += stride;
 	}
-
-	make_pwetty(mem_base, width, height, stride, info->format);
 }
 
-static void fill_tiles_rgb16fp(const struct util_format_info *info, void *mem,
-			       unsigned int width, unsigned int height,
-			       unsigned int stride)
+static void fill_tiles_rgb(const struct util_format_info *info, void *mem,
+			   unsigned int cpp, unsigned int width,
+			   unsigned int height, unsigned int stride)
 {
-	const struct util_rgb_info *rgb = &info->rgb;
-	void *mem_base = mem;
-	unsigned int x, y;
-
-	/* TODO: Give this actual fp16 precision */
-	for (y = 0; y < height; ++y) {
-		for (x = 0; x < width; ++x) {
-			div_t d = div(x+y, width);
-			uint32_t rgb32 = 0x00130502 * (d.quot >> 6)
-				       + 0x000a1120 * (d.rem >> 6);
-			uint32_t alpha = ((y < height/2) && (x < width/2)) ? 127 : 255;
-			uint64_t color =
-				MAKE_RGBA8FP16(rgb, (rgb32 >> 16) & 0xff,
-					       (rgb32 >> 8) & 0xff, rgb32 & 0xff,
-					       alpha);
-
-			((uint64_t *)mem)[x] = color;
-		}
-		mem += stride;
+	/* 16 and 24 bpp formats are opaque all over. */
+	unsigned int lines = cpp >= 4 ? 2 : 1;
+	unsigned int length = width + height;
+	struct fill_job job;
+	unsigned char *line;
+
+	line = malloc(lines * length * cpp);
+	if (!line) {
+		printf("Error: failed to allocate the tiles pattern.\n");
+		return;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.row = tiles_rgb_row;
+	job.width = width;
+	job.height = height;
+	job.dst = mem;
+	job.pitch = stride;
+	job.cpp = cpp;
+	job.line[0] = line;
+	tiles_rgb_line(&info->rgb, line, cpp, width, length, 255);
+	if (lines > 1) {
+		job.line[1] = line + length * cpp;
+		tiles_rgb_line(&info->rgb, line + length * cpp, cpp, width,
+			       length, 127);
 	}
+	fill_rows(&job);
+
+	free(line);
+
+	make_pwetty(mem, width, height, stride, info->format);
 }
 
 static void fill_tiles(const struct util_format_info *info, void *planes[3],
@@ -1055,13 +1331,13 @@ static void fill_tiles(const struct util_format_info *info, void *planes[3],
 	case DRM_FORMAT_RGBX5551:
 	case DRM_FORMAT_BGRA5551:
 	case DRM_FORMAT_BGRX5551:
-		return fill_tiles_rgb16(info, planes[0],
-					width, height, stride);
+		return fill_tiles_rgb(info, planes[0], 2,
+				      width, height, stride);
 
 	case DRM_FORMAT_BGR888:
 	case DRM_FORMAT_RGB888:
-		return fill_tiles_rgb24(info, planes[0],
-					width, height, stride);
+		return fill_tiles_rgb(info, planes[0], 3,
+				      width, height, stride);
 	case DRM_FORMAT_ARGB8888:
 	case DRM_FORMAT_XRGB8888:
 	case DRM_FORMAT_ABGR8888:
@@ -1078,34 +1354,49 @@ static void fill_tiles(const struct util_format_info *info, void *planes[3],
 	case DRM_FORMAT_RGBX1010102:
 	case DRM_FORMAT_BGRA1010102:
 	case DRM_FORMAT_BGRX1010102:
-		return fill_tiles_rgb32(info, planes[0],
-					width, height, stride);
+		return fill_tiles_rgb(info, planes[0], 4,
+				      width, height, stride);
 
 	case DRM_FORMAT_XRGB16161616F:
 	case DRM_FORMAT_XBGR16161616F:
 	case DRM_FORMAT_ARGB16161616F:
 	case DRM_FORMAT_ABGR16161616F:
-		return fill_tiles_rgb16fp(info, planes[0],
-					  width, height, stride);
+		return fill_tiles_rgb(info, planes[0], 8,
+				      width, height, stride);
 	}
 }
 
+static void plain_row(const struct fill_job *job, unsigned int y)
+{
+	memset(job->dst + y * job->pitch, job->value, job->pitch);
+}
+
 static void fill_plain(const struct util_format_info *info, void *planes[3],
 		       unsigned int height,
 		       unsigned int stride)
 {
+	struct fill_job job;
+
+	memset(&job, 0, sizeof(job));
+	job.row = plain_row;
+	job.height = height;
+	job.dst = planes[0];
+	job.pitch = stride;
+
 	switch (info->format) {
 	case DRM_FORMAT_XRGB16161616F:
 	case DRM_FORMAT_XBGR16161616F:
 	case DRM_FORMAT_ARGB16161616F:
 	case DRM_FORMAT_ABGR16161616F:
 		/* 0x3838 = 0.5273 */
-		memset(planes[0], 0x38, stride * height);
+		job.value = 0x38;
 		break;
 	default:
-		memset(planes[0], 0x77, stride * height);
+		job.value = 0x77;
 		break;
 	}
+
+	fill_rows(&job);
 }
 
 static void fill_gradient_rgb32(const struct util_rgb_info *rgb,
@@ -1188,10 +1479,13 @@ static void fill_gradient_rgb16fp(const struct util_rgb_info *rgb,
  * where this matters, the pattern actually emits stripes 2-pixels
  * wide for each gradient color. Otherwise the difference may be a bit
  * hard to notice.
+ *
+ * Returns the bytes written to each row, or 0 for unsupported formats. An
+ * odd width leaves the last pixel alone.
  */
-static void fill_gradient(const struct util_format_info *info, void *planes[3],
-			  unsigned int width, unsigned int height,
-			  unsigned int stride)
+static unsigned int fill_gradient_direct(const struct util_format_info *info,
+					 void *planes[3], unsigned int width,
+					 unsigned int height, unsigned int stride)
 {
 	switch (info->format) {
 	case DRM_FORMAT_ARGB8888:
@@ -1210,16 +1504,60 @@ static void fill_gradient(const struct util_format_info *info, void *planes[3],
 	case DRM_FORMAT_RGBX1010102:
 	case DRM_FORMAT_BGRA1010102:
 	case DRM_FORMAT_BGRX1010102:
-		return fill_gradient_rgb32(&info->rgb, planes[0],
-					   width, height, stride);
+		fill_gradient_rgb32(&info->rgb, planes[0],
+				    width, height, stride);
+		return width / 2 * 8;
 
 	case DRM_FORMAT_XRGB16161616F:
 	case DRM_FORMAT_XBGR16161616F:
 	case DRM_FORMAT_ARGB16161616F:
 	case DRM_FORMAT_ABGR16161616F:
-		return fill_gradient_rgb16fp(&info->rgb, planes[0],
-					     width, height, stride);
+		fill_gradient_rgb16fp(&info->rgb, planes[0],
+				      width, height, stride);
+		return width / 2 * 16;
 	}
+
+	return 0;
+}
+
+/* All rows of each half of the gradient are the same. */
+static void fill_gradient(const struct util_format_info *info, void *planes[3],
+			  unsigned int width, unsigned int height,
+			  unsigned int stride)
+{
+	void *scratch_planes[3] = { NULL, };
+	unsigned char *scratch;
+	struct fill_job job;
+	unsigned int bytes;
+
+	scratch = height > 2 ? calloc(2, stride) : NULL;
+	if (!scratch) {
+		fill_gradient_direct(info, planes, width, height, stride);
+		return;
+	}
+
+	scratch_planes[0] = scratch;
+	bytes = fill_gradient_direct(info, scratch_planes, width, 2, stride);
+	if (!bytes) {
+		free(scratch);
+		return;
+	}
+
+	memset(&job, 0, sizeof(job));
+	job.row = band_row;
+	job.width = width;
+	job.height = height;
+	job.dst = planes[0];
+	job.pitch = stride;
+	job.src = scratch;
+	job.src_pitch = stride;
+	job.src_bytes = bytes;
+	job.split[0] = height / 2;
+	job.split[1] = height / 2;
+	job.src_row[2] = 1;
+	fill_rows(&job);
+
+	free(scratch);
 }
 
 /*
@@ -1263,6 +1601,18 @@ void util_fill_pattern(uint32_t format, enum util_fill_pattern pattern,
 	}
 }
 
+/*
+ * util_pattern_set_threads - Set the number of threads filling patterns
+ * @threads: Maximum number of threads, 0 for one per online CPU
+ *
+ * Buffers are only split between threads once they are large enough for
+ * that to pay off.
+ */
+void util_pattern_set_threads(unsigned int threads)
+{
+	fill_threads = threads;
+}
+
 static const char *pattern_names[] = {
 	[UTIL_PATTERN_TILES] = "tiles",
 	[UTIL_PATTERN_SMPTE] = "smpte",
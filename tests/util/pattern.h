@@ -43,4 +43,6 @@ void util_smpte_c8_gamma(unsigned size, struct drm_color_lut *lut);
 
 enum util_fill_pattern util_pattern_enum(const char *name);
 
+void util_pattern_set_threads(unsigned int threads);
+
 #endif /* UTIL_PATTERN_H */
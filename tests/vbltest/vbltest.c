@@ -33,6 +33,7 @@
 #include <errno.h>
 #include <poll.h>
 #include <sys/time.h>
+#include <time.h>
 #if HAVE_SYS_SELECT_H
 #include <sys/select.h>
 #endif
@@ -45,7 +46,7 @@
 
 extern char *optarg;
 extern int optind, opterr, optopt;
-static char optstr[] = "D:M:s";
+static char optstr[] = "D:j:M:s";
 
 int secondary = 0;
 
@@ -82,12 +83,246 @@ static void vblank_handler(int fd, unsigned int frame, unsigned int sec,
 	}
 }
 
+/*
+ * Jitter analysis: every event is stamped on arrival, so the interval
+ * between the vblank timestamps of consecutive events gives the jitter, and
+ * the difference between arrival and vblank timestamp the delivery delay.
+ * Both are in CLOCK_MONOTONIC, as is the cost of each queueing ioctl.
+ */
+struct vbl_sample {
+	uint64_t vblank_ns;
+	uint64_t arrival_ns;
+	uint64_t queue_ns;
+	uint64_t sequence;
+};
+
+struct vbl_analysis {
+	struct vbl_sample *samples;
+	unsigned int count, frames;
+	uint64_t queue_ns;
+	uint32_t crtc_id;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int queue_vblank(int fd, struct vbl_analysis *analysis)
+{
+	uint64_t start = now_ns();
+	drmVBlank vbl;
+	int ret;
+
+	vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT;
+	if (secondary)
+		vbl.request.type |= DRM_VBLANK_SECONDARY;
+	vbl.request.sequence = 1;
+	vbl.request.signal = (unsigned long)analysis;
+	ret = drmWaitVBlank(fd, &vbl);
+
+	analysis->queue_ns = now_ns() - start;
+	return ret;
+}
+
+static int queue_sequence(int fd, struct vbl_analysis *analysis)
+{
+	uint64_t start = now_ns();
+	int ret;
+
+	ret = drmCrtcQueueSequence(fd, analysis->crtc_id,
+				   DRM_CRTC_SEQUENCE_RELATIVE, 1, NULL,
+				   (uint64_t)(uintptr_t)analysis);
+
+	analysis->queue_ns = now_ns() - start;
+	return ret;
+}
+
+static void record_sample(struct vbl_analysis *analysis, uint64_t sequence,
+			  uint64_t vblank_ns)
+{
+	struct vbl_sample *sample = &analysis->samples[analysis->count++];
+
+	sample->arrival_ns = now_ns();
+	sample->vblank_ns = vblank_ns;
+	sample->queue_ns = analysis->queue_ns;
+	sample->sequence = sequence;
+}
+
+static void analysis_vblank_handler(int fd, unsigned int frame,
+				    unsigned int sec, unsigned int usec,
+				    void *data)
+{
+	struct vbl_analysis *analysis = data;
+
+	record_sample(analysis, frame, sec * 1000000000ull + usec * 1000ull);
+	if (analysis->count < analysis->frames &&
+	    queue_vblank(fd, analysis))
+		fprintf(stderr, "drmWaitVBlank (relative, event) failed\n");
+}
+
+static void analysis_sequence_handler(int fd, uint64_t sequence, uint64_t ns,
+				      uint64_t user_data)
+{
+	struct vbl_analysis *analysis = (void *)(uintptr_t)user_data;
+
+	record_sample(analysis, sequence, ns);
+	if (analysis->count < analysis->frames &&
+	    queue_sequence(fd, analysis))
+		fprintf(stderr, "drmCrtcQueueSequence failed\n");
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *name, uint64_t *values,
+			      unsigned int count)
+{
+	qsort(values, count, sizeof(*values), compare_u64);
+	printf("  %-16s p50 %9.1fus  p90 %9.1fus  p99 %9.1fus  max %9.1fus\n",
+	       name, values[count / 2] / 1e3, values[count * 9 / 10] / 1e3,
+	       values[count * 99 / 100] / 1e3, values[count - 1] / 1e3);
+}
+
+static void print_analysis(const char *api, struct vbl_analysis *analysis)
+{
+	struct vbl_sample *samples = analysis->samples;
+	unsigned int i, count = analysis->count;
+	uint64_t *values, period, skipped = 0;
+	int64_t delta;
+
+	if (count < 3) {
+		printf("%s: not enough events\n", api);
+		return;
+	}
+
+	values = malloc(count * sizeof(*values));
+	if (!values)
+		return;
+
+	/* The median interval serves as the nominal refresh period. */
+	for (i = 1; i < count; i++) {
+		values[i - 1] = samples[i].vblank_ns - samples[i - 1].vblank_ns;
+		skipped += samples[i].sequence - samples[i - 1].sequence - 1;
+	}
+	qsort(values, count - 1, sizeof(*values), compare_u64);
+	period = values[(count - 1) / 2];
+
+	printf("%s: %u events, period %.3fms (%.02fHz), %llu vblanks skipped\n",
+	       api, count, period / 1e6, 1e9 / period,
+	       (unsigned long long)skipped);
+
+	for (i = 1; i < count; i++) {
+		delta = samples[i].vblank_ns - samples[i - 1].vblank_ns -
+			period * (samples[i].sequence - samples[i - 1].sequence);
+		values[i - 1] = delta < 0 ? -delta : delta;
+	}
+	print_percentiles("jitter", values, count - 1);
+
+	/* A corrected vblank timestamp can be later than the arrival. */
+	for (i = 0; i < count; i++) {
+		delta = samples[i].arrival_ns - samples[i].vblank_ns;
+		values[i] = delta < 0 ? 0 : delta;
+	}
+	print_percentiles("delivery delay", values, count);
+
+	for (i = 0; i < count; i++)
+		values[i] = samples[i].queue_ns;
+	print_percentiles("queue overhead", values, count);
+
+	free(values);
+}
+
+static int analyze(int fd, const char *api, struct vbl_analysis *analysis,
+		   int (*queue)(int fd, struct vbl_analysis *analysis))
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	drmEventContext evctx;
+	int ret;
+
+	memset(&evctx, 0, sizeof evctx);
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.vblank_handler = analysis_vblank_handler;
+	evctx.sequence_handler = analysis_sequence_handler;
+
+	analysis->count = 0;
+	ret = queue(fd, analysis);
+	if (ret) {
+		printf("%s: queueing failed: %s\n", api, strerror(errno));
+		return ret;
+	}
+
+	while (analysis->count < analysis->frames) {
+		ret = poll(&pfd, 1, 3000);
+		if (ret <= 0) {
+			fprintf(stderr, "poll timed out or error (ret %d)\n",
+				ret);
+			return -1;
+		}
+
+		ret = drmHandleEvent(fd, &evctx);
+		if (ret != 0) {
+			printf("drmHandleEvent failed: %i\n", ret);
+			return ret;
+		}
+	}
+
+	print_analysis(api, analysis);
+	return 0;
+}
+
+static int analyze_jitter(int fd, unsigned int frames)
+{
+	struct vbl_analysis analysis;
+	drmModeResPtr res;
+	uint64_t cap = 0;
+	int ret;
+
+	if (drmGetCap(fd, DRM_CAP_TIMESTAMP_MONOTONIC, &cap) || !cap)
+		fprintf(stderr, "warning: vblank timestamps are not CLOCK_MONOTONIC, delivery delays are meaningless\n");
+
+	memset(&analysis, 0, sizeof analysis);
+	analysis.frames = frames;
+	analysis.samples = calloc(frames, sizeof(*analysis.samples));
+	if (!analysis.samples)
+		return -1;
+
+	ret = analyze(fd, "drmWaitVBlank", &analysis, queue_vblank);
+	if (ret)
+		goto out;
+
+	/* drmCrtcQueueSequence addresses the CRTC by id, not by pipe. */
+	res = drmModeGetResources(fd);
+	if (!res || res->count_crtcs <= secondary) {
+		printf("drmCrtcQueueSequence: no CRTC for pipe %d\n", secondary);
+		drmModeFreeResources(res);
+		ret = -1;
+		goto out;
+	}
+	analysis.crtc_id = res->crtcs[secondary];
+	drmModeFreeResources(res);
+
+	ret = analyze(fd, "drmCrtcQueueSequence", &analysis, queue_sequence);
+
+out:
+	free(analysis.samples);
+	return ret;
+}
+
 static void usage(char *name)
 {
-	fprintf(stderr, "usage: %s [-DMs]\n", name);
+	fprintf(stderr, "usage: %s [-DjMs]\n", name);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "options:\n");
 	fprintf(stderr, "  -D DEVICE  open the given device\n");
+	fprintf(stderr, "  -j FRAMES  analyze vblank jitter over the given number of frames\n");
 	fprintf(stderr, "  -M MODULE  open the given module\n");
 	fprintf(stderr, "  -s         use secondary pipe\n");
 	exit(0);
@@ -96,6 +331,7 @@ static void usage(char *name)
 int main(int argc, char **argv)
 {
 	const char *device = NULL, *module = NULL;
+	unsigned int frames = 0;
 	int c, fd, ret;
 	drmVBlank vbl;
 	drmEventContext evctx;
@@ -107,6 +343,11 @@ int main(int argc, char **argv)
 		case 'D':
 			device = optarg;
 			break;
+		case 'j':
+			frames = strtoul(optarg, NULL, 0);
+			if (frames < 3)
+				usage(argv[0]);
+			break;
 		case 'M':
 			module = optarg;
 			break;
@@ -136,6 +377,9 @@ int main(int argc, char **argv)
 
 	printf("starting count: %d\n", vbl.request.sequence);
 
+	if (frames)
+		return analyze_jitter(fd, frames) ? 1 : 0;
+
 	handler_info.vbl_count = 0;
 	gettimeofday(&handler_info.start, NULL);
 
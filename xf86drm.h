@@ -760,6 +760,12 @@ extern void drmSLDump(void *l);
 extern int  drmSLLookupNeighbors(void *l, unsigned long key,
 				 unsigned long *prev_key, void **prev_value,
 				 unsigned long *next_key, void **next_value);
+extern int  drmSLInsertSorted(void *l, const unsigned long *keys,
+			       void **values, int count);
+extern int  drmSLLowerBound(void *l, unsigned long key,
+			    unsigned long *found_key, void **value);
+extern int  drmSLUpperBound(void *l, unsigned long key,
+			    unsigned long *found_key, void **value);
 
 extern int drmOpenOnce(void *unused, const char *BusID, int *newlyopened);
 extern int drmOpenOnceWithType(const char *BusID, int *newlyopened, int type);
@@ -826,6 +832,103 @@ extern int drmHandleEvent(int fd, drmEventContextPtr evctx);
 extern int drmHandleEvent2(int fd, drmEventContextPtr evctx,
 	drmEventVendorHandler vendorhandler);
 
+/*
+ * drmHandleEventDrain() dispatches events like drmHandleEvent2(), but keeps
+ * reading until no events are left, so that a single wakeup handles
+ * everything that is pending. It never blocks after the first read, and the
+ * first read does not block either if the fd is O_NONBLOCK.
+ *
+ * Events are read into 'buffer', which must be 8 byte aligned, in chunks of
+ * up to 'size' bytes. If 'buffer' is NULL, a 4 KiB buffer on the stack is
+ * used instead.
+ *
+ * Returns the number of events dispatched, or -1 if the first read fails.
+ * A later read error ends the drain and still returns the count.
+ */
+extern int drmHandleEventDrain(int fd, drmEventContextPtr evctx,
+			       drmEventVendorHandler vendorhandler,
+			       void *buffer, size_t size);
+
+/*
+ * drmEventLoop waits on any number of DRM fds and fences with a single
+ * epoll fd. DRM fds are dispatched with drmHandleEventDrain() through their
+ * own drmEventContext; the handler's fd argument tells the devices apart.
+ * Fences are eventfds, e.g. ones signaled by a syncobj, and sync_file fds
+ * as handled by libsync.h. An eventfd fires each time it is signaled, a
+ * sync_file fires once and is then removed from the loop. The loop never
+ * closes any of the registered fds.
+ *
+ * drmEventLoopDispatch() waits up to 'timeout' milliseconds (-1 waits
+ * forever) and returns the number of DRM events and fences dispatched, or
+ * a negative errno. drmEventLoopGetArrivalTime() returns the
+ * CLOCK_MONOTONIC time in ns at which the events being dispatched were
+ * picked up, so handlers can measure their wakeup-to-dispatch latency.
+ * drmEventLoopGetFd() returns the epoll fd, for nesting the loop into
+ * another one.
+ *
+ * The other functions return 0 or a negative errno. Sources may be added
+ * and removed from within handlers.
+ */
+typedef struct _drmEventLoop drmEventLoop, *drmEventLoopPtr;
+
+typedef void (*drmEventLoopFenceHandler)(int fd, uint64_t arrival_ns,
+					 void *user_data);
+
+extern drmEventLoopPtr drmEventLoopCreate(void);
+extern void drmEventLoopDestroy(drmEventLoopPtr loop);
+extern int drmEventLoopGetFd(drmEventLoopPtr loop);
+extern int drmEventLoopAddDevice(drmEventLoopPtr loop, int fd,
+				 drmEventContextPtr evctx,
+				 drmEventVendorHandler vendorhandler);
+extern int drmEventLoopAddEventfd(drmEventLoopPtr loop, int fd,
+				  drmEventLoopFenceHandler handler,
+				  void *user_data);
+extern int drmEventLoopAddSyncFile(drmEventLoopPtr loop, int fd,
+				   drmEventLoopFenceHandler handler,
+				   void *user_data);
+extern int drmEventLoopRemove(drmEventLoopPtr loop, int fd);
+extern int drmEventLoopDispatch(drmEventLoopPtr loop, int timeout);
+extern uint64_t drmEventLoopGetArrivalTime(drmEventLoopPtr loop);
+
+/*
+ * drmEventQueue hands vblank, page flip and CRTC sequence events from the
+ * thread reading the DRM fd to one other thread, as fixed-size records in a
+ * lock-free single-producer/single-consumer ring.
+ *
+ * drmEventQueueRead() is the producer: it reads everything pending on 'fd',
+ * like drmHandleEventDrain(), and queues the core events. Other events go to
+ * 'vendorhandler' (if non-NULL) with 'ctx'. It never reads more events than
+ * there are free records, the rest stay queued in the kernel and keep the
+ * fd readable. Returns the number of events queued, or -1 on error.
+ *
+ * drmEventQueueDequeue() is the consumer: it copies up to 'count' records
+ * into 'records' and returns how many it copied, or a negative errno. If the
+ * queue is empty, it waits up to 'timeout' milliseconds (-1 waits forever)
+ * for the producer; it may return 0 early on a spurious wakeup.
+ *
+ * 'size' is rounded up to a power of two, and to at least 128 records so
+ * that vendor events of up to 4 KiB can be read.
+ */
+typedef struct _drmEventQueue drmEventQueue, *drmEventQueuePtr;
+
+typedef struct _drmEventRecord {
+	uint32_t type;		/* DRM_EVENT_VBLANK, _FLIP_COMPLETE or _CRTC_SEQUENCE */
+	int32_t fd;
+	uint32_t crtc_id;	/* only set for DRM_EVENT_FLIP_COMPLETE */
+	uint32_t pad;
+	uint64_t sequence;
+	uint64_t time_ns;	/* vblank timestamp, CLOCK_MONOTONIC by default */
+	uint64_t user_data;
+} drmEventRecord, *drmEventRecordPtr;
+
+extern drmEventQueuePtr drmEventQueueCreate(unsigned int size);
+extern void drmEventQueueDestroy(drmEventQueuePtr queue);
+extern int drmEventQueueRead(int fd, drmEventQueuePtr queue,
+			     drmEventVendorHandler vendorhandler, void *ctx);
+extern int drmEventQueueDequeue(drmEventQueuePtr queue,
+				drmEventRecordPtr records,
+				unsigned int count, int timeout);
+
 extern char *drmGetDeviceNameFromFd(int fd);
 
 /* Improved version of drmGetDeviceNameFromFd which attributes for any type of
@@ -51,11 +51,19 @@
 #include "libdrm_macros.h"
 #include "xf86drmMode.h"
 #include "xf86drm.h"
+#include "util_math.h"
+#include "libdrm_lists.h"
 #include <drm.h>
 #include <string.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#if HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #define memclear(s) memset(&s, 0, sizeof(s))
 
@@ -687,6 +695,263 @@ drm_public void drmModeFreeProperty(drmModePropertyPtr ptr)
 	drmFree(ptr);
 }
 
+/*
+ * Queries into caller-owned scratch storage
+ *
+ * The kernel only fills in an array if the capacity passed in is large
+ * enough, and reports the real counts either way. Passing a capacity hint
+ * up front thus usually gets everything in a single ioctl, and the counts
+ * are only used for a second attempt if the hint was short. The hints grow
+ * to the largest counts seen, so that the next query with the same scratch
+ * fits right away.
+ */
+
+#define SCRATCH_HINT_PROPS	32
+#define SCRATCH_HINT_MODES	32
+#define SCRATCH_HINT_ENCODERS	8
+#define SCRATCH_HINT_VALUES	8
+#define SCRATCH_HINT_ENUMS	16
+
+struct _drmModeScratch {
+	void *data;
+	size_t size;
+
+	/* capacity hints */
+	uint32_t count_props;
+	uint32_t count_modes;
+	uint32_t count_encoders;
+	uint32_t count_values;
+	uint32_t count_enum_blobs;
+};
+
+drm_public drmModeScratchPtr drmModeScratchAlloc(void)
+{
+	drmModeScratchPtr scratch;
+
+	scratch = drmMalloc(sizeof(*scratch));
+	if (!scratch)
+		return NULL;
+
+	scratch->count_props = SCRATCH_HINT_PROPS;
+	scratch->count_modes = SCRATCH_HINT_MODES;
+	scratch->count_encoders = SCRATCH_HINT_ENCODERS;
+	scratch->count_values = SCRATCH_HINT_VALUES;
+	scratch->count_enum_blobs = SCRATCH_HINT_ENUMS;
+
+	return scratch;
+}
+
+drm_public void drmModeScratchFree(drmModeScratchPtr scratch)
+{
+	if (!scratch)
+		return;
+
+	free(scratch->data);
+	drmFree(scratch);
+}
+
+static void *scratch_reserve(drmModeScratchPtr scratch, size_t size)
+{
+	void *data;
+
+	if (size <= scratch->size)
+		return scratch->data;
+
+	size = MAX2(size, 2 * scratch->size);
+	data = realloc(scratch->data, size);
+	if (!data)
+		return NULL;
+
+	scratch->data = data;
+	scratch->size = size;
+
+	return data;
+}
+
+static drmModeConnectorPtr
+_drmModeGetConnectorScratch(int fd, uint32_t connector_id, int probe,
+			    drmModeScratchPtr scratch)
+{
+	struct drm_mode_get_connector conn;
+	drmModeConnectorPtr r;
+	uint32_t count_props = scratch->count_props;
+	uint32_t count_modes = scratch->count_modes;
+	uint32_t count_encoders = scratch->count_encoders;
+	uint64_t *prop_values;
+	struct drm_mode_modeinfo *modes;
+	uint32_t *props, *encoders;
+	char *p;
+
+	for (;;) {
+		/* Lay out the arrays behind the result, by decreasing alignment. */
+		p = scratch_reserve(scratch, sizeof(*r) +
+				    count_props * sizeof(uint64_t) +
+				    count_props * sizeof(uint32_t) +
+				    count_encoders * sizeof(uint32_t) +
+				    count_modes * sizeof(*modes));
+		if (!p)
+			return NULL;
+
+		r = (drmModeConnectorPtr)p;
+		prop_values = (uint64_t *)(p + sizeof(*r));
+		props = (uint32_t *)(prop_values + count_props);
+		encoders = props + count_props;
+		modes = (struct drm_mode_modeinfo *)(encoders + count_encoders);
+
+		memclear(conn);
+		conn.connector_id = connector_id;
+		conn.count_props = count_props;
+		conn.props_ptr = VOID2U64(props);
+		conn.prop_values_ptr = VOID2U64(prop_values);
+		conn.count_encoders = count_encoders;
+		conn.encoders_ptr = VOID2U64(encoders);
+
+		/*
+		 * The kernel only probes if no room for modes is passed in, so
+		 * probing always takes a second ioctl if there are any modes.
+		 */
+		if (!probe) {
+			conn.count_modes = count_modes;
+			conn.modes_ptr = VOID2U64(modes);
+		}
+
+		if (drmIoctl(fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn))
+			return NULL;
+
+		if (conn.count_props <= count_props &&
+		    conn.count_encoders <= count_encoders &&
+		    conn.count_modes <= count_modes &&
+		    (!probe || conn.count_modes == 0))
+			break;
+
+		count_props = MAX2(count_props, conn.count_props);
+		count_encoders = MAX2(count_encoders, conn.count_encoders);
+		count_modes = MAX2(count_modes, conn.count_modes);
+		probe = 0;
+	}
+
+	scratch->count_props = count_props;
+	scratch->count_encoders = count_encoders;
+	scratch->count_modes = count_modes;
+
+	memset(r, 0, sizeof(*r));
+	r->connector_id = conn.connector_id;
+	r->encoder_id = conn.encoder_id;
+	r->connection   = conn.connection;
+	r->mmWidth      = conn.mm_width;
+	r->mmHeight     = conn.mm_height;
+	/* convert subpixel from kernel to userspace */
+	r->subpixel     = conn.subpixel + 1;
+	r->count_modes  = conn.count_modes;
+	r->modes        = (drmModeModeInfoPtr)modes;
+	r->count_props  = conn.count_props;
+	r->props        = props;
+	r->prop_values  = prop_values;
+	r->count_encoders = conn.count_encoders;
+	r->encoders     = encoders;
+	r->connector_type  = conn.connector_type;
+	r->connector_type_id = conn.connector_type_id;
+
+	return r;
+}
+
+drm_public drmModeConnectorPtr
+drmModeGetConnectorScratch(int fd, uint32_t connector_id,
+			   drmModeScratchPtr scratch)
+{
+	if (!scratch)
+		return NULL;
+
+	return _drmModeGetConnectorScratch(fd, connector_id, 1, scratch);
+}
+
+drm_public drmModeConnectorPtr
+drmModeGetConnectorCurrentScratch(int fd, uint32_t connector_id,
+				  drmModeScratchPtr scratch)
+{
+	if (!scratch)
+		return NULL;
+
+	return _drmModeGetConnectorScratch(fd, connector_id, 0, scratch);
+}
+
+drm_public drmModePropertyPtr
+drmModeGetPropertyScratch(int fd, uint32_t property_id,
+			  drmModeScratchPtr scratch)
+{
+	struct drm_mode_get_property prop;
+	drmModePropertyPtr r;
+	uint32_t count_values, count_enum_blobs;
+	uint64_t *values;
+	struct drm_mode_property_enum *enums;
+	char *p;
+
+	if (!scratch)
+		return NULL;
+
+	count_values = scratch->count_values;
+	count_enum_blobs = scratch->count_enum_blobs;
+
+	for (;;) {
+		/*
+		 * Legacy blob properties return 32 bit lengths and IDs through
+		 * the same pointers, which always fit since values has at least
+		 * as many 64 bit entries.
+		 */
+		count_values = MAX2(count_values, count_enum_blobs);
+
+		p = scratch_reserve(scratch, sizeof(*r) +
+				    count_values * sizeof(*values) +
+				    count_enum_blobs * sizeof(*enums));
+		if (!p)
+			return NULL;
+
+		r = (drmModePropertyPtr)p;
+		values = (uint64_t *)(p + sizeof(*r));
+		enums = (struct drm_mode_property_enum *)(values + count_values);
+
+		memclear(prop);
+		prop.prop_id = property_id;
+		prop.count_values = count_values;
+		prop.values_ptr = VOID2U64(values);
+		prop.count_enum_blobs = count_enum_blobs;
+		prop.enum_blob_ptr = VOID2U64(enums);
+
+		if (drmIoctl(fd, DRM_IOCTL_MODE_GETPROPERTY, &prop))
+			return NULL;
+
+		if (prop.count_values <= count_values &&
+		    prop.count_enum_blobs <= count_enum_blobs)
+			break;
+
+		count_values = MAX2(count_values, prop.count_values);
+		count_enum_blobs = MAX2(count_enum_blobs, prop.count_enum_blobs);
+	}
+
+	scratch->count_values = count_values;
+	scratch->count_enum_blobs = count_enum_blobs;
+
+	memset(r, 0, sizeof(*r));
+	r->prop_id = prop.prop_id;
+	r->count_values = prop.count_values;
+
+	r->flags = prop.flags;
+	if (prop.count_values)
+		r->values = values;
+	if (prop.flags & (DRM_MODE_PROP_ENUM | DRM_MODE_PROP_BITMASK)) {
+		r->count_enums = prop.count_enum_blobs;
+		r->enums = enums;
+	} else if (prop.flags & DRM_MODE_PROP_BLOB) {
+		r->values = values;
+		r->blob_ids = (uint32_t *)enums;
+		r->count_blobs = prop.count_enum_blobs;
+	}
+	memcpy(r->name, prop.name, DRM_PROP_NAME_LEN);
+	r->name[DRM_PROP_NAME_LEN-1] = 0;
+
+	return r;
+}
+
 drm_public drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd,
 														 uint32_t blob_id)
 {
@@ -880,25 +1145,20 @@ drm_public int drmModeCrtcSetGamma(int fd, uint32_t crtc_id, uint32_t size,
 	return DRM_IOCTL(fd, DRM_IOCTL_MODE_SETGAMMA, &l);
 }
 
-drm_public int drmHandleEvent2(int fd, drmEventContextPtr evctx,
-			drmEventVendorHandler vendorhandler)
+/* Default buffer size for drmHandleEventDrain(), and the largest event
+ * drmEventQueueRead() can take. */
+#define DRM_EVENT_DRAIN_BUFFER_SIZE	4096
+
+static int drm_dispatch_events(int fd, drmEventContextPtr evctx,
+			       drmEventVendorHandler vendorhandler,
+			       const char *buffer, int len)
 {
-	char buffer[1024];
-	int len, i;
+	int i, count = 0;
 	struct drm_event *e;
 	struct drm_event_vblank *vblank;
 	struct drm_event_crtc_sequence *seq;
 	void *user_data;
 
-	/* The DRM read semantics guarantees that we always get only
-	 * complete events. */
-
-	len = read(fd, buffer, sizeof buffer);
-	if (len == 0)
-		return 0;
-	if (len < (int)sizeof *e)
-		return -1;
-
 	i = 0;
 	while (i < len) {
 		e = (struct drm_event *)(buffer + i);
@@ -946,635 +1206,2503 @@ drm_public int drmHandleEvent2(int fd, drmEventContextPtr evctx,
 			break;
 		}
 		i += e->length;
+		count++;
 	}
 
-	return 0;
+	return count;
 }
 
-drm_public int drmHandleEvent(int fd, drmEventContextPtr evctx)
+drm_public int drmHandleEvent2(int fd, drmEventContextPtr evctx,
+			drmEventVendorHandler vendorhandler)
 {
-	return drmHandleEvent2(fd, evctx, NULL);
-}
+	char buffer[1024];
+	int len;
 
-drm_public int drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id,
-		    uint32_t flags, void *user_data)
-{
-	struct drm_mode_crtc_page_flip flip;
+	/* The DRM read semantics guarantees that we always get only
+	 * complete events. */
 
-	memclear(flip);
-	flip.fb_id = fb_id;
-	flip.crtc_id = crtc_id;
-	flip.user_data = VOID2U64(user_data);
-	flip.flags = flags;
+	len = read(fd, buffer, sizeof buffer);
+	if (len == 0)
+		return 0;
+	if (len < (int)sizeof(struct drm_event))
+		return -1;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+	drm_dispatch_events(fd, evctx, vendorhandler, buffer, len);
+
+	return 0;
 }
 
-drm_public int drmModePageFlipTarget(int fd, uint32_t crtc_id, uint32_t fb_id,
-			  uint32_t flags, void *user_data,
-			  uint32_t target_vblank)
+drm_public int drmHandleEventDrain(int fd, drmEventContextPtr evctx,
+				   drmEventVendorHandler vendorhandler,
+				   void *buffer, size_t size)
 {
-	struct drm_mode_crtc_page_flip_target flip_target;
+	uint64_t stack_buffer[DRM_EVENT_DRAIN_BUFFER_SIZE / sizeof(uint64_t)];
+	struct pollfd pfd;
+	int len, count = 0;
 
-	memclear(flip_target);
-	flip_target.fb_id = fb_id;
-	flip_target.crtc_id = crtc_id;
-	flip_target.user_data = VOID2U64(user_data);
-	flip_target.flags = flags;
-	flip_target.sequence = target_vblank;
+	if (!buffer) {
+		buffer = stack_buffer;
+		size = sizeof(stack_buffer);
+	}
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip_target);
+	if (size > INT_MAX)
+		size = INT_MAX;
+
+	for (;;) {
+		len = read(fd, buffer, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (len == 0)
+			break;
+		/* Events already dispatched are still reported. */
+		if (len < (int)sizeof(struct drm_event))
+			return count ? count : -1;
+
+		count += drm_dispatch_events(fd, evctx, vendorhandler,
+					     buffer, len);
+
+		/*
+		 * The kernel only returns complete events, so room left in the
+		 * buffer does not mean the queue ran empty: a large event may
+		 * still be pending. Check for more without blocking, whether
+		 * or not the fd is O_NONBLOCK.
+		 */
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+			break;
+	}
+
+	return count;
 }
 
-drm_public int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
-		    uint32_t fb_id, uint32_t flags,
-		    int32_t crtc_x, int32_t crtc_y,
-		    uint32_t crtc_w, uint32_t crtc_h,
-		    uint32_t src_x, uint32_t src_y,
-		    uint32_t src_w, uint32_t src_h)
+drm_public int drmHandleEvent(int fd, drmEventContextPtr evctx)
 {
-	struct drm_mode_set_plane s;
+	return drmHandleEvent2(fd, evctx, NULL);
+}
 
-	memclear(s);
-	s.plane_id = plane_id;
-	s.crtc_id = crtc_id;
-	s.fb_id = fb_id;
-	s.flags = flags;
-	s.crtc_x = crtc_x;
-	s.crtc_y = crtc_y;
-	s.crtc_w = crtc_w;
-	s.crtc_h = crtc_h;
-	s.src_x = src_x;
-	s.src_y = src_y;
-	s.src_w = src_w;
-	s.src_h = src_h;
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_SETPLANE, &s);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-drm_public drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
-{
-	struct drm_mode_get_plane ovr, counts;
-	drmModePlanePtr r = 0;
+#if HAVE_SYS_EPOLL_H
 
-retry:
-	memclear(ovr);
-	ovr.plane_id = plane_id;
-	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANE, &ovr))
-		return 0;
+/* Number of ready fds taken from the kernel per epoll_wait(). */
+#define DRM_EVENT_LOOP_BATCH	32
 
-	counts = ovr;
+enum drm_event_source_type {
+	DRM_EVENT_SOURCE_DEVICE,
+	DRM_EVENT_SOURCE_EVENTFD,
+	DRM_EVENT_SOURCE_SYNC_FILE,
+};
 
-	if (ovr.count_format_types) {
-		ovr.format_type_ptr = VOID2U64(drmMalloc(ovr.count_format_types *
-							 sizeof(uint32_t)));
-		if (!ovr.format_type_ptr)
-			goto err_allocs;
-	}
+struct drm_event_source {
+	drmMMListHead link;
+	enum drm_event_source_type type;
+	int fd;
+	int removed;
+	drmEventContextPtr evctx;
+	drmEventVendorHandler vendorhandler;
+	drmEventLoopFenceHandler handler;
+	void *user_data;
+};
 
-	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANE, &ovr))
-		goto err_allocs;
+struct _drmEventLoop {
+	int epoll_fd;
+	drmMMListHead sources;
+	/* Sources removed while dispatching, freed once the batch is done. */
+	drmMMListHead removed;
+	uint64_t arrival_ns;
+	uint64_t buffer[DRM_EVENT_DRAIN_BUFFER_SIZE / sizeof(uint64_t)];
+};
 
-	if (counts.count_format_types < ovr.count_format_types) {
-		drmFree(U642VOID(ovr.format_type_ptr));
-		goto retry;
-	}
+drm_public drmEventLoopPtr drmEventLoopCreate(void)
+{
+	drmEventLoopPtr loop;
 
-	if (!(r = drmMalloc(sizeof(*r))))
-		goto err_allocs;
+	loop = drmMalloc(sizeof(*loop));
+	if (!loop)
+		return NULL;
 
-	r->count_formats = ovr.count_format_types;
-	r->plane_id = ovr.plane_id;
-	r->crtc_id = ovr.crtc_id;
-	r->fb_id = ovr.fb_id;
-	r->possible_crtcs = ovr.possible_crtcs;
-	r->gamma_size = ovr.gamma_size;
-	r->formats = drmAllocCpy(U642VOID(ovr.format_type_ptr),
-				 ovr.count_format_types, sizeof(uint32_t));
-	if (ovr.count_format_types && !r->formats) {
-		drmFree(r->formats);
-		drmFree(r);
-		r = 0;
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epoll_fd < 0) {
+		drmFree(loop);
+		return NULL;
 	}
 
-err_allocs:
-	drmFree(U642VOID(ovr.format_type_ptr));
+	DRMINITLISTHEAD(&loop->sources);
+	DRMINITLISTHEAD(&loop->removed);
 
-	return r;
+	return loop;
 }
 
-drm_public void drmModeFreePlane(drmModePlanePtr ptr)
+static void event_loop_free_removed(drmEventLoopPtr loop)
 {
-	if (!ptr)
+	struct drm_event_source *source;
+
+	while (!DRMLISTEMPTY(&loop->removed)) {
+		source = DRMLISTENTRY(struct drm_event_source,
+				      loop->removed.next, link);
+		DRMLISTDEL(&source->link);
+		drmFree(source);
+	}
+}
+
+drm_public void drmEventLoopDestroy(drmEventLoopPtr loop)
+{
+	struct drm_event_source *source, *tmp;
+
+	if (!loop)
 		return;
 
-	drmFree(ptr->formats);
-	drmFree(ptr);
+	/* The fds belong to the caller, only the loop's own state goes. */
+	DRMLISTFOREACHENTRYSAFE(source, tmp, &loop->sources, link) {
+		DRMLISTDEL(&source->link);
+		drmFree(source);
+	}
+	event_loop_free_removed(loop);
+
+	close(loop->epoll_fd);
+	drmFree(loop);
 }
 
-drm_public drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+drm_public int drmEventLoopGetFd(drmEventLoopPtr loop)
 {
-	struct drm_mode_get_plane_res res, counts;
-	drmModePlaneResPtr r = 0;
+	return loop->epoll_fd;
+}
 
-retry:
-	memclear(res);
-	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res))
-		return 0;
+static int event_loop_add(drmEventLoopPtr loop, int fd,
+			  struct drm_event_source *source, uint32_t events)
+{
+	struct epoll_event ev;
 
-	counts = res;
+	memclear(ev);
+	ev.events = events;
+	ev.data.ptr = source;
 
-	if (res.count_planes) {
-		res.plane_id_ptr = VOID2U64(drmMalloc(res.count_planes *
-							sizeof(uint32_t)));
-		if (!res.plane_id_ptr)
-			goto err_allocs;
+	if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+		int err = -errno;
+
+		drmFree(source);
+		return err;
 	}
 
-	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res))
-		goto err_allocs;
+	source->fd = fd;
+	DRMLISTADDTAIL(&source->link, &loop->sources);
 
-	if (counts.count_planes < res.count_planes) {
+	return 0;
+}
+
+drm_public int drmEventLoopAddDevice(drmEventLoopPtr loop, int fd,
+				     drmEventContextPtr evctx,
+				     drmEventVendorHandler vendorhandler)
+{
+	struct drm_event_source *source;
+
+	source = drmMalloc(sizeof(*source));
+	if (!source)
+		return -ENOMEM;
+
+	source->type = DRM_EVENT_SOURCE_DEVICE;
+	source->evctx = evctx;
+	source->vendorhandler = vendorhandler;
+
+	return event_loop_add(loop, fd, source, EPOLLIN);
+}
+
+static int event_loop_add_fence(drmEventLoopPtr loop, int fd,
+				enum drm_event_source_type type,
+				uint32_t events,
+				drmEventLoopFenceHandler handler,
+				void *user_data)
+{
+	struct drm_event_source *source;
+
+	source = drmMalloc(sizeof(*source));
+	if (!source)
+		return -ENOMEM;
+
+	source->type = type;
+	source->handler = handler;
+	source->user_data = user_data;
+
+	return event_loop_add(loop, fd, source, events);
+}
+
+drm_public int drmEventLoopAddEventfd(drmEventLoopPtr loop, int fd,
+				      drmEventLoopFenceHandler handler,
+				      void *user_data)
+{
+	return event_loop_add_fence(loop, fd, DRM_EVENT_SOURCE_EVENTFD, EPOLLIN,
+				    handler, user_data);
+}
+
+drm_public int drmEventLoopAddSyncFile(drmEventLoopPtr loop, int fd,
+				       drmEventLoopFenceHandler handler,
+				       void *user_data)
+{
+	/* A signaled sync_file stays readable, so it only fires once. */
+	return event_loop_add_fence(loop, fd, DRM_EVENT_SOURCE_SYNC_FILE,
+				    EPOLLIN | EPOLLONESHOT, handler, user_data);
+}
+
+static void event_loop_remove(drmEventLoopPtr loop,
+			      struct drm_event_source *source)
+{
+	epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+	/*
+	 * The source may still be referenced by the batch being dispatched,
+	 * so it is only marked here and freed after the batch.
+	 */
+	source->removed = 1;
+	DRMLISTDEL(&source->link);
+	DRMLISTADD(&source->link, &loop->removed);
+}
+
+drm_public int drmEventLoopRemove(drmEventLoopPtr loop, int fd)
+{
+	struct drm_event_source *source;
+
+	DRMLISTFOREACHENTRY(source, &loop->sources, link) {
+		if (source->fd == fd) {
+			event_loop_remove(loop, source);
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+drm_public uint64_t drmEventLoopGetArrivalTime(drmEventLoopPtr loop)
+{
+	return loop->arrival_ns;
+}
+
+static int event_loop_dispatch_source(drmEventLoopPtr loop,
+				      struct drm_event_source *source)
+{
+	uint64_t counter;
+	int ret;
+
+	switch (source->type) {
+	case DRM_EVENT_SOURCE_DEVICE:
+		ret = drmHandleEventDrain(source->fd, source->evctx,
+					  source->vendorhandler, loop->buffer,
+					  sizeof(loop->buffer));
+		return ret < 0 ? -errno : ret;
+	case DRM_EVENT_SOURCE_EVENTFD:
+		/* Reset the counter so the eventfd is not reported again. */
+		do {
+			ret = read(source->fd, &counter, sizeof(counter));
+		} while (ret < 0 && errno == EINTR);
+		if (ret != sizeof(counter))
+			return 0;
+		break;
+	case DRM_EVENT_SOURCE_SYNC_FILE:
+		event_loop_remove(loop, source);
+		break;
+	}
+
+	if (source->handler)
+		source->handler(source->fd, loop->arrival_ns,
+				source->user_data);
+
+	return 1;
+}
+
+drm_public int drmEventLoopDispatch(drmEventLoopPtr loop, int timeout)
+{
+	struct epoll_event events[DRM_EVENT_LOOP_BATCH];
+	struct drm_event_source *source;
+	int i, n, ret, count = 0;
+
+	n = epoll_wait(loop->epoll_fd, events, DRM_EVENT_LOOP_BATCH, timeout);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	/* Everything in this batch had arrived by the time epoll returned. */
+	loop->arrival_ns = monotonic_ns();
+
+	for (i = 0; i < n; i++) {
+		source = events[i].data.ptr;
+		if (source->removed)
+			continue;
+
+		ret = event_loop_dispatch_source(loop, source);
+		if (ret < 0) {
+			count = ret;
+			break;
+		}
+		count += ret;
+	}
+
+	event_loop_free_removed(loop);
+
+	return count;
+}
+
+#else
+
+drm_public drmEventLoopPtr drmEventLoopCreate(void)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+drm_public void drmEventLoopDestroy(drmEventLoopPtr loop)
+{
+}
+
+drm_public int drmEventLoopGetFd(drmEventLoopPtr loop)
+{
+	return -ENOSYS;
+}
+
+drm_public int drmEventLoopAddDevice(drmEventLoopPtr loop, int fd,
+				     drmEventContextPtr evctx,
+				     drmEventVendorHandler vendorhandler)
+{
+	return -ENOSYS;
+}
+
+drm_public int drmEventLoopAddEventfd(drmEventLoopPtr loop, int fd,
+				      drmEventLoopFenceHandler handler,
+				      void *user_data)
+{
+	return -ENOSYS;
+}
+
+drm_public int drmEventLoopAddSyncFile(drmEventLoopPtr loop, int fd,
+				       drmEventLoopFenceHandler handler,
+				       void *user_data)
+{
+	return -ENOSYS;
+}
+
+drm_public int drmEventLoopRemove(drmEventLoopPtr loop, int fd)
+{
+	return -ENOSYS;
+}
+
+drm_public uint64_t drmEventLoopGetArrivalTime(drmEventLoopPtr loop)
+{
+	return 0;
+}
+
+drm_public int drmEventLoopDispatch(drmEventLoopPtr loop, int timeout)
+{
+	return -ENOSYS;
+}
+
+#endif
+
+/*
+ * Single producer, single consumer ring of decoded events. The producer
+ * only writes head and the consumer only writes tail, so neither needs a
+ * lock: the acquire/release pairs below order the records against the
+ * index that publishes them. Both indices run freely and are masked on
+ * access, which keeps full and empty apart without a spare slot.
+ */
+struct _drmEventQueue {
+	unsigned int head;
+	unsigned int waiting;
+	/* Keep the consumer's index off the producer's cache line. */
+	unsigned int tail __attribute__((aligned(64)));
+	unsigned int mask;
+	int wake[2];
+	drmEventRecordPtr records;
+};
+
+drm_public drmEventQueuePtr drmEventQueueCreate(unsigned int size)
+{
+	drmEventQueuePtr queue;
+	unsigned int i;
+
+	if (size == 0 || size > (1u << 24))
+		return NULL;
+
+	/*
+	 * Reads are limited to the free records, see drmEventQueueRead(), so
+	 * an empty ring must take a read large enough for any event.
+	 */
+	size = MAX2(size, DRM_EVENT_DRAIN_BUFFER_SIZE /
+			  sizeof(struct drm_event_vblank));
+
+	/* Round up to a power of two for the index masks. */
+	size--;
+	for (i = 1; i < 32; i <<= 1)
+		size |= size >> i;
+	size++;
+
+	queue = drmMalloc(sizeof(*queue));
+	if (!queue)
+		return NULL;
+
+	queue->records = drmMalloc(size * sizeof(*queue->records));
+	if (!queue->records)
+		goto err_free;
+
+	if (pipe(queue->wake))
+		goto err_free_records;
+
+	for (i = 0; i < 2; i++) {
+		fcntl(queue->wake[i], F_SETFD, FD_CLOEXEC);
+		fcntl(queue->wake[i], F_SETFL, O_NONBLOCK);
+	}
+
+	queue->mask = size - 1;
+
+	return queue;
+
+err_free_records:
+	drmFree(queue->records);
+err_free:
+	drmFree(queue);
+	return NULL;
+}
+
+drm_public void drmEventQueueDestroy(drmEventQueuePtr queue)
+{
+	if (!queue)
+		return;
+
+	close(queue->wake[0]);
+	close(queue->wake[1]);
+	drmFree(queue->records);
+	drmFree(queue);
+}
+
+static int event_queue_decode(int fd, drmEventQueuePtr queue,
+			      drmEventVendorHandler vendorhandler, void *ctx,
+			      const char *buffer, int len, unsigned int *head)
+{
+	struct drm_event *e;
+	struct drm_event_vblank *vblank;
+	struct drm_event_crtc_sequence *seq;
+	drmEventRecordPtr record;
+	int i, count = 0;
+
+	for (i = 0; i < len; i += e->length) {
+		e = (struct drm_event *)(buffer + i);
+		record = &queue->records[*head & queue->mask];
+
+		switch (e->type) {
+		case DRM_EVENT_VBLANK:
+		case DRM_EVENT_FLIP_COMPLETE:
+			vblank = (struct drm_event_vblank *) e;
+			record->type = e->type;
+			record->fd = fd;
+			record->crtc_id = e->type == DRM_EVENT_FLIP_COMPLETE ?
+					  vblank->crtc_id : 0;
+			record->sequence = vblank->sequence;
+			record->time_ns = vblank->tv_sec * 1000000000ull +
+					  vblank->tv_usec * 1000ull;
+			record->user_data = vblank->user_data;
+			break;
+		case DRM_EVENT_CRTC_SEQUENCE:
+			seq = (struct drm_event_crtc_sequence *) e;
+			record->type = e->type;
+			record->fd = fd;
+			record->crtc_id = 0;
+			record->sequence = seq->sequence;
+			record->time_ns = seq->time_ns;
+			record->user_data = seq->user_data;
+			break;
+		default:
+			if (vendorhandler)
+				vendorhandler(fd, e, ctx);
+			continue;
+		}
+
+		(*head)++;
+		count++;
+	}
+
+	return count;
+}
+
+drm_public int drmEventQueueRead(int fd, drmEventQueuePtr queue,
+				 drmEventVendorHandler vendorhandler,
+				 void *ctx)
+{
+	uint64_t buffer[DRM_EVENT_DRAIN_BUFFER_SIZE / sizeof(uint64_t)];
+	unsigned int head, tail, space;
+	struct pollfd pfd;
+	size_t size;
+	int len, count = 0;
+
+	head = queue->head;
+
+	for (;;) {
+		tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+		space = queue->mask + 1 - (head - tail);
+		if (space == 0)
+			break;
+
+		/*
+		 * Every core event is a drm_event_vblank sized record, so
+		 * limiting the read to the free slots means nothing is ever
+		 * dropped: whatever does not fit stays queued in the kernel
+		 * and keeps the fd readable. A larger vendor event that does
+		 * not fit yet makes the read return 0, until the consumer has
+		 * freed enough records; an empty ring always has room.
+		 */
+		size = sizeof(buffer);
+		if (space < size / sizeof(struct drm_event_vblank))
+			size = space * sizeof(struct drm_event_vblank);
+
+		len = read(fd, buffer, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (len == 0)
+			break;
+		if (len < (int)sizeof(struct drm_event)) {
+			count = -1;
+			break;
+		}
+
+		count += event_queue_decode(fd, queue, vendorhandler, ctx,
+					    (const char *)buffer, len, &head);
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+			break;
+	}
+
+	if (head == queue->head)
+		return count;
+
+	__atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+
+	/*
+	 * Pairs with the fence in drmEventQueueDequeue(): either the consumer
+	 * sees the new head, or this sees it waiting and wakes it up.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->waiting, __ATOMIC_RELAXED) &&
+	    write(queue->wake[1], "", 1) < 0 && errno != EAGAIN)
+		return -1;
+
+	return count;
+}
+
+static void event_queue_clear_wake(drmEventQueuePtr queue)
+{
+	char buffer[64];
+
+	while (read(queue->wake[0], buffer, sizeof(buffer)) > 0)
+		;
+}
+
+drm_public int drmEventQueueDequeue(drmEventQueuePtr queue,
+				    drmEventRecordPtr records,
+				    unsigned int count, int timeout)
+{
+	unsigned int head, tail, i;
+	struct pollfd pfd;
+	int ret;
+
+	tail = queue->tail;
+	head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+	if (head == tail && timeout != 0) {
+		__atomic_store_n(&queue->waiting, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+		head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			pfd.fd = queue->wake[0];
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			ret = poll(&pfd, 1, timeout);
+			if (ret < 0 && errno != EINTR) {
+				__atomic_store_n(&queue->waiting, 0,
+						 __ATOMIC_RELAXED);
+				return -errno;
+			}
+		}
+
+		__atomic_store_n(&queue->waiting, 0, __ATOMIC_RELAXED);
+		event_queue_clear_wake(queue);
+		head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+	}
+
+	if (count > head - tail)
+		count = head - tail;
+
+	for (i = 0; i < count; i++)
+		records[i] = queue->records[(tail + i) & queue->mask];
+
+	__atomic_store_n(&queue->tail, tail + count, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+drm_public int drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id,
+		    uint32_t flags, void *user_data)
+{
+	struct drm_mode_crtc_page_flip flip;
+
+	memclear(flip);
+	flip.fb_id = fb_id;
+	flip.crtc_id = crtc_id;
+	flip.user_data = VOID2U64(user_data);
+	flip.flags = flags;
+
+	return DRM_IOCTL(fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip);
+}
+
+drm_public int drmModePageFlipTarget(int fd, uint32_t crtc_id, uint32_t fb_id,
+			  uint32_t flags, void *user_data,
+			  uint32_t target_vblank)
+{
+	struct drm_mode_crtc_page_flip_target flip_target;
+
+	memclear(flip_target);
+	flip_target.fb_id = fb_id;
+	flip_target.crtc_id = crtc_id;
+	flip_target.user_data = VOID2U64(user_data);
+	flip_target.flags = flags;
+	flip_target.sequence = target_vblank;
+
+	return DRM_IOCTL(fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip_target);
+}
+
+/* Number of vblank timestamps the refresh period is fitted to. */
+#define FRAME_HISTORY	16
+
+enum frame_state {
+	FRAME_IDLE,
+	FRAME_QUEUED,
+	FRAME_SUBMITTED,
+};
+
+struct frame_sample {
+	uint64_t sequence;
+	uint64_t ns;
+};
+
+struct _drmModeFrameScheduler {
+	int fd;
+	uint32_t crtc_id;
+
+	struct frame_sample history[FRAME_HISTORY];
+	unsigned int count_history;
+	unsigned int next_history;
+	uint64_t last_sequence;
+
+	/* Least squares fit of the history: ns = base_ns + period * n. */
+	double period_ns;
+	uint64_t base_sequence;
+	double base_ns;
+	int fit_dirty;
+
+	enum frame_state state;
+	uint64_t target;
+	uint64_t submit_ns;
+	drmModeFrameSubmit submit;
+	void *user_data;
+
+	uint64_t last_flip_sequence;
+	uint64_t last_flip_ns;
+	uint64_t latency_total_ns;
+	uint64_t jitter_total_ns;
+	uint64_t jitter_count;
+	drmModeFrameStats stats;
+};
+
+static void frame_add_sample(drmModeFrameSchedulerPtr sched,
+			     uint64_t sequence, uint64_t ns)
+{
+	struct frame_sample *sample;
+
+	if (sched->count_history && sequence <= sched->last_sequence)
+		return;
+
+	sample = &sched->history[sched->next_history];
+	sample->sequence = sequence;
+	sample->ns = ns;
+
+	sched->next_history = (sched->next_history + 1) % FRAME_HISTORY;
+	if (sched->count_history < FRAME_HISTORY)
+		sched->count_history++;
+	sched->last_sequence = sequence;
+	sched->fit_dirty = 1;
+}
+
+/* Extends a 32-bit vblank event sequence to 64 bits. */
+static uint64_t frame_extend_sequence(drmModeFrameSchedulerPtr sched,
+				      uint32_t sequence)
+{
+	if (!sched->count_history)
+		return sequence;
+
+	return sched->last_sequence +
+	       (int32_t)(sequence - (uint32_t)sched->last_sequence);
+}
+
+static int frame_fit(drmModeFrameSchedulerPtr sched)
+{
+	const struct frame_sample *newest, *sample;
+	double mean_n = 0, mean_ns = 0, sxx = 0, sxy = 0, dn, dns;
+	unsigned int i;
+
+	if (!sched->fit_dirty)
+		return sched->period_ns > 0 ? 0 : -EAGAIN;
+
+	sched->fit_dirty = 0;
+	sched->period_ns = 0;
+
+	if (sched->count_history < 2)
+		return -EAGAIN;
+
+	/*
+	 * Fit relative to the newest sample, so the doubles only ever hold
+	 * small values however long the CRTC has been running.
+	 */
+	newest = &sched->history[(sched->next_history + FRAME_HISTORY - 1) %
+				 FRAME_HISTORY];
+
+	for (i = 0; i < sched->count_history; i++) {
+		sample = &sched->history[i];
+		mean_n -= newest->sequence - sample->sequence;
+		mean_ns -= newest->ns - sample->ns;
+	}
+	mean_n /= sched->count_history;
+	mean_ns /= sched->count_history;
+
+	for (i = 0; i < sched->count_history; i++) {
+		sample = &sched->history[i];
+		dn = -(double)(newest->sequence - sample->sequence) - mean_n;
+		dns = -(double)(newest->ns - sample->ns) - mean_ns;
+		sxx += dn * dn;
+		sxy += dn * dns;
+	}
+
+	sched->period_ns = sxy / sxx;
+	sched->base_sequence = newest->sequence;
+	sched->base_ns = newest->ns + mean_ns - sched->period_ns * mean_n;
+
+	return sched->period_ns > 0 ? 0 : -EAGAIN;
+}
+
+drm_public drmModeFrameSchedulerPtr drmModeFrameSchedulerCreate(int fd,
+								uint32_t crtc_id)
+{
+	drmModeFrameSchedulerPtr sched;
+
+	sched = drmMalloc(sizeof(*sched));
+	if (!sched)
+		return NULL;
+
+	sched->fd = fd;
+	sched->crtc_id = crtc_id;
+
+	return sched;
+}
+
+drm_public void drmModeFrameSchedulerFree(drmModeFrameSchedulerPtr sched)
+{
+	drmFree(sched);
+}
+
+drm_public int drmModeFrameSchedulerSample(drmModeFrameSchedulerPtr sched)
+{
+	uint64_t sequence, ns;
+
+	if (drmCrtcGetSequence(sched->fd, sched->crtc_id, &sequence, &ns))
+		return -errno;
+
+	frame_add_sample(sched, sequence, ns);
+
+	return 0;
+}
+
+drm_public int drmModeFrameSchedulerPredict(drmModeFrameSchedulerPtr sched,
+					    uint64_t sequence, uint64_t *ns)
+{
+	int ret;
+
+	ret = frame_fit(sched);
+	if (ret)
+		return ret;
+
+	*ns = sched->base_ns + sched->period_ns *
+	      ((double)sequence - sched->base_sequence);
+
+	return 0;
+}
+
+drm_public int drmModeFrameSchedulerNextSequence(drmModeFrameSchedulerPtr sched,
+						 uint64_t ns,
+						 uint64_t *sequence)
+{
+	double frames;
+	int ret;
+
+	ret = frame_fit(sched);
+	if (ret)
+		return ret;
+
+	frames = ((double)ns - sched->base_ns) / sched->period_ns;
+	if (frames < 0)
+		frames = 0;
+
+	/* The first vblank at or after ns. */
+	*sequence = sched->base_sequence + (uint64_t)frames;
+	if (sched->base_ns + sched->period_ns *
+	    ((double)*sequence - sched->base_sequence) < (double)ns)
+		(*sequence)++;
+
+	return 0;
+}
+
+drm_public int drmModeFrameSchedulerQueue(drmModeFrameSchedulerPtr sched,
+					  uint64_t target,
+					  drmModeFrameSubmit submit,
+					  void *user_data)
+{
+	uint64_t queued;
+
+	if (sched->state != FRAME_IDLE)
+		return -EBUSY;
+	if (target == 0)
+		return -EINVAL;
+
+	/*
+	 * A flip submitted during frame target - 1 completes at the start of
+	 * frame target, so wake up on the vblank before it.
+	 */
+	if (drmCrtcQueueSequence(sched->fd, sched->crtc_id,
+				 DRM_CRTC_SEQUENCE_NEXT_ON_MISS, target - 1,
+				 &queued, VOID2U64(sched)))
+		return -errno;
+
+	sched->state = FRAME_QUEUED;
+	sched->target = target;
+	sched->submit = submit;
+	sched->user_data = user_data;
+
+	/* The kernel moved the wakeup, the deadline is already missed. */
+	return queued > target - 1 ? 1 : 0;
+}
+
+drm_public int drmModeFrameSchedulerHandleSequence(drmModeFrameSchedulerPtr sched,
+						   uint64_t sequence,
+						   uint64_t ns)
+{
+	int ret;
+
+	frame_add_sample(sched, sequence, ns);
+
+	if (sched->state != FRAME_QUEUED)
+		return 0;
+
+	sched->state = FRAME_SUBMITTED;
+	sched->submit_ns = monotonic_ns();
+
+	ret = sched->submit(sched->fd, sched->crtc_id, sched->target,
+			    sched->user_data);
+	if (ret)
+		sched->state = FRAME_IDLE;
+
+	return ret;
+}
+
+drm_public int drmModeFrameSchedulerHandleFlip(drmModeFrameSchedulerPtr sched,
+					       unsigned int sequence,
+					       uint64_t ns)
+{
+	drmModeFrameStats *stats = &sched->stats;
+	uint64_t extended, latency, interval, expected, jitter;
+	int late = 0;
+
+	extended = frame_extend_sequence(sched, sequence);
+	frame_add_sample(sched, extended, ns);
+
+	if (sched->state != FRAME_SUBMITTED)
+		return 0;
+
+	sched->state = FRAME_IDLE;
+	stats->frames++;
+
+	if (extended > sched->target) {
+		late = extended - sched->target;
+		stats->missed++;
+	}
+
+	latency = ns > sched->submit_ns ? ns - sched->submit_ns : 0;
+	sched->latency_total_ns += latency;
+	stats->latency_avg_ns = sched->latency_total_ns / stats->frames;
+	stats->latency_max_ns = MAX2(stats->latency_max_ns, latency);
+
+	/*
+	 * Jitter is how far the time between two flips strays from the
+	 * number of refresh periods between them.
+	 */
+	if (sched->last_flip_ns && extended > sched->last_flip_sequence &&
+	    frame_fit(sched) == 0) {
+		interval = ns - sched->last_flip_ns;
+		expected = sched->period_ns *
+			   (extended - sched->last_flip_sequence);
+		jitter = interval > expected ? interval - expected :
+					       expected - interval;
+		sched->jitter_total_ns += jitter;
+		sched->jitter_count++;
+		stats->jitter_avg_ns = sched->jitter_total_ns /
+				       sched->jitter_count;
+		stats->jitter_max_ns = MAX2(stats->jitter_max_ns, jitter);
+	}
+
+	sched->last_flip_sequence = extended;
+	sched->last_flip_ns = ns;
+
+	return late;
+}
+
+drm_public void drmModeFrameSchedulerGetStats(drmModeFrameSchedulerPtr sched,
+					      drmModeFrameStatsPtr stats)
+{
+	*stats = sched->stats;
+	stats->period_ns = frame_fit(sched) == 0 ? sched->period_ns : 0;
+}
+
+drm_public int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
+		    uint32_t fb_id, uint32_t flags,
+		    int32_t crtc_x, int32_t crtc_y,
+		    uint32_t crtc_w, uint32_t crtc_h,
+		    uint32_t src_x, uint32_t src_y,
+		    uint32_t src_w, uint32_t src_h)
+{
+	struct drm_mode_set_plane s;
+
+	memclear(s);
+	s.plane_id = plane_id;
+	s.crtc_id = crtc_id;
+	s.fb_id = fb_id;
+	s.flags = flags;
+	s.crtc_x = crtc_x;
+	s.crtc_y = crtc_y;
+	s.crtc_w = crtc_w;
+	s.crtc_h = crtc_h;
+	s.src_x = src_x;
+	s.src_y = src_y;
+	s.src_w = src_w;
+	s.src_h = src_h;
+
+	return DRM_IOCTL(fd, DRM_IOCTL_MODE_SETPLANE, &s);
+}
+
+drm_public drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id)
+{
+	struct drm_mode_get_plane ovr, counts;
+	drmModePlanePtr r = 0;
+
+retry:
+	memclear(ovr);
+	ovr.plane_id = plane_id;
+	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANE, &ovr))
+		return 0;
+
+	counts = ovr;
+
+	if (ovr.count_format_types) {
+		ovr.format_type_ptr = VOID2U64(drmMalloc(ovr.count_format_types *
+							 sizeof(uint32_t)));
+		if (!ovr.format_type_ptr)
+			goto err_allocs;
+	}
+
+	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANE, &ovr))
+		goto err_allocs;
+
+	if (counts.count_format_types < ovr.count_format_types) {
+		drmFree(U642VOID(ovr.format_type_ptr));
+		goto retry;
+	}
+
+	if (!(r = drmMalloc(sizeof(*r))))
+		goto err_allocs;
+
+	r->count_formats = ovr.count_format_types;
+	r->plane_id = ovr.plane_id;
+	r->crtc_id = ovr.crtc_id;
+	r->fb_id = ovr.fb_id;
+	r->possible_crtcs = ovr.possible_crtcs;
+	r->gamma_size = ovr.gamma_size;
+	r->formats = drmAllocCpy(U642VOID(ovr.format_type_ptr),
+				 ovr.count_format_types, sizeof(uint32_t));
+	if (ovr.count_format_types && !r->formats) {
+		drmFree(r->formats);
+		drmFree(r);
+		r = 0;
+	}
+
+err_allocs:
+	drmFree(U642VOID(ovr.format_type_ptr));
+
+	return r;
+}
+
+drm_public void drmModeFreePlane(drmModePlanePtr ptr)
+{
+	if (!ptr)
+		return;
+
+	drmFree(ptr->formats);
+	drmFree(ptr);
+}
+
+drm_public drmModePlaneResPtr drmModeGetPlaneResources(int fd)
+{
+	struct drm_mode_get_plane_res res, counts;
+	drmModePlaneResPtr r = 0;
+
+retry:
+	memclear(res);
+	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res))
+		return 0;
+
+	counts = res;
+
+	if (res.count_planes) {
+		res.plane_id_ptr = VOID2U64(drmMalloc(res.count_planes *
+							sizeof(uint32_t)));
+		if (!res.plane_id_ptr)
+			goto err_allocs;
+	}
+
+	if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &res))
+		goto err_allocs;
+
+	if (counts.count_planes < res.count_planes) {
 		drmFree(U642VOID(res.plane_id_ptr));
 		goto retry;
 	}
 
-	if (!(r = drmMalloc(sizeof(*r))))
-		goto err_allocs;
+	if (!(r = drmMalloc(sizeof(*r))))
+		goto err_allocs;
+
+	r->count_planes = res.count_planes;
+	r->planes = drmAllocCpy(U642VOID(res.plane_id_ptr),
+				  res.count_planes, sizeof(uint32_t));
+	if (res.count_planes && !r->planes) {
+		drmFree(r->planes);
+		drmFree(r);
+		r = 0;
+	}
+
+err_allocs:
+	drmFree(U642VOID(res.plane_id_ptr));
+
+	return r;
+}
+
+drm_public void drmModeFreePlaneResources(drmModePlaneResPtr ptr)
+{
+	if (!ptr)
+		return;
+
+	drmFree(ptr->planes);
+	drmFree(ptr);
+}
+
+drm_public drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd,
+						      uint32_t object_id,
+						      uint32_t object_type)
+{
+	struct drm_mode_obj_get_properties properties;
+	drmModeObjectPropertiesPtr ret = NULL;
+	uint32_t count;
+
+retry:
+	memclear(properties);
+	properties.obj_id = object_id;
+	properties.obj_type = object_type;
+
+	if (drmIoctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &properties))
+		return 0;
+
+	count = properties.count_props;
+
+	if (count) {
+		properties.props_ptr = VOID2U64(drmMalloc(count *
+							  sizeof(uint32_t)));
+		if (!properties.props_ptr)
+			goto err_allocs;
+		properties.prop_values_ptr = VOID2U64(drmMalloc(count *
+						      sizeof(uint64_t)));
+		if (!properties.prop_values_ptr)
+			goto err_allocs;
+	}
+
+	if (drmIoctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &properties))
+		goto err_allocs;
+
+	if (count < properties.count_props) {
+		drmFree(U642VOID(properties.props_ptr));
+		drmFree(U642VOID(properties.prop_values_ptr));
+		goto retry;
+	}
+	count = properties.count_props;
+
+	ret = drmMalloc(sizeof(*ret));
+	if (!ret)
+		goto err_allocs;
+
+	ret->count_props = count;
+	ret->props = drmAllocCpy(U642VOID(properties.props_ptr),
+				 count, sizeof(uint32_t));
+	ret->prop_values = drmAllocCpy(U642VOID(properties.prop_values_ptr),
+				       count, sizeof(uint64_t));
+	if (ret->count_props && (!ret->props || !ret->prop_values)) {
+		drmFree(ret->props);
+		drmFree(ret->prop_values);
+		drmFree(ret);
+		ret = NULL;
+	}
+
+err_allocs:
+	drmFree(U642VOID(properties.props_ptr));
+	drmFree(U642VOID(properties.prop_values_ptr));
+	return ret;
+}
+
+drm_public void drmModeFreeObjectProperties(drmModeObjectPropertiesPtr ptr)
+{
+	if (!ptr)
+		return;
+	drmFree(ptr->props);
+	drmFree(ptr->prop_values);
+	drmFree(ptr);
+}
+
+drm_public int drmModeObjectSetProperty(int fd, uint32_t object_id, uint32_t object_type,
+			     uint32_t property_id, uint64_t value)
+{
+	struct drm_mode_obj_set_property prop;
+
+	memclear(prop);
+	prop.value = value;
+	prop.prop_id = property_id;
+	prop.obj_id = object_id;
+	prop.obj_type = object_type;
+
+	return DRM_IOCTL(fd, DRM_IOCTL_MODE_OBJ_SETPROPERTY, &prop);
+}
+
+typedef struct _drmModeAtomicReqItem drmModeAtomicReqItem, *drmModeAtomicReqItemPtr;
+
+/*
+ * FNV-1a over 64-bit words, in four independent lanes so that the
+ * multiplies of a large LUT overlap. The tail is folded in byte by byte.
+ */
+static uint64_t content_hash(const void *data, size_t size)
+{
+	const uint64_t prime = 0x100000001b3ull;
+	const unsigned char *p = data;
+	uint64_t lane[4], word[4], hash;
+	unsigned int i;
+
+	for (i = 0; i < 4; i++)
+		lane[i] = (0xcbf29ce484222325ull + i) ^ size;
+
+	for (; size >= sizeof(word); p += sizeof(word), size -= sizeof(word)) {
+		memcpy(word, p, sizeof(word));
+		for (i = 0; i < 4; i++)
+			lane[i] = (lane[i] ^ word[i]) * prime;
+	}
+
+	hash = lane[0];
+	for (i = 1; i < 4; i++)
+		hash = (hash ^ lane[i]) * prime;
+	for (; size; p++, size--)
+		hash = (hash ^ *p) * prime;
+
+	return hash;
+}
+
+struct _drmModeAtomicReqItem {
+	uint32_t object_id;
+	uint32_t property_id;
+	uint64_t value;
+};
+
+struct _drmModeAtomicReq {
+	uint32_t cursor;
+	uint32_t size_items;
+	drmModeAtomicReqItemPtr items;
+
+	uint32_t *objs_cache;
+	uint32_t *count_props_cache;
+	uint32_t *props_cache;
+	uint64_t *prop_values_cache;
+
+	/* scratch space for sorting items that were added out of order */
+	drmModeAtomicReqItemPtr sort_cache[2];
+
+	uint32_t count_cache;
+	uint32_t size_cache;
+
+	/* last committed state in delta mode, sorted, plus a merge buffer */
+	drmModeAtomicReqItemPtr committed[2];
+	uint32_t count_committed;
+	uint32_t count_pending;
+	uint32_t size_committed;
+
+	/* TEST_ONLY outcomes, keyed by the hash of the normalized cache */
+	drmModeAtomicTestCachePtr test_cache;
+	uint64_t test_key;
+	uint32_t count_test_props;
+
+	/* flags */
+	uint32_t dirty:1;
+	uint32_t delta:1;
+	uint32_t padding:30;
+};
+
+drm_public drmModeAtomicReqPtr drmModeAtomicAlloc(void)
+{
+	drmModeAtomicReqPtr req;
+
+	req = drmMalloc(sizeof *req);
+	if (!req)
+		return NULL;
+
+	req->dirty = 1;
+
+	return req;
+}
+
+drm_public drmModeAtomicReqPtr drmModeAtomicDuplicate(drmModeAtomicReqPtr old)
+{
+	drmModeAtomicReqPtr new;
+
+	if (!old)
+		return NULL;
+
+	new = drmMalloc(sizeof *new);
+	if (!new)
+		return NULL;
+
+	new->cursor = old->cursor;
+	new->size_items = old->size_items;
+
+	if (old->size_items) {
+		new->items = drmMalloc(old->size_items * sizeof(*new->items));
+		if (!new->items) {
+			free(new);
+			return NULL;
+		}
+		memcpy(new->items, old->items,
+		       old->size_items * sizeof(*new->items));
+	}
+
+	new->dirty = 1;
+
+	return new;
+}
+
+drm_public int drmModeAtomicClone(const drmModeAtomicReq *old, drmModeAtomicReq *new)
+{
+	if (!old || !new)
+		return -EINVAL;
+
+	if (old->cursor >= new->size_items) {
+		drmModeAtomicReqItem *new_items;
+
+		new_items = drmMalloc(old->cursor * sizeof(*old->items));
+		if (!new_items)
+			return -ENOMEM;
+
+		free(new->items);
+		new->items = new_items;
+		new->size_items = old->cursor;
+	}
+
+	memcpy(new->items, old->items, old->cursor * sizeof(*old->items));
+
+	new->cursor = old->cursor;
+	new->dirty = 1;
+
+	return 0;
+}
+
+drm_public int drmModeAtomicMerge(drmModeAtomicReqPtr base,
+                                  drmModeAtomicReqPtr augment)
+{
+	if (!base)
+		return -EINVAL;
+
+	if (!augment || augment->cursor == 0)
+		return 0;
+
+	if (base->cursor + augment->cursor >= base->size_items) {
+		drmModeAtomicReqItemPtr new;
+		int saved_size = base->size_items;
+
+		base->size_items = base->cursor + augment->cursor;
+		new = realloc(base->items,
+			      base->size_items * sizeof(*base->items));
+		if (!new) {
+			base->size_items = saved_size;
+			return -ENOMEM;
+		}
+		base->items = new;
+	}
+
+	memcpy(&base->items[base->cursor], augment->items,
+	       augment->cursor * sizeof(*augment->items));
+	base->cursor += augment->cursor;
+
+	base->dirty = 1;
+
+	return 0;
+}
+
+drm_public int drmModeAtomicGetCursor(drmModeAtomicReqPtr req)
+{
+	if (!req)
+		return -EINVAL;
+	return req->cursor;
+}
+
+drm_public void drmModeAtomicSetCursor(drmModeAtomicReqPtr req, int cursor)
+{
+	if (!req)
+		return;
+
+	if (cursor < 0)
+		return;
+
+	if (req->cursor != cursor)
+		req->dirty = 1;
+
+	req->cursor = cursor;
+}
+
+drm_public void drmModeAtomicReset(drmModeAtomicReqPtr req)
+{
+	if (!req)
+		return;
+
+	req->cursor = 0;
+	req->dirty = 1;
+}
+
+drm_public int drmModeAtomicSetDelta(drmModeAtomicReqPtr req, int enable)
+{
+	if (!req)
+		return -EINVAL;
+
+	req->delta = !!enable;
+	req->count_committed = 0;
+	req->dirty = 1;
+
+	return 0;
+}
+
+drm_public void drmModeAtomicInvalidateDelta(drmModeAtomicReqPtr req)
+{
+	if (!req)
+		return;
+
+	req->count_committed = 0;
+	req->dirty = 1;
+}
+
+/* TEST_ONLY outcomes are kept in sets of this many entries. */
+#define ATOMIC_TEST_WAYS	4
+
+struct atomic_test_entry {
+	uint64_t key;
+	uint32_t generation;
+	uint32_t flags;
+	int32_t result;
+	uint32_t count_objs;
+	uint32_t count_props;
+	uint32_t size;
+	/* The tested values, then objects, property counts and properties. */
+	void *state;
+};
+
+struct _drmModeAtomicTestCache {
+	/* Entries from older generations are invalid. */
+	uint32_t generation;
+	uint32_t mask;
+	uint32_t victim;
+	struct atomic_test_entry *entries;
+	drmModeAtomicTestCacheStats stats;
+};
+
+drm_public drmModeAtomicTestCachePtr drmModeAtomicTestCacheCreate(unsigned int size)
+{
+	drmModeAtomicTestCachePtr cache;
+	unsigned int sets = 1;
+
+	while (sets * ATOMIC_TEST_WAYS < size && sets < (1u << 20))
+		sets *= 2;
+
+	cache = drmMalloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->entries = drmMalloc(sets * ATOMIC_TEST_WAYS *
+				   sizeof(*cache->entries));
+	if (!cache->entries) {
+		drmFree(cache);
+		return NULL;
+	}
+
+	cache->generation = 1;
+	cache->mask = sets - 1;
 
-	r->count_planes = res.count_planes;
-	r->planes = drmAllocCpy(U642VOID(res.plane_id_ptr),
-				  res.count_planes, sizeof(uint32_t));
-	if (res.count_planes && !r->planes) {
-		drmFree(r->planes);
-		drmFree(r);
-		r = 0;
+	return cache;
+}
+
+drm_public void drmModeAtomicTestCacheFree(drmModeAtomicTestCachePtr cache)
+{
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	for (i = 0; i < (cache->mask + 1) * ATOMIC_TEST_WAYS; i++)
+		free(cache->entries[i].state);
+	drmFree(cache->entries);
+	drmFree(cache);
+}
+
+drm_public void drmModeAtomicTestCacheInvalidate(drmModeAtomicTestCachePtr cache)
+{
+	unsigned int i;
+
+	if (!cache)
+		return;
+
+	cache->stats.invalidations++;
+
+	if (++cache->generation == 0) {
+		/* Wrapped around, really forget everything. */
+		for (i = 0; i < (cache->mask + 1) * ATOMIC_TEST_WAYS; i++)
+			cache->entries[i].generation = 0;
+		cache->generation = 1;
 	}
+}
 
-err_allocs:
-	drmFree(U642VOID(res.plane_id_ptr));
+drm_public void drmModeAtomicTestCacheGetStats(drmModeAtomicTestCachePtr cache,
+					       drmModeAtomicTestCacheStatsPtr stats)
+{
+	*stats = cache->stats;
+}
 
-	return r;
+drm_public int drmModeAtomicSetTestCache(drmModeAtomicReqPtr req,
+					 drmModeAtomicTestCachePtr cache)
+{
+	if (!req)
+		return -EINVAL;
+
+	req->test_cache = cache;
+	/* Make the next commit compute the key. */
+	req->dirty = 1;
+
+	return 0;
 }
 
-drm_public void drmModeFreePlaneResources(drmModePlaneResPtr ptr)
+static size_t atomic_test_state_size(uint32_t count_objs, uint32_t count_props)
 {
-	if (!ptr)
+	return count_props * sizeof(uint64_t) +
+		(2 * count_objs + count_props) * sizeof(uint32_t);
+}
+
+/* Whether entry holds exactly the normalized property set of req. */
+static bool atomic_test_match(const struct atomic_test_entry *entry,
+			      drmModeAtomicReqPtr req, uint32_t flags)
+{
+	const char *p = entry->state;
+	uint32_t count_objs = req->count_cache;
+	uint32_t count_props = req->count_test_props;
+
+	if (entry->key != req->test_key || entry->flags != flags ||
+	    entry->count_objs != count_objs ||
+	    entry->count_props != count_props)
+		return false;
+
+	if (memcmp(p, req->prop_values_cache, count_props * sizeof(uint64_t)))
+		return false;
+	p += count_props * sizeof(uint64_t);
+	if (memcmp(p, req->objs_cache, count_objs * sizeof(uint32_t)))
+		return false;
+	p += count_objs * sizeof(uint32_t);
+	if (memcmp(p, req->count_props_cache, count_objs * sizeof(uint32_t)))
+		return false;
+	p += count_objs * sizeof(uint32_t);
+
+	return !memcmp(p, req->props_cache, count_props * sizeof(uint32_t));
+}
+
+/*
+ * Copies the normalized property set of req into entry, which stays invalid
+ * until the outcome is stored. Returns -ENOMEM if there is no room for it.
+ */
+static int atomic_test_save(struct atomic_test_entry *entry,
+			    drmModeAtomicReqPtr req, uint32_t flags)
+{
+	uint32_t count_objs = req->count_cache;
+	uint32_t count_props = req->count_test_props;
+	size_t size = atomic_test_state_size(count_objs, count_props);
+	char *p;
+
+	entry->generation = 0;
+
+	if (size > entry->size) {
+		p = realloc(entry->state, size);
+		if (!p)
+			return -ENOMEM;
+		entry->state = p;
+		entry->size = size;
+	}
+
+	p = entry->state;
+	memcpy(p, req->prop_values_cache, count_props * sizeof(uint64_t));
+	p += count_props * sizeof(uint64_t);
+	memcpy(p, req->objs_cache, count_objs * sizeof(uint32_t));
+	p += count_objs * sizeof(uint32_t);
+	memcpy(p, req->count_props_cache, count_objs * sizeof(uint32_t));
+	p += count_objs * sizeof(uint32_t);
+	memcpy(p, req->props_cache, count_props * sizeof(uint32_t));
+
+	entry->key = req->test_key;
+	entry->flags = flags;
+	entry->count_objs = count_objs;
+	entry->count_props = count_props;
+
+	return 0;
+}
+
+/*
+ * Returns the entry holding the outcome for the property set of req and
+ * flags if there is a valid one, or else the entry to store it in. The
+ * hash only picks the set, entries are compared in full.
+ */
+static struct atomic_test_entry *
+atomic_test_lookup(drmModeAtomicTestCachePtr cache, drmModeAtomicReqPtr req,
+		   uint32_t flags, bool *hit)
+{
+	struct atomic_test_entry *set;
+	unsigned int i;
+
+	cache->stats.lookups++;
+	*hit = true;
+
+	set = &cache->entries[(req->test_key & cache->mask) * ATOMIC_TEST_WAYS];
+	for (i = 0; i < ATOMIC_TEST_WAYS; i++) {
+		if (set[i].generation == cache->generation &&
+		    atomic_test_match(&set[i], req, flags))
+			return &set[i];
+	}
+
+	*hit = false;
+	for (i = 0; i < ATOMIC_TEST_WAYS; i++) {
+		if (set[i].generation != cache->generation)
+			return &set[i];
+	}
+
+	return &set[cache->victim++ % ATOMIC_TEST_WAYS];
+}
+
+drm_public int drmModeAtomicAddProperty(drmModeAtomicReqPtr req,
+                                        uint32_t object_id,
+                                        uint32_t property_id,
+                                        uint64_t value)
+{
+	if (!req)
+		return -EINVAL;
+
+	if (object_id == 0 || property_id == 0)
+		return -EINVAL;
+
+	if (req->cursor >= req->size_items) {
+		const uint32_t item_size_inc = getpagesize() / sizeof(*req->items);
+		drmModeAtomicReqItemPtr new;
+
+		req->size_items += item_size_inc;
+		new = realloc(req->items, req->size_items * sizeof(*req->items));
+		if (!new) {
+			req->size_items -= item_size_inc;
+			return -ENOMEM;
+		}
+		req->items = new;
+	}
+
+	req->items[req->cursor].object_id = object_id;
+	req->items[req->cursor].property_id = property_id;
+	req->items[req->cursor].value = value;
+	req->cursor++;
+	req->dirty = 1;
+
+	return req->cursor;
+}
+
+drm_public void drmModeAtomicFree(drmModeAtomicReqPtr req)
+{
+	if (!req)
 		return;
 
-	drmFree(ptr->planes);
-	drmFree(ptr);
+	drmFree(req->items);
+
+	free(req->objs_cache);
+	free(req->count_props_cache);
+	free(req->props_cache);
+	free(req->prop_values_cache);
+	free(req->sort_cache[0]);
+	free(req->sort_cache[1]);
+	free(req->committed[0]);
+	free(req->committed[1]);
+
+	drmFree(req);
 }
 
-drm_public drmModeObjectPropertiesPtr drmModeObjectGetProperties(int fd,
-						      uint32_t object_id,
-						      uint32_t object_type)
+static inline int item_less(const drmModeAtomicReqItem *first,
+			    const drmModeAtomicReqItem *second)
 {
-	struct drm_mode_obj_get_properties properties;
-	drmModeObjectPropertiesPtr ret = NULL;
-	uint32_t count;
+	if (first->object_id != second->object_id)
+		return first->object_id < second->object_id;
 
-retry:
-	memclear(properties);
-	properties.obj_id = object_id;
-	properties.obj_type = object_type;
+	return first->property_id < second->property_id;
+}
 
-	if (drmIoctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &properties))
+static bool items_sorted(const drmModeAtomicReqItem *items, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 1; i < count; i++) {
+		if (item_less(&items[i], &items[i - 1]))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Stable bottom-up merge sort of the request items by object ID, then by
+ * property ID, using the two sort caches as ping-pong buffers. Stability
+ * keeps duplicate property sets in the order they were added, so that the
+ * last one wins. Returns the buffer holding the sorted items.
+ */
+static drmModeAtomicReqItemPtr sort_items(drmModeAtomicReqPtr req)
+{
+	drmModeAtomicReqItemPtr src = req->sort_cache[0];
+	drmModeAtomicReqItemPtr dst = req->sort_cache[1];
+	drmModeAtomicReqItemPtr tmp;
+	const uint32_t count = req->cursor;
+	uint32_t width, lo, mid, hi, i, j, k;
+
+	memcpy(src, req->items, count * sizeof(*src));
+
+	for (width = 1; width < count; width *= 2) {
+		for (lo = 0; lo < count; lo += 2 * width) {
+			mid = MIN2(lo + width, count);
+			hi = MIN2(lo + 2 * width, count);
+
+			for (i = lo, j = mid, k = lo; k < hi; k++) {
+				if (j >= hi ||
+				    (i < mid && !item_less(&src[j], &src[i])))
+					dst[k] = src[i++];
+				else
+					dst[k] = src[j++];
+			}
+		}
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	return src;
+}
+
+static int grow_cache(drmModeAtomicReqPtr req, uint32_t count)
+{
+	uint32_t size = req->size_cache ? req->size_cache : 16;
+	void *p;
+
+	if (count <= req->size_cache)
 		return 0;
 
-	count = properties.count_props;
+	while (size < count)
+		size *= 2;
 
-	if (count) {
-		properties.props_ptr = VOID2U64(drmMalloc(count *
-							  sizeof(uint32_t)));
-		if (!properties.props_ptr)
-			goto err_allocs;
-		properties.prop_values_ptr = VOID2U64(drmMalloc(count *
-						      sizeof(uint64_t)));
-		if (!properties.prop_values_ptr)
-			goto err_allocs;
+	/* Keep whatever we manage to grow, size_cache is the minimum. */
+#define GROW(array) \
+	do { \
+		p = realloc(req->array, size * sizeof(*req->array)); \
+		if (!p) \
+			return -ENOMEM; \
+		req->array = p; \
+	} while (0)
+
+	GROW(objs_cache);
+	GROW(count_props_cache);
+	GROW(props_cache);
+	GROW(prop_values_cache);
+	GROW(sort_cache[0]);
+	GROW(sort_cache[1]);
+#undef GROW
+
+	req->size_cache = size;
+
+	return 0;
+}
+
+static int update_cache(drmModeAtomicReqPtr req)
+{
+	const drmModeAtomicReqItem *items = req->items;
+	uint32_t count_objs = 0;
+	uint32_t count_props = 0;
+	uint32_t i;
+
+	if (grow_cache(req, req->cursor)) {
+		errno = ENOMEM;
+		return -ENOMEM;
 	}
 
-	if (drmIoctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &properties))
-		goto err_allocs;
+	/* Most users add properties object by object, so only sort if needed. */
+	if (!items_sorted(items, req->cursor))
+		items = sort_items(req);
 
-	if (count < properties.count_props) {
-		drmFree(U642VOID(properties.props_ptr));
-		drmFree(U642VOID(properties.prop_values_ptr));
-		goto retry;
+	/*
+	 * Equal property sets are now adjacent, in the order they were added.
+	 * Eliminate duplicates in a single pass, keeping the last value.
+	 */
+	for (i = 0; i < req->cursor; i++) {
+		if (i + 1 < req->cursor &&
+		    items[i].object_id == items[i + 1].object_id &&
+		    items[i].property_id == items[i + 1].property_id)
+			continue;
+
+		if (count_objs == 0 ||
+		    req->objs_cache[count_objs - 1] != items[i].object_id) {
+			req->objs_cache[count_objs] = items[i].object_id;
+			req->count_props_cache[count_objs] = 0;
+			count_objs++;
+		}
+
+		req->count_props_cache[count_objs - 1]++;
+		req->props_cache[count_props] = items[i].property_id;
+		req->prop_values_cache[count_props] = items[i].value;
+		count_props++;
 	}
-	count = properties.count_props;
 
-	ret = drmMalloc(sizeof(*ret));
-	if (!ret)
-		goto err_allocs;
+	req->count_cache = count_objs;
+	req->dirty = 0;
+
+	if (req->test_cache) {
+		req->count_test_props = count_props;
+		req->test_key = content_hash(req->objs_cache,
+					     count_objs * sizeof(uint32_t));
+		req->test_key ^= content_hash(req->count_props_cache,
+					      count_objs * sizeof(uint32_t)) * 3;
+		req->test_key ^= content_hash(req->props_cache,
+					      count_props * sizeof(uint32_t)) * 5;
+		req->test_key ^= content_hash(req->prop_values_cache,
+					      count_props * sizeof(uint64_t)) * 7;
+	}
+
+	return 0;
+}
+
+/*
+ * Drop the property sets from the cache whose value matches the committed
+ * state, and merge the full cache into the second committed buffer, which
+ * becomes the committed state if the commit succeeds. Both lists are
+ * sorted, so this is a single merge pass. Returns the number of properties
+ * left in the cache.
+ */
+static int apply_delta(drmModeAtomicReqPtr req)
+{
+	const drmModeAtomicReqItem *old = req->committed[0];
+	drmModeAtomicReqItemPtr new;
+	drmModeAtomicReqItem item;
+	uint32_t count = req->count_committed + req->cursor;
+	uint32_t size = req->size_committed ? req->size_committed : 16;
+	uint32_t i, j, k = 0, c = 0, n = 0;
+	uint32_t count_objs = 0, count_props = 0, kept;
+	bool same;
+	void *p;
+
+	if (count > req->size_committed) {
+		while (size < count)
+			size *= 2;
+
+		p = realloc(req->committed[0], size * sizeof(*new));
+		if (!p)
+			return -ENOMEM;
+		req->committed[0] = p;
+
+		p = realloc(req->committed[1], size * sizeof(*new));
+		if (!p)
+			return -ENOMEM;
+		req->committed[1] = p;
+
+		req->size_committed = size;
+		old = req->committed[0];
+	}
+	new = req->committed[1];
+
+	for (i = 0; i < req->count_cache; i++) {
+		item.object_id = req->objs_cache[i];
+
+		for (j = 0, kept = 0; j < req->count_props_cache[i]; j++, k++) {
+			item.property_id = req->props_cache[k];
+			item.value = req->prop_values_cache[k];
+
+			while (c < req->count_committed && item_less(&old[c], &item))
+				new[n++] = old[c++];
+
+			same = false;
+			if (c < req->count_committed &&
+			    old[c].object_id == item.object_id &&
+			    old[c].property_id == item.property_id)
+				same = old[c++].value == item.value;
+
+			new[n++] = item;
+
+			if (same)
+				continue;
+
+			req->props_cache[count_props] = item.property_id;
+			req->prop_values_cache[count_props] = item.value;
+			count_props++;
+			kept++;
+		}
+
+		if (kept) {
+			req->objs_cache[count_objs] = item.object_id;
+			req->count_props_cache[count_objs] = kept;
+			count_objs++;
+		}
+	}
+
+	while (c < req->count_committed)
+		new[n++] = old[c++];
+
+	req->count_pending = n;
+	req->count_cache = count_objs;
+
+	/* The cache now only holds the delta, rebuild it for the next commit. */
+	req->dirty = 1;
+
+	return count_props;
+}
+
+drm_public int
+drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+			void *user_data)
+{
+	struct drm_mode_atomic atomic;
+	drmModeAtomicReqItemPtr tmp;
+	struct atomic_test_entry *memo = NULL;
+	bool dirty, hit;
+	int ret;
+
+	if (!req)
+		return -EINVAL;
+
+	if (req->cursor == 0)
+		return 0;
+
+	dirty = req->dirty;
+	if (dirty && update_cache(req))
+		return -1;
+
+	if (req->test_cache && (flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		memo = atomic_test_lookup(req->test_cache, req, flags, &hit);
+		if (hit) {
+			/* The delta was not applied, leave it to the next commit. */
+			if (req->delta)
+				req->dirty = dirty;
+			req->test_cache->stats.hits++;
+			return memo->result;
+		}
+		/* Save the full set now, the delta replaces it in the cache. */
+		if (atomic_test_save(memo, req, flags))
+			memo = NULL;
+	}
+
+	if (dirty && req->delta) {
+		ret = apply_delta(req);
+		if (ret < 0) {
+			/* Fall back to committing everything. */
+			req->count_committed = 0;
+			req->dirty = 1;
+			if (update_cache(req))
+				return -1;
+		} else if (ret == 0 && !(flags & DRM_MODE_PAGE_FLIP_EVENT)) {
+			/* Nothing changed, and nobody waits for an event. */
+			return 0;
+		} else if (ret == 0) {
+			/* Send the full state, so that the CRTCs signal. */
+			if (update_cache(req))
+				return -1;
+			req->dirty = 1;
+		}
+	}
+
+	memclear(atomic);
+
+	atomic.flags = flags;
+	atomic.count_objs = req->count_cache;
+	atomic.objs_ptr = VOID2U64(req->objs_cache);
+	atomic.count_props_ptr = VOID2U64(req->count_props_cache);
+	atomic.props_ptr = VOID2U64(req->props_cache);
+	atomic.prop_values_ptr = VOID2U64(req->prop_values_cache);
+	atomic.user_data = VOID2U64(user_data);
+
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+
+	if (memo) {
+		/* Only remember verdicts, not transient failures. */
+		if (ret == 0 || ret == -EINVAL || ret == -ERANGE) {
+			memo->generation = req->test_cache->generation;
+			memo->result = ret;
+			req->test_cache->stats.stored++;
+		}
+	} else if (req->test_cache && !(flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+		/*
+		 * A failed commit means the kernel disagrees with what was
+		 * tested, and any real commit changes state such as bandwidth
+		 * that every other test depends on.
+		 */
+		drmModeAtomicTestCacheInvalidate(req->test_cache);
+	}
 
-	ret->count_props = count;
-	ret->props = drmAllocCpy(U642VOID(properties.props_ptr),
-				 count, sizeof(uint32_t));
-	ret->prop_values = drmAllocCpy(U642VOID(properties.prop_values_ptr),
-				       count, sizeof(uint64_t));
-	if (ret->count_props && (!ret->props || !ret->prop_values)) {
-		drmFree(ret->props);
-		drmFree(ret->prop_values);
-		drmFree(ret);
-		ret = NULL;
+	if (req->delta && req->dirty) {
+		/* Only a real commit that succeeded changes the committed state. */
+		if (ret == 0 && !(flags & DRM_MODE_ATOMIC_TEST_ONLY)) {
+			tmp = req->committed[0];
+			req->committed[0] = req->committed[1];
+			req->committed[1] = tmp;
+			req->count_committed = req->count_pending;
+		}
 	}
 
-err_allocs:
-	drmFree(U642VOID(properties.props_ptr));
-	drmFree(U642VOID(properties.prop_values_ptr));
 	return ret;
 }
 
-drm_public void drmModeFreeObjectProperties(drmModeObjectPropertiesPtr ptr)
-{
-	if (!ptr)
-		return;
-	drmFree(ptr->props);
-	drmFree(ptr->prop_values);
-	drmFree(ptr);
-}
-
-drm_public int drmModeObjectSetProperty(int fd, uint32_t object_id, uint32_t object_type,
-			     uint32_t property_id, uint64_t value)
+drm_public int
+drmModeCreatePropertyBlob(int fd, const void *data, size_t length,
+                                     uint32_t *id)
 {
-	struct drm_mode_obj_set_property prop;
+	struct drm_mode_create_blob create;
+	int ret;
 
-	memclear(prop);
-	prop.value = value;
-	prop.prop_id = property_id;
-	prop.obj_id = object_id;
-	prop.obj_type = object_type;
+	if (length >= 0xffffffff)
+		return -ERANGE;
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_OBJ_SETPROPERTY, &prop);
-}
+	memclear(create);
 
-typedef struct _drmModeAtomicReqItem drmModeAtomicReqItem, *drmModeAtomicReqItemPtr;
+	create.length = length;
+	create.data = (uintptr_t) data;
+	create.blob_id = 0;
+	*id = 0;
 
-struct _drmModeAtomicReqItem {
-	uint32_t object_id;
-	uint32_t property_id;
-	uint64_t value;
-};
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_CREATEPROPBLOB, &create);
+	if (ret != 0)
+		return ret;
 
-struct _drmModeAtomicReq {
-	uint32_t cursor;
-	uint32_t size_items;
-	drmModeAtomicReqItemPtr items;
+	*id = create.blob_id;
+	return 0;
+}
 
-	uint32_t *objs_cache;
-	uint32_t *count_props_cache;
-	uint32_t *props_cache;
-	uint64_t *prop_values_cache;
+drm_public int
+drmModeDestroyPropertyBlob(int fd, uint32_t id)
+{
+	struct drm_mode_destroy_blob destroy;
 
-	uint32_t count_cache;
-	uint32_t size_cache[2];
+	memclear(destroy);
+	destroy.blob_id = id;
+	return DRM_IOCTL(fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &destroy);
+}
 
-	/* flags */
-	uint32_t dirty:1;
-	uint32_t padding:31;
+/*
+ * The blob and FB caches keep their entries in a drmHash table by content
+ * hash. The table holds the first entry for each hash, and entries with
+ * colliding hashes are chained off it. The chain link comes first in each
+ * entry, so that the table's values double as links.
+ */
+struct hash_chain {
+	struct hash_chain *next;	/* same hash */
+	uint64_t hash;
 };
 
-drm_public drmModeAtomicReqPtr drmModeAtomicAlloc(void)
+static void *hash_chain_lookup(void *table, uint64_t hash)
 {
-	drmModeAtomicReqPtr req;
+	void *value;
 
-	req = drmMalloc(sizeof *req);
-	if (!req)
+	if (drmHashLookup(table, (unsigned long)hash, &value))
 		return NULL;
 
-	req->dirty = 1;
+	return value;
+}
 
-	return req;
+static void hash_chain_insert(void *table, struct hash_chain *link)
+{
+	struct hash_chain *head = hash_chain_lookup(table, link->hash);
+
+	if (head) {
+		link->next = head->next;
+		head->next = link;
+	} else {
+		link->next = NULL;
+		drmHashInsert(table, (unsigned long)link->hash, link);
+	}
 }
 
-drm_public drmModeAtomicReqPtr drmModeAtomicDuplicate(drmModeAtomicReqPtr old)
+static void hash_chain_unlink(void *table, struct hash_chain *link)
 {
-	drmModeAtomicReqPtr new;
+	struct hash_chain *prev = hash_chain_lookup(table, link->hash);
+
+	/* drmHashInsert() does not replace, so the table's entry is deleted
+	 * and its successor inserted when the chain's head goes away. */
+	if (prev == link) {
+		drmHashDelete(table, (unsigned long)link->hash);
+		if (link->next)
+			drmHashInsert(table, (unsigned long)link->hash,
+				      link->next);
+	} else {
+		while (prev->next != link)
+			prev = prev->next;
+		prev->next = link->next;
+	}
+}
 
-	if (!old)
-		return NULL;
+/* Unreferenced blobs kept around for reuse before the oldest is destroyed. */
+#define BLOB_CACHE_IDLE	16
 
-	new = drmMalloc(sizeof *new);
-	if (!new)
-		return NULL;
+struct blob_entry {
+	struct hash_chain chain;	/* must come first */
+	drmMMListHead idle;
+	uint32_t id;
+	unsigned int refcount;
+	size_t size;
+	/* blob data follows */
+};
 
-	new->cursor = old->cursor;
-	new->size_items = old->size_items;
+struct _drmModeBlobCache {
+	int fd;
+	void *by_hash;
+	void *by_id;
+	drmMMListHead idle;
+	unsigned int count_idle;
+	drmModeBlobCacheStats stats;
+};
 
-	if (old->size_items) {
-		new->items = drmMalloc(old->size_items * sizeof(*new->items));
-		if (!new->items) {
-			free(new);
-			return NULL;
-		}
-		memcpy(new->items, old->items,
-		       old->size_items * sizeof(*new->items));
+drm_public drmModeBlobCachePtr drmModeBlobCacheCreate(int fd)
+{
+	drmModeBlobCachePtr cache;
+
+	cache = drmMalloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
+
+	cache->fd = fd;
+	cache->by_hash = drmHashCreate();
+	cache->by_id = drmHashCreate();
+	if (!cache->by_hash || !cache->by_id) {
+		if (cache->by_hash)
+			drmHashDestroy(cache->by_hash);
+		if (cache->by_id)
+			drmHashDestroy(cache->by_id);
+		drmFree(cache);
+		return NULL;
 	}
 
-	new->dirty = 1;
+	DRMINITLISTHEAD(&cache->idle);
 
-	return new;
+	return cache;
 }
 
-drm_public int drmModeAtomicClone(const drmModeAtomicReq *old, drmModeAtomicReq *new)
+static void blob_cache_destroy_entry(drmModeBlobCachePtr cache,
+				     struct blob_entry *entry)
 {
-	if (!old || !new)
-		return -EINVAL;
+	drmModeDestroyPropertyBlob(cache->fd, entry->id);
+	cache->stats.destroyed++;
 
-	if (old->cursor >= new->size_items) {
-		drmModeAtomicReqItem *new_items;
+	hash_chain_unlink(cache->by_hash, &entry->chain);
+	drmHashDelete(cache->by_id, entry->id);
 
-		new_items = drmMalloc(old->cursor * sizeof(*old->items));
-		if (!new_items)
-			return -ENOMEM;
+	drmFree(entry);
+}
 
-		free(new->items);
-		new->items = new_items;
-		new->size_items = old->cursor;
-	}
+drm_public void drmModeBlobCacheDestroy(drmModeBlobCachePtr cache)
+{
+	struct blob_entry *entry;
+	unsigned long key;
+	void *value;
 
-	memcpy(new->items, old->items, old->cursor * sizeof(*old->items));
+	if (!cache)
+		return;
 
-	new->cursor = old->cursor;
-	new->dirty = 1;
+	/* Destroy every blob, whether or not it is still referenced. */
+	while (drmHashFirst(cache->by_id, &key, &value)) {
+		entry = value;
+		blob_cache_destroy_entry(cache, entry);
+	}
 
-	return 0;
+	drmHashDestroy(cache->by_hash);
+	drmHashDestroy(cache->by_id);
+	drmFree(cache);
 }
 
-drm_public int drmModeAtomicMerge(drmModeAtomicReqPtr base,
-                                  drmModeAtomicReqPtr augment)
+drm_public int drmModeBlobCacheGet(drmModeBlobCachePtr cache,
+				   const void *data, size_t size,
+				   uint32_t *id)
 {
-	if (!base)
-		return -EINVAL;
+	struct blob_entry *entry;
+	uint64_t hash;
+	int ret;
 
-	if (!augment || augment->cursor == 0)
-		return 0;
+	hash = content_hash(data, size);
 
-	if (base->cursor + augment->cursor >= base->size_items) {
-		drmModeAtomicReqItemPtr new;
-		int saved_size = base->size_items;
+	for (entry = hash_chain_lookup(cache->by_hash, hash); entry;
+	     entry = (struct blob_entry *)entry->chain.next) {
+		if (entry->chain.hash != hash || entry->size != size ||
+		    memcmp(entry + 1, data, size))
+			continue;
 
-		base->size_items = base->cursor + augment->cursor;
-		new = realloc(base->items,
-			      base->size_items * sizeof(*base->items));
-		if (!new) {
-			base->size_items = saved_size;
-			return -ENOMEM;
+		if (entry->refcount++ == 0) {
+			DRMLISTDEL(&entry->idle);
+			cache->count_idle--;
 		}
-		base->items = new;
+
+		cache->stats.hits++;
+		*id = entry->id;
+		return 0;
 	}
 
-	memcpy(&base->items[base->cursor], augment->items,
-	       augment->cursor * sizeof(*augment->items));
-	base->cursor += augment->cursor;
+	entry = drmMalloc(sizeof(*entry) + size);
+	if (!entry)
+		return -ENOMEM;
 
-	base->dirty = 1;
+	ret = drmModeCreatePropertyBlob(cache->fd, data, size, &entry->id);
+	if (ret) {
+		drmFree(entry);
+		return ret;
+	}
+
+	entry->chain.hash = hash;
+	entry->size = size;
+	entry->refcount = 1;
+	memcpy(entry + 1, data, size);
+
+	hash_chain_insert(cache->by_hash, &entry->chain);
+	drmHashInsert(cache->by_id, entry->id, entry);
 
+	cache->stats.misses++;
+	*id = entry->id;
 	return 0;
 }
 
-drm_public int drmModeAtomicGetCursor(drmModeAtomicReqPtr req)
+drm_public int drmModeBlobCachePut(drmModeBlobCachePtr cache, uint32_t id)
 {
-	if (!req)
-		return -EINVAL;
-	return req->cursor;
-}
+	struct blob_entry *entry;
+	void *value;
 
-drm_public void drmModeAtomicSetCursor(drmModeAtomicReqPtr req, int cursor)
-{
-	if (!req)
-		return;
+	if (drmHashLookup(cache->by_id, id, &value))
+		return -ENOENT;
 
-	if (cursor < 0)
-		return;
+	entry = value;
+	if (entry->refcount == 0)
+		return -EINVAL;
 
-	if (req->cursor != cursor)
-		req->dirty = 1;
+	if (--entry->refcount)
+		return 0;
 
-	req->cursor = cursor;
+	/*
+	 * The kernel keeps its own reference to blobs used by the current
+	 * state, so the id only needs to stay alive for being reused. Keep
+	 * the most recently released ones and destroy the oldest.
+	 */
+	DRMLISTADD(&entry->idle, &cache->idle);
+	if (++cache->count_idle > BLOB_CACHE_IDLE)
+		drmModeBlobCacheTrim(cache, BLOB_CACHE_IDLE);
+
+	return 0;
 }
 
-drm_public int drmModeAtomicAddProperty(drmModeAtomicReqPtr req,
-                                        uint32_t object_id,
-                                        uint32_t property_id,
-                                        uint64_t value)
+drm_public void drmModeBlobCacheTrim(drmModeBlobCachePtr cache,
+				     unsigned int keep)
 {
-	if (!req)
-		return -EINVAL;
+	struct blob_entry *entry;
 
-	if (object_id == 0 || property_id == 0)
-		return -EINVAL;
+	while (cache->count_idle > keep) {
+		entry = DRMLISTENTRY(struct blob_entry, cache->idle.prev, idle);
+		DRMLISTDEL(&entry->idle);
+		cache->count_idle--;
+		blob_cache_destroy_entry(cache, entry);
+	}
+}
 
-	if (req->cursor >= req->size_items) {
-		const uint32_t item_size_inc = getpagesize() / sizeof(*req->items);
-		drmModeAtomicReqItemPtr new;
+drm_public void drmModeBlobCacheGetStats(drmModeBlobCachePtr cache,
+					 drmModeBlobCacheStatsPtr stats)
+{
+	*stats = cache->stats;
+	stats->idle = cache->count_idle;
+}
 
-		req->size_items += item_size_inc;
-		new = realloc(req->items, req->size_items * sizeof(*req->items));
-		if (!new) {
-			req->size_items -= item_size_inc;
-			return -ENOMEM;
-		}
-		req->items = new;
-	}
+/* Unreferenced FBs kept around for reuse before the oldest is removed. */
+#define FB_CACHE_IDLE	32
+
+struct fb_key {
+	uint32_t width, height;
+	uint32_t pixel_format;
+	uint32_t flags;
+	uint32_t handles[4];
+	uint32_t pitches[4];
+	uint32_t offsets[4];
+	uint64_t modifier[4];
+};
 
-	req->items[req->cursor].object_id = object_id;
-	req->items[req->cursor].property_id = property_id;
-	req->items[req->cursor].value = value;
-	req->cursor++;
-	req->dirty = 1;
+struct fb_entry {
+	struct hash_chain chain;	/* must come first */
+	drmMMListHead link;
+	drmMMListHead idle;
+	uint32_t fb_id;
+	unsigned int refcount;
+	int stale;
+	struct fb_key key;
+};
 
-	return req->cursor;
-}
+struct _drmModeFBCache {
+	int fd;
+	void *by_hash;
+	void *by_id;
+	drmMMListHead entries;
+	drmMMListHead idle;
+	unsigned int count_idle;
+	drmModeFBCacheStats stats;
+};
 
-drm_public void drmModeAtomicFree(drmModeAtomicReqPtr req)
+drm_public drmModeFBCachePtr drmModeFBCacheCreate(int fd)
 {
-	if (!req)
-		return;
+	drmModeFBCachePtr cache;
 
-	drmFree(req->items);
+	cache = drmMalloc(sizeof(*cache));
+	if (!cache)
+		return NULL;
 
-	free(req->objs_cache);
-	free(req->count_props_cache);
-	free(req->props_cache);
-	free(req->prop_values_cache);
+	cache->fd = fd;
+	cache->by_hash = drmHashCreate();
+	cache->by_id = drmHashCreate();
+	if (!cache->by_hash || !cache->by_id) {
+		if (cache->by_hash)
+			drmHashDestroy(cache->by_hash);
+		if (cache->by_id)
+			drmHashDestroy(cache->by_id);
+		drmFree(cache);
+		return NULL;
+	}
 
-	drmFree(req);
+	DRMINITLISTHEAD(&cache->entries);
+	DRMINITLISTHEAD(&cache->idle);
+
+	return cache;
 }
 
-static int sort_req_list(const void *misc, const void *other)
+/* Takes an entry out of the key lookup, so it is never handed out again. */
+static void fb_cache_unlink(drmModeFBCachePtr cache, struct fb_entry *entry)
 {
-	const drmModeAtomicReqItem *first = misc;
-	const drmModeAtomicReqItem *second = other;
+	if (entry->stale)
+		return;
 
-	if (first->object_id < second->object_id)
-		return -1;
-	else if (first->object_id > second->object_id)
-		return 1;
-	else
-		return second->property_id - first->property_id;
+	entry->stale = 1;
+	hash_chain_unlink(cache->by_hash, &entry->chain);
 }
 
-static int update_cache(drmModeAtomicReqPtr req)
+static void fb_cache_remove(drmModeFBCachePtr cache, struct fb_entry *entry)
 {
-	drmModeAtomicReqPtr sorted;
-	int ret = -1;
-
-	uint32_t last_obj_id = 0;
-	int obj_idx = -1;
-	uint32_t count_objs = 0;
-	uint32_t i;
-
-	sorted = drmModeAtomicDuplicate(req);
-	if (sorted == NULL)
-		return -ENOMEM;
-
-	/* Sort the list by object ID, then by property ID. */
-	qsort(sorted->items, sorted->cursor, sizeof(*sorted->items),
-	      sort_req_list);
+	drmModeRmFB(cache->fd, entry->fb_id);
+	cache->stats.removed++;
 
-	/* Now the list is sorted, eliminate duplicate property sets. */
-	for (i = 0; i < sorted->cursor; i++) {
-		if (sorted->items[i].object_id != last_obj_id) {
-			count_objs++;
-			last_obj_id = sorted->items[i].object_id;
-		}
+	fb_cache_unlink(cache, entry);
+	drmHashDelete(cache->by_id, entry->fb_id);
 
-		if (i == sorted->cursor - 1)
-			continue;
+	/* Only unreferenced entries that were not stale sit on the idle list. */
+	if (!DRMLISTEMPTY(&entry->idle)) {
+		DRMLISTDEL(&entry->idle);
+		cache->count_idle--;
+	}
+	DRMLISTDEL(&entry->link);
+	drmFree(entry);
+}
 
-		if (sorted->items[i].object_id != sorted->items[i + 1].object_id ||
-		    sorted->items[i].property_id != sorted->items[i + 1].property_id)
-			continue;
+drm_public void drmModeFBCacheDestroy(drmModeFBCachePtr cache)
+{
+	struct fb_entry *entry, *tmp;
 
-		memmove(&sorted->items[i], &sorted->items[i + 1],
-			(sorted->cursor - i - 1) * sizeof(*sorted->items));
-		sorted->cursor--;
-	}
+	if (!cache)
+		return;
 
-	/* Increase the cache buffer if necessary. */
-	if (count_objs > req->size_cache[0]) {
-		free(req->objs_cache);
-		free(req->count_props_cache);
+	/* Remove every FB, whether or not it is still referenced. */
+	DRMLISTFOREACHENTRYSAFE(entry, tmp, &cache->entries, link)
+		fb_cache_remove(cache, entry);
 
-		req->objs_cache = malloc(count_objs * sizeof(uint32_t));
-		req->count_props_cache = malloc(count_objs * sizeof(uint32_t));
+	drmHashDestroy(cache->by_hash);
+	drmHashDestroy(cache->by_id);
+	drmFree(cache);
+}
 
-		if (!req->objs_cache || !req->count_props_cache) {
-			req->size_cache[0] = 0;
-			errno = ENOMEM;
-			goto fail;
-		}
+drm_public int drmModeFBCacheGet(drmModeFBCachePtr cache, uint32_t width,
+				 uint32_t height, uint32_t pixel_format,
+				 const uint32_t bo_handles[4],
+				 const uint32_t pitches[4],
+				 const uint32_t offsets[4],
+				 const uint64_t modifier[4],
+				 uint32_t *buf_id, uint32_t flags)
+{
+	struct fb_entry *entry;
+	struct fb_key key;
+	uint64_t hash;
+	int ret;
 
-		req->size_cache[0] = count_objs;
-	}
+	/* Cleared first, the padding-free key is compared with memcmp(). */
+	memclear(key);
+	key.width = width;
+	key.height = height;
+	key.pixel_format = pixel_format;
+	key.flags = flags;
+	memcpy(key.handles, bo_handles, sizeof(key.handles));
+	memcpy(key.pitches, pitches, sizeof(key.pitches));
+	memcpy(key.offsets, offsets, sizeof(key.offsets));
+	if (modifier)
+		memcpy(key.modifier, modifier, sizeof(key.modifier));
 
-	if (sorted->cursor > req->size_cache[1]) {
-		free(req->props_cache);
-		free(req->prop_values_cache);
+	hash = content_hash(&key, sizeof(key));
 
-		req->props_cache = malloc(sorted->cursor * sizeof(uint32_t));
-		req->prop_values_cache = malloc(sorted->cursor * sizeof(uint64_t));
+	for (entry = hash_chain_lookup(cache->by_hash, hash); entry;
+	     entry = (struct fb_entry *)entry->chain.next) {
+		if (entry->chain.hash != hash ||
+		    memcmp(&entry->key, &key, sizeof(key)))
+			continue;
 
-		if (!req->props_cache || !req->prop_values_cache) {
-			req->size_cache[1] = 0;
-			errno = ENOMEM;
-			goto fail;
+		if (entry->refcount++ == 0) {
+			DRMLISTDELINIT(&entry->idle);
+			cache->count_idle--;
 		}
 
-		req->size_cache[1] = sorted->cursor;
+		cache->stats.hits++;
+		*buf_id = entry->fb_id;
+		return 0;
 	}
 
-	for (i = 0, last_obj_id = 0; i < sorted->cursor; i++) {
-		if (sorted->items[i].object_id != last_obj_id) {
-			obj_idx++;
-			req->objs_cache[obj_idx] = sorted->items[i].object_id;
-			req->count_props_cache[obj_idx] = 0;
-			last_obj_id = req->objs_cache[obj_idx];
-		}
+	entry = drmMalloc(sizeof(*entry));
+	if (!entry)
+		return -ENOMEM;
 
-		req->count_props_cache[obj_idx]++;
-		req->props_cache[i] = sorted->items[i].property_id;
-		req->prop_values_cache[i] = sorted->items[i].value;
+	ret = drmModeAddFB2WithModifiers(cache->fd, width, height, pixel_format,
+					 bo_handles, pitches, offsets, modifier,
+					 &entry->fb_id, flags);
+	if (ret) {
+		drmFree(entry);
+		return ret;
 	}
 
-	req->count_cache = count_objs;
-	req->dirty = 0;
+	entry->chain.hash = hash;
+	entry->key = key;
+	entry->refcount = 1;
+	DRMINITLISTHEAD(&entry->idle);
 
-	ret = 0;
+	hash_chain_insert(cache->by_hash, &entry->chain);
+	drmHashInsert(cache->by_id, entry->fb_id, entry);
+	DRMLISTADD(&entry->link, &cache->entries);
 
-fail:
-	drmModeAtomicFree(sorted);
-	return ret;
+	cache->stats.misses++;
+	*buf_id = entry->fb_id;
+	return 0;
 }
 
-drm_public int
-drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
-			void *user_data)
+drm_public int drmModeFBCachePut(drmModeFBCachePtr cache, uint32_t buf_id)
 {
-	struct drm_mode_atomic atomic;
+	struct fb_entry *entry;
+	void *value;
 
-	if (!req)
+	if (drmHashLookup(cache->by_id, buf_id, &value))
+		return -ENOENT;
+
+	entry = value;
+	if (entry->refcount == 0)
 		return -EINVAL;
 
-	if (req->cursor == 0)
+	if (--entry->refcount)
 		return 0;
 
-	if (req->dirty == 0)
-		goto out;
-
-	if (update_cache(req))
-		return -1;
-
-out:
-	memclear(atomic);
+	if (entry->stale) {
+		fb_cache_remove(cache, entry);
+		return 0;
+	}
 
-	atomic.flags = flags;
-	atomic.count_objs = req->count_cache;
-	atomic.objs_ptr = VOID2U64(req->objs_cache);
-	atomic.count_props_ptr = VOID2U64(req->count_props_cache);
-	atomic.props_ptr = VOID2U64(req->props_cache);
-	atomic.prop_values_ptr = VOID2U64(req->prop_values_cache);
-	atomic.user_data = VOID2U64(user_data);
+	DRMLISTADD(&entry->idle, &cache->idle);
+	if (++cache->count_idle > FB_CACHE_IDLE)
+		drmModeFBCacheTrim(cache, FB_CACHE_IDLE);
 
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	return 0;
 }
 
-drm_public int
-drmModeCreatePropertyBlob(int fd, const void *data, size_t length,
-                                     uint32_t *id)
+drm_public void drmModeFBCacheInvalidateHandle(drmModeFBCachePtr cache,
+					       uint32_t handle)
 {
-	struct drm_mode_create_blob create;
-	int ret;
-
-	if (length >= 0xffffffff)
-		return -ERANGE;
+	struct fb_entry *entry, *tmp;
+	unsigned int i;
 
-	memclear(create);
+	DRMLISTFOREACHENTRYSAFE(entry, tmp, &cache->entries, link) {
+		for (i = 0; i < 4; i++) {
+			if (entry->key.handles[i] == handle)
+				break;
+		}
+		if (i == 4)
+			continue;
 
-	create.length = length;
-	create.data = (uintptr_t) data;
-	create.blob_id = 0;
-	*id = 0;
+		/*
+		 * The handle may be reused for another BO once closed, so
+		 * FBs still in use are only taken out of the lookup and
+		 * removed when their last reference goes.
+		 */
+		cache->stats.invalidated++;
+		if (entry->refcount)
+			fb_cache_unlink(cache, entry);
+		else
+			fb_cache_remove(cache, entry);
+	}
+}
 
-	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_CREATEPROPBLOB, &create);
-	if (ret != 0)
-		return ret;
+drm_public void drmModeFBCacheTrim(drmModeFBCachePtr cache, unsigned int keep)
+{
+	struct fb_entry *entry;
 
-	*id = create.blob_id;
-	return 0;
+	while (cache->count_idle > keep) {
+		entry = DRMLISTENTRY(struct fb_entry, cache->idle.prev, idle);
+		fb_cache_remove(cache, entry);
+	}
 }
 
-drm_public int
-drmModeDestroyPropertyBlob(int fd, uint32_t id)
+drm_public void drmModeFBCacheGetStats(drmModeFBCachePtr cache,
+				       drmModeFBCacheStatsPtr stats)
 {
-	struct drm_mode_destroy_blob destroy;
-
-	memclear(destroy);
-	destroy.blob_id = id;
-	return DRM_IOCTL(fd, DRM_IOCTL_MODE_DESTROYPROPBLOB, &destroy);
+	*stats = cache->stats;
+	stats->idle = cache->count_idle;
 }
 
 drm_public int
@@ -1701,3 +3829,490 @@ drm_public void drmModeFreeFB2(drmModeFB2Ptr ptr)
 {
 	drmFree(ptr);
 }
+
+/*
+ * KMS state snapshots
+ *
+ * Everything a snapshot references lives in one arena, so it is torn down
+ * with a single call. Lookups go through two open addressing hash tables,
+ * one by object ID and one by (object ID, property name).
+ */
+
+#define SNAPSHOT_CHUNK_SIZE (64 * 1024)
+#define SNAPSHOT_PROPS_HINT 32
+
+/* A chunk header is followed by size bytes of 64 bit aligned storage. */
+struct snapshot_chunk {
+	struct snapshot_chunk *next;
+	size_t size;
+	size_t used;
+};
+
+struct snapshot_prop_entry {
+	uint32_t object_id;
+	uint32_t hash;
+	drmModePropertyPtr prop;
+	uint64_t value;
+};
+
+struct snapshot {
+	drmModeSnapshot base;
+
+	struct snapshot_chunk *chunks;
+
+	uint32_t objs_mask;
+	drmModeSnapshotObjectPtr *objs_hash;
+
+	uint32_t props_mask;
+	struct snapshot_prop_entry *props_hash;
+};
+
+static void *snapshot_alloc(struct snapshot *s, size_t size)
+{
+	struct snapshot_chunk *chunk = s->chunks;
+	void *ptr;
+
+	size = ALIGN(size, sizeof(uint64_t));
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = MAX2(size, SNAPSHOT_CHUNK_SIZE);
+
+		chunk = drmMalloc(sizeof(*chunk) + chunk_size);
+		if (!chunk)
+			return NULL;
+
+		chunk->size = chunk_size;
+		chunk->next = s->chunks;
+		s->chunks = chunk;
+	}
+
+	ptr = (char *)(chunk + 1) + chunk->used;
+	chunk->used += size;
+
+	/* drmMalloc() hands out zeroed memory, and chunks are never reused. */
+	return ptr;
+}
+
+static uint32_t snapshot_hash(uint32_t object_id, const char *name)
+{
+	uint32_t hash = 2166136261u ^ object_id;
+
+	/* FNV-1a */
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static int snapshot_get_ids(int fd, struct snapshot *s)
+{
+	drmModeResPtr r = &s->base.res;
+	drmModePlaneResPtr pr = &s->base.plane_res;
+	struct drm_mode_card_res res, counts;
+	struct drm_mode_get_plane_res plane_res;
+	uint32_t count_planes;
+
+retry:
+	memclear(res);
+	if (drmIoctl(fd, DRM_IOCTL_MODE_GETRESOURCES, &res))
+		return -errno;
+
+	counts = res;
+
+	r->fbs = snapshot_alloc(s, res.count_fbs * sizeof(uint32_t));
+	r->crtcs = snapshot_alloc(s, res.count_crtcs * sizeof(uint32_t));
+	r->connectors = snapshot_alloc(s, res.count_connectors * sizeof(uint32_t));
+	r->encoders = snapshot_alloc(s, res.count_encoders * sizeof(uint32_t));
+	if (!r->fbs || !r->crtcs || !r->connectors || !r->encoders)
+		return -ENOMEM;
+
+	res.fb_id_ptr = VOID2U64(r->fbs);
+	res.crtc_id_ptr = VOID2U64(r->crtcs);
+	res.connector_id_ptr = VOID2U64(r->connectors);
+	res.encoder_id_ptr = VOID2U64(r->encoders);
+
+	if (drmIoctl(fd, DRM_IOCTL_MODE_GETRESOURCES, &res))
+		return -errno;
+
+	/* See drmModeGetResources(), the arena just keeps the stale arrays. */
+	if (counts.count_fbs < res.count_fbs ||
+	    counts.count_crtcs < res.count_crtcs ||
+	    counts.count_connectors < res.count_connectors ||
+	    counts.count_encoders < res.count_encoders)
+		goto retry;
+
+	r->count_fbs = res.count_fbs;
+	r->count_crtcs = res.count_crtcs;
+	r->count_connectors = res.count_connectors;
+	r->count_encoders = res.count_encoders;
+	r->min_width = res.min_width;
+	r->max_width = res.max_width;
+	r->min_height = res.min_height;
+	r->max_height = res.max_height;
+
+	/* Without plane support, there are just no planes in the snapshot. */
+	do {
+		memclear(plane_res);
+		if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &plane_res))
+			return 0;
+
+		count_planes = plane_res.count_planes;
+		pr->planes = snapshot_alloc(s, count_planes * sizeof(uint32_t));
+		if (!pr->planes)
+			return -ENOMEM;
+		plane_res.plane_id_ptr = VOID2U64(pr->planes);
+
+		if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANERESOURCES, &plane_res))
+			return 0;
+	} while (count_planes < plane_res.count_planes);
+
+	pr->count_planes = plane_res.count_planes;
+
+	return 0;
+}
+
+static int snapshot_get_plane(int fd, struct snapshot *s, uint32_t plane_id,
+			      drmModePlanePtr plane)
+{
+	struct drm_mode_get_plane ovr;
+	uint32_t count;
+
+	do {
+		memclear(ovr);
+		ovr.plane_id = plane_id;
+		if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANE, &ovr))
+			return -errno;
+
+		count = ovr.count_format_types;
+		plane->formats = snapshot_alloc(s, count * sizeof(uint32_t));
+		if (!plane->formats)
+			return -ENOMEM;
+		ovr.format_type_ptr = VOID2U64(plane->formats);
+
+		if (drmIoctl(fd, DRM_IOCTL_MODE_GETPLANE, &ovr))
+			return -errno;
+	} while (count < ovr.count_format_types);
+
+	plane->count_formats = ovr.count_format_types;
+	plane->plane_id = ovr.plane_id;
+	plane->crtc_id = ovr.crtc_id;
+	plane->fb_id = ovr.fb_id;
+	plane->possible_crtcs = ovr.possible_crtcs;
+	plane->gamma_size = ovr.gamma_size;
+
+	return 0;
+}
+
+static int snapshot_get_object(int fd, struct snapshot *s, uint32_t object_id,
+			       uint32_t object_type,
+			       drmModeSnapshotObjectPtr obj)
+{
+	struct drm_mode_obj_get_properties properties;
+	uint32_t count = SNAPSHOT_PROPS_HINT;
+
+	/*
+	 * Guess the number of properties, so that the common case gets away
+	 * with a single ioctl, and only ask the kernel when the guess was short.
+	 */
+	for (;;) {
+		obj->props = snapshot_alloc(s, count * sizeof(uint32_t));
+		obj->prop_values = snapshot_alloc(s, count * sizeof(uint64_t));
+		if (!obj->props || !obj->prop_values)
+			return -ENOMEM;
+
+		memclear(properties);
+		properties.obj_id = object_id;
+		properties.obj_type = object_type;
+		properties.count_props = count;
+		properties.props_ptr = VOID2U64(obj->props);
+		properties.prop_values_ptr = VOID2U64(obj->prop_values);
+
+		if (drmIoctl(fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &properties))
+			return -errno;
+
+		if (properties.count_props <= count)
+			break;
+
+		count = properties.count_props;
+	}
+
+	obj->object_id = object_id;
+	obj->object_type = object_type;
+	obj->count_props = properties.count_props;
+
+	return 0;
+}
+
+static int snapshot_get_property(int fd, struct snapshot *s,
+				 drmModeScratchPtr scratch,
+				 uint32_t property_id, drmModePropertyPtr r)
+{
+	drmModePropertyPtr prop;
+	size_t values_size, enums_size;
+
+	prop = drmModeGetPropertyScratch(fd, property_id, scratch);
+	if (!prop)
+		return -errno;
+
+	/* Legacy blob properties keep 32 bit lengths in values. */
+	if (prop->flags & DRM_MODE_PROP_BLOB)
+		values_size = MAX2(prop->count_values * sizeof(uint64_t),
+				   prop->count_blobs * sizeof(uint32_t));
+	else
+		values_size = prop->count_values * sizeof(uint64_t);
+	enums_size = prop->count_enums * sizeof(struct drm_mode_property_enum) +
+		     prop->count_blobs * sizeof(uint32_t);
+
+	*r = *prop;
+	r->values = NULL;
+	r->enums = NULL;
+	r->blob_ids = NULL;
+
+	if (prop->values) {
+		r->values = snapshot_alloc(s, values_size);
+		if (!r->values)
+			return -ENOMEM;
+		memcpy(r->values, prop->values, values_size);
+	}
+
+	if (prop->enums || prop->blob_ids) {
+		void *enums = snapshot_alloc(s, enums_size);
+
+		if (!enums)
+			return -ENOMEM;
+		memcpy(enums, prop->enums ? (void *)prop->enums :
+		       (void *)prop->blob_ids, enums_size);
+
+		if (prop->enums)
+			r->enums = enums;
+		else
+			r->blob_ids = enums;
+	}
+
+	return 0;
+}
+
+static uint32_t snapshot_table_size(uint32_t count)
+{
+	uint32_t size = 16;
+
+	/* Keep the load factor at or below one half. */
+	while (size < 2 * count)
+		size *= 2;
+
+	return size;
+}
+
+static int snapshot_get_properties(int fd, struct snapshot *s,
+				   drmModeScratchPtr scratch)
+{
+	drmModeSnapshotPtr base = &s->base;
+	drmModePropertyPtr *by_id, prop;
+	struct snapshot_prop_entry *entry;
+	drmModeSnapshotObjectPtr obj;
+	uint32_t count = 0, mask, id_mask, i, j, h, hash;
+	int ret;
+
+	for (i = 0; i < base->count_objects; i++)
+		count += base->objects[i].count_props;
+
+	/* Most property IDs are shared between objects of the same type. */
+	id_mask = snapshot_table_size(count) - 1;
+	by_id = snapshot_alloc(s, (id_mask + 1) * sizeof(*by_id));
+	base->properties = snapshot_alloc(s, count * sizeof(*base->properties));
+
+	mask = snapshot_table_size(count) - 1;
+	s->props_hash = snapshot_alloc(s, (mask + 1) * sizeof(*s->props_hash));
+	s->props_mask = mask;
+
+	if (!by_id || !base->properties || !s->props_hash)
+		return -ENOMEM;
+
+	for (i = 0; i < base->count_objects; i++) {
+		obj = &base->objects[i];
+
+		for (j = 0; j < obj->count_props; j++) {
+			for (h = obj->props[j] * 2654435761u; ; h++) {
+				prop = by_id[h & id_mask];
+				if (!prop || prop->prop_id == obj->props[j])
+					break;
+			}
+
+			if (!prop) {
+				prop = &base->properties[base->count_properties];
+				ret = snapshot_get_property(fd, s, scratch,
+							    obj->props[j], prop);
+				if (ret)
+					return ret;
+				base->count_properties++;
+				by_id[h & id_mask] = prop;
+			}
+
+			hash = snapshot_hash(obj->object_id, prop->name);
+			for (h = hash; s->props_hash[h & mask].prop; h++)
+				;
+
+			entry = &s->props_hash[h & mask];
+			entry->object_id = obj->object_id;
+			entry->hash = hash;
+			entry->prop = prop;
+			entry->value = obj->prop_values[j];
+		}
+	}
+
+	return 0;
+}
+
+drm_public drmModeSnapshotPtr drmModeSnapshotCreate(int fd)
+{
+	struct snapshot *s;
+	drmModeSnapshotPtr base;
+	drmModeSnapshotObjectPtr obj;
+	drmModeScratchPtr scratch;
+	struct snapshot_chunk *chunk;
+	uint32_t count, i, h;
+	int ret;
+
+	/* The snapshot header is the first allocation of its own arena. */
+	chunk = drmMalloc(sizeof(*chunk) + SNAPSHOT_CHUNK_SIZE);
+	if (!chunk)
+		return NULL;
+	chunk->size = SNAPSHOT_CHUNK_SIZE;
+	s = (struct snapshot *)(chunk + 1);
+	chunk->used = ALIGN(sizeof(*s), sizeof(uint64_t));
+	s->chunks = chunk;
+	base = &s->base;
+
+	ret = snapshot_get_ids(fd, s);
+	if (ret)
+		goto fail;
+
+	base->planes = snapshot_alloc(s, base->plane_res.count_planes *
+				      sizeof(*base->planes));
+	count = base->res.count_crtcs + base->res.count_connectors +
+		base->plane_res.count_planes;
+	base->objects = snapshot_alloc(s, count * sizeof(*base->objects));
+	s->objs_mask = snapshot_table_size(count) - 1;
+	s->objs_hash = snapshot_alloc(s, (s->objs_mask + 1) *
+				      sizeof(*s->objs_hash));
+	if (!base->planes || !base->objects || !s->objs_hash) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < base->plane_res.count_planes; i++) {
+		ret = snapshot_get_plane(fd, s, base->plane_res.planes[i],
+					 &base->planes[i]);
+		if (ret)
+			goto fail;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint32_t id, type;
+
+		if (i < (uint32_t)base->res.count_crtcs) {
+			id = base->res.crtcs[i];
+			type = DRM_MODE_OBJECT_CRTC;
+		} else if (i < (uint32_t)(base->res.count_crtcs +
+					  base->res.count_connectors)) {
+			id = base->res.connectors[i - base->res.count_crtcs];
+			type = DRM_MODE_OBJECT_CONNECTOR;
+		} else {
+			id = base->plane_res.planes[i - base->res.count_crtcs -
+						    base->res.count_connectors];
+			type = DRM_MODE_OBJECT_PLANE;
+		}
+
+		obj = &base->objects[base->count_objects];
+		ret = snapshot_get_object(fd, s, id, type, obj);
+		if (ret == -ENOENT)
+			continue; /* hot-unplugged since GETRESOURCES */
+		if (ret)
+			goto fail;
+		base->count_objects++;
+
+		for (h = id * 2654435761u; s->objs_hash[h & s->objs_mask]; h++)
+			;
+		s->objs_hash[h & s->objs_mask] = obj;
+	}
+
+	scratch = drmModeScratchAlloc();
+	if (!scratch) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	ret = snapshot_get_properties(fd, s, scratch);
+	drmModeScratchFree(scratch);
+	if (ret)
+		goto fail;
+
+	return base;
+
+fail:
+	drmModeSnapshotFree(base);
+	errno = -ret;
+	return NULL;
+}
+
+drm_public void drmModeSnapshotFree(drmModeSnapshotPtr snapshot)
+{
+	struct snapshot *s = (struct snapshot *)snapshot;
+	struct snapshot_chunk *chunk, *next;
+
+	if (!snapshot)
+		return;
+
+	/* The last chunk holds the snapshot itself. */
+	for (chunk = s->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		drmFree(chunk);
+	}
+}
+
+drm_public drmModeSnapshotObjectPtr
+drmModeSnapshotGetObject(drmModeSnapshotPtr snapshot, uint32_t object_id)
+{
+	struct snapshot *s = (struct snapshot *)snapshot;
+	drmModeSnapshotObjectPtr obj;
+	uint32_t h;
+
+	if (!snapshot)
+		return NULL;
+
+	for (h = object_id * 2654435761u; ; h++) {
+		obj = s->objs_hash[h & s->objs_mask];
+		if (!obj || obj->object_id == object_id)
+			return obj;
+	}
+}
+
+drm_public drmModePropertyPtr
+drmModeSnapshotFindProperty(drmModeSnapshotPtr snapshot, uint32_t object_id,
+			    const char *name, uint64_t *value)
+{
+	struct snapshot *s = (struct snapshot *)snapshot;
+	struct snapshot_prop_entry *entry;
+	uint32_t hash, h;
+
+	if (!snapshot || !name)
+		return NULL;
+
+	hash = snapshot_hash(object_id, name);
+	for (h = hash; ; h++) {
+		entry = &s->props_hash[h & s->props_mask];
+		if (!entry->prop)
+			return NULL;
+
+		if (entry->hash == hash && entry->object_id == object_id &&
+		    !strcmp(entry->prop->name, name))
+			break;
+	}
+
+	if (value)
+		*value = entry->value;
+
+	return entry->prop;
+}
@@ -403,6 +403,47 @@ int drmModeAddFB2WithModifiers(int fd, uint32_t width, uint32_t height,
  */
 extern int drmModeRmFB(int fd, uint32_t bufferId);
 
+/*
+ * Framebuffer cache, one per fd. drmModeFBCacheGet() takes the same
+ * arguments as drmModeAddFB2WithModifiers(), but hands out an existing FB
+ * with the same handles, pitches, offsets, format, modifiers, size and
+ * flags if there is one, and takes a reference on it. drmModeFBCachePut()
+ * drops the reference. Unreferenced FBs are kept for reuse until more than
+ * 32 pile up, or until drmModeFBCacheTrim(), which keeps at most 'keep' of
+ * them.
+ *
+ * GEM handles are reused once closed, so drmModeFBCacheInvalidateHandle()
+ * must be called before closing a handle that was used for an FB. FBs of
+ * that handle are no longer handed out; the unreferenced ones are removed
+ * right away, the others with their last reference.
+ * drmModeFBCacheDestroy() removes all FBs.
+ */
+typedef struct _drmModeFBCache drmModeFBCache, *drmModeFBCachePtr;
+
+typedef struct _drmModeFBCacheStats {
+	uint64_t hits;
+	uint64_t misses;	/* FBs added */
+	uint64_t removed;
+	uint64_t invalidated;
+	uint32_t idle;		/* unreferenced FBs still around */
+} drmModeFBCacheStats, *drmModeFBCacheStatsPtr;
+
+extern drmModeFBCachePtr drmModeFBCacheCreate(int fd);
+extern void drmModeFBCacheDestroy(drmModeFBCachePtr cache);
+extern int drmModeFBCacheGet(drmModeFBCachePtr cache, uint32_t width,
+			     uint32_t height, uint32_t pixel_format,
+			     const uint32_t bo_handles[4],
+			     const uint32_t pitches[4],
+			     const uint32_t offsets[4],
+			     const uint64_t modifier[4],
+			     uint32_t *buf_id, uint32_t flags);
+extern int drmModeFBCachePut(drmModeFBCachePtr cache, uint32_t buf_id);
+extern void drmModeFBCacheInvalidateHandle(drmModeFBCachePtr cache,
+					   uint32_t handle);
+extern void drmModeFBCacheTrim(drmModeFBCachePtr cache, unsigned int keep);
+extern void drmModeFBCacheGetStats(drmModeFBCachePtr cache,
+				   drmModeFBCacheStatsPtr stats);
+
 /**
  * Mark a region of a framebuffer as dirty.
  */
@@ -483,6 +524,33 @@ extern int drmModeDetachMode(int fd, uint32_t connectorId, drmModeModeInfoPtr mo
 extern drmModePropertyPtr drmModeGetProperty(int fd, uint32_t propertyId);
 extern void drmModeFreeProperty(drmModePropertyPtr ptr);
 
+/*
+ * Variants of drmModeGetConnector(), drmModeGetConnectorCurrent() and
+ * drmModeGetProperty() that build their result in caller-owned scratch
+ * storage instead of the heap. They pass a capacity hint to the kernel so
+ * that a single ioctl usually suffices, and only need a second one when the
+ * hint was too small (or when a probed connector has modes, because the
+ * kernel only probes when no modes are requested).
+ *
+ * The result lives in the scratch storage and stays valid until the next
+ * query using the same scratch. It must not be passed to the matching
+ * drmModeFree*() function.
+ */
+typedef struct _drmModeScratch drmModeScratch, *drmModeScratchPtr;
+
+extern drmModeScratchPtr drmModeScratchAlloc(void);
+extern void drmModeScratchFree(drmModeScratchPtr scratch);
+
+extern drmModeConnectorPtr drmModeGetConnectorScratch(int fd,
+						      uint32_t connector_id,
+						      drmModeScratchPtr scratch);
+extern drmModeConnectorPtr
+drmModeGetConnectorCurrentScratch(int fd, uint32_t connector_id,
+				  drmModeScratchPtr scratch);
+extern drmModePropertyPtr drmModeGetPropertyScratch(int fd,
+						    uint32_t property_id,
+						    drmModeScratchPtr scratch);
+
 extern drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id);
 extern void drmModeFreePropertyBlob(drmModePropertyBlobPtr ptr);
 extern int drmModeConnectorSetProperty(int fd, uint32_t connector_id, uint32_t property_id,
@@ -499,6 +567,61 @@ extern int drmModePageFlipTarget(int fd, uint32_t crtc_id, uint32_t fb_id,
 				 uint32_t flags, void *user_data,
 				 uint32_t target_vblank);
 
+/*
+ * Per-CRTC frame pacing on top of drmCrtcQueueSequence().
+ *
+ * The scheduler fits the refresh period to the last few vblank timestamps it
+ * has seen, from drmModeFrameSchedulerSample() and from the events passed
+ * to it. drmModeFrameSchedulerPredict() returns the predicted time of a
+ * vblank, drmModeFrameSchedulerNextSequence() the first vblank at or after
+ * a time; both return -EAGAIN until the period is known.
+ *
+ * drmModeFrameSchedulerQueue() arranges for 'submit' to be called on the
+ * vblank before 'target', where it should queue a page flip or an atomic
+ * commit with DRM_MODE_PAGE_FLIP_EVENT set. It returns 1 if that vblank has
+ * already passed, 0 if not, or a negative errno; only one frame can be
+ * queued at a time. The scheduler does not read events itself, the caller
+ * passes them on from its drmEventContext handlers:
+ *
+ *  - CRTC sequence events with user_data == (uintptr_t)sched to
+ *    drmModeFrameSchedulerHandleSequence(), which calls 'submit';
+ *  - the resulting flip event to drmModeFrameSchedulerHandleFlip(), which
+ *    returns how many frames late the flip was.
+ */
+typedef struct _drmModeFrameScheduler drmModeFrameScheduler, *drmModeFrameSchedulerPtr;
+
+typedef int (*drmModeFrameSubmit)(int fd, uint32_t crtc_id, uint64_t target,
+				  void *user_data);
+
+typedef struct _drmModeFrameStats {
+	uint64_t frames;		/* flips completed */
+	uint64_t missed;		/* flips that completed after their target */
+	uint64_t period_ns;		/* fitted refresh period, 0 if unknown */
+	uint64_t latency_avg_ns;	/* submit to flip completion */
+	uint64_t latency_max_ns;
+	uint64_t jitter_avg_ns;		/* deviation of flip intervals from the period */
+	uint64_t jitter_max_ns;
+} drmModeFrameStats, *drmModeFrameStatsPtr;
+
+extern drmModeFrameSchedulerPtr drmModeFrameSchedulerCreate(int fd,
+							    uint32_t crtc_id);
+extern void drmModeFrameSchedulerFree(drmModeFrameSchedulerPtr sched);
+extern int drmModeFrameSchedulerSample(drmModeFrameSchedulerPtr sched);
+extern int drmModeFrameSchedulerPredict(drmModeFrameSchedulerPtr sched,
+					uint64_t sequence, uint64_t *ns);
+extern int drmModeFrameSchedulerNextSequence(drmModeFrameSchedulerPtr sched,
+					     uint64_t ns, uint64_t *sequence);
+extern int drmModeFrameSchedulerQueue(drmModeFrameSchedulerPtr sched,
+				      uint64_t target,
+				      drmModeFrameSubmit submit,
+				      void *user_data);
+extern int drmModeFrameSchedulerHandleSequence(drmModeFrameSchedulerPtr sched,
+					       uint64_t sequence, uint64_t ns);
+extern int drmModeFrameSchedulerHandleFlip(drmModeFrameSchedulerPtr sched,
+					   unsigned int sequence, uint64_t ns);
+extern void drmModeFrameSchedulerGetStats(drmModeFrameSchedulerPtr sched,
+					  drmModeFrameStatsPtr stats);
+
 extern drmModePlaneResPtr drmModeGetPlaneResources(int fd);
 extern drmModePlanePtr drmModeGetPlane(int fd, uint32_t plane_id);
 extern int drmModeSetPlane(int fd, uint32_t plane_id, uint32_t crtc_id,
@@ -532,6 +655,59 @@ extern int drmModeAtomicAddProperty(drmModeAtomicReqPtr req,
 				    uint32_t object_id,
 				    uint32_t property_id,
 				    uint64_t value);
+
+/**
+ * Empty the request, keeping its allocations so that it can be filled again
+ * for the next frame without reallocating.
+ */
+extern void drmModeAtomicReset(drmModeAtomicReqPtr req);
+
+/**
+ * Enable or disable delta mode. In delta mode the request remembers the
+ * property values of its last successful non-TEST_ONLY commit, and later
+ * commits only pass the properties whose value changed to the kernel.
+ * A commit without changes is skipped, unless it asks for a page flip
+ * event, in which case the full request is sent.
+ *
+ * The remembered state is only updated through this request. Call
+ * drmModeAtomicInvalidateDelta() whenever the kernel state may have been
+ * changed behind its back, e.g. after a VT switch, drmModeRmFB() of a
+ * framebuffer in use, or a commit through another request.
+ */
+extern int drmModeAtomicSetDelta(drmModeAtomicReqPtr req, int enable);
+extern void drmModeAtomicInvalidateDelta(drmModeAtomicReqPtr req);
+
+/**
+ * Remember the outcome of DRM_MODE_ATOMIC_TEST_ONLY commits. A request with
+ * a test cache set looks its normalized property set and flags up before
+ * testing, and only asks the kernel if that combination was not tested yet.
+ * Only success, EINVAL and ERANGE are remembered. One cache can be shared
+ * by all requests on the same fd; 'size' is the number of outcomes kept.
+ *
+ * A TEST_ONLY result also depends on the state of the objects a request
+ * does not mention, such as the bandwidth used by other planes, so the
+ * cache is meant for requests that fully describe the objects whose
+ * assignment is being searched. It forgets everything after any real
+ * commit through a request using it. Callers must invalidate it after
+ * commits on the fd made without it, on hotplug, and on other changes
+ * behind its back.
+ */
+typedef struct _drmModeAtomicTestCache drmModeAtomicTestCache, *drmModeAtomicTestCachePtr;
+
+typedef struct _drmModeAtomicTestCacheStats {
+	uint64_t lookups;
+	uint64_t hits;
+	uint64_t stored;
+	uint64_t invalidations;
+} drmModeAtomicTestCacheStats, *drmModeAtomicTestCacheStatsPtr;
+
+extern drmModeAtomicTestCachePtr drmModeAtomicTestCacheCreate(unsigned int size);
+extern void drmModeAtomicTestCacheFree(drmModeAtomicTestCachePtr cache);
+extern void drmModeAtomicTestCacheInvalidate(drmModeAtomicTestCachePtr cache);
+extern void drmModeAtomicTestCacheGetStats(drmModeAtomicTestCachePtr cache,
+					   drmModeAtomicTestCacheStatsPtr stats);
+extern int drmModeAtomicSetTestCache(drmModeAtomicReqPtr req,
+				     drmModeAtomicTestCachePtr cache);
 extern int drmModeAtomicCommit(int fd,
 			       drmModeAtomicReqPtr req,
 			       uint32_t flags,
@@ -541,6 +717,86 @@ extern int drmModeCreatePropertyBlob(int fd, const void *data, size_t size,
 				     uint32_t *id);
 extern int drmModeDestroyPropertyBlob(int fd, uint32_t id);
 
+/*
+ * Property blob cache, one per fd. drmModeBlobCacheGet() returns the id of
+ * a blob holding 'data', creating it only if no blob with the same content
+ * exists yet, and takes a reference on it. drmModeBlobCachePut() drops the
+ * reference. Unreferenced blobs are not destroyed right away, so setting
+ * the same mode or LUT again only costs a hash lookup; the oldest ones go
+ * once more than 16 pile up, or on drmModeBlobCacheTrim(), which keeps at
+ * most 'keep' of them. drmModeBlobCacheDestroy() destroys all blobs.
+ */
+typedef struct _drmModeBlobCache drmModeBlobCache, *drmModeBlobCachePtr;
+
+typedef struct _drmModeBlobCacheStats {
+	uint64_t hits;
+	uint64_t misses;	/* blobs created */
+	uint64_t destroyed;
+	uint32_t idle;		/* unreferenced blobs still alive */
+} drmModeBlobCacheStats, *drmModeBlobCacheStatsPtr;
+
+extern drmModeBlobCachePtr drmModeBlobCacheCreate(int fd);
+extern void drmModeBlobCacheDestroy(drmModeBlobCachePtr cache);
+extern int drmModeBlobCacheGet(drmModeBlobCachePtr cache,
+			       const void *data, size_t size, uint32_t *id);
+extern int drmModeBlobCachePut(drmModeBlobCachePtr cache, uint32_t id);
+extern void drmModeBlobCacheTrim(drmModeBlobCachePtr cache, unsigned int keep);
+extern void drmModeBlobCacheGetStats(drmModeBlobCachePtr cache,
+				     drmModeBlobCacheStatsPtr stats);
+
+/*
+ * KMS state snapshots
+ *
+ * A snapshot fetches the resource IDs, the planes, and the properties of
+ * every CRTC, connector and plane in one go, and fetches each distinct
+ * property definition only once. Connectors are not probed. Everything is
+ * kept in a single arena that drmModeSnapshotFree() releases at once, and
+ * properties can be looked up by object ID and name without further ioctls.
+ *
+ * Like the rest of this interface, planes other than overlays are only
+ * reported when DRM_CLIENT_CAP_UNIVERSAL_PLANES is set, and properties are
+ * only reported when DRM_CLIENT_CAP_ATOMIC is set where the driver needs it.
+ */
+
+typedef struct _drmModeSnapshotObject {
+	uint32_t object_id;
+	uint32_t object_type; /* DRM_MODE_OBJECT_* */
+	uint32_t count_props;
+	uint32_t *props;
+	uint64_t *prop_values;
+} drmModeSnapshotObject, *drmModeSnapshotObjectPtr;
+
+typedef struct _drmModeSnapshot {
+	drmModeRes res;
+	drmModePlaneRes plane_res;
+	drmModePlanePtr planes; /* plane_res.count_planes entries */
+
+	uint32_t count_objects;
+	drmModeSnapshotObjectPtr objects; /* CRTCs, connectors, then planes */
+
+	uint32_t count_properties;
+	drmModePropertyPtr properties; /* every property ID once */
+} drmModeSnapshot, *drmModeSnapshotPtr;
+
+extern drmModeSnapshotPtr drmModeSnapshotCreate(int fd);
+extern void drmModeSnapshotFree(drmModeSnapshotPtr snapshot);
+
+/**
+ * Look up a CRTC, connector or plane of the snapshot by ID.
+ */
+extern drmModeSnapshotObjectPtr
+drmModeSnapshotGetObject(drmModeSnapshotPtr snapshot, uint32_t object_id);
+
+/**
+ * Look up the property called name on an object, and return its definition
+ * (including the prop_id) and, if value is non-NULL, its value at the time
+ * of the snapshot. Returns NULL if the object has no such property. The
+ * result is owned by the snapshot.
+ */
+extern drmModePropertyPtr
+drmModeSnapshotFindProperty(drmModeSnapshotPtr snapshot, uint32_t object_id,
+			    const char *name, uint64_t *value);
+
 /*
  * DRM mode lease APIs. These create and manage new drm_masters with
  * access to a subset of the available DRM resources
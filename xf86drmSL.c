@@ -29,6 +29,12 @@
  *
  * This file contains a straightforward skip list implementation.n
  *
+ * Entries are carved out of per-list chunks rather than malloc'd one at a
+ * time, and freed entries are recycled through per-level free lists, so
+ * insert/delete churn does not hit the system allocator.  Destroying a list
+ * releases all of its chunks at once.  Each list carries its own PRNG
+ * state, so independent lists do not share (or race on) a global generator.
+ *
  * FUTURE ENHANCEMENTS
  *
  * REFERENCES
@@ -49,10 +55,7 @@
 #define SL_FREED_MAGIC 0xdecea5edLU
 #define SL_MAX_LEVEL   16
 #define SL_RANDOM_SEED 0xc01055a1LU
-
-#define SL_RANDOM_DECL        static void *state = NULL
-#define SL_RANDOM_INIT(seed)  if (!state) state = drmRandomCreate(seed)
-#define SL_RANDOM             drmRandom(state)
+#define SL_CHUNK_SIZE  (16 * 1024)
 
 typedef struct SLEntry {
     unsigned long     magic;	   /* SL_ENTRY_MAGIC */
@@ -62,22 +65,74 @@ typedef struct SLEntry {
     struct SLEntry    *forward[1]; /* variable sized array */
 } SLEntry, *SLEntryPtr;
 
+typedef struct SLChunk {
+    struct SLChunk    *next;
+    unsigned long     used;	/* Bytes handed out from data[] */
+    unsigned long     size;	/* Bytes available in data[] */
+    SLEntryPtr        data[1];	/* variable sized, pointer aligned */
+} SLChunk, *SLChunkPtr;
+
 typedef struct SkipList {
     unsigned long    magic;	/* SL_LIST_MAGIC */
     int              level;
     int              count;
     SLEntryPtr       head;
     SLEntryPtr       p0;	/* Position for iteration */
+    void             *random;	/* Per-list PRNG state */
+    SLChunkPtr       chunks;	/* Entry storage, newest first */
+    SLEntryPtr       free[SL_MAX_LEVEL + 2]; /* Recycled entries by levels */
 } SkipList, *SkipListPtr;
 
-static SLEntryPtr SLCreateEntry(int max_level, unsigned long key, void *value)
+static unsigned long SLEntrySize(int levels)
+{
+    unsigned long size = sizeof(SLEntry) + levels * sizeof(SLEntryPtr);
+
+    return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+static SLEntryPtr SLAllocEntry(SkipListPtr list, int levels)
+{
+    SLChunkPtr    chunk = list->chunks;
+    unsigned long size  = SLEntrySize(levels);
+    SLEntryPtr    entry;
+
+    if ((entry = list->free[levels])) {
+	list->free[levels] = entry->forward[0];
+	return entry;
+    }
+
+    if (!chunk || chunk->size - chunk->used < size) {
+	unsigned long avail = SL_CHUNK_SIZE - sizeof(*chunk);
+
+	if (avail < size) avail = size;
+	chunk = drmMalloc(sizeof(*chunk) + avail);
+	if (!chunk) return NULL;
+	chunk->size  = avail;
+	chunk->used  = 0;
+	chunk->next  = list->chunks;
+	list->chunks = chunk;
+    }
+
+    entry        = (SLEntryPtr)((char *)chunk->data + chunk->used);
+    chunk->used += size;
+    return entry;
+}
+
+static void SLFreeEntry(SkipListPtr list, SLEntryPtr entry)
+{
+    entry->magic                = SL_FREED_MAGIC;
+    entry->forward[0]           = list->free[entry->levels];
+    list->free[entry->levels]   = entry;
+}
+
+static SLEntryPtr SLCreateEntry(SkipListPtr list, int max_level,
+				unsigned long key, void *value)
 {
     SLEntryPtr entry;
     
     if (max_level < 0 || max_level > SL_MAX_LEVEL) max_level = SL_MAX_LEVEL;
 
-    entry         = drmMalloc(sizeof(*entry)
-			     + (max_level + 1) * sizeof(entry->forward[0]));
+    entry         = SLAllocEntry(list, max_level + 1);
     if (!entry) return NULL;
     entry->magic  = SL_ENTRY_MAGIC;
     entry->key    = key;
@@ -87,14 +142,17 @@ static SLEntryPtr SLCreateEntry(int max_level, unsigned long key, void *value)
     return entry;
 }
 
-static int SLRandomLevel(void)
+static int SLRandomLevel(SkipListPtr list)
 {
-    int level = 1;
-    SL_RANDOM_DECL;
-
-    SL_RANDOM_INIT(SL_RANDOM_SEED);
-    
-    while ((SL_RANDOM & 0x01) && level < SL_MAX_LEVEL) ++level;
+    unsigned long bits  = drmRandom(list->random);
+    int           level = 1;
+
+				/* One draw yields 31 coin flips, which
+				   is more than SL_MAX_LEVEL needs. */
+    while ((bits & 0x01) && level < SL_MAX_LEVEL) {
+	bits >>= 1;
+	++level;
+    }
     return level;
 }
 
@@ -105,10 +163,20 @@ drm_public void *drmSLCreate(void)
 
     list           = drmMalloc(sizeof(*list));
     if (!list) return NULL;
+    list->random   = drmRandomCreate(SL_RANDOM_SEED);
+    if (!list->random) {
+	drmFree(list);
+	return NULL;
+    }
     list->magic    = SL_LIST_MAGIC;
     list->level    = 0;
-    list->head     = SLCreateEntry(SL_MAX_LEVEL, 0, NULL);
+    list->head     = SLCreateEntry(list, SL_MAX_LEVEL, 0, NULL);
     list->count    = 0;
+    if (!list->head) {
+	drmRandomDestroy(list->random);
+	drmFree(list);
+	return NULL;
+    }
 
     for (i = 0; i <= SL_MAX_LEVEL; i++) list->head->forward[i] = NULL;
     
@@ -120,6 +188,8 @@ drm_public int drmSLDestroy(void *l)
     SkipListPtr   list  = (SkipListPtr)l;
     SLEntryPtr    entry;
     SLEntryPtr    next;
+    SLChunkPtr    chunk;
+    SLChunkPtr    next_chunk;
 
     if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
 
@@ -127,9 +197,14 @@ drm_public int drmSLDestroy(void *l)
 	if (entry->magic != SL_ENTRY_MAGIC) return -1; /* Bad magic */
 	next         = entry->forward[0];
 	entry->magic = SL_FREED_MAGIC;
-	drmFree(entry);
     }
 
+    for (chunk = list->chunks; chunk; chunk = next_chunk) {
+	next_chunk = chunk->next;
+	drmFree(chunk);
+    }
+
+    drmRandomDestroy(list->random);
     list->magic = SL_FREED_MAGIC;
     drmFree(list);
     return 0;
@@ -152,28 +227,22 @@ static SLEntryPtr SLLocate(void *l, unsigned long key, SLEntryPtr *update)
     return entry->forward[0];
 }
 
-drm_public int drmSLInsert(void *l, unsigned long key, void *value)
+/* Link a new entry for key after the predecessors in update. */
+static int SLLink(SkipListPtr list, SLEntryPtr *update,
+		  unsigned long key, void *value)
 {
-    SkipListPtr   list  = (SkipListPtr)l;
     SLEntryPtr    entry;
-    SLEntryPtr    update[SL_MAX_LEVEL + 1];
     int           level;
     int           i;
 
-    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
-
-    entry = SLLocate(list, key, update);
-
-    if (entry && entry->key == key) return 1; /* Already in list */
-
-
-    level = SLRandomLevel();
+    level = SLRandomLevel(list);
     if (level > list->level) {
 	level = ++list->level;
 	update[level] = list->head;
     }
 
-    entry = SLCreateEntry(level, key, value);
+    entry = SLCreateEntry(list, level, key, value);
+    if (!entry) return -1;
 
 				/* Fix up forward pointers */
     for (i = 0; i <= level; i++) {
@@ -182,7 +251,62 @@ drm_public int drmSLInsert(void *l, unsigned long key, void *value)
     }
 
     ++list->count;
-    return 0;			/* Added to table */
+    return 0;
+}
+
+drm_public int drmSLInsert(void *l, unsigned long key, void *value)
+{
+    SkipListPtr   list  = (SkipListPtr)l;
+    SLEntryPtr    entry;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1];
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    entry = SLLocate(list, key, update);
+
+    if (entry && entry->key == key) return 1; /* Already in list */
+
+    return SLLink(list, update, key, value); /* 0 if added to table */
+}
+
+drm_public int drmSLInsertSorted(void *l, const unsigned long *keys,
+				 void **values, int count)
+{
+    SkipListPtr   list  = (SkipListPtr)l;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1];
+    SLEntryPtr    entry;
+    unsigned long previous = 0;
+    int           added    = 0;
+    int           i, j;
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    SLLocate(list, count > 0 ? keys[0] : 0, update);
+
+    for (i = 0; i < count; i++) {
+	if (i && keys[i] < previous) {
+				/* Out of order, search from the top */
+	    SLLocate(list, keys[i], update);
+	} else {
+				/* Every update[j] still precedes keys[i],
+				   so only walk forward from there. */
+	    for (j = list->level; j >= 0; j--) {
+		while (update[j]->forward[j] &&
+		       update[j]->forward[j]->key < keys[i])
+		    update[j] = update[j]->forward[j];
+	    }
+	}
+	previous = keys[i];
+
+	entry = update[0]->forward[0];
+	if (entry && entry->key == keys[i]) continue; /* Already in list */
+
+	if (SLLink(list, update, keys[i], values ? values[i] : NULL))
+	    return -1;
+	++added;
+    }
+
+    return added;
 }
 
 drm_public int drmSLDelete(void *l, unsigned long key)
@@ -204,8 +328,8 @@ drm_public int drmSLDelete(void *l, unsigned long key)
 	    update[i]->forward[i] = entry->forward[i];
     }
 
-    entry->magic = SL_FREED_MAGIC;
-    drmFree(entry);
+    if (list->p0 == entry) list->p0 = entry->forward[0];
+    SLFreeEntry(list, entry);
 
     while (list->level && !list->head->forward[list->level]) --list->level;
     --list->count;
@@ -283,6 +407,43 @@ drm_public int drmSLFirst(void *l, unsigned long *key, void **value)
     return drmSLNext(list, key, value);
 }
 
+static int SLSeek(SkipListPtr list, SLEntryPtr entry,
+		  unsigned long *key, void **value)
+{
+    list->p0 = entry;
+    return drmSLNext(list, key, value);
+}
+
+/* Position the iterator on the first entry whose key is >= key.  Returns 1
+ * and the entry if there is one, 0 if every key in the list is smaller.
+ * Subsequent drmSLNext() calls continue from there. */
+drm_public int drmSLLowerBound(void *l, unsigned long key,
+			       unsigned long *found_key, void **value)
+{
+    SkipListPtr   list = (SkipListPtr)l;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1];
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    return SLSeek(list, SLLocate(list, key, update), found_key, value);
+}
+
+/* Like drmSLLowerBound(), but for the first entry whose key is > key. */
+drm_public int drmSLUpperBound(void *l, unsigned long key,
+			       unsigned long *found_key, void **value)
+{
+    SkipListPtr   list = (SkipListPtr)l;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1];
+    SLEntryPtr    entry;
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    entry = SLLocate(list, key, update);
+    if (entry && entry->key == key) entry = entry->forward[0];
+
+    return SLSeek(list, entry, found_key, value);
+}
+
 /* Dump internal data structures for debugging. */
 drm_public void drmSLDump(void *l)
 {